@@ -0,0 +1,532 @@
+/****************************************************************************
+**
+**
+****************************************************************************/
+
+/*
+   Control-plane benchmark. Installs xhservice_bench_fixture (in a
+   private runtime and configuration directory on Unix) and measures:
+
+   - cold start: XHServiceController::start() to RUNNING as seen by the
+     controller, and the fixture's main() (exec()) to RUNNING,
+   - sendCommand() round trips from 1 and from N concurrent
+     controllers: p50/p99/p999 and throughput, and the same commands
+     pipelined through sendCommandAsync() on one connection,
+   - call() round trips echoing small payloads through the socket and
+     large ones through the shared memory slab,
+   - logMessage() call latency and throughput from 1 and N threads,
+     measured inside the fixture, to the system log and to an
+     XHFileLogSink, and the same messages through XHBINLOG(),
+   - the cost of starting and killing event loop timers with 100k of
+     them active, how late they fire and how often the loop wakes up,
+     without and with slack, also inside the fixture.
+
+   A summary goes to stdout; --json writes the results as JSON, for
+   comparing runs before and after a change.
+*/
+
+#include "xhservice.h"
+#include <algorithm>
+#include <chrono>
+#include <future>
+#include <string>
+#include <thread>
+#include <vector>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#if defined(_WIN32)
+#  define popen _popen
+#  define pclose _pclose
+#else
+#  include <dirent.h>
+#  include <unistd.h>
+#endif
+
+#ifndef XHSERVICE_BENCH_FIXTURE
+#  define XHSERVICE_BENCH_FIXTURE "xhservice_bench_fixture"
+#endif
+
+static const char *const fixtureName = "xhservice_bench_fixture";
+
+struct Options
+{
+	Options()
+		: controllers(4), commands(2000), runs(5), logMessages(200000), logThreads(4),
+		timers(100000), fixture(XHSERVICE_BENCH_FIXTURE) {}
+
+	int controllers;
+	int commands;
+	int runs;
+	int logMessages;
+	int logThreads;
+	int timers;
+	std::string fixture;
+	std::string json;
+};
+
+struct Distribution
+{
+	Distribution() : count(0), p50(0), p99(0), p999(0), max(0), mean(0) {}
+
+	int64_t count;
+	double p50;
+	double p99;
+	double p999;
+	double max;
+	double mean;
+};
+
+static int64_t wallClockUs()
+{
+	return std::chrono::duration_cast<std::chrono::microseconds>(
+		std::chrono::system_clock::now().time_since_epoch()).count();
+}
+
+static double elapsedUs(std::chrono::steady_clock::time_point since)
+{
+	return std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - since).count();
+}
+
+static Distribution distribution(std::vector<double> samples)
+{
+	Distribution d;
+	if (samples.empty())
+		return d;
+	std::sort(samples.begin(), samples.end());
+	double sum = 0;
+	for (size_t i = 0; i < samples.size(); ++i)
+		sum += samples[i];
+	size_t last = samples.size() - 1;
+	d.count = samples.size();
+	d.p50 = samples[(size_t)(0.5 * last + 0.5)];
+	d.p99 = samples[(size_t)(0.99 * last + 0.5)];
+	d.p999 = samples[(size_t)(0.999 * last + 0.5)];
+	d.max = samples[last];
+	d.mean = sum / samples.size();
+	return d;
+}
+
+static std::string toJson(const Distribution &d)
+{
+	char text[256];
+	::snprintf(text, sizeof(text),
+		"{\"count\": %lld, \"p50\": %.1f, \"p99\": %.1f, \"p999\": %.1f, \"max\": %.1f, \"mean\": %.1f}",
+		(long long)d.count, d.p50, d.p99, d.p999, d.max, d.mean);
+	return text;
+}
+
+static bool waitForState(XHServiceController &controller, XHServiceController::State state,
+	int timeoutMs)
+{
+	std::chrono::steady_clock::time_point begin = std::chrono::steady_clock::now();
+	while (elapsedUs(begin) < timeoutMs * 1000.0) {
+		if (controller.status().state == state)
+			return true;
+		std::this_thread::sleep_for(std::chrono::microseconds(100));
+	}
+	return false;
+}
+
+static bool stopFixture(XHServiceController &controller)
+{
+	if (!controller.isRunning())
+		return true;
+	controller.stop();
+	return waitForState(controller, XHServiceController::StoppedState, 10000);
+}
+
+struct ColdStart
+{
+	std::vector<double> launchToRunning;	// milliseconds
+	std::vector<double> execToRunning;
+	std::vector<double> execToStart;
+	std::vector<double> stop;
+};
+
+static bool measureColdStart(XHServiceController &controller, int runs, ColdStart *result)
+{
+	for (int run = 0; run < runs; ++run) {
+		int64_t launched = wallClockUs();
+		if (!controller.start() || !waitForState(controller, XHServiceController::RunningState, 10000)) {
+			fprintf(stderr, "xhservice_bench: the fixture did not start\n");
+			return false;
+		}
+		int64_t running = wallClockUs();
+		int64_t entered = controller.statusCounter(0);
+		int64_t started = controller.statusCounter(1);
+		result->launchToRunning.push_back((running - launched) / 1000.0);
+		result->execToRunning.push_back((running - entered) / 1000.0);
+		result->execToStart.push_back((started - entered) / 1000.0);
+
+		std::chrono::steady_clock::time_point stopBegin = std::chrono::steady_clock::now();
+		if (!stopFixture(controller)) {
+			fprintf(stderr, "xhservice_bench: the fixture did not stop\n");
+			return false;
+		}
+		result->stop.push_back(elapsedUs(stopBegin) / 1000.0);
+	}
+	return true;
+}
+
+struct CommandRun
+{
+	CommandRun() : controllers(0), pipelined(false), failures(0), commandsPerSecond(0) {}
+
+	int controllers;
+	bool pipelined;
+	int failures;
+	double commandsPerSecond;
+	Distribution roundTrip;	// microseconds
+};
+
+static CommandRun measureCommands(int controllers, int commands)
+{
+	std::vector<std::vector<double> > samples(controllers);
+	std::vector<int> failures(controllers, 0);
+	std::vector<std::thread> threads;
+	std::chrono::steady_clock::time_point begin = std::chrono::steady_clock::now();
+	for (int c = 0; c < controllers; ++c) {
+		threads.push_back(std::thread([&, c]() {
+			XHServiceController controller(fixtureName);
+			samples[c].reserve(commands);
+			for (int i = 0; i < commands; ++i) {
+				std::chrono::steady_clock::time_point sent = std::chrono::steady_clock::now();
+				if (controller.sendCommand(1))
+					samples[c].push_back(elapsedUs(sent));
+				else
+					++failures[c];
+			}
+		}));
+	}
+	for (size_t t = 0; t < threads.size(); ++t)
+		threads[t].join();
+	double seconds = elapsedUs(begin) / 1e6;
+
+	CommandRun run;
+	run.controllers = controllers;
+	std::vector<double> all;
+	for (int c = 0; c < controllers; ++c) {
+		all.insert(all.end(), samples[c].begin(), samples[c].end());
+		run.failures += failures[c];
+	}
+	run.roundTrip = distribution(all);
+	run.commandsPerSecond = all.size() / (seconds > 0 ? seconds : 1e-9);
+	return run;
+}
+
+// All commands in flight at once; the latency runs from sending a
+// command to its reply.
+static CommandRun measurePipelined(int commands)
+{
+	XHServiceController controller(fixtureName);
+	std::vector<std::future<bool> > replies;
+	std::vector<std::chrono::steady_clock::time_point> sent;
+	replies.reserve(commands);
+	sent.reserve(commands);
+	std::chrono::steady_clock::time_point begin = std::chrono::steady_clock::now();
+	for (int i = 0; i < commands; ++i) {
+		sent.push_back(std::chrono::steady_clock::now());
+		replies.push_back(controller.sendCommandAsync(1));
+	}
+	CommandRun run;
+	run.controllers = 1;
+	run.pipelined = true;
+	std::vector<double> samples;
+	for (int i = 0; i < commands; ++i) {
+		if (replies[i].get())
+			samples.push_back(elapsedUs(sent[i]));
+		else
+			++run.failures;
+	}
+	double seconds = elapsedUs(begin) / 1e6;
+	run.roundTrip = distribution(samples);
+	run.commandsPerSecond = samples.size() / (seconds > 0 ? seconds : 1e-9);
+	return run;
+}
+
+struct CallRun
+{
+	CallRun() : size(0), failures(0), megabytesPerSecond(0) {}
+
+	size_t size;
+	int failures;
+	double megabytesPerSecond;	// request and reply
+	Distribution roundTrip;	// microseconds
+};
+
+static CallRun measureCalls(size_t size, int calls)
+{
+	XHServiceController controller(fixtureName);
+	std::string request(size, 'x');
+	std::string reply;
+	std::vector<double> samples;
+	samples.reserve(calls);
+	CallRun run;
+	run.size = size;
+	std::chrono::steady_clock::time_point begin = std::chrono::steady_clock::now();
+	for (int i = 0; i < calls; ++i) {
+		std::chrono::steady_clock::time_point sent = std::chrono::steady_clock::now();
+		if (controller.call(1, request, &reply) && reply.size() == size)
+			samples.push_back(elapsedUs(sent));
+		else
+			++run.failures;
+	}
+	double seconds = elapsedUs(begin) / 1e6;
+	run.roundTrip = distribution(samples);
+	run.megabytesPerSecond = 2.0 * size * samples.size() / 1e6 / (seconds > 0 ? seconds : 1e-9);
+	return run;
+}
+
+// Runs one of the fixture's in-process benchmarks and returns its JSON
+// line.
+static std::string runFixtureBench(const Options &options, const char *mode, int a, int b)
+{
+	char numbers[64];
+	::snprintf(numbers, sizeof(numbers), " %d %d", a, b);
+	std::string command = "\"" + options.fixture + "\" " + mode + numbers;
+	FILE *pipe = ::popen(command.c_str(), "r");
+	if (!pipe)
+		return std::string();
+	std::string output;
+	char buffer[512];
+	while (::fgets(buffer, sizeof(buffer), pipe))
+		output += buffer;
+	if (::pclose(pipe) != 0)
+		return std::string();
+	while (!output.empty() && (output[output.size() - 1] == '\n' || output[output.size() - 1] == '\r'))
+		output.erase(output.size() - 1);
+	return output;
+}
+
+static std::string measureLog(const Options &options, const char *mode, int threads)
+{
+	return runFixtureBench(options, mode, options.logMessages, threads);
+}
+
+static std::string measureTimers(const Options &options, int slackMs)
+{
+	return runFixtureBench(options, "-timerbench", options.timers, slackMs);
+}
+
+#if !defined(_WIN32)
+static void removeTree(const std::string &path)
+{
+	if (DIR *dir = ::opendir(path.c_str())) {
+		while (dirent *entry = ::readdir(dir)) {
+			if (!strcmp(entry->d_name, ".") || !strcmp(entry->d_name, ".."))
+				continue;
+			std::string child = path + "/" + entry->d_name;
+			if (::unlink(child.c_str()) != 0)
+				removeTree(child);
+		}
+		::closedir(dir);
+	}
+	::rmdir(path.c_str());
+}
+#endif
+
+static void printHelp(const char *program)
+{
+	printf("\n%s [options]\n"
+		"\t--controllers N\t: Concurrent controllers sending commands (default 4).\n"
+		"\t--commands N\t: Commands sent by each controller (default 2000).\n"
+		"\t--runs N\t: Cold starts to measure (default 5).\n"
+		"\t--log-messages N\t: Messages logged per log run (default 200000).\n"
+		"\t--log-threads N\t: Threads of the concurrent log run (default 4).\n"
+		"\t--timers N\t: Timers of the timer runs (default 100000).\n"
+		"\t--fixture PATH\t: The xhservice_bench_fixture binary.\n"
+		"\t--json FILE\t: Also write the results as JSON to FILE, - for stdout.\n",
+		program);
+}
+
+static bool parseOptions(int argc, char **argv, Options *options)
+{
+	for (int i = 1; i < argc; ++i) {
+		std::string a = argv[i];
+		if (a == "-h" || a == "--help")
+			return false;
+		if (i + 1 == argc) {
+			fprintf(stderr, "xhservice_bench: %s needs a value\n", a.c_str());
+			return false;
+		}
+		const char *value = argv[++i];
+		if (a == "--controllers")
+			options->controllers = atoi(value);
+		else if (a == "--commands")
+			options->commands = atoi(value);
+		else if (a == "--runs")
+			options->runs = atoi(value);
+		else if (a == "--log-messages")
+			options->logMessages = atoi(value);
+		else if (a == "--log-threads")
+			options->logThreads = atoi(value);
+		else if (a == "--timers")
+			options->timers = atoi(value);
+		else if (a == "--fixture")
+			options->fixture = value;
+		else if (a == "--json")
+			options->json = value;
+		else {
+			fprintf(stderr, "xhservice_bench: unknown option %s\n", a.c_str());
+			return false;
+		}
+	}
+	return options->controllers > 0 && options->commands > 0 && options->runs > 0
+		&& options->logMessages > 0 && options->logThreads > 0 && options->timers > 0;
+}
+
+int main(int argc, char **argv)
+{
+	Options options;
+	if (!parseOptions(argc, argv, &options)) {
+		printHelp(argv[0]);
+		return 2;
+	}
+
+#if !defined(_WIN32)
+	// Keep the fixture's settings, socket and status page away from any
+	// installed service.
+	std::string scratch;
+	if (!::getenv("XHSERVICE_RUNTIME_DIR") && !::getenv("XHSERVICE_CONFIG_DIR")) {
+		char dir[] = "/tmp/xhservice_bench.XXXXXX";
+		if (!::mkdtemp(dir)) {
+			perror("xhservice_bench: mkdtemp");
+			return 1;
+		}
+		scratch = dir;
+		::setenv("XHSERVICE_RUNTIME_DIR", dir, 1);
+		::setenv("XHSERVICE_CONFIG_DIR", dir, 1);
+	}
+#endif
+
+	XHServiceController controller(fixtureName);
+	bool installedHere = false;
+	if (!controller.isInstalled()) {
+		// The fixture installs itself, like any service run with -i.
+		std::string command = "\"" + options.fixture + "\" -i";
+		if (std::system(command.c_str()) != 0 || !controller.isInstalled()) {
+			fprintf(stderr, "xhservice_bench: could not install %s\n", options.fixture.c_str());
+			return 1;
+		}
+		installedHere = true;
+	}
+	stopFixture(controller);
+
+	int status = 0;
+	ColdStart coldStart;
+	std::vector<CommandRun> commandRuns;
+	std::vector<CallRun> callRuns;
+	if (!measureColdStart(controller, options.runs, &coldStart)) {
+		status = 1;
+	} else if (!controller.start() || !waitForState(controller, XHServiceController::RunningState, 10000)) {
+		fprintf(stderr, "xhservice_bench: the fixture did not start\n");
+		status = 1;
+	} else {
+		// Warm up the connection paths before measuring.
+		measureCommands(1, 100);
+		commandRuns.push_back(measureCommands(1, options.commands));
+		if (options.controllers > 1)
+			commandRuns.push_back(measureCommands(options.controllers, options.commands));
+		commandRuns.push_back(measurePipelined(options.commands));
+		const size_t sizes[] = { 64, 64 * 1024, 4 * 1024 * 1024 };
+		for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); ++i)
+			callRuns.push_back(measureCalls(sizes[i], std::max(10, options.commands / (i ? 10 : 1))));
+	}
+	stopFixture(controller);
+	if (installedHere)
+		controller.uninstall();
+#if !defined(_WIN32)
+	if (!scratch.empty())
+		removeTree(scratch);
+#endif
+
+	std::vector<std::string> logRuns;
+	const char *logModes[] = { "-logbench", "-filelogbench", "-binlogbench" };
+	for (size_t i = 0; i < sizeof(logModes) / sizeof(logModes[0]); ++i) {
+#if defined(_WIN32)
+		if (i)
+			break;
+#endif
+		logRuns.push_back(measureLog(options, logModes[i], 1));
+		if (options.logThreads > 1)
+			logRuns.push_back(measureLog(options, logModes[i], options.logThreads));
+	}
+	std::vector<std::string> timerRuns;
+	timerRuns.push_back(measureTimers(options, 0));
+	timerRuns.push_back(measureTimers(options, 10));
+
+	Distribution launchToRunning = distribution(coldStart.launchToRunning);
+	Distribution execToRunning = distribution(coldStart.execToRunning);
+	Distribution execToStart = distribution(coldStart.execToStart);
+	Distribution stop = distribution(coldStart.stop);
+	printf("cold start (ms, %d runs)\n", options.runs);
+	printf("  start() to RUNNING      p50 %8.2f  max %8.2f\n", launchToRunning.p50, launchToRunning.max);
+	printf("  exec() to RUNNING       p50 %8.2f  max %8.2f\n", execToRunning.p50, execToRunning.max);
+	printf("  exec() to start()       p50 %8.2f  max %8.2f\n", execToStart.p50, execToStart.max);
+	printf("  stop() to STOPPED       p50 %8.2f  max %8.2f\n", stop.p50, stop.max);
+	printf("sendCommand() round trip (us)\n");
+	for (size_t i = 0; i < commandRuns.size(); ++i) {
+		const CommandRun &run = commandRuns[i];
+		printf("  %2d %-12s p50 %8.1f  p99 %8.1f  p999 %8.1f  %9.0f/s  %d failed\n",
+			run.controllers, run.pipelined ? "pipelined" : "controllers", run.roundTrip.p50, run.roundTrip.p99, run.roundTrip.p999,
+			run.commandsPerSecond, run.failures);
+	}
+	printf("call() echo round trip (us)\n");
+	for (size_t i = 0; i < callRuns.size(); ++i) {
+		const CallRun &run = callRuns[i];
+		printf("  %8zu bytes   p50 %8.1f  p99 %8.1f  p999 %8.1f  %9.1f MB/s  %d failed\n",
+			run.size, run.roundTrip.p50, run.roundTrip.p99, run.roundTrip.p999,
+			run.megabytesPerSecond, run.failures);
+	}
+	printf("logMessage()\n");
+	for (size_t i = 0; i < logRuns.size(); ++i)
+		printf("  %s\n", logRuns[i].empty() ? "(failed)" : logRuns[i].c_str());
+	printf("timers\n");
+	for (size_t i = 0; i < timerRuns.size(); ++i)
+		printf("  %s\n", timerRuns[i].empty() ? "(failed)" : timerRuns[i].c_str());
+
+	if (!options.json.empty()) {
+		std::string json = "{\n  \"cold_start_ms\": {\n";
+		json += "    \"start_to_running\": " + toJson(launchToRunning) + ",\n";
+		json += "    \"exec_to_running\": " + toJson(execToRunning) + ",\n";
+		json += "    \"exec_to_start\": " + toJson(execToStart) + ",\n";
+		json += "    \"stop_to_stopped\": " + toJson(stop) + "\n  },\n";
+		json += "  \"command_round_trip_us\": [";
+		for (size_t i = 0; i < commandRuns.size(); ++i) {
+			char head[160];
+			::snprintf(head, sizeof(head),
+				"%s\n    {\"controllers\": %d, \"pipelined\": %s, \"failures\": %d, \"commands_per_s\": %.0f, "
+				"\"latency\": ",
+				i ? "," : "", commandRuns[i].controllers, commandRuns[i].pipelined ? "true" : "false",
+				commandRuns[i].failures,
+				commandRuns[i].commandsPerSecond);
+			json += head + toJson(commandRuns[i].roundTrip) + "}";
+		}
+		json += "\n  ],\n  \"call_round_trip_us\": [";
+		for (size_t i = 0; i < callRuns.size(); ++i) {
+			char head[160];
+			::snprintf(head, sizeof(head),
+				"%s\n    {\"bytes\": %zu, \"failures\": %d, \"megabytes_per_s\": %.1f, \"latency\": ",
+				i ? "," : "", callRuns[i].size, callRuns[i].failures, callRuns[i].megabytesPerSecond);
+			json += head + toJson(callRuns[i].roundTrip) + "}";
+		}
+		json += "\n  ],\n  \"log\": [";
+		for (size_t i = 0; i < logRuns.size(); ++i)
+			json += (i ? ",\n    " : "\n    ") + (logRuns[i].empty() ? std::string("null") : logRuns[i]);
+		json += "\n  ],\n  \"timers\": [";
+		for (size_t i = 0; i < timerRuns.size(); ++i)
+			json += (i ? ",\n    " : "\n    ") + (timerRuns[i].empty() ? std::string("null") : timerRuns[i]);
+		json += "\n  ]\n}\n";
+		if (options.json == "-") {
+			fputs(json.c_str(), stdout);
+		} else if (FILE *f = ::fopen(options.json.c_str(), "w")) {
+			fputs(json.c_str(), f);
+			::fclose(f);
+		} else {
+			fprintf(stderr, "xhservice_bench: could not write %s\n", options.json.c_str());
+			status = 1;
+		}
+	}
+	return status;
+}
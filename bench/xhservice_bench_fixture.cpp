@@ -0,0 +1,461 @@
+/****************************************************************************
+**
+**
+****************************************************************************/
+
+/*
+   Service driven by xhservice_bench. Run as a service it does nothing
+   but answer the controller and echo call() requests; status counter
+   0 is the time its process entered main() and counter 1 the time
+   start() was called, both in microseconds since the epoch, for the
+   benchmark to split the cold start. Run with -logbench it measures
+   logMessage() in-process and prints the results as one JSON object,
+   with -filelogbench the same with an XHFileLogSink in a scratch
+   directory, with -binlogbench the same through XHBINLOG(), and with
+   -timerbench it does the same for the timers of the event loop.
+   -filelogstress rotates an XHFileLogSink with tiny segments as fast
+   as it can and exits with 1 if a segment went missing, and
+   -binlogwrap checks an XHBinaryLog whose thread buffer wraps over
+   and over; CTest runs both.
+*/
+
+#include "xhservice.h"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <vector>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#if !defined(_WIN32)
+#  include <dirent.h>
+#  include <unistd.h>
+#endif
+
+static int64_t wallClockUs()
+{
+	return std::chrono::duration_cast<std::chrono::microseconds>(
+		std::chrono::system_clock::now().time_since_epoch()).count();
+}
+
+static int64_t mainEnteredUs;
+
+class XHBenchFixture : public XHServiceBase
+{
+public:
+	XHBenchFixture(int argc, char **argv)
+		: XHServiceBase(argc, argv, "xhservice_bench_fixture")
+	{
+		setServiceDescription("xhservice_bench fixture");
+		setServiceFlags(CanBeSuspended);
+	}
+
+	void createApplication(int &, char **) {}
+
+	void start()
+	{
+		setStatusCounter(0, mainEnteredUs);
+		setStatusCounter(1, wallClockUs());
+	}
+
+	void processCommand(int) {}
+
+	bool pumpEvents(int timeoutMs) { return processEvents(timeoutMs); }
+
+	// Echoes the request back, for the call() round trips.
+	bool processRequest(int, const char *data, size_t size, std::string *reply)
+	{
+		reply->assign(data, size);
+		return true;
+	}
+};
+
+static int64_t percentile(const std::vector<int64_t> &sorted, double fraction)
+{
+	if (sorted.empty())
+		return 0;
+	size_t i = (size_t)(fraction * (sorted.size() - 1) + 0.5);
+	return sorted[std::min(i, sorted.size() - 1)];
+}
+
+/*
+   logMessage() from 'threads' threads, 'messages' calls in total.
+   Latencies are per call, in nanoseconds. Throughput counts only the
+   messages that were delivered, so a sink that drops under load does
+   not look faster than one that keeps up; the drops are reported on
+   their own. flushLog() is timed separately, and written_per_s counts
+   both.
+*/
+static int logBench(XHBenchFixture &service, const char *sink, int messages, int threads)
+{
+	std::vector<std::vector<int64_t> > latencies(threads);
+	std::atomic<int> ready(0);
+	std::atomic<bool> go(false);
+	std::vector<std::thread> workers;
+	int perThread = messages / threads;
+	for (int t = 0; t < threads; ++t) {
+		workers.push_back(std::thread([&, t]() {
+			std::vector<int64_t> &mine = latencies[t];
+			mine.reserve(perThread);
+			char text[64];
+			++ready;
+			while (!go.load())
+				;
+			for (int i = 0; i < perThread; ++i) {
+				::snprintf(text, sizeof(text), "xhservice_bench message %d/%d", t, i);
+				std::chrono::steady_clock::time_point begin = std::chrono::steady_clock::now();
+				service.logMessage(text, XHServiceBase::Information);
+				mine.push_back(std::chrono::duration_cast<std::chrono::nanoseconds>(
+					std::chrono::steady_clock::now() - begin).count());
+			}
+		}));
+	}
+	while (ready.load() < threads)
+		std::this_thread::yield();
+	std::chrono::steady_clock::time_point begin = std::chrono::steady_clock::now();
+	go = true;
+	for (size_t t = 0; t < workers.size(); ++t)
+		workers[t].join();
+	double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+	std::chrono::steady_clock::time_point flushBegin = std::chrono::steady_clock::now();
+	service.flushLog(-1);
+	double flushMs = std::chrono::duration<double, std::milli>(
+		std::chrono::steady_clock::now() - flushBegin).count();
+
+	uint64_t dropped = service.droppedLogMessages();
+	std::vector<int64_t> all;
+	for (size_t t = 0; t < latencies.size(); ++t)
+		all.insert(all.end(), latencies[t].begin(), latencies[t].end());
+	std::sort(all.begin(), all.end());
+	double delivered = all.size() > dropped ? (double)(all.size() - dropped) : 0;
+	printf("{\"sink\": \"%s\", \"threads\": %d, \"messages\": %d, \"p50_ns\": %lld, \"p99_ns\": %lld, "
+		"\"p999_ns\": %lld, \"max_ns\": %lld, \"delivered\": %.0f, \"dropped\": %llu, "
+		"\"messages_per_s\": %.0f, \"flush_ms\": %.3f, \"written_per_s\": %.0f}\n",
+		sink, threads, (int)all.size(), (long long)percentile(all, 0.5), (long long)percentile(all, 0.99),
+		(long long)percentile(all, 0.999), (long long)(all.empty() ? 0 : all.back()),
+		delivered, (unsigned long long)dropped, delivered / (seconds > 0 ? seconds : 1e-9),
+		flushMs, delivered / (seconds + flushMs / 1000 > 0 ? seconds + flushMs / 1000 : 1e-9));
+	return 0;
+}
+
+#if !defined(_WIN32)
+static std::string makeScratchDirectory()
+{
+	const char *tmp = ::getenv("TMPDIR");
+	std::string pattern = std::string(tmp && *tmp ? tmp : "/tmp") + "/xhservice_bench_log.XXXXXX";
+	std::vector<char> directory(pattern.begin(), pattern.end());
+	directory.push_back(0);
+	return ::mkdtemp(&directory[0]) ? std::string(&directory[0]) : std::string();
+}
+
+static void removeScratchDirectory(const std::string &directory)
+{
+	if (DIR *dir = ::opendir(directory.c_str())) {
+		while (dirent *entry = ::readdir(dir)) {
+			if (strcmp(entry->d_name, ".") && strcmp(entry->d_name, ".."))
+				::unlink((directory + "/" + entry->d_name).c_str());
+		}
+		::closedir(dir);
+	}
+	::rmdir(directory.c_str());
+}
+
+/*
+   logBench() with the messages going to an XHFileLogSink. The buffer
+   is large and blocks when full, so written_per_s is what the sink
+   sustains rather than what the buffer absorbs.
+*/
+static int fileLogBench(char *program, int messages, int threads)
+{
+	std::string directory = makeScratchDirectory();
+	if (directory.empty())
+		return 1;
+	int status;
+	{
+		char *args[] = { program, 0 };
+		XHBenchFixture service(1, args);
+		service.setLogBufferSize(64 * 1024);
+		service.setLogOverflowPolicy(XHServiceBase::BlockOnOverflow);
+		service.setLogSink(new XHFileLogSink(directory + "/bench.log"));
+		status = logBench(service, "file", messages, threads);
+	}
+	removeScratchDirectory(directory);
+	return status;
+}
+
+/*
+   Writes to an XHFileLogSink directly, with segments so small that
+   the writer rotates again and again while the background thread is
+   still compressing, then checks that every segment ended up as the
+   live log or an archive and no spare was left behind.
+*/
+static int fileLogStress(int writes, int segmentSize)
+{
+	std::string directory = makeScratchDirectory();
+	if (directory.empty())
+		return 1;
+	uint64_t rotated;
+	uint64_t dropped;
+	{
+		XHFileLogSink sink(directory + "/stress.log");
+		sink.setMaxSegmentSize(segmentSize);
+		XHLogEntry entry;
+		entry.type = XHServiceBase::Information;
+		char text[64];
+		for (int i = 0; i < writes; ++i) {
+			::snprintf(text, sizeof(text), "xhservice_bench stress message %d", i);
+			entry.time = wallClockUs();
+			entry.message = text;
+			sink.write(entry);
+		}
+		sink.flush();
+		rotated = sink.segmentsRotated();
+		dropped = sink.droppedEntries();
+	}
+	int segments = 0;
+	int spares = 0;
+	if (DIR *dir = ::opendir(directory.c_str())) {
+		while (dirent *entry = ::readdir(dir)) {
+			if (!strcmp(entry->d_name, "stress.log")
+				|| (!strncmp(entry->d_name, "stress.log.", 11) && entry->d_name[11] >= '0' && entry->d_name[11] <= '9'))
+				++segments;
+			else if (!strncmp(entry->d_name, "stress.log.next", 15))
+				++spares;
+		}
+		::closedir(dir);
+	}
+	bool ok = (uint64_t)segments == rotated + 1 && spares == 0 && dropped == 0;
+	printf("{\"writes\": %d, \"segment_bytes\": %d, \"rotated\": %llu, \"segments\": %d, "
+		"\"spares\": %d, \"dropped\": %llu, \"ok\": %s}\n",
+		writes, segmentSize, (unsigned long long)rotated, segments, spares, (unsigned long long)dropped,
+		ok ? "true" : "false");
+	removeScratchDirectory(directory);
+	return ok ? 0 : 1;
+}
+
+/*
+   The messages of logBench() through XHBINLOG(), formatting left to
+   the decoder. Timing each call would cost more than the call, so the
+   cost is the mean over the run. The thread buffers hold the whole
+   run: dropped stays 0 unless the writer thread falls far behind.
+*/
+static int binaryLogBench(int messages, int threads)
+{
+	std::string directory = makeScratchDirectory();
+	if (directory.empty())
+		return 1;
+	XHBinaryLog log;
+	log.setThreadBufferSize(64 * 1024 * 1024);
+	if (!log.open(directory + "/bench.xhlog")) {
+		removeScratchDirectory(directory);
+		return 1;
+	}
+	std::atomic<int> ready(0);
+	std::atomic<bool> go(false);
+	std::vector<std::thread> workers;
+	int perThread = messages / threads;
+	for (int t = 0; t < threads; ++t) {
+		workers.push_back(std::thread([&, t]() {
+			// The first call registers the format and the thread buffer.
+			XHBINLOG(log, XHServiceBase::Information, "xhservice_bench warm up %d", t);
+			++ready;
+			while (!go.load())
+				;
+			for (int i = 0; i < perThread; ++i)
+				XHBINLOG(log, XHServiceBase::Information, "xhservice_bench message %d/%d", t, i);
+		}));
+	}
+	while (ready.load() < threads)
+		std::this_thread::yield();
+	std::chrono::steady_clock::time_point begin = std::chrono::steady_clock::now();
+	go = true;
+	for (size_t t = 0; t < workers.size(); ++t)
+		workers[t].join();
+	double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+	std::chrono::steady_clock::time_point flushBegin = std::chrono::steady_clock::now();
+	log.flush(-1);
+	double flushMs = std::chrono::duration<double, std::milli>(
+		std::chrono::steady_clock::now() - flushBegin).count();
+	int calls = perThread * threads;
+	printf("{\"sink\": \"binary\", \"threads\": %d, \"messages\": %d, \"mean_ns\": %.1f, "
+		"\"messages_per_s\": %.0f, \"dropped\": %llu, \"flush_ms\": %.3f, \"written_per_s\": %.0f}\n",
+		threads, calls, seconds * 1e9 * threads / (calls > 0 ? calls : 1), calls / (seconds > 0 ? seconds : 1e-9),
+		(unsigned long long)log.droppedRecords(), flushMs,
+		calls / (seconds + flushMs / 1000 > 0 ? seconds + flushMs / 1000 : 1e-9));
+	log.close();
+	removeScratchDirectory(directory);
+	return 0;
+}
+
+/*
+   Logs records of 32 bytes, which fill the smallest thread buffer
+   exactly, so every wrap of the ring comes without padding. Then reads
+   the file back and checks that it holds each record written, intact.
+*/
+static int binaryLogWrap(int messages)
+{
+	std::string directory = makeScratchDirectory();
+	if (directory.empty())
+		return 1;
+	std::string fileName = directory + "/wrap.xhlog";
+	XHBinaryLog log;
+	log.setThreadBufferSize(4096);
+	if (!log.open(fileName)) {
+		removeScratchDirectory(directory);
+		return 1;
+	}
+	// 17 bytes of event header and 15 of a string argument. A pause
+	// every half buffer lets the writer thread keep up.
+	static const char payload[] = "xhservice32";
+	for (int i = 0; i < messages; ++i) {
+		XHBINLOG(log, XHServiceBase::Information, "%s", payload);
+		if (i % 64 == 63)
+			std::this_thread::sleep_for(std::chrono::milliseconds(1));
+	}
+	log.flush(-1);
+	uint64_t written = log.writtenRecords();
+	uint64_t dropped = log.droppedRecords();
+	log.close();
+
+	std::vector<char> data;
+	if (FILE *file = ::fopen(fileName.c_str(), "rb")) {
+		char chunk[65536];
+		size_t n;
+		while ((n = ::fread(chunk, 1, sizeof(chunk), file)) > 0)
+			data.insert(data.end(), chunk, chunk + n);
+		::fclose(file);
+	}
+	removeScratchDirectory(directory);
+
+	uint64_t events = 0;
+	uint64_t corrupt = 0;
+	size_t p = sizeof(XHBinaryLogMagic);
+	while (p + XHBinaryLogHeaderSize <= data.size()) {
+		uint32_t size;
+		memcpy(&size, &data[p + 1], 4);
+		if (size < XHBinaryLogHeaderSize || size > data.size() - p) {
+			++corrupt;
+			break;
+		}
+		if (data[p] == XHBinaryLogEventRecord) {
+			++events;
+			uint32_t length = 0;
+			if (size >= XHBinaryLogEventSize + 4)
+				memcpy(&length, &data[p + XHBinaryLogEventSize], 4);
+			if (size != 32 || length != sizeof(payload) - 1
+				|| memcmp(&data[p + XHBinaryLogEventSize + 4], payload, length))
+				++corrupt;
+		} else if (data[p] < XHBinaryLogFormatRecord || data[p] > XHBinaryLogEventRecord) {
+			++corrupt;
+		}
+		p += size;
+	}
+	bool ok = corrupt == 0 && p == data.size() && events == written && events + dropped == (uint64_t)messages;
+	printf("{\"messages\": %d, \"written\": %llu, \"dropped\": %llu, \"events\": %llu, "
+		"\"corrupt\": %llu, \"ok\": %s}\n",
+		messages, (unsigned long long)written, (unsigned long long)dropped, (unsigned long long)events,
+		(unsigned long long)corrupt, ok ? "true" : "false");
+	return ok ? 0 : 1;
+}
+#endif
+
+/*
+   'timers' single shot timers due within 'spanMs', half of them killed
+   again. Costs are per call in nanoseconds; lateness is how long after
+   its due time a timer fired, in microseconds, and wakeups counts the
+   processEvents() calls it took to fire them all.
+*/
+static int timerBench(XHBenchFixture &service, int timers, int slackMs)
+{
+	const int spanMs = 2000;
+	std::vector<int64_t> lateness;
+	lateness.reserve(timers);
+	std::vector<uint64_t> ids(timers);
+	uint64_t seed = 88172645463325252ull;
+	std::chrono::steady_clock::time_point begin = std::chrono::steady_clock::now();
+	for (int i = 0; i < timers; ++i) {
+		seed ^= seed << 13;
+		seed ^= seed >> 7;
+		seed ^= seed << 17;
+		int delay = 1 + (int)(seed % spanMs);
+		int64_t due = wallClockUs() + delay * 1000;
+		ids[i] = service.singleShot(delay, [&lateness, due]() {
+			lateness.push_back(wallClockUs() - due);
+		}, slackMs);
+	}
+	double startNs = std::chrono::duration<double, std::nano>(
+		std::chrono::steady_clock::now() - begin).count() / timers;
+	begin = std::chrono::steady_clock::now();
+	for (int i = 0; i < timers; i += 2)
+		service.killTimer(ids[i]);
+	double killNs = std::chrono::duration<double, std::nano>(
+		std::chrono::steady_clock::now() - begin).count() / ((timers + 1) / 2);
+	int wakeups = 0;
+	while (service.activeTimers() > 0) {
+		service.pumpEvents(-1);
+		++wakeups;
+	}
+	std::sort(lateness.begin(), lateness.end());
+	printf("{\"timers\": %d, \"slack_ms\": %d, \"start_ns\": %.1f, \"kill_ns\": %.1f, "
+		"\"fired\": %d, \"wakeups\": %d, \"late_p50_us\": %lld, \"late_p99_us\": %lld, "
+		"\"late_max_us\": %lld}\n",
+		timers, slackMs, startNs, killNs, (int)lateness.size(), wakeups,
+		(long long)percentile(lateness, 0.5), (long long)percentile(lateness, 0.99),
+		(long long)(lateness.empty() ? 0 : lateness.back()));
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	mainEnteredUs = wallClockUs();
+	if (argc > 1 && !strcmp(argv[1], "-logbench")) {
+		int messages = argc > 2 ? atoi(argv[2]) : 200000;
+		int threads = argc > 3 ? atoi(argv[3]) : 1;
+		if (messages <= 0 || threads <= 0)
+			return 1;
+		char *args[] = { argv[0], 0 };
+		XHBenchFixture service(1, args);
+		return logBench(service, "system", messages, threads);
+	}
+#if !defined(_WIN32)
+	if (argc > 1 && !strcmp(argv[1], "-filelogbench")) {
+		int messages = argc > 2 ? atoi(argv[2]) : 200000;
+		int threads = argc > 3 ? atoi(argv[3]) : 1;
+		if (messages <= 0 || threads <= 0)
+			return 1;
+		return fileLogBench(argv[0], messages, threads);
+	}
+	if (argc > 1 && !strcmp(argv[1], "-filelogstress")) {
+		int writes = argc > 2 ? atoi(argv[2]) : 1000000;
+		int segmentSize = argc > 3 ? atoi(argv[3]) : 64 * 1024;
+		if (writes <= 0 || segmentSize <= 0)
+			return 1;
+		return fileLogStress(writes, segmentSize);
+	}
+	if (argc > 1 && !strcmp(argv[1], "-binlogwrap")) {
+		int messages = argc > 2 ? atoi(argv[2]) : 20000;
+		if (messages <= 0)
+			return 1;
+		return binaryLogWrap(messages);
+	}
+	if (argc > 1 && !strcmp(argv[1], "-binlogbench")) {
+		int messages = argc > 2 ? atoi(argv[2]) : 200000;
+		int threads = argc > 3 ? atoi(argv[3]) : 1;
+		if (messages <= 0 || threads <= 0)
+			return 1;
+		return binaryLogBench(messages, threads);
+	}
+#endif
+	if (argc > 1 && !strcmp(argv[1], "-timerbench")) {
+		int timers = argc > 2 ? atoi(argv[2]) : 100000;
+		int slackMs = argc > 3 ? atoi(argv[3]) : 0;
+		if (timers <= 0 || slackMs < 0)
+			return 1;
+		char *args[] = { argv[0], 0 };
+		XHBenchFixture service(1, args);
+		return timerBench(service, timers, slackMs);
+	}
+	XHBenchFixture service(argc, argv);
+	return service.exec();
+}
@@ -5,7 +5,11 @@
 
 #include "xhservice.h"
 #include "xhservice_p.h"
+#include <algorithm>
+#include <limits.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <iostream>
 /*!
     \class XHServiceController
@@ -109,8 +113,9 @@ XHServiceController::~XHServiceController()
 
     On Windows it uses the system's service control manager.
 
-    On Unix it checks configuration written to QSettings::SystemScope
-    using "QtSoftware" as organization name.
+    On Unix it checks for the service's configuration file, written to
+    /etc/xhservice (or ~/.config/xhservice for non-root users, or
+    $XHSERVICE_CONFIG_DIR when set).
 
     \sa install()
 */
@@ -133,6 +138,211 @@ std::string XHServiceController::serviceName() const
 {
 	return d_ptr->serviceName;
 }
+
+/*
+   Reads the status page published by the running service. Returns
+   false when there is no page or it can't be trusted, in which case
+   the platform code asks the service manager instead.
+*/
+bool XHServiceControllerPrivate::readStatus(XHStatusSnapshot *snapshot)
+{
+	return statusReader.read(serviceName, snapshot);
+}
+
+/*
+   How long stop() waits for the service to go away: the drain deadline
+   the service published, plus a grace period for stop() and
+   executeApplication() to unwind. -1 when the service drains for as
+   long as it takes.
+*/
+int XHServiceControllerPrivate::stopTimeout()
+{
+	XHStatusSnapshot status;
+	int64_t drain = readStatus(&status) ? status.drainTimeout : XHStatusDrainTimeoutMs;
+	return drain < 0 ? -1 : (int)std::min<int64_t>(drain + XHStatusStopGraceMs, INT_MAX);
+}
+
+/*!
+    \class XHServiceStatus
+
+    \brief The XHServiceStatus struct holds a snapshot of a service's
+    properties, as returned by XHServiceController::status().
+
+    \c timestamp is the monotonic time, in milliseconds, at which the
+    snapshot was taken. \c pid and \c startTime (milliseconds since
+    the epoch) are only known while the service runs; \c startTime and
+    \c checkPoint/\c waitHint come from the service's status page and
+    are 0 when it isn't available.
+
+    \c drainDuration and \c abortedOperations describe the last stop of
+    the service: how long, in milliseconds, it waited for its in-flight
+    operations, and how many were still running at the drain deadline.
+
+    \c restarts counts the crashed processes a RestartOnCrash or
+    WorkerProcesses service has restarted.
+
+    \sa XHServiceBase::setDrainTimeout(), XHServiceController::exitHistory()
+*/
+XHServiceStatus::XHServiceStatus()
+	: installed(false), running(false), state(XHServiceController::StoppedState),
+	startupType(XHServiceController::ManualStartup), pid(0), startTime(0),
+	checkPoint(0), waitHint(0), drainDuration(0), abortedOperations(0), restarts(0), timestamp(0)
+{
+}
+
+/*!
+    \class XHServiceExitRecord
+
+    \brief The XHServiceExitRecord struct describes how a supervised
+    process of a service ended, as returned by
+    XHServiceController::exitHistory().
+
+    \c time is when the process ended, in milliseconds since the
+    epoch, and \c uptime how long it had run. A process killed by a
+    signal has \c signal set (and \c coreDumped if it left a core
+    file); otherwise \c exitCode is its exit code. \c restartDelay is
+    how long the supervisor waited before starting it again, or -1 if
+    it didn't: the process exited with code 0, or crashed too often.
+
+    \sa XHServiceBase::RestartOnCrash
+*/
+
+/*!
+    \class XHProcessSample
+
+    \brief The XHProcessSample struct holds the resource usage of a
+    running service at one point in time, as returned by
+    XHServiceController::processSample().
+
+    \c time is when the sample was taken, in milliseconds since the
+    epoch. \c residentBytes is the resident set size (the working set
+    on Windows), \c userTime and \c systemTime the CPU time the
+    process has used so far, in microseconds. \c threads and \c
+    openFiles count the threads and the open file descriptors (handles
+    on Windows) of the process. \c voluntarySwitches and \c
+    involuntarySwitches count the context switches of all its threads
+    so far.
+
+    A value the platform doesn't provide is -1; Windows has no cheap
+    per-process count of context switches.
+
+    \sa XHServiceBase::setProcessSampleInterval()
+*/
+
+/*!
+    \enum XHServiceController::State
+    This enum describes the state of a service. The values match the
+    Win32 SERVICE_* states.
+
+    \value StoppedState The service is not running.
+    \value StartPendingState The service is starting.
+    \value StopPendingState The service is stopping.
+    \value RunningState The service is running.
+    \value ContinuePendingState The service is resuming from pause.
+    \value PausePendingState The service is pausing.
+    \value PausedState The service is paused.
+*/
+
+/*!
+    Returns every property of the controlled service in one snapshot.
+    The properties are gathered in a single pass (one open of the
+    service manager on Windows, one read of the configuration on
+    Unix), or read from the service's status page while it runs.
+
+    If \a maxAgeMs is greater than 0 and the previous snapshot taken by
+    this controller is younger than \a maxAgeMs milliseconds, that
+    snapshot is returned instead of querying again.
+
+    \sa isInstalled(), isRunning(), serviceDescription(),
+    serviceFilePath(), startupType()
+*/
+XHServiceStatus XHServiceController::status(int maxAgeMs) const
+{
+	std::lock_guard<std::mutex> lock(d_ptr->cacheMutex);
+	int64_t now = xhMonotonicMs();
+	if (maxAgeMs > 0 && d_ptr->cachedStatus.timestamp != 0
+		&& now - d_ptr->cachedStatus.timestamp < maxAgeMs)
+		return d_ptr->cachedStatus;
+	XHServiceStatus result;
+	result.name = d_ptr->serviceName;
+	d_ptr->queryStatus(&result);
+	result.running = result.state != StoppedState;
+	result.timestamp = now;
+	d_ptr->cachedStatus = result;
+	return result;
+}
+
+/*!
+    Returns the value of the custom status counter \a index (0 to
+    StatusCounterCount - 1) published by the running service with
+    XHServiceBase::setStatusCounter(), or 0 if the service doesn't
+    publish a status page.
+
+    The counters are read from shared memory, so polling them costs no
+    system calls once the page has been mapped.
+
+    \sa XHServiceBase::setStatusCounter()
+*/
+int64_t XHServiceController::statusCounter(int index) const
+{
+	int64_t value = 0;
+	if (!d_ptr->statusReader.counter(d_ptr->serviceName, index, &value))
+		return 0;
+	return value;
+}
+
+/*!
+    Returns the last exits of the processes supervised by a service
+    running with XHServiceBase::RestartOnCrash or
+    XHServiceBase::WorkerProcesses, oldest first. Exits requested by a
+    stop aren't recorded.
+
+    The history is read from the service's status page and survives
+    the service: after a service gave up on a crash loop, it still
+    tells why. At most 16 exits are kept.
+
+    \sa XHServiceStatus::restarts
+*/
+std::vector<XHServiceExitRecord> XHServiceController::exitHistory() const
+{
+	std::vector<XHServiceExitRecord> records;
+	d_ptr->statusReader.exits(d_ptr->serviceName, &records);
+	return records;
+}
+
+/*!
+    Returns the latest sample of the controlled service's resource
+    usage, or a sample with \c time 0 if the service doesn't publish
+    any.
+
+    Like the status counters, the samples are read from the service's
+    status page without any IPC. They are kept when the service stops,
+    so the last one describes the service shortly before it ended.
+
+    \sa processHistory(), XHServiceBase::setProcessSampleInterval()
+*/
+XHProcessSample XHServiceController::processSample() const
+{
+	std::vector<XHProcessSample> samples;
+	if (!d_ptr->statusReader.samples(d_ptr->serviceName, &samples) || samples.empty())
+		return XHProcessSample();
+	return samples.back();
+}
+
+/*!
+    Returns the last samples of the controlled service's resource
+    usage, oldest first. At most 60 samples are kept, a minute's worth
+    at the default interval; CPU time and context switches can be
+    turned into rates from the differences between them.
+
+    \sa processSample()
+*/
+std::vector<XHProcessSample> XHServiceController::processHistory() const
+{
+	std::vector<XHProcessSample> samples;
+	d_ptr->statusReader.samples(d_ptr->serviceName, &samples);
+	return samples;
+}
 /*!
     \fn QString XHServiceController::serviceDescription() const
 
@@ -165,8 +375,8 @@ std::string XHServiceController::serviceName() const
     On Windows service is installed in the system's service control manager with the given
     \a account and \a password.
 
-    On Unix service configuration is written to QSettings::SystemScope
-    using "QtSoftware" as organization name. \a account and \a password
+    On Unix service configuration is written to the service's
+    configuration file (see isInstalled()). \a account and \a password
     arguments are ignored.
 
     \warning Due to the different implementations of how services (daemons)
@@ -195,8 +405,7 @@ bool XHServiceController::install(const std::string &serviceFilePath,
 
     On Windows service is uninstalled using the system's service control manager.
 
-    On Unix service configuration is cleared using QSettings::SystemScope
-    with "QtSoftware" as organization name.
+    On Unix the service's configuration file is removed.
 
 
     \sa install()
@@ -233,7 +442,9 @@ bool XHServiceController::start()
     the service is not running.
 
     Returns true if a running service was successfully stopped;
-    otherwise false.
+    otherwise false. The service first drains its in-flight operations,
+    so this waits for up to the service's
+    XHServiceBase::drainTimeout() plus a few seconds.
 
     \sa start(), XHServiceBase::stop(), XHServiceBase::ServiceFlags
 */
@@ -279,6 +490,163 @@ bool XHServiceController::start()
     \sa XHServiceBase::processCommand()
 */
 
+/*!
+    \fn bool XHServiceController::call(int code, const std::string &request, std::string *reply, int timeoutMs)
+
+    Sends the request \a code with the binary payload \a request to
+    the service and waits up to \a timeoutMs milliseconds for the
+    answer of XHServiceBase::processRequest(), which is stored in \a
+    reply. Unlike commands, any \a code can be used.
+
+    Payloads of 64 KiB and more, in either direction, don't go through
+    the control socket: they are exchanged in a shared memory slab
+    that the controller keeps across calls, up to 16 MiB. Calls made
+    through the same controller are serialized; use one controller per
+    thread to have several calls in flight.
+
+    Returns true if the service processed the request successfully;
+    otherwise returns false. Only supported on Unix.
+
+    \sa sendCommand(), XHServiceBase::processRequest()
+*/
+
+/*!
+    \fn std::future<bool> XHServiceController::sendCommandAsync(int code)
+
+    Sends the user command \a code like sendCommand(), without waiting
+    for the reply. The returned future becomes true once the service
+    accepted the command.
+
+    The asynchronous functions of a controller share one persistent
+    connection to the service: any number of requests can be in
+    flight, and their replies are matched to them by request id. A
+    background thread receives the replies; if the connection breaks,
+    all pending requests fail and the next one connects again.
+
+    On Windows the request completes before the function returns.
+
+    \sa stopAsync(), pauseAsync(), resumeAsync(), callAsync()
+*/
+
+/*!
+    \fn std::future<bool> XHServiceController::stopAsync()
+
+    Requests the service to stop without waiting for the reply. Unlike
+    stop(), the future becomes true as soon as the service accepted the
+    request, not once it stopped.
+
+    \sa sendCommandAsync()
+*/
+
+/*!
+    \fn std::future<bool> XHServiceController::pauseAsync()
+
+    Requests the service to pause without waiting for the reply.
+
+    \sa pause(), sendCommandAsync()
+*/
+
+/*!
+    \fn std::future<bool> XHServiceController::resumeAsync()
+
+    Requests the service to continue without waiting for the reply.
+
+    \sa resume(), sendCommandAsync()
+*/
+
+/*!
+    \fn std::future<XHServiceReply> XHServiceController::callAsync(int code, const std::string &request)
+
+    Sends the request \a code with the payload \a request like call(),
+    without waiting for the reply. Unlike call(), calls made this way
+    can be in flight at the same time, each with a slab of its own for
+    large payloads. Only supported on Unix.
+
+    \sa call(), sendCommandAsync()
+*/
+
+/*!
+    Calls \a handler with every state change of the service from now
+    on, including a change to the initial state: start, stop, pause and
+    continue with their pending states, and crashes. The changes are
+    pushed by the service as they happen, so short-lived states are not
+    missed the way they are when polling status(). \a handler runs on
+    a thread of the controller and replaces any earlier subscription.
+
+    A service that goes away without reporting StoppedState is reported
+    as stopped with XHServiceStateChange::crashed set, as is a crashed
+    worker process restarted by the service; the latter has the
+    worker's index, exit code and signal. The subscription follows the
+    service across restarts until unsubscribe() is called or the
+    controller is destroyed.
+
+    On Unix the changes stream over the control socket; on Windows
+    they come from the service control manager's status change
+    notifications.
+
+    Returns true if the subscription was set up.
+
+    \sa unsubscribe(), status()
+*/
+bool XHServiceController::subscribe(const std::function<void(const XHServiceStateChange &)> &handler)
+{
+	d_ptr->sysUnsubscribe();
+	return handler && d_ptr->sysSubscribe(handler);
+}
+
+/*!
+    Ends the subscription set up with subscribe(). \a handler is not
+    called anymore once this function returns.
+*/
+void XHServiceController::unsubscribe()
+{
+	d_ptr->sysUnsubscribe();
+}
+
+/*!
+    \fn bool XHServiceController::upgrade(const std::string &filePath)
+
+    Replaces the running service by a new instance of \a filePath
+    without closing its listening sockets. If \a filePath is empty, the
+    path the service was installed with is started again, which picks
+    up a binary replaced on disk.
+
+    The running instance launches the new binary and passes it the
+    control socket and every descriptor registered with
+    XHServiceBase::setHandoffDescriptor(). Both instances serve until
+    the new one runs; the old one then drains its in-flight operations
+    and stops. If the new instance fails to start, the old one keeps
+    running.
+
+    Returns true if the running service accepted the request, not
+    once the upgrade completed. Only supported on Linux.
+
+    \sa XHServiceBase::takeInheritedDescriptor()
+*/
+
+/*!
+    \fn std::vector<XHMetricSample> XHServiceController::metrics() const
+
+    Returns the metrics of the running service, registered with
+    XHServiceBase::metrics(), or an empty list if the service doesn't
+    run. The service answers on its control thread, so the snapshot
+    comes back even while the service is busy in a callback. Only
+    supported on Unix.
+
+    \sa metricsReport(), XHMetricsRegistry
+*/
+
+/*!
+    \fn std::string XHServiceController::metricsReport(XHMetricsRegistry::Format format) const
+
+    Returns the metrics of the running service encoded in \a format,
+    by default as Prometheus text exposition that can be served as is
+    to a Prometheus scraper. Returns an empty string if the service
+    doesn't run.
+
+    \sa metrics(), XHMetricsRegistry::decode()
+*/
+
 class XHServiceStarter 
 {
 public:
@@ -294,19 +662,296 @@ private:
 };
 XHServiceBase * XHServiceBasePrivate::instance = 0;
 XHServiceBasePrivate::XHServiceBasePrivate(const std::string &name)
-    : startupType(XHServiceController::ManualStartup), serviceFlags(0), controller(name)
+    : startupType(XHServiceController::ManualStartup), serviceFlags(0), exitCode(0), controller(name),
+      log(name), executor(0), executorThreads(0), executorAbandoned(false), runningAsService(false), timerSlack(0),
+      transition(XHServiceEvent::None), transitionDeferred(false), progressCheckPoint(0), startingUp(true), drainTimeout(XHStatusDrainTimeoutMs), drainDuration(0), drainAborted(0),
+      workerCount(0), workerAffinity(XHServiceBase::NoAffinity), workerIndex(-1), supervising(false),
+      workers(0), restartDelay(10), maxRestartDelay(30000), crashLoopLimit(5),
+      crashLoopPeriod(60000)
 {
+	commandsProcessed = metrics.counter("xhservice_commands_total",
+		"Commands handled by processCommand()");
+	requestsProcessed = metrics.counter("xhservice_requests_total",
+		"Requests handled by processRequest()");
+	controlLatency = metrics.histogram("xhservice_control_latency_us",
+		"Time from a control request to the end of its callback, in microseconds");
+	logMessages = metrics.counter("xhservice_log_messages_total", "Messages passed to logMessage()");
+	logBytes = metrics.counter("xhservice_log_bytes_total", "Bytes of message text passed to logMessage()");
+	logDropped = metrics.counter("xhservice_log_dropped_total",
+		"Messages dropped because the log buffer was full");
+	logSuppressed = metrics.counter("xhservice_log_suppressed_total",
+		"Messages suppressed by the log rate limit");
+	eventLoop.setHandler([this](const XHServiceEvent &event) {
+		processEvent(event.type, event.code);
+		controlLatency.record(xhEventTimeUs() - event.posted);
+	});
+	startupPlan.d_ptr->progress = [this](const std::string &step, bool finished,
+		uint32_t checkPoint, uint32_t waitHint) {
+		progressCheckPoint.store(checkPoint);
+		sysSetProgress((finished ? "Initialized " : "Initializing ") + step, checkPoint, waitHint);
+	};
 
 }
 
 XHServiceBasePrivate::~XHServiceBasePrivate()
 {
-
+	delete executor;
 }
 
 void XHServiceBasePrivate::startService()
 {
+    serviceExecutor();
+    beginTransition(XHServiceEvent::Start);
     q_ptr->start();
+    if (endTransition())
+        finishTransition(XHServiceEvent::Start, true);
+    endStartup(true);
+}
+
+XHServiceExecutor *XHServiceBasePrivate::serviceExecutor()
+{
+	std::lock_guard<std::mutex> lock(executorMutex);
+	if (!executor)
+		executor = new XHServiceExecutor(executorThreads);
+	return executor;
+}
+
+/*
+   Called by the platform's control handler, which runs on a thread of
+   its own. While the built-in event loop runs the request is queued
+   and handled on the service thread, so a slow stop() or
+   processCommand() never blocks the handler. Until start() has
+   returned the request waits for endStartup() instead: the service
+   thread is still busy starting up, and stop() must not run beside
+   start(). Services that run their own loop in executeApplication()
+   and don't call processEvents() get the callbacks on the handler
+   thread after that, as before.
+*/
+void XHServiceBasePrivate::postEvent(int type, int code)
+{
+	if (eventLoop.tryPost(type, code))
+		return;
+	{
+		std::lock_guard<std::mutex> lock(startupMutex);
+		if (startingUp) {
+			startupEvents.push_back(std::make_pair(type, code));
+			return;
+		}
+	}
+	int64_t begin = xhEventTimeUs();
+	processEvent(type, code);
+	controlLatency.record(xhEventTimeUs() - begin);
+}
+
+/*
+   Called on the service thread once start() has returned, or once it
+   is clear that it never will. The requests that came in meanwhile are
+   handled right here, in order, before the service enters its loop; a
+   stop among them makes exec() return at once. Without \a deliver the
+   service is on its way out already and they are dropped.
+*/
+void XHServiceBasePrivate::endStartup(bool deliver)
+{
+	std::vector<std::pair<int, int> > events;
+	{
+		std::lock_guard<std::mutex> lock(startupMutex);
+		startingUp = false;
+		events.swap(startupEvents);
+	}
+	for (size_t i = 0; deliver && i < events.size(); ++i)
+		postEvent(events[i].first, events[i].second);
+}
+
+void XHServiceBasePrivate::processEvent(int type, int code)
+{
+	// The master of worker processes has no application of its own:
+	// requests go to the workers, and sysStopWorkers() stops them once
+	// the loop returned.
+	if (supervising) {
+		if (type == XHServiceEvent::Stop || type == XHServiceEvent::Shutdown) {
+			quitLoop(0);
+			return;
+		}
+		sysPostToWorkers(type, code);
+		if (type == XHServiceEvent::Pause)
+			sysSetState(XHServicePaused);
+		else if (type == XHServiceEvent::Resume)
+			sysSetState(XHServiceRunning);
+		return;
+	}
+	switch (type) {
+		case XHServiceEvent::Stop:
+		case XHServiceEvent::Shutdown:
+			pauseToken.resume();
+			eventLoop.setTimersPaused(false);
+			// The running tasks get the drain deadline below.
+			if (type == XHServiceEvent::Shutdown && executor)
+				executor->cancel(0);
+			drainOperations();
+			beginTransition(type);
+			q_ptr->stop();
+			if (endTransition())
+				finishTransition(type, true);
+			break;
+		case XHServiceEvent::Pause:
+			pauseToken.pause();
+			if (executor)
+				executor->pause();
+			beginTransition(type);
+			q_ptr->pause();
+			if (endTransition())
+				finishTransition(type, true);
+			break;
+		case XHServiceEvent::Resume:
+			eventLoop.setTimersPaused(false);
+			beginTransition(type);
+			q_ptr->resume();
+			if (endTransition())
+				finishTransition(type, true);
+			break;
+		case XHServiceEvent::Command:
+			q_ptr->processCommand(code);
+			commandsProcessed.add();
+			break;
+		default:
+			break;
+	}
+}
+
+/*
+   start(), stop(), pause() and resume() run between beginTransition()
+   and endTransition(); one that called XHServiceBase::deferTransition()
+   is finished by completeTransition() later on, in the order they were
+   deferred.
+*/
+void XHServiceBasePrivate::beginTransition(int type)
+{
+	transition = type;
+	transitionDeferred = false;
+}
+
+bool XHServiceBasePrivate::endTransition()
+{
+	bool deferred = transitionDeferred;
+	transition = XHServiceEvent::None;
+	transitionDeferred = false;
+	return !deferred;
+}
+
+void XHServiceBasePrivate::finishTransition(int type, bool success)
+{
+	switch (type) {
+		case XHServiceEvent::Start:
+			if (success) {
+				if (runningAsService)
+					sysSetState(XHServiceRunning);
+			} else {
+				q_ptr->logMessage("The service failed to start", XHServiceBase::Error);
+				quitLoop(1);
+			}
+			break;
+		case XHServiceEvent::Stop:
+		case XHServiceEvent::Shutdown:
+			// A service can't refuse to stop.
+			quitLoop(0);
+			break;
+		case XHServiceEvent::Pause:
+			if (success) {
+				// Timers run until pause() has finished, a paused
+				// service doesn't wake up for them.
+				eventLoop.setTimersPaused(true);
+				sysSetState(XHServicePaused);
+				break;
+			}
+			// Refused: the service keeps running.
+			if (executor)
+				executor->resume();
+			pauseToken.resume();
+			sysSetState(XHServiceRunning);
+			break;
+		case XHServiceEvent::Resume:
+			if (!success) {
+				eventLoop.setTimersPaused(true);
+				sysSetState(XHServicePaused);
+				break;
+			}
+			if (executor)
+				executor->resume();
+			pauseToken.resume();
+			sysSetState(XHServiceRunning);
+			break;
+		default:
+			break;
+	}
+}
+
+/*
+   Ends the event loop with \a code. On the loop's own thread it quits
+   right away; anywhere else, or before exec() runs, a Quit event is
+   queued so that exec() returns as soon as it takes it.
+*/
+void XHServiceBasePrivate::quitLoop(int code)
+{
+	if (eventLoop.isLoopThread())
+		eventLoop.quit(code);
+	else
+		eventLoop.post(XHServiceEvent::Quit, code);
+}
+
+/*
+   Runs a controller's call() on the service thread, or on the
+   platform's control thread when the service doesn't run the event
+   loop, like the other callbacks.
+*/
+bool XHServiceBasePrivate::processRequest(int code, const char *data, size_t size,
+	std::string *reply)
+{
+	bool ok = q_ptr->processRequest(code, data, size, reply);
+	requestsProcessed.add();
+	return ok;
+}
+
+/*
+   Lets the operations registered through XHServiceOperation and the
+   executor's tasks finish before stop() tears down what they use,
+   reporting stop progress to the service manager once a heartbeat
+   while it waits. The executor gets what is left of the deadline.
+   After that its queued tasks are dropped and its running ones are
+   abandoned, and both count as aborted operations.
+*/
+void XHServiceBasePrivate::drainOperations()
+{
+	int64_t begin = xhMonotonicMs();
+	uint32_t checkPoint = 0;
+	int left = drain.drain(drainTimeout, [&](int inFlight) {
+		char text[64];
+		::snprintf(text, sizeof(text), "Draining %d operations", inFlight);
+		sysSetProgress(text, ++checkPoint, XHStatusStaleMs);
+	});
+	if (executor) {
+		int64_t spent = xhMonotonicMs() - begin;
+		int executorBudget = drainTimeout < 0 ? -1 : (int)std::max<int64_t>(0, drainTimeout - spent);
+		if (!executor->drain(executorBudget)) {
+			int tasks = executor->pendingTasks();
+			char text[64];
+			::snprintf(text, sizeof(text), "Dropping %d executor tasks", tasks);
+			q_ptr->logMessage(text, XHServiceBase::Warning);
+			if (!executor->cancel(0)) {
+				left += tasks;
+				executorAbandoned = true;
+			}
+		}
+	}
+	int64_t duration = xhMonotonicMs() - begin;
+	drainDuration.store(duration);
+	uint64_t aborted = drainAborted.fetch_add(left) + left;
+	statusPage.setDrain(duration, aborted);
+	if (left > 0) {
+		char text[96];
+		::snprintf(text, sizeof(text), "%d operations still running after %d ms, stopping anyway",
+			left, (int)duration);
+		q_ptr->logMessage(text, XHServiceBase::Warning);
+	}
 }
 
 int XHServiceBasePrivate::run(bool asService, const std::vector<std::string> &argList)
@@ -324,20 +969,78 @@ int XHServiceBasePrivate::run(bool asService, const std::vector<std::string> &ar
 		argv[i] = c;
 	}
 
-    if (asService && !sysInit())
+    if (asService && !sysd && !sysInit())
         return -1;
+    runningAsService = asService;
+    if (asService) {
+        // The status page lets controllers poll the service without
+        // going through the service manager.
+        statusPage.open(controller.serviceName());
+        statusPage.setInfo(filePath(), serviceDescription, startupType);
+        statusPage.setFlags(serviceFlags);
+        statusPage.setDrainTimeout(drainTimeout);
+    }
+
+    // Listening sockets opened by a supervisor, for createApplication()
+    // to take.
+    sysCollectActivatedSockets();
+
+    int res = -1;
+    if (asService && (serviceFlags & (XHServiceBase::WorkerProcesses | XHServiceBase::RestartOnCrash))
+        && sysStartWorkers()) {
+        // The workers run the application; this process only restarts
+        // them and passes the controller's requests on.
+        supervising = true;
+        sysSetPath();
+        sysSetState(XHServiceRunning);
+        endStartup(true);
+        res = eventLoop.exec();
+        sysStopWorkers();
+        supervising = false;
+        exitCode = res;
+        log.flush(-1);
+        sysSetState(XHServiceStopped);
+        sysCleanup();
+        statusPage.close();
+        return res;
+    }
 
 	q_ptr->createApplication(argc,argv.data());   
 
     if (asService)
         sysSetPath();
 
-    XHServiceStarter starter(this);
-	starter.slotStart();
-	// TODO 
-    int res = q_ptr->executeApplication();
-    if (asService)
+    // Independent init steps run in parallel and keep the service
+    // manager informed; start() only runs once all of them succeeded.
+    if (startupPlan.run()) {
+        XHServiceStarter starter(this);
+        starter.slotStart();
+        // TODO 
+        res = q_ptr->executeApplication();
+        // Deleting the executor joins its workers, which would wait for
+        // the tasks the drain abandoned; those end with the process.
+        if (!executorAbandoned)
+            delete executor;
+        executor = 0;
+    } else {
+        // start() never ran, so there is nothing to stop either.
+        endStartup(false);
+        std::vector<XHStartupStepResult> results = startupPlan.results();
+        for (size_t i = 0; i < results.size(); ++i) {
+            if (!results[i].success && !results[i].skipped)
+                q_ptr->logMessage("Startup step '" + results[i].name + "' failed",
+                    XHServiceBase::Error);
+        }
+    }
+    exitCode = res;
+    // Whatever was logged on the way down reaches the sink before the
+    // service is reported as stopped.
+    log.flush(-1);
+    if (asService) {
+        sysSetState(XHServiceStopped);
         sysCleanup();
+        statusPage.close();
+    }
     return res;
 }
 
@@ -376,7 +1079,11 @@ int XHServiceBasePrivate::run(bool asService, const std::vector<std::string> &ar
     executable depends on (i.e. Qt), are located in the same directory
     as the service, or in a system path.
 
-    On Unix a service is implemented as a daemon.
+    On Unix a service is implemented as a daemon. Controllers talk to
+    it through a UNIX-domain control socket in a directory private to
+    the service's user (/run/xhservice for root,
+    $XDG_RUNTIME_DIR/xhservice otherwise, or $XHSERVICE_RUNTIME_DIR)
+    that the daemon serves from a single epoll thread; SIGTERM and SIGINT are handled like a stop request.
 
     You can retrieve the service's description, state, and startup
     type using the serviceDescription(), serviceFlags() and
@@ -441,6 +1148,9 @@ int XHServiceBasePrivate::run(bool asService, const std::vector<std::string> &ar
             This is a blocking call, the service will be executed like a normal application.
             In this mode you will not be able to communicate with the service from the contoller.
     \row \i -t \i -terminate \i Stop the service.
+    \row \i -g \i -upgrade
+         \i Replace the running service by this binary, handing over its
+            listening sockets (Linux only).
     \row \i -p \i -pause \i Pause the service.
     \row \i -r \i -resume \i Resume a paused service.
     \row \i -c \e{cmd} \i -command \e{cmd}
@@ -480,6 +1190,18 @@ int XHServiceBasePrivate::run(bool asService, const std::vector<std::string> &ar
     \value CanBeSuspended The service can be suspended.
     \value CannotBeStopped The service cannot be stopped.
     \value NeedsStopOnShutdown (Windows only) The service will be stopped before the system shuts down. Note that Microsoft recommends this only for services that must absolutely clean up during shutdown, because there is a limited time available for shutdown of services.
+    \value WorkerProcesses (Unix only) The service runs as a master process supervising workerCount() worker processes, each running createApplication(), start() and executeApplication(). See setWorkerCount().
+    \value RestartOnCrash (Unix only) The service runs in a child process that is restarted when it crashes. See setRestartDelay().
+*/
+
+/*!
+    \enum XHServiceBase::WorkerAffinity
+
+    This enum describes how worker processes are pinned to CPUs.
+
+    \value NoAffinity The workers may run on any CPU the service may run on.
+    \value CoreAffinity Each worker is pinned to one CPU, round robin.
+    \value NumaNodeAffinity Each worker is pinned to the CPUs of one NUMA node, round robin.
 */
 
 /*!
@@ -582,6 +1304,8 @@ std::string XHServiceBase::serviceDescription() const
 void XHServiceBase::setServiceDescription(const std::string &description)
 {
     d_ptr->serviceDescription = description;
+    if (d_ptr->statusPage.isOpen())
+        d_ptr->statusPage.setInfo(d_ptr->filePath(), description, d_ptr->startupType);
 }
 
 /*!
@@ -642,6 +1366,11 @@ int XHServiceBase::serviceFlags() const
 
 int XHServiceBase::exec()
 {
+#if defined(Q_OS_UNIX)
+	// Started by the master of a WorkerProcesses service.
+	if (::getenv("XHSERVICE_WORKER"))
+		return d_ptr->sysRunWorker();
+#endif
     if (d_ptr->args.size() > 1) {
         std::string a =  d_ptr->args.at(1);
         if (a == std::string("-i") || a == std::string("-install")) {
@@ -694,6 +1423,13 @@ int XHServiceBase::exec()
             if (!d_ptr->controller.stop())
 				fprintf(stderr, "The service could not be stopped.");
             return 0;
+        } else if (a == std::string("-g") || a == std::string("-upgrade")) {
+            // Run from the new binary: the running instance hands over to it.
+            if (!d_ptr->controller.upgrade(d_ptr->filePath())) {
+                fprintf(stderr, "The service [%s] could not be upgraded\n", serviceName().c_str());
+                return -1;
+            }
+            return 0;
         } else if (a == std::string("-p") || a == std::string("-pause")) {
             d_ptr->controller.pause();
             return 0;
@@ -701,12 +1437,14 @@ int XHServiceBase::exec()
             d_ptr->controller.resume();
             return 0;
         } else if (a == std::string("-c") || a == std::string("-command")) {
-            int code = 0;
-			if (d_ptr->args.size() > 2){
-				std::string _v = d_ptr->args[2];
-				code = atoi(_v.c_str());
-			}
-            d_ptr->controller.sendCommand(code);
+			// Several codes go out pipelined on one connection.
+			std::vector<std::future<bool> > sent;
+			for (size_t i = 2; i < d_ptr->args.size(); ++i)
+				sent.push_back(d_ptr->controller.sendCommandAsync(atoi(d_ptr->args[i].c_str())));
+			if (sent.empty())
+				sent.push_back(d_ptr->controller.sendCommandAsync(0));
+			for (size_t i = 0; i < sent.size(); ++i)
+				sent[i].wait();
             return 0;
         } else if(a == std::string("-h") || a == std::string("-help")) {
 			printHelp();
@@ -730,13 +1468,14 @@ int XHServiceBase::exec()
 }
 void XHServiceBase::printHelp()
 {
-	printf("\n%s -[i|u|e|s|t|c|v|h]\n"
+	printf("\n%s -[i|u|e|s|t|g|c|v|h]\n"
 		"\t-i(nstall) [account] [password]\t: Install the service, optionally using given account and password\n"
 		"\t-u(ninstall)\t: Uninstall the service.\n"
 		"\t-e(xec)\t\t: Run as a regular application. Useful for debugging.\n"
 		"\t-s(tart)\t: Start the service.\n"
 		"\t-t(erminate)\t: Stop the service.\n"
-		"\t-c(ommand) num\t: Send command code num to the service.\n"
+		"\t-(up)g(rade)\t: Replace the running service by this binary, keeping its sockets.\n"
+		"\t-c(ommand) num...\t: Send command codes num... to the service.\n"
 		"\t-v(ersion)\t: Print version and status information.\n"
 		"\t-h(elp)   \t: Show this help\n",
 		"\tNo arguments\t: Start the service.\n",
@@ -756,93 +1495,947 @@ void XHServiceBase::printHelp()
     Refer to the MSDN for more information about how to do this on
     Windows.
 
+    The message is copied into a preallocated buffer and written by a
+    background thread, so the call doesn't wait for the system log.
+    On Unix messages go to syslog; \a id, \a category and \a data are
+    ignored there. setLogSink() sends them elsewhere, for instance to
+    an XHFileLogSink.
+
+    If a rate limit is set, messages beyond it are suppressed and
+    summarized later; see setLogRateLimit().
+
     \sa MessageType
 */
 
-/*!
-    Returns a pointer to the current application's XHServiceBase
-    instance.
-*/
-XHServiceBase *XHServiceBase::instance()
+void XHServiceBase::logMessage(const std::string &message, MessageType type,
+	int id, uint16_t category, const std::string &data)
 {
-    return XHServiceBasePrivate::instance;
+	d_ptr->logMessages.add();
+	d_ptr->logBytes.add(message.size());
+	if (!d_ptr->log.admit(type, message, id, category)) {
+		d_ptr->logSuppressed.add();
+		return;
+	}
+	if (!d_ptr->log.post(type, message, id, category, data))
+		d_ptr->logDropped.add();
 }
 
 /*!
-    \fn void XHServiceBase::start()
-
-    This function must be implemented in XHServiceBase subclasses in
-    order to perform the service's work. Usually you create some main
-    object on the heap which is the heart of your service.
+    Blocks until every message passed to logMessage() before the call
+    has been written to the system log, or until \a timeoutMs
+    milliseconds have passed (-1 waits forever). Returns true if all
+    of them were written.
 
-    The function is only called when no service specific arguments
-    were passed to the service constructor, and is called by exec()
-    after it has called the executeApplication() function.
-
-    Note that you \e don't need to create an application object or
-    call its exec() function explicitly.
+    The log is also flushed when executeApplication() returns and when
+    the service object is destroyed.
 
-    \sa exec(), stop(), XHServiceController::start()
+    \sa logMessage()
 */
+bool XHServiceBase::flushLog(int timeoutMs)
+{
+	return d_ptr->log.flush(timeoutMs);
+}
 
 /*!
-    Reimplement this function to perform additional cleanups before
-    shutting down (for example deleting a main object if it was
-    created in the start() function).
+    Makes \a sink the destination of the messages passed to
+    logMessage(), instead of the system log. The service takes
+    ownership of the sink and deletes it when it is replaced or when
+    the log shuts down. Passing 0 returns to the system log.
 
-    This function is called in reply to controller requests. The
-    default implementation does nothing.
+    The writer thread switches over between two batches of messages,
+    so call this before the first logMessage() for every message to go
+    to the new sink.
 
-    \sa start(), XHServiceController::stop()
+    \sa XHLogSink, XHFileLogSink
 */
-void XHServiceBase::stop()
+void XHServiceBase::setLogSink(XHLogSink *sink)
 {
+	d_ptr->log.setSink(sink);
 }
 
 /*!
-    Reimplement this function to pause the service's execution (for
-    example to stop a polling timer, or to ignore socket notifiers).
-
-    This function is called in reply to controller requests.  The
-    default implementation does nothing.
+    Returns the number of messages the log buffer can hold. The default
+    is 1024.
 
-    \sa resume(), XHServiceController::pause()
+    \sa setLogBufferSize()
 */
-void XHServiceBase::pause()
+int XHServiceBase::logBufferSize() const
 {
+	return d_ptr->log.capacity();
 }
 
 /*!
-    Reimplement this function to continue the service after a call to
-    pause().
+    Sets the number of messages the log buffer holds to \a records,
+    rounded up to a power of two. The buffer is allocated by the first
+    logMessage() call; later calls to this function have no effect.
 
-    This function is called in reply to controller requests. The
-    default implementation does nothing.
-
-    \sa pause(), XHServiceController::resume()
+    \sa logBufferSize(), setLogOverflowPolicy()
 */
-void XHServiceBase::resume()
+void XHServiceBase::setLogBufferSize(int records)
 {
+	d_ptr->log.setCapacity(records);
 }
 
 /*!
-    Reimplement this function to process the user command \a code.
+    \enum XHServiceBase::LogOverflowPolicy
 
+    This enum describes what logMessage() does when the log buffer is
+    full.
 
-    This function is called in reply to controller requests.  The
-    default implementation does nothing.
+    \value DropOnOverflow The message is discarded and counted in
+           droppedLogMessages(). The caller never waits.
+    \value BlockOnOverflow The caller waits until the writer thread
+           has made room.
+*/
 
-    \sa XHServiceController::sendCommand()
+/*!
+    Returns the policy applied when the log buffer is full.
+
+    \sa setLogOverflowPolicy()
 */
-void XHServiceBase::processCommand(int /*code*/)
+XHServiceBase::LogOverflowPolicy XHServiceBase::logOverflowPolicy() const
 {
+	return (LogOverflowPolicy)d_ptr->log.overflowPolicy();
 }
 
 /*!
-    \fn void XHServiceBase::createApplication(int &argc, char **argv)
+    Sets the policy applied when the log buffer is full to \a policy.
+    The default is DropOnOverflow.
 
-    Creates the application object using the \a argc and \a argv
-    parameters.
+    \sa logOverflowPolicy(), droppedLogMessages()
+*/
+void XHServiceBase::setLogOverflowPolicy(LogOverflowPolicy policy)
+{
+	d_ptr->log.setOverflowPolicy(policy);
+}
+
+/*!
+    Returns the number of messages discarded because the log buffer
+    was full.
+
+    \sa setLogOverflowPolicy()
+*/
+uint64_t XHServiceBase::droppedLogMessages() const
+{
+	return d_ptr->log.dropped();
+}
+
+/*!
+    Returns the number of messages of one kind logMessage() passes on
+    per second, or 0 if messages are not limited (the default).
+
+    \sa setLogRateLimit()
+*/
+int XHServiceBase::logRateLimit() const
+{
+	return d_ptr->log.limiter.limit();
+}
+
+/*!
+    Returns the number of messages of one kind that may be logged in a
+    burst beyond the rate limit.
+
+    \sa setLogRateLimit()
+*/
+int XHServiceBase::logRateBurst() const
+{
+	return d_ptr->log.limiter.burst();
+}
+
+/*!
+    Limits each kind of message to \a messagesPerSecond on average,
+    allowing bursts of up to \a burst messages. Messages with an \c id
+    or \c category are of the same kind if both match; others if their
+    texts are equal. A \a messagesPerSecond of 0 turns the limit off,
+    which is the default.
+
+    Messages beyond the limit are not queued. At most every five
+    seconds, and when the log is shut down, the writer thread logs one
+    message per kind telling how many were suppressed, with the text of
+    the first of them. Suppressed messages are counted in
+    suppressedLogMessages() and not in droppedLogMessages().
+
+    A suppressed call costs a hash lookup and an atomic update, so a
+    failing component that logs in a tight loop no longer floods the
+    system log or the log buffer.
+
+    \sa logRateLimit(), logRateBurst()
+*/
+void XHServiceBase::setLogRateLimit(int messagesPerSecond, int burst)
+{
+	d_ptr->log.limiter.setLimit(messagesPerSecond, burst);
+}
+
+/*!
+    Returns the number of messages suppressed by the log rate limit.
+
+    \sa setLogRateLimit()
+*/
+uint64_t XHServiceBase::suppressedLogMessages() const
+{
+	return d_ptr->log.limiter.suppressed();
+}
+
+/*!
+    Returns the startup plan of the service. Steps added to it, usually
+    from createApplication(), run in parallel before start() is called
+    and are reported to the service manager as startup progress. The
+    service does not start if one of them fails.
+
+    \sa XHStartupPlan
+*/
+XHStartupPlan &XHServiceBase::startupPlan()
+{
+	return d_ptr->startupPlan;
+}
+
+/*!
+    Returns the pause token of the service, paused while the service
+    handles a pause request and is paused, and resumed once resume()
+    returned or the service is asked to stop. Worker threads call
+    XHPauseToken::wait() to park while the service is paused.
+
+    \sa pause(), resume(), XHPauseToken
+*/
+XHPauseToken &XHServiceBase::pauseToken()
+{
+	return d_ptr->pauseToken;
+}
+
+/*!
+    Returns the executor of the service, a pool of executorThreads()
+    worker threads for the service's background work. It is created
+    right before start() is called, or by the first call of this
+    function, and destroyed once executeApplication() returned.
+
+    The executor follows the service: it parks its workers while the
+    service is paused, gets what is left of drainTimeout() to finish
+    its tasks when the service is stopped, dropping the tasks that
+    haven't started by then, and drops them right away on a system
+    shutdown. Once the service is stopping, only the executor's own tasks can
+    post more.
+
+    \sa XHServiceExecutor, pauseToken()
+*/
+XHServiceExecutor &XHServiceBase::executor()
+{
+	return *d_ptr->serviceExecutor();
+}
+
+/*!
+    Returns the number of worker threads the executor is created with.
+    The default, 0, creates one per core the process may run on.
+
+    \sa setExecutorThreads(), XHServiceExecutor::availableCores()
+*/
+int XHServiceBase::executorThreads() const
+{
+	return d_ptr->executorThreads;
+}
+
+/*!
+    Sets the number of executor threads to \a threads. It has no effect
+    once executor() was created.
+*/
+void XHServiceBase::setExecutorThreads(int threads)
+{
+	d_ptr->executorThreads = threads;
+}
+
+/*!
+    Returns the metrics registry of the service, which controllers
+    read with XHServiceController::metrics(). Besides the metrics the
+    service registers, it holds the built-in ones listed in the
+    XHMetricsRegistry documentation. With WorkerProcesses or
+    RestartOnCrash, controllers read the registry of the supervising
+    process, not the workers'.
+
+    \sa XHMetricsRegistry
+*/
+XHMetricsRegistry &XHServiceBase::metrics()
+{
+	return d_ptr->metrics;
+}
+
+/*!
+    Registers an in-flight operation, such as a write to a device that
+    must not be cut off half way. Returns false, without registering
+    anything, once the service is stopping; the caller should then not
+    start the operation. Every successful call must be balanced by
+    endOperation(). XHServiceOperation does both.
+
+    When the service is asked to stop, it waits for the registered
+    operations to end before calling stop(), for at most drainTimeout()
+    milliseconds. Registering and ending an operation costs two atomic
+    operations.
+
+    \sa XHServiceOperation, inFlightOperations()
+*/
+bool XHServiceBase::beginOperation()
+{
+	return d_ptr->drain.enter();
+}
+
+/*!
+    Ends an operation registered with beginOperation().
+*/
+void XHServiceBase::endOperation()
+{
+	d_ptr->drain.leave();
+}
+
+/*!
+    Returns the number of operations currently registered with
+    beginOperation().
+*/
+int XHServiceBase::inFlightOperations() const
+{
+	return d_ptr->drain.inFlight();
+}
+
+/*!
+    Returns how long, in milliseconds, the service waits for in-flight
+    operations when it is asked to stop. The default is 10 seconds.
+
+    \sa setDrainTimeout()
+*/
+int XHServiceBase::drainTimeout() const
+{
+	return d_ptr->drainTimeout;
+}
+
+/*!
+    Sets the drain deadline to \a timeoutMs milliseconds. 0 doesn't
+    wait at all; a negative value waits until every operation ended.
+    The service reports stop progress to the service manager while it
+    waits, so a deadline longer than the manager's stop timeout is
+    fine. Operations still running at the deadline are counted in
+    abortedOperations() and logged as a warning, and stop() is called
+    regardless.
+*/
+void XHServiceBase::setDrainTimeout(int timeoutMs)
+{
+	d_ptr->drainTimeout = timeoutMs;
+	d_ptr->statusPage.setDrainTimeout(timeoutMs);
+}
+
+/*!
+    Returns how long, in milliseconds, the last stop waited for the
+    in-flight operations. Controllers read the same figure from
+    XHServiceStatus::drainDuration.
+*/
+int64_t XHServiceBase::lastDrainDuration() const
+{
+	return d_ptr->drainDuration.load();
+}
+
+/*!
+    Returns the number of operations that were still running when a
+    drain deadline passed. Controllers read the same figure from
+    XHServiceStatus::abortedOperations.
+*/
+uint64_t XHServiceBase::abortedOperations() const
+{
+	return d_ptr->drainAborted.load();
+}
+
+/*!
+    Registers \a fd to be handed to the new instance when the service
+    is upgraded, under \a name. Listening sockets registered here keep
+    accepting connections across the upgrade; shared memory objects
+    keep their contents. The descriptor stays owned by this instance.
+    A negative \a fd removes \a name.
+
+    \sa takeInheritedDescriptor(), XHServiceController::upgrade()
+*/
+void XHServiceBase::setHandoffDescriptor(const std::string &name, int fd)
+{
+	std::lock_guard<std::mutex> lock(d_ptr->handoffMutex);
+	if (fd < 0)
+		d_ptr->handoffDescriptors.erase(name);
+	else
+		d_ptr->handoffDescriptors[name] = fd;
+}
+
+/*!
+    Returns the descriptor inherited under \a name, or -1 if there is
+    none. The caller owns the returned descriptor.
+
+    Descriptors are inherited from the instance this one replaces (see
+    setHandoffDescriptor()) or, on Linux, from a supervisor using
+    socket activation: systemd, or anything else that passes listening
+    sockets through \c LISTEN_FDS, \c LISTEN_PID and
+    \c LISTEN_FDNAMES. Unnamed sockets are called "unknown".
+
+    Inherited descriptors are available from createApplication() on;
+    those not taken by the time the service reports running are
+    closed.
+
+    \code
+    void MyService::createApplication(int &argc, char **argv)
+    {
+        listener = takeInheritedDescriptor("modbus");
+        if (listener < 0)
+            listener = openListener(502);
+        setHandoffDescriptor("modbus", listener);
+    }
+    \endcode
+
+    \sa setHandoffDescriptor()
+*/
+int XHServiceBase::takeInheritedDescriptor(const std::string &name)
+{
+	return takeInheritedSocket(name).descriptor;
+}
+
+/*!
+    Like takeInheritedDescriptor(), but also returns what kind of
+    socket the descriptor is and its local address. If several sockets
+    share \a name, as the sockets of one systemd socket unit do, each
+    call returns the next one.
+
+    With socket activation the supervisor binds the ports early, before
+    the service even starts, and queues the connections arriving
+    meanwhile; nothing is lost while the service starts, and it may be
+    started only when the first connection arrives.
+
+    \code
+    void MyService::createApplication(int &argc, char **argv)
+    {
+        for (;;) {
+            XHInheritedSocket socket = takeInheritedSocket("modbus");
+            if (!socket.isValid())
+                break;
+            if (socket.type == XHInheritedSocket::TcpSocket && socket.listening)
+                server.addListener(socket.descriptor);
+        }
+    }
+    \endcode
+
+    \sa inheritedSockets()
+*/
+XHInheritedSocket XHServiceBase::takeInheritedSocket(const std::string &name)
+{
+	std::lock_guard<std::mutex> lock(d_ptr->handoffMutex);
+	std::vector<XHInheritedSocket> &sockets = d_ptr->inheritedDescriptors;
+	for (size_t i = 0; i < sockets.size(); ++i) {
+		if (sockets[i].name == name) {
+			XHInheritedSocket socket = sockets[i];
+			sockets.erase(sockets.begin() + i);
+			return socket;
+		}
+	}
+	return XHInheritedSocket();
+}
+
+/*!
+    Returns the inherited sockets not taken yet, in the order they were
+    passed. The descriptors stay owned by the service base until taken.
+
+    \sa takeInheritedSocket()
+*/
+std::vector<XHInheritedSocket> XHServiceBase::inheritedSockets() const
+{
+	std::lock_guard<std::mutex> lock(d_ptr->handoffMutex);
+	return d_ptr->inheritedDescriptors;
+}
+
+/*!
+    Returns the number of worker processes a service with the
+    WorkerProcesses flag runs. The default, 0, runs one worker per CPU
+    the service may run on.
+
+    \sa setWorkerCount()
+*/
+int XHServiceBase::workerCount() const
+{
+	return d_ptr->workerCount;
+}
+
+/*!
+    Sets the number of worker processes to \a count. Call it, like
+    setServiceFlags(), from the constructor: the master reads it before
+    createApplication() would run.
+
+    With the WorkerProcesses flag the service process becomes a master
+    that starts the service binary once per worker. Every worker calls
+    createApplication(), start() and executeApplication() as if the
+    service were run with -e, with workerIndex() telling them apart. A
+    worker that crashes is started again, as described for
+    setRestartDelay(); the service stops once no worker is left. Pause,
+    resume and command requests are passed on to every worker; on stop
+    the workers drain and stop, and those still running drainTimeout()
+    plus five seconds later are killed.
+
+    The workers share the load by accepting on the same port: either
+    each worker binds it with \c SO_REUSEPORT, or the master's
+    inherited sockets, which every worker receives, are taken with
+    takeInheritedSocket(). Workers don't publish status counters.
+
+    \code
+    MyService::MyService(int argc, char **argv)
+        : XHServiceBase(argc, argv, "modbus-gateway")
+    {
+        setServiceFlags(WorkerProcesses);
+        setWorkerCount(4);
+        setWorkerAffinity(CoreAffinity);
+    }
+    \endcode
+
+    \sa workerAffinity(), workerIndex()
+*/
+void XHServiceBase::setWorkerCount(int count)
+{
+	d_ptr->workerCount = count;
+}
+
+/*!
+    Returns how worker processes are pinned to CPUs. The default is
+    NoAffinity.
+*/
+XHServiceBase::WorkerAffinity XHServiceBase::workerAffinity() const
+{
+	return WorkerAffinity(d_ptr->workerAffinity);
+}
+
+/*!
+    Pins the worker processes according to \a affinity. The CPUs are
+    taken from those the service itself may run on.
+*/
+void XHServiceBase::setWorkerAffinity(WorkerAffinity affinity)
+{
+	d_ptr->workerAffinity = affinity;
+}
+
+/*!
+    Returns the index, from 0 to workerCount() - 1, of this worker
+    process, or -1 if the service doesn't run as a worker. A restarted
+    worker keeps its index.
+*/
+int XHServiceBase::workerIndex() const
+{
+	return d_ptr->workerIndex;
+}
+
+/*!
+    Returns how long, in milliseconds, a service running with
+    RestartOnCrash waits before restarting a crashed process. The
+    default is 10 ms.
+
+    \sa setRestartDelay()
+*/
+int XHServiceBase::restartDelay() const
+{
+	return d_ptr->restartDelay;
+}
+
+/*!
+    Sets the delay before the first restart to \a delayMs
+    milliseconds.
+
+    With the RestartOnCrash flag the service process becomes a
+    supervisor that runs createApplication(), start() and
+    executeApplication() in a child process, started like a single
+    worker of WorkerProcesses (see setWorkerCount()). When the child is
+    killed by a signal or exits with a non-zero code, it is started
+    again after the restart delay. The delay doubles with every crash
+    in a row, up to maxRestartDelay(), and starts over once the child
+    ran for crashLoopPeriod(). A child that crashes crashLoopLimit()
+    times within crashLoopPeriod() is considered to crash in a loop and
+    isn't restarted anymore; the service then stops with exit code 1,
+    leaving the rest to the system's service manager. A child exiting
+    with code 0 stops the service normally.
+
+    Every exit is logged and recorded with its cause and uptime; see
+    XHServiceController::exitHistory(). The same policy applies to the
+    workers of WorkerProcesses.
+
+    Like the flags, the policy must be set from the constructor.
+*/
+void XHServiceBase::setRestartDelay(int delayMs)
+{
+	d_ptr->restartDelay = delayMs;
+}
+
+/*!
+    Returns the longest delay, in milliseconds, between restarts of a
+    process that keeps crashing. The default is 30 seconds.
+*/
+int XHServiceBase::maxRestartDelay() const
+{
+	return d_ptr->maxRestartDelay;
+}
+
+/*!
+    Limits the delay between restarts to \a delayMs milliseconds.
+*/
+void XHServiceBase::setMaxRestartDelay(int delayMs)
+{
+	d_ptr->maxRestartDelay = delayMs;
+}
+
+/*!
+    Returns the number of crashes within crashLoopPeriod() after which
+    a process isn't restarted anymore. The default is 5.
+*/
+int XHServiceBase::crashLoopLimit() const
+{
+	return d_ptr->crashLoopLimit;
+}
+
+/*!
+    Sets the crash loop limit to \a crashes. 0 restarts crashed
+    processes forever.
+*/
+void XHServiceBase::setCrashLoopLimit(int crashes)
+{
+	d_ptr->crashLoopLimit = crashes;
+}
+
+/*!
+    Returns the period, in milliseconds, within which crashLoopLimit()
+    crashes are a crash loop. The default is one minute.
+*/
+int XHServiceBase::crashLoopPeriod() const
+{
+	return d_ptr->crashLoopPeriod;
+}
+
+/*!
+    Sets the crash loop period to \a periodMs milliseconds.
+*/
+void XHServiceBase::setCrashLoopPeriod(int periodMs)
+{
+	d_ptr->crashLoopPeriod = periodMs;
+}
+
+/*!
+    \class XHInheritedSocket
+
+    \brief The XHInheritedSocket struct describes a descriptor the
+    service inherited, as returned by
+    XHServiceBase::takeInheritedSocket().
+
+    \c address and \c port are the local address the socket is bound
+    to; for local (Unix domain) sockets \c address is the path, or the
+    name prefixed with '@' in the abstract namespace. \c listening is
+    true for sockets connections can be accepted from.
+
+    \value InvalidSocket No descriptor.
+    \value TcpSocket An IPv4 or IPv6 stream socket.
+    \value UdpSocket An IPv4 or IPv6 datagram socket.
+    \value LocalStreamSocket A Unix domain stream socket.
+    \value LocalDatagramSocket A Unix domain datagram socket.
+    \value LocalSeqPacketSocket A Unix domain sequenced-packet socket.
+    \value OtherDescriptor Any other descriptor, such as a FIFO.
+*/
+
+/*!
+    \class XHServiceOperation
+
+    \brief The XHServiceOperation class marks the scope of an in-flight
+    operation that a stopping service waits for.
+
+    The constructor calls XHServiceBase::beginOperation() and the
+    destructor the matching endOperation(). If the service is already
+    stopping, isAccepted() returns false and the operation should be
+    skipped.
+
+    \code
+    void FieldBus::writeSetpoint(int tag, double value)
+    {
+        XHServiceOperation operation;
+        if (!operation.isAccepted())
+            return;
+        port.write(tag, value);
+    }
+    \endcode
+
+    \sa XHServiceBase::setDrainTimeout()
+*/
+
+/*!
+    Registers an operation with \a service, by default the service of
+    the process.
+*/
+XHServiceOperation::XHServiceOperation(XHServiceBase *service)
+	: service(service && service->beginOperation() ? service : 0)
+{
+}
+
+/*!
+    Ends the operation.
+*/
+XHServiceOperation::~XHServiceOperation()
+{
+	if (service)
+		service->endOperation();
+}
+
+/*!
+    Sets the custom status counter \a index (0 to
+    XHServiceController::StatusCounterCount - 1) to \a value.
+
+    Counters live in the service's shared status page and are read by
+    XHServiceController::statusCounter() without any IPC. Updating one
+    is a single atomic store and is safe from any thread. They are
+    reset when the service starts and only published while it runs as
+    a service (not with -e).
+
+    \sa addStatusCounter()
+*/
+void XHServiceBase::setStatusCounter(int index, int64_t value)
+{
+	d_ptr->statusPage.setCounter(index, value);
+}
+
+/*!
+    Atomically adds \a delta to the custom status counter \a index.
+
+    \sa setStatusCounter()
+*/
+void XHServiceBase::addStatusCounter(int index, int64_t delta)
+{
+	d_ptr->statusPage.addCounter(index, delta);
+}
+
+/*!
+    Returns the interval, in milliseconds, at which the service samples
+    its own resource usage. The default is 1000.
+
+    \sa setProcessSampleInterval()
+*/
+int XHServiceBase::processSampleInterval() const
+{
+	return d_ptr->statusPage.sampleInterval();
+}
+
+/*!
+    Sets the interval at which the service samples its own resource
+    usage (memory, CPU time, threads, open files and context switches)
+    to \a intervalMs milliseconds; 0 turns sampling off.
+
+    The samples are taken by the thread that beats the status page's
+    heartbeat, so intervals shorter than a second are rounded up to
+    one. A sample costs a few reads of files opened when the service
+    started (\c /proc/self on Linux) and no allocation. Like the
+    status counters, samples are only published while the service runs
+    as a service, and are read by XHServiceController::processSample()
+    and XHServiceController::processHistory().
+*/
+void XHServiceBase::setProcessSampleInterval(int intervalMs)
+{
+	d_ptr->statusPage.setSampleInterval(intervalMs);
+}
+
+/*!
+    Runs \a function on the service thread, from the event loop run by
+    executeApplication() or processEvents(). Can be called from any
+    thread. Functions posted after the event loop returned for good
+    are dropped.
+*/
+void XHServiceBase::post(const std::function<void()> &function)
+{
+	d_ptr->eventLoop.post(function);
+}
+
+/*!
+    Reports the progress of a pending start or stop to the service
+    manager, with \a status as the text shown by systemd. The service
+    manager waits another \a waitHintMs milliseconds, or the status
+    heartbeat's staleness limit if \a waitHintMs is -1, for the next
+    report or the new state before it gives up on the service. Can be
+    called from any thread.
+
+    \sa deferTransition()
+*/
+void XHServiceBase::reportProgress(const std::string &status, int waitHintMs)
+{
+	d_ptr->sysSetProgress(status, ++d_ptr->progressCheckPoint,
+		waitHintMs < 0 ? (uint32_t)XHStatusStaleMs : (uint32_t)waitHintMs);
+}
+
+/*!
+    Calls \a callback every \a intervalMs milliseconds on the service
+    thread, from the event loop run by executeApplication() or
+    processEvents(), and returns the id of the timer for killTimer().
+    Must be called on the service thread; other threads post() the
+    call.
+
+    The timer is due \a slackMs milliseconds late at most, or
+    timerSlack() if \a slackMs is -1: it is rounded up to a multiple
+    of the slack, so timers due within the same slack window fire
+    together and the service wakes up once for all of them. Periods
+    missed while the service thread was busy are skipped, not caught
+    up on.
+
+    Timers don't fire while the service is paused: they stop once
+    pause() returned and resume before resume() is called, a timer
+    that fell due in between firing once.
+
+    The timers live in a hierarchical timer wheel, so starting and
+    killing a timer takes constant time however many there are.
+
+    \sa singleShot(), killTimer(), setTimerSlack()
+*/
+uint64_t XHServiceBase::startTimer(int intervalMs, const std::function<void()> &callback, int slackMs)
+{
+	return d_ptr->eventLoop.startTimer(intervalMs, slackMs < 0 ? d_ptr->timerSlack : slackMs, true,
+		callback);
+}
+
+/*!
+    Calls \a callback once, \a delayMs milliseconds from now, and
+    returns the id of the timer. Otherwise like startTimer().
+*/
+uint64_t XHServiceBase::singleShot(int delayMs, const std::function<void()> &callback, int slackMs)
+{
+	return d_ptr->eventLoop.startTimer(delayMs, slackMs < 0 ? d_ptr->timerSlack : slackMs, false,
+		callback);
+}
+
+/*!
+    Stops the timer \a id. Returns false if there is no such timer,
+    for example because it was a single shot timer that has fired.
+    Must be called on the service thread.
+*/
+bool XHServiceBase::killTimer(uint64_t id)
+{
+	return d_ptr->eventLoop.killTimer(id);
+}
+
+/*!
+    Returns the number of timers started and not killed or fired yet.
+*/
+int XHServiceBase::activeTimers() const
+{
+	return d_ptr->eventLoop.timerCount();
+}
+
+/*!
+    Returns the default slack of timers in milliseconds, 0 unless
+    changed with setTimerSlack().
+
+    \sa startTimer()
+*/
+int XHServiceBase::timerSlack() const
+{
+	return d_ptr->timerSlack;
+}
+
+/*!
+    Sets the slack of timers started without one to \a slackMs
+    milliseconds. Timers started already keep theirs.
+*/
+void XHServiceBase::setTimerSlack(int slackMs)
+{
+	d_ptr->timerSlack = slackMs > 0 ? slackMs : 0;
+}
+
+/*!
+    Returns a pointer to the current application's XHServiceBase
+    instance.
+*/
+XHServiceBase *XHServiceBase::instance()
+{
+    return XHServiceBasePrivate::instance;
+}
+
+/*!
+    \fn void XHServiceBase::start()
+
+    This function must be implemented in XHServiceBase subclasses in
+    order to perform the service's work. Usually you create some main
+    object on the heap which is the heart of your service.
+
+    The function is only called when no service specific arguments
+    were passed to the service constructor, and is called by exec()
+    after it has called the executeApplication() function.
+
+    Note that you \e don't need to create an application object or
+    call its exec() function explicitly.
+
+    \sa exec(), stop(), XHServiceController::start()
+*/
+
+/*!
+    Reimplement this function to perform additional cleanups before
+    shutting down (for example deleting a main object if it was
+    created in the start() function).
+
+    This function is called in reply to controller requests. The
+    default implementation does nothing.
+
+    \sa start(), XHServiceController::stop()
+*/
+void XHServiceBase::stop()
+{
+}
+
+/*!
+    Reimplement this function to pause the service's execution (for
+    example to stop a polling timer, or to ignore socket notifiers).
+
+    This function is called in reply to controller requests.  The
+    default implementation does nothing. Worker threads that wait on
+    pauseToken() are parked already when it is called.
+
+    \sa resume(), pauseToken(), XHServiceController::pause()
+*/
+void XHServiceBase::pause()
+{
+}
+
+/*!
+    Reimplement this function to continue the service after a call to
+    pause().
+
+    This function is called in reply to controller requests. The
+    default implementation does nothing.
+
+    \sa pause(), XHServiceController::resume()
+*/
+void XHServiceBase::resume()
+{
+}
+
+/*!
+    Reimplement this function to process the user command \a code.
+
+
+    This function is called in reply to controller requests.  The
+    default implementation does nothing.
+
+    \sa XHServiceController::sendCommand()
+*/
+void XHServiceBase::processCommand(int /*code*/)
+{
+}
+
+/*!
+    Reimplement this function to answer the request \a code sent with
+    XHServiceController::call(). The request payload is the \a size
+    bytes at \a data; store the answer in \a reply and return true,
+    or return false to fail the call.
+
+    Large payloads are read in place from memory shared with the
+    controller, so \a data is only valid until the function returns.
+
+    The default implementation does nothing and returns false.
+
+    \sa XHServiceController::call(), processCommand()
+*/
+bool XHServiceBase::processRequest(int /*code*/, const char * /*data*/, size_t /*size*/,
+	std::string * /*reply*/)
+{
+	return false;
+}
+
+/*!
+    \fn void XHServiceBase::createApplication(int &argc, char **argv)
+
+    Creates the application object using the \a argc and \a argv
+    parameters.
 
     This function is only called when no \l
     {serviceSpecificArguments}{service specific arguments} were
@@ -857,20 +2450,98 @@ void XHServiceBase::processCommand(int /*code*/)
 */
 
 /*!
-    \fn int XHServiceBase::executeApplication()
-
     Executes the application previously created with the
     createApplication() function.
 
     This function is only called when no \l
     {serviceSpecificArguments}{service specific arguments} were
     passed to the service constructor, and is called by exec() after
-    it has called the createApplication() function and before start() function.
+    it has called the createApplication() and start() functions.
+
+    The default implementation runs the service's built-in event
+    loop: controller requests are queued by the platform's control
+    handler and stop(), pause(), resume() and processCommand() are
+    called on this thread. The loop returns after stop(), or when
+    quit() is called, with the code passed to quit().
+
+    Reimplementations that run a loop of their own should call
+    processEvents() from it; otherwise the control callbacks are
+    invoked directly on the control handler's thread.
 
-    This function is implemented in XHService.
+    \sa exec(), createApplication(), quit(), processEvents()
+*/
+int XHServiceBase::executeApplication()
+{
+	return d_ptr->eventLoop.exec();
+}
+
+/*!
+    Makes the built-in event loop run by executeApplication() return
+    \a returnCode. Can be called from any thread.
+
+    \sa executeApplication()
+*/
+void XHServiceBase::quit(int returnCode)
+{
+	d_ptr->eventLoop.post(XHServiceEvent::Quit, returnCode);
+}
+
+/*!
+    Delivers pending controller requests on the calling thread and
+    returns true if any were handled. If none are pending the call
+    waits up to \a timeoutMs milliseconds for one (-1 waits forever,
+    0 returns at once).
+
+    Use this from a reimplemented executeApplication() that runs its
+    own loop. Must only be called from a single thread.
+
+    \sa executeApplication()
+*/
+bool XHServiceBase::processEvents(int timeoutMs)
+{
+	return d_ptr->eventLoop.processEvents(timeoutMs);
+}
 
-    \sa exec(), createApplication()
+/*!
+    Tells the service that the start(), stop(), pause() or resume()
+    being called isn't finished when the function returns. The service
+    stays in the pending state, and the event loop keeps running, until
+    completeTransition() is called. Must be called on the service
+    thread, from one of those functions.
+
+    This lets a service start, or stop, without holding up the event
+    loop: start() sets the work going and returns, and the event loop
+    delivers the completions. Report progress with reportProgress()
+    meanwhile, so that the service manager doesn't give up on the
+    service. XHAsyncService does all of this for coroutines.
+
+    \sa completeTransition(), XHAsyncService
 */
+void XHServiceBase::deferTransition()
+{
+	if (d_ptr->transition != XHServiceEvent::None && !d_ptr->transitionDeferred) {
+		d_ptr->transitionDeferred = true;
+		d_ptr->deferredTransitions.push_back(d_ptr->transition);
+	}
+}
+
+/*!
+    Finishes the oldest transition put off with deferTransition(). If
+    \a success is true the service enters the new state. Otherwise a
+    failed start stops the service with exit code 1, a failed pause
+    leaves it running and a failed resume leaves it paused; a stop
+    can't fail. Must be called on the service thread.
+
+    \sa deferTransition()
+*/
+void XHServiceBase::completeTransition(bool success)
+{
+	if (d_ptr->deferredTransitions.empty())
+		return;
+	int type = d_ptr->deferredTransitions.front();
+	d_ptr->deferredTransitions.pop_front();
+	d_ptr->finishTransition(type, success);
+}
 
 /*!
     \class XHService
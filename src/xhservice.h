@@ -7,11 +7,31 @@
 #define XHSERVICE_H
 
 #include "xhservice_global.h"
+#include "xhservice_binlog.h"
+#include "xhservice_executor.h"
+#include "xhservice_log.h"
+#include "xhservice_metrics.h"
+#include "xhservice_startup.h"
+#include <atomic>
+#include <functional>
+#include <future>
 #include <string>
 #include <vector>
 #include <stdint.h>
 
 class XHServiceControllerPrivate;
+struct XHServiceStatus;
+struct XHServiceExitRecord;
+struct XHServiceStateChange;
+struct XHProcessSample;
+
+struct XHSERVICE_EXPORT XHServiceReply
+{
+	XHServiceReply() : ok(false) {}
+
+	bool ok;
+	std::string data;
+};
 
 class XHSERVICE_EXPORT XHServiceController
 {
@@ -20,6 +40,15 @@ public:
 	{
 		AutoStartup = 0, ManualStartup
 	};
+	enum State
+	{
+		StoppedState = 1, StartPendingState, StopPendingState, RunningState,
+		ContinuePendingState, PausePendingState, PausedState
+	};
+	enum
+	{
+		StatusCounterCount = 16
+	};
 	XHServiceController(const std::string &name);
 	virtual ~XHServiceController();
 
@@ -30,6 +59,7 @@ public:
 	std::string serviceDescription() const;
 	std::string serviceFilePath() const;	
 	StartupType startupType() const;
+	XHServiceStatus status(int maxAgeMs = 0) const;
 	static bool install(const std::string &serviceFilePath,
 		const std::string &account = std::string(),
 		const std::string &password = std::string());
@@ -41,11 +71,139 @@ public:
 	bool pause();
 	bool resume();
 	bool sendCommand(int code);
+	bool call(int code, const std::string &request, std::string *reply = 0, int timeoutMs = 5000);
+	bool upgrade(const std::string &filePath = std::string());
+
+	std::future<bool> stopAsync();
+	std::future<bool> pauseAsync();
+	std::future<bool> resumeAsync();
+	std::future<bool> sendCommandAsync(int code);
+	std::future<XHServiceReply> callAsync(int code, const std::string &request);
+
+	bool subscribe(const std::function<void(const XHServiceStateChange &change)> &handler);
+	void unsubscribe();
+
+	int64_t statusCounter(int index) const;
+	std::vector<XHServiceExitRecord> exitHistory() const;
+	XHProcessSample processSample() const;
+	std::vector<XHProcessSample> processHistory() const;
+	std::vector<XHMetricSample> metrics() const;
+	std::string metricsReport(XHMetricsRegistry::Format format = XHMetricsRegistry::PrometheusText) const;
 
 private:
 	XHServiceControllerPrivate *d_ptr;
 };
 
+struct XHSERVICE_EXPORT XHServiceStatus
+{
+	XHServiceStatus();
+
+	std::string name;
+	bool installed;
+	bool running;
+	XHServiceController::State state;
+	XHServiceController::StartupType startupType;
+	std::string description;
+	std::string filePath;
+	int64_t pid;
+	int64_t startTime;
+	uint32_t checkPoint;
+	uint32_t waitHint;
+	int64_t drainDuration;
+	int64_t abortedOperations;
+	int64_t restarts;
+	int64_t timestamp;
+};
+
+struct XHSERVICE_EXPORT XHServiceStateChange
+{
+	XHServiceStateChange()
+		: time(0), state(XHServiceController::StoppedState), crashed(false), pid(0), workerIndex(-1),
+		exitCode(0), signal(0) {}
+
+	int64_t time;
+	XHServiceController::State state;
+	bool crashed;
+	int64_t pid;
+	int workerIndex;
+	int exitCode;
+	int signal;
+};
+
+struct XHSERVICE_EXPORT XHServiceExitRecord
+{
+	XHServiceExitRecord()
+		: time(0), pid(0), workerIndex(0), exitCode(0), signal(0), coreDumped(false),
+		uptime(0), restartDelay(-1) {}
+
+	int64_t time;
+	int64_t pid;
+	int workerIndex;
+	int exitCode;
+	int signal;
+	bool coreDumped;
+	int64_t uptime;
+	int64_t restartDelay;
+};
+
+struct XHSERVICE_EXPORT XHProcessSample
+{
+	XHProcessSample()
+		: time(0), residentBytes(-1), userTime(-1), systemTime(-1), threads(-1), openFiles(-1),
+		voluntarySwitches(-1), involuntarySwitches(-1) {}
+
+	int64_t time;
+	int64_t residentBytes;
+	int64_t userTime;
+	int64_t systemTime;
+	int threads;
+	int openFiles;
+	int64_t voluntarySwitches;
+	int64_t involuntarySwitches;
+};
+
+struct XHSERVICE_EXPORT XHInheritedSocket
+{
+	enum Type
+	{
+		InvalidSocket = 0, TcpSocket, UdpSocket, LocalStreamSocket, LocalDatagramSocket,
+		LocalSeqPacketSocket, OtherDescriptor
+	};
+	XHInheritedSocket() : descriptor(-1), type(InvalidSocket), listening(false), port(0) {}
+
+	bool isValid() const { return descriptor >= 0; }
+
+	std::string name;
+	int descriptor;
+	Type type;
+	bool listening;
+	std::string address;
+	int port;
+};
+
+class XHSERVICE_EXPORT XHPauseToken
+{
+public:
+	XHPauseToken();
+
+	bool isPaused() const { return word.load(std::memory_order_relaxed) != 0; }
+	bool wait(int timeoutMs = -1) const
+	{
+		return word.load(std::memory_order_relaxed) == 0 || park(timeoutMs);
+	}
+
+	void pause();
+	void resume();
+
+private:
+	XHPauseToken(const XHPauseToken &);
+	XHPauseToken &operator=(const XHPauseToken &);
+
+	bool park(int timeoutMs) const;
+
+	mutable std::atomic<uint32_t> word;
+};
+
 class XHServiceBasePrivate;
 
 class XHSERVICE_EXPORT XHServiceBase
@@ -56,12 +214,24 @@ public:
 		Success = 0, Error, Warning, Information
 	};
 
+	enum LogOverflowPolicy
+	{
+		DropOnOverflow = 0, BlockOnOverflow
+	};
+
 	enum ServiceFlag
 	{
 		Default = 0x00,
 		CanBeSuspended = 0x01,
 		CannotBeStopped = 0x02,
-		NeedsStopOnShutdown = 0x04
+		NeedsStopOnShutdown = 0x04,
+		WorkerProcesses = 0x08,
+		RestartOnCrash = 0x10
+	};
+
+	enum WorkerAffinity
+	{
+		NoAffinity = 0, CoreAffinity, NumaNodeAffinity
 	};
 	XHServiceBase(int argc, char **argv, const std::string &name);
 	virtual ~XHServiceBase();
@@ -79,23 +249,106 @@ public:
 
 	void logMessage(const std::string &message, MessageType type = Success,
 		int id = 0, uint16_t category = 0, const std::string &data = std::string());
+	bool flushLog(int timeoutMs = -1);
+	void setLogSink(XHLogSink *sink);
+
+	int logBufferSize() const;
+	void setLogBufferSize(int records);
+	LogOverflowPolicy logOverflowPolicy() const;
+	void setLogOverflowPolicy(LogOverflowPolicy policy);
+	uint64_t droppedLogMessages() const;
+	int logRateLimit() const;
+	int logRateBurst() const;
+	void setLogRateLimit(int messagesPerSecond, int burst = 10);
+	uint64_t suppressedLogMessages() const;
+
+	void setStatusCounter(int index, int64_t value);
+	void addStatusCounter(int index, int64_t delta = 1);
+	int processSampleInterval() const;
+	void setProcessSampleInterval(int intervalMs);
+
+	void post(const std::function<void()> &function);
+	void reportProgress(const std::string &status, int waitHintMs = -1);
+
+	uint64_t startTimer(int intervalMs, const std::function<void()> &callback, int slackMs = -1);
+	uint64_t singleShot(int delayMs, const std::function<void()> &callback, int slackMs = -1);
+	bool killTimer(uint64_t id);
+	int activeTimers() const;
+	int timerSlack() const;
+	void setTimerSlack(int slackMs);
+
+	XHStartupPlan &startupPlan();
+	XHMetricsRegistry &metrics();
+	XHPauseToken &pauseToken();
+	XHServiceExecutor &executor();
+	int executorThreads() const;
+	void setExecutorThreads(int threads);
+
+	bool beginOperation();
+	void endOperation();
+	int inFlightOperations() const;
+	int drainTimeout() const;
+	void setDrainTimeout(int timeoutMs);
+	int64_t lastDrainDuration() const;
+	uint64_t abortedOperations() const;
+
+	void setHandoffDescriptor(const std::string &name, int fd);
+	int takeInheritedDescriptor(const std::string &name);
+	XHInheritedSocket takeInheritedSocket(const std::string &name);
+	std::vector<XHInheritedSocket> inheritedSockets() const;
+
+	int workerCount() const;
+	void setWorkerCount(int count);
+	WorkerAffinity workerAffinity() const;
+	void setWorkerAffinity(WorkerAffinity affinity);
+	int workerIndex() const;
+
+	int restartDelay() const;
+	void setRestartDelay(int delayMs);
+	int maxRestartDelay() const;
+	void setMaxRestartDelay(int delayMs);
+	int crashLoopLimit() const;
+	void setCrashLoopLimit(int crashes);
+	int crashLoopPeriod() const;
+	void setCrashLoopPeriod(int periodMs);
 
 	static XHServiceBase *instance();
 
 public:
 	virtual void createApplication(int &argc, char **argv) = 0;
 	virtual void start() = 0;
-	virtual int executeApplication() = 0;	
+	virtual int executeApplication();
 	virtual void stop();
 protected:	
 	virtual void pause();
 	virtual void resume();
 	virtual void processCommand(int code);
+	virtual bool processRequest(int code, const char *data, size_t size, std::string *reply);
 	void printHelp();
+	void quit(int returnCode = 0);
+	bool processEvents(int timeoutMs = 0);
+	void deferTransition();
+	void completeTransition(bool success = true);
 private:
 
 	friend class XHServiceSysPrivate;
+	friend class XHServiceBasePrivate;
 	XHServiceBasePrivate *d_ptr;
 };
 
+class XHSERVICE_EXPORT XHServiceOperation
+{
+public:
+	explicit XHServiceOperation(XHServiceBase *service = XHServiceBase::instance());
+	~XHServiceOperation();
+
+	bool isAccepted() const { return service != 0; }
+
+private:
+	XHServiceOperation(const XHServiceOperation &);
+	XHServiceOperation &operator=(const XHServiceOperation &);
+
+	XHServiceBase *service;
+};
+
 #endif // XHSERVICE_H
@@ -0,0 +1,554 @@
+/****************************************************************************
+**
+**
+****************************************************************************/
+
+#include "xhservice_binlog.h"
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <stdio.h>
+#if defined(_WIN32)
+#  include <windows.h>
+#elif defined(__linux__)
+#  include <unistd.h>
+#  include <sys/syscall.h>
+#endif
+
+enum
+{
+	DefaultThreadBufferSize = 1024 * 1024,
+	MinimumThreadBufferSize = 4096,
+	FileBufferSize = 1024 * 1024,
+	IdleSleepMaxMs = 16,
+	ClockIntervalMs = 100
+};
+
+struct XHBinaryLogFormatInfo
+{
+	int type;
+	int line;
+	std::string format;
+	std::string file;
+	std::vector<uint8_t> tags;
+};
+
+// Formats are process wide: every log writes those it meets to its file.
+static std::mutex &formatMutex()
+{
+	static std::mutex mutex;
+	return mutex;
+}
+
+static std::vector<XHBinaryLogFormatInfo> &formats()
+{
+	static std::vector<XHBinaryLogFormatInfo> registered;
+	return registered;
+}
+
+uint32_t XHBinaryLogFormat::registerFormat(int type, const char *format, const char *file, int line,
+	const uint8_t *tags, int argc)
+{
+	XHBinaryLogFormatInfo info;
+	info.type = type;
+	info.line = line;
+	info.format = format;
+	info.file = file;
+	info.tags.assign(tags, tags + argc);
+	std::lock_guard<std::mutex> lock(formatMutex());
+	formats().push_back(info);
+	return (uint32_t)(formats().size() - 1);
+}
+
+struct XHBinaryLogBufferDeleter
+{
+	void operator()(XHBinaryLogBuffer *buffer) const
+	{
+		delete [] buffer->data;
+		delete buffer;
+	}
+};
+
+/*
+   The buffers of one thread, one per log it has written to. The last
+   one used is cached, so the common case is a compare. When the thread
+   exits its buffers are orphaned; the writer threads free them once
+   they are drained.
+*/
+struct XHBinaryLogThreadBuffers
+{
+	XHBinaryLogThreadBuffers() : lastSerial(0), last(0) {}
+
+	~XHBinaryLogThreadBuffers()
+	{
+		for (size_t i = 0; i < buffers.size(); ++i)
+			buffers[i].second->orphaned.store(true, std::memory_order_release);
+	}
+
+	std::vector<std::pair<uint64_t, std::shared_ptr<XHBinaryLogBuffer> > > buffers;
+	uint64_t lastSerial;
+	XHBinaryLogBuffer *last;
+};
+
+static thread_local XHBinaryLogThreadBuffers threadBuffers;
+static std::atomic<uint64_t> nextSerial(1);
+
+static uint64_t currentThreadId()
+{
+#if defined(_WIN32)
+	return ::GetCurrentThreadId();
+#elif defined(__linux__)
+	return (uint64_t)::syscall(SYS_gettid);
+#else
+	return (uint64_t)std::hash<std::thread::id>()(std::this_thread::get_id());
+#endif
+}
+
+static int64_t wallClockNs()
+{
+	return std::chrono::duration_cast<std::chrono::nanoseconds>(
+		std::chrono::system_clock::now().time_since_epoch()).count();
+}
+
+class XHBinaryLogPrivate
+{
+public:
+	XHBinaryLogPrivate()
+		: serial(nextSerial.fetch_add(1)), bufferSize(DefaultThreadBufferSize), file(0),
+		stopping(false), passes(0), written(0), droppedGone(0), lastThread(0), lastClockMs(0) {}
+
+	void writerLoop();
+	bool drain(XHBinaryLogBuffer *buffer);
+	void writeRun(const char *data, size_t size);
+	void writeFormat(uint32_t id);
+	void writeThread(uint64_t id);
+	void writeClock();
+
+	const uint64_t serial;
+	std::atomic<int> bufferSize;
+	std::string name;
+	FILE *file;
+	std::vector<char> fileBuffer;
+
+	std::mutex mutex;
+	std::condition_variable wake;
+	std::condition_variable progress;
+	std::vector<std::shared_ptr<XHBinaryLogBuffer> > buffers;
+	bool stopping;
+	uint64_t passes;
+	std::thread writer;
+
+	// Writer thread.
+	std::atomic<uint64_t> written;
+	std::atomic<uint64_t> droppedGone;	// by buffers since freed
+	std::vector<char> emitted;	// format ids already in the file
+	uint64_t lastThread;
+	int64_t lastClockMs;
+};
+
+void XHBinaryLogPrivate::writeRun(const char *data, size_t size)
+{
+	if (size && ::fwrite(data, 1, size, file) != size)
+		::clearerr(file);
+}
+
+static void putRecordHeader(std::string *record, int kind)
+{
+	record->push_back((char)kind);
+	record->append(4, 0);	// the size, filled in last
+}
+
+static void putU32(std::string *record, uint32_t value)
+{
+	record->append((const char *)&value, 4);
+}
+
+static void finishRecord(std::string *record)
+{
+	uint32_t size = (uint32_t)record->size();
+	memcpy(&(*record)[1], &size, 4);
+}
+
+void XHBinaryLogPrivate::writeFormat(uint32_t id)
+{
+	if (id >= emitted.size())
+		emitted.resize(id + 1, 0);
+	emitted[id] = 1;
+	XHBinaryLogFormatInfo info;
+	{
+		std::lock_guard<std::mutex> lock(formatMutex());
+		info = formats()[id];
+	}
+	std::string record;
+	putRecordHeader(&record, XHBinaryLogFormatRecord);
+	putU32(&record, id);
+	record.push_back((char)info.type);
+	putU32(&record, (uint32_t)info.line);
+	record.push_back((char)info.tags.size());
+	record.append(info.tags.begin(), info.tags.end());
+	putU32(&record, (uint32_t)info.file.size());
+	record += info.file;
+	putU32(&record, (uint32_t)info.format.size());
+	record += info.format;
+	finishRecord(&record);
+	writeRun(record.data(), record.size());
+}
+
+void XHBinaryLogPrivate::writeThread(uint64_t id)
+{
+	lastThread = id;
+	std::string record;
+	putRecordHeader(&record, XHBinaryLogThreadRecord);
+	record.append((const char *)&id, 8);
+	finishRecord(&record);
+	writeRun(record.data(), record.size());
+}
+
+void XHBinaryLogPrivate::writeClock()
+{
+	uint64_t ticks = XHBinaryLog::ticks();
+	int64_t ns = wallClockNs();
+	lastClockMs = ns / 1000000;
+	std::string record;
+	putRecordHeader(&record, XHBinaryLogClockRecord);
+	record.append((const char *)&ticks, 8);
+	record.append((const char *)&ns, 8);
+	finishRecord(&record);
+	writeRun(record.data(), record.size());
+}
+
+/*
+   Copies what the thread has committed to the file, in runs of
+   records as long as the ring allows. A run is cut short where a
+   format has to be written first.
+*/
+bool XHBinaryLogPrivate::drain(XHBinaryLogBuffer *buffer)
+{
+	uint64_t tail = buffer->tail.load(std::memory_order_relaxed);
+	uint64_t head = buffer->head.load(std::memory_order_acquire);
+	if (tail == head)
+		return false;
+	if (buffer->threadId != lastThread)
+		writeThread(buffer->threadId);
+	size_t mask = buffer->capacity - 1;
+	uint64_t runStart = tail;
+	uint64_t records = 0;
+	while (tail != head) {
+		// A record that ended exactly at the end of the ring left no
+		// padding; the run can't go on past it either.
+		if (((size_t)tail & mask) == 0 && tail != runStart) {
+			writeRun(buffer->data + ((size_t)runStart & mask), (size_t)(tail - runStart));
+			runStart = tail;
+		}
+		const char *p = buffer->data + ((size_t)tail & mask);
+		if (*p == XHBinaryLogPadding) {
+			writeRun(buffer->data + ((size_t)runStart & mask), (size_t)(tail - runStart));
+			tail += buffer->capacity - ((size_t)tail & mask);
+			runStart = tail;
+			continue;
+		}
+		uint32_t size;
+		memcpy(&size, p + 1, 4);
+		uint32_t id;
+		memcpy(&id, p + 5, 4);
+		if (id >= emitted.size() || !emitted[id]) {
+			writeRun(buffer->data + ((size_t)runStart & mask), (size_t)(tail - runStart));
+			runStart = tail;
+			writeFormat(id);
+		}
+		tail += size;
+		++records;
+	}
+	writeRun(buffer->data + ((size_t)runStart & mask), (size_t)(tail - runStart));
+	buffer->tail.store(tail, std::memory_order_release);
+	written.fetch_add(records, std::memory_order_relaxed);
+	return true;
+}
+
+/*
+   Polls the thread buffers: producers never make a system call to
+   wake the writer. It sleeps longer the longer there is nothing to
+   write, up to IdleSleepMaxMs, and flush() and close() wake it.
+*/
+void XHBinaryLogPrivate::writerLoop()
+{
+	std::vector<std::shared_ptr<XHBinaryLogBuffer> > snapshot;
+	int sleepMs = 1;
+	for (;;) {
+		bool stop;
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			snapshot = buffers;
+			stop = stopping;
+		}
+		bool any = false;
+		std::vector<XHBinaryLogBuffer *> finished;
+		for (size_t i = 0; i < snapshot.size(); ++i) {
+			XHBinaryLogBuffer *buffer = snapshot[i].get();
+			// Read before draining: an orphan drained is done for good.
+			bool orphaned = buffer->orphaned.load(std::memory_order_acquire);
+			any |= drain(buffer);
+			if (orphaned)
+				finished.push_back(buffer);
+		}
+		snapshot.clear();
+		int64_t nowMs = wallClockNs() / 1000000;
+		if (any && nowMs - lastClockMs >= ClockIntervalMs)
+			writeClock();
+
+		std::unique_lock<std::mutex> lock(mutex);
+		for (size_t i = 0; i < finished.size(); ++i) {
+			for (size_t j = 0; j < buffers.size(); ++j) {
+				if (buffers[j].get() == finished[i]) {
+					droppedGone.fetch_add(finished[i]->dropped.load(), std::memory_order_relaxed);
+					buffers.erase(buffers.begin() + j);
+					break;
+				}
+			}
+		}
+		++passes;
+		progress.notify_all();
+		if (stop)
+			break;
+		if (any) {
+			sleepMs = 1;
+			continue;
+		}
+		::fflush(file);
+		wake.wait_for(lock, std::chrono::milliseconds(sleepMs));
+		sleepMs = sleepMs * 2 > IdleSleepMaxMs ? IdleSleepMaxMs : sleepMs * 2;
+	}
+	writeClock();
+	::fflush(file);
+}
+
+/*!
+    \class XHBinaryLog
+
+    \brief The XHBinaryLog class records log messages in a compact
+    binary file and leaves the formatting to the decoder.
+
+    XHServiceBase::logMessage() takes a finished string, so callers pay
+    for formatting it even if nobody ever reads it. XHBINLOG() takes a
+    printf style format instead. The format is registered once per
+    call site, when the call first runs; after that a call stores the
+    format's id, the time stamp counter and the raw bytes of its
+    arguments in a buffer of the calling thread, and returns. Nothing
+    is formatted and no lock is taken.
+
+    \code
+    static XHBinaryLog trace;
+    trace.open("/var/log/myservice/acquisition.xhlog");
+    ...
+    XHBINLOG(trace, XHServiceBase::Information, "frame %u from %s: %d bytes in %.3f ms",
+        frame, camera.name(), size, elapsedMs);
+    \endcode
+
+    Integers, enums, floating point numbers, pointers, C strings and
+    std::string can be logged; strings are copied. A writer thread of
+    the log polls the thread buffers and appends what they hold to the
+    file, together with each format the first time it is used and the
+    clock readings that turn time stamps into wall clock time. The
+    xhservice_logdecode tool built with the library renders the file
+    as text:
+
+    \code
+    xhservice_logdecode /var/log/myservice/acquisition.xhlog
+    \endcode
+
+    A call costs a few tens of nanoseconds. When a thread's buffer is
+    full, because the writer thread can't keep up, the record is
+    dropped and counted in droppedRecords().
+
+    Each thread that logs gets a buffer of threadBufferSize() bytes,
+    freed after the thread exits. A log is meant to live as long as the
+    threads writing to it.
+*/
+
+/*!
+    Creates a closed log. XHBINLOG() calls do nothing until open() is
+    called.
+*/
+XHBinaryLog::XHBinaryLog()
+	: active(false), d_ptr(new XHBinaryLogPrivate)
+{
+}
+
+/*!
+    Closes the log.
+*/
+XHBinaryLog::~XHBinaryLog()
+{
+	close();
+	delete d_ptr;
+}
+
+/*!
+    Creates or truncates \a fileName and starts writing to it. Returns
+    false if the file could not be created. An open log is closed
+    first.
+*/
+bool XHBinaryLog::open(const std::string &fileName)
+{
+	close();
+	FILE *file = ::fopen(fileName.c_str(), "wb");
+	if (!file)
+		return false;
+	d_ptr->fileBuffer.resize(FileBufferSize);
+	::setvbuf(file, &d_ptr->fileBuffer[0], _IOFBF, d_ptr->fileBuffer.size());
+	d_ptr->name = fileName;
+	d_ptr->file = file;
+	d_ptr->emitted.clear();
+	d_ptr->lastThread = 0;
+	d_ptr->stopping = false;
+	d_ptr->writeRun(XHBinaryLogMagic, sizeof(XHBinaryLogMagic));
+	d_ptr->writeClock();
+	{
+		// Records left from before the last close() belong to no file.
+		std::lock_guard<std::mutex> lock(d_ptr->mutex);
+		for (size_t i = 0; i < d_ptr->buffers.size(); ++i)
+			d_ptr->buffers[i]->tail.store(d_ptr->buffers[i]->head.load());
+	}
+	d_ptr->writer = std::thread(&XHBinaryLogPrivate::writerLoop, d_ptr);
+	active.store(true);
+	return true;
+}
+
+/*!
+    Writes what the threads have logged so far and closes the file.
+    Calls racing with close() may be lost.
+*/
+void XHBinaryLog::close()
+{
+	if (!d_ptr->writer.joinable())
+		return;
+	active.store(false);
+	{
+		std::lock_guard<std::mutex> lock(d_ptr->mutex);
+		d_ptr->stopping = true;
+		d_ptr->wake.notify_one();
+	}
+	d_ptr->writer.join();
+	::fclose(d_ptr->file);
+	d_ptr->file = 0;
+}
+
+/*!
+    Returns the name of the file, or an empty string if the log has
+    never been opened.
+*/
+std::string XHBinaryLog::fileName() const
+{
+	return d_ptr->name;
+}
+
+/*!
+    Blocks until everything logged before the call is in the file (in
+    the page cache, that is), or until \a timeoutMs milliseconds have
+    passed; -1 waits forever. Returns true if it all got there.
+*/
+bool XHBinaryLog::flush(int timeoutMs)
+{
+	std::unique_lock<std::mutex> lock(d_ptr->mutex);
+	if (!d_ptr->writer.joinable())
+		return true;
+	// The second pass from now has started after the call.
+	uint64_t target = d_ptr->passes + 2;
+	d_ptr->wake.notify_one();
+	std::chrono::steady_clock::time_point deadline =
+		std::chrono::steady_clock::now() + std::chrono::milliseconds(timeoutMs < 0 ? 0 : timeoutMs);
+	while (d_ptr->passes < target) {
+		if (timeoutMs < 0) {
+			d_ptr->progress.wait(lock);
+		} else if (d_ptr->progress.wait_until(lock, deadline) == std::cv_status::timeout) {
+			return d_ptr->passes >= target;
+		}
+		d_ptr->wake.notify_one();
+	}
+	return true;
+}
+
+/*!
+    Returns the size of the buffer each thread gets. The default is
+    1 MB.
+
+    \sa setThreadBufferSize()
+*/
+int XHBinaryLog::threadBufferSize() const
+{
+	return d_ptr->bufferSize.load();
+}
+
+/*!
+    Sets the size of the buffer of each thread to \a bytes, rounded up
+    to a power of two of at least 4 KB. Threads that have logged
+    already keep their buffers.
+
+    \sa threadBufferSize()
+*/
+void XHBinaryLog::setThreadBufferSize(int bytes)
+{
+	int size = MinimumThreadBufferSize;
+	while (size < bytes && size < (1 << 30))
+		size <<= 1;
+	d_ptr->bufferSize.store(size);
+}
+
+/*!
+    Returns the number of records dropped because a thread's buffer
+    was full.
+*/
+uint64_t XHBinaryLog::droppedRecords() const
+{
+	std::lock_guard<std::mutex> lock(d_ptr->mutex);
+	uint64_t dropped = d_ptr->droppedGone.load(std::memory_order_relaxed);
+	for (size_t i = 0; i < d_ptr->buffers.size(); ++i)
+		dropped += d_ptr->buffers[i]->dropped.load(std::memory_order_relaxed);
+	return dropped;
+}
+
+/*!
+    Returns the number of records written to the file.
+*/
+uint64_t XHBinaryLog::writtenRecords() const
+{
+	return d_ptr->written.load(std::memory_order_relaxed);
+}
+
+XHBinaryLogBuffer *XHBinaryLog::threadBuffer()
+{
+	XHBinaryLogThreadBuffers &mine = threadBuffers;
+	if (mine.lastSerial == d_ptr->serial)
+		return mine.last;
+	for (size_t i = 0; i < mine.buffers.size(); ++i) {
+		if (mine.buffers[i].first == d_ptr->serial) {
+			mine.lastSerial = d_ptr->serial;
+			mine.last = mine.buffers[i].second.get();
+			return mine.last;
+		}
+	}
+	XHBinaryLogBuffer *raw = new XHBinaryLogBuffer;
+	raw->capacity = (size_t)d_ptr->bufferSize.load();
+	raw->data = new char[raw->capacity];
+	// Fault the pages in now rather than during the first calls.
+	memset(raw->data, 0, raw->capacity);
+	raw->head.store(0);
+	raw->tail.store(0);
+	raw->cachedTail = 0;
+	raw->dropped.store(0);
+	raw->orphaned.store(false);
+	raw->threadId = currentThreadId();
+	std::shared_ptr<XHBinaryLogBuffer> buffer(raw, XHBinaryLogBufferDeleter());
+	{
+		std::lock_guard<std::mutex> lock(d_ptr->mutex);
+		d_ptr->buffers.push_back(buffer);
+	}
+	mine.buffers.push_back(std::make_pair(d_ptr->serial, buffer));
+	mine.lastSerial = d_ptr->serial;
+	mine.last = raw;
+	return raw;
+}
@@ -0,0 +1,307 @@
+/****************************************************************************
+**
+**
+****************************************************************************/
+
+#ifndef XHSERVICE_BINLOG_H
+#define XHSERVICE_BINLOG_H
+
+#include "xhservice_global.h"
+#include <atomic>
+#include <string>
+#include <type_traits>
+#include <string.h>
+#include <stdint.h>
+#if defined(_M_X64) || defined(_M_IX86)
+#  include <intrin.h>
+#  define XHSERVICE_BINLOG_TSC
+#elif defined(__x86_64__) || defined(__i386__)
+#  include <x86intrin.h>
+#  define XHSERVICE_BINLOG_TSC
+#else
+#  include <chrono>
+#endif
+
+/*
+   The file format, read back by xhservice_logdecode. A file starts
+   with XHBinaryLogMagic; then come records, each a kind byte and a
+   32 bit size of the whole record, all integers little endian:
+
+   Format  id u32, type u8, line u32, argc u8, argc tags u8,
+           file length u32, file, format length u32, format
+   Clock   ticks u64, wall clock ns since the epoch i64
+   Thread  thread id u64
+   Event   format id u32, ticks u64, arguments: Int32, UInt32 4 bytes,
+           Int64, UInt64, Double, Pointer 8 bytes, String length u32
+           and the bytes
+
+   A Format record comes before the first Event using it, a Thread
+   record before the Events of a thread. Clock records pair the ticks
+   of the events with the wall clock.
+*/
+static const char XHBinaryLogMagic[8] = { 'X', 'H', 'B', 'L', 'O', 'G', 0, 1 };
+
+enum XHBinaryLogRecord
+{
+	XHBinaryLogPadding = 0,	// never in a file: the rest of a thread buffer is unused
+	XHBinaryLogFormatRecord,
+	XHBinaryLogClockRecord,
+	XHBinaryLogThreadRecord,
+	XHBinaryLogEventRecord
+};
+
+enum XHBinaryLogTag
+{
+	XHBinaryLogInt32 = 1,
+	XHBinaryLogUInt32,
+	XHBinaryLogInt64,
+	XHBinaryLogUInt64,
+	XHBinaryLogDouble,
+	XHBinaryLogString,
+	XHBinaryLogPointer
+};
+
+enum { XHBinaryLogHeaderSize = 1 + 4, XHBinaryLogEventSize = XHBinaryLogHeaderSize + 4 + 8 };
+
+/*
+   How an argument is stored. Integers and enums keep their size,
+   rounded up to 4 bytes; strings are copied.
+*/
+template <typename T, typename Enable = void>
+struct XHBinaryLogArg;
+
+template <typename T>
+struct XHBinaryLogArg<T, typename std::enable_if<std::is_integral<T>::value || std::is_enum<T>::value>::type>
+{
+	typedef typename std::conditional<std::is_enum<T>::value || std::is_signed<T>::value,
+		typename std::conditional<(sizeof(T) > 4), int64_t, int32_t>::type,
+		typename std::conditional<(sizeof(T) > 4), uint64_t, uint32_t>::type>::type Stored;
+
+	static const uint8_t tag = sizeof(Stored) == 8
+		? (std::is_signed<Stored>::value ? XHBinaryLogInt64 : XHBinaryLogUInt64)
+		: (std::is_signed<Stored>::value ? XHBinaryLogInt32 : XHBinaryLogUInt32);
+	static size_t size(T) { return sizeof(Stored); }
+	static char *encode(char *p, T value)
+	{
+		Stored stored = (Stored)value;
+		memcpy(p, &stored, sizeof(stored));
+		return p + sizeof(stored);
+	}
+};
+
+template <typename T>
+struct XHBinaryLogArg<T, typename std::enable_if<std::is_floating_point<T>::value>::type>
+{
+	static const uint8_t tag = XHBinaryLogDouble;
+	static size_t size(T) { return sizeof(double); }
+	static char *encode(char *p, T value)
+	{
+		double stored = (double)value;
+		memcpy(p, &stored, sizeof(stored));
+		return p + sizeof(stored);
+	}
+};
+
+template <typename T>
+struct XHBinaryLogArg<T *, typename std::enable_if<!std::is_same<typename std::remove_cv<T>::type, char>::value>::type>
+{
+	static const uint8_t tag = XHBinaryLogPointer;
+	static size_t size(const T *) { return sizeof(uint64_t); }
+	static char *encode(char *p, const T *value)
+	{
+		uint64_t stored = (uint64_t)(uintptr_t)value;
+		memcpy(p, &stored, sizeof(stored));
+		return p + sizeof(stored);
+	}
+};
+
+struct XHBinaryLogStringArg
+{
+	static const uint8_t tag = XHBinaryLogString;
+	static char *encode(char *p, const char *text, uint32_t length)
+	{
+		memcpy(p, &length, sizeof(length));
+		memcpy(p + sizeof(length), text, length);
+		return p + sizeof(length) + length;
+	}
+};
+
+template <>
+struct XHBinaryLogArg<const char *> : XHBinaryLogStringArg
+{
+	static size_t size(const char *text) { return sizeof(uint32_t) + (text ? strlen(text) : 6); }
+	static char *encode(char *p, const char *text)
+	{
+		return text ? XHBinaryLogStringArg::encode(p, text, (uint32_t)strlen(text))
+			: XHBinaryLogStringArg::encode(p, "(null)", 6);
+	}
+};
+
+template <>
+struct XHBinaryLogArg<char *> : XHBinaryLogArg<const char *> {};
+
+template <>
+struct XHBinaryLogArg<std::string> : XHBinaryLogStringArg
+{
+	static size_t size(const std::string &text) { return sizeof(uint32_t) + text.size(); }
+	static char *encode(char *p, const std::string &text)
+	{
+		return XHBinaryLogStringArg::encode(p, text.data(), (uint32_t)text.size());
+	}
+};
+
+template <typename... Args>
+struct XHBinaryLogSignature {};
+
+// Never called: XHBINLOG() takes the argument types from its decltype.
+template <typename... Args>
+XHBinaryLogSignature<typename std::decay<Args>::type...> xhBinaryLogSignature(const Args &...);
+
+class XHSERVICE_EXPORT XHBinaryLogFormat
+{
+public:
+	template <typename... Args>
+	XHBinaryLogFormat(int type, const char *format, const char *file, int line,
+		const XHBinaryLogSignature<Args...> *)
+	{
+		const uint8_t tags[] = { XHBinaryLogArg<Args>::tag..., 0 };
+		formatId = registerFormat(type, format, file, line, tags, sizeof...(Args));
+	}
+
+	uint32_t id() const { return formatId; }
+
+private:
+	static uint32_t registerFormat(int type, const char *format, const char *file, int line,
+		const uint8_t *tags, int argc);
+
+	uint32_t formatId;
+};
+
+/*
+   A thread's buffer: a ring of bytes with one producer, the thread,
+   and one consumer, the writer thread of the log.
+*/
+struct XHBinaryLogBuffer
+{
+	char *data;
+	size_t capacity;	// a power of two
+	std::atomic<uint64_t> head;	// written by the thread
+	std::atomic<uint64_t> tail;	// written by the writer thread
+	uint64_t cachedTail;	// the thread's copy
+	std::atomic<uint64_t> dropped;
+	std::atomic<bool> orphaned;	// the thread has exited
+	uint64_t threadId;
+};
+
+class XHBinaryLogPrivate;
+
+class XHSERVICE_EXPORT XHBinaryLog
+{
+public:
+	XHBinaryLog();
+	~XHBinaryLog();
+
+	bool open(const std::string &fileName);
+	void close();
+	bool isOpen() const { return active.load(std::memory_order_relaxed); }
+	std::string fileName() const;
+
+	bool flush(int timeoutMs = -1);
+
+	int threadBufferSize() const;
+	void setThreadBufferSize(int bytes);
+
+	uint64_t droppedRecords() const;
+	uint64_t writtenRecords() const;
+
+	template <typename... Args>
+	void log(const XHBinaryLogFormat &format, const Args &... args)
+	{
+		if (!active.load(std::memory_order_relaxed))
+			return;
+		size_t size = XHBinaryLogEventSize + argumentsSize(args...);
+		XHBinaryLogBuffer *buffer = threadBuffer();
+		char *p = reserve(buffer, size);
+		if (!p)
+			return;
+		*p = XHBinaryLogEventRecord;
+		uint32_t value = (uint32_t)size;
+		memcpy(p + 1, &value, 4);
+		value = format.id();
+		memcpy(p + 5, &value, 4);
+		uint64_t now = ticks();
+		memcpy(p + 9, &now, 8);
+		encodeArguments(p + XHBinaryLogEventSize, args...);
+		buffer->head.store(buffer->head.load(std::memory_order_relaxed) + size, std::memory_order_release);
+	}
+
+	static uint64_t ticks()
+	{
+#if defined(XHSERVICE_BINLOG_TSC)
+		return __rdtsc();
+#else
+		return std::chrono::duration_cast<std::chrono::nanoseconds>(
+			std::chrono::steady_clock::now().time_since_epoch()).count();
+#endif
+	}
+
+private:
+	XHBinaryLog(const XHBinaryLog &);
+	XHBinaryLog &operator=(const XHBinaryLog &);
+
+	XHBinaryLogBuffer *threadBuffer();
+
+	// Room for size contiguous bytes, or 0 if the buffer is full.
+	static char *reserve(XHBinaryLogBuffer *buffer, size_t size)
+	{
+		uint64_t head = buffer->head.load(std::memory_order_relaxed);
+		size_t offset = (size_t)head & (buffer->capacity - 1);
+		size_t skip = offset + size > buffer->capacity ? buffer->capacity - offset : 0;
+		if (head + skip + size - buffer->cachedTail > buffer->capacity) {
+			buffer->cachedTail = buffer->tail.load(std::memory_order_acquire);
+			if (head + skip + size - buffer->cachedTail > buffer->capacity) {
+				buffer->dropped.fetch_add(1, std::memory_order_relaxed);
+				return 0;
+			}
+		}
+		if (skip) {
+			buffer->data[offset] = XHBinaryLogPadding;
+			head += skip;
+			buffer->head.store(head, std::memory_order_release);
+			offset = 0;
+		}
+		return buffer->data + offset;
+	}
+
+	static size_t argumentsSize() { return 0; }
+	template <typename T, typename... Rest>
+	static size_t argumentsSize(const T &first, const Rest &... rest)
+	{
+		return XHBinaryLogArg<typename std::decay<T>::type>::size(first) + argumentsSize(rest...);
+	}
+
+	static void encodeArguments(char *) {}
+	template <typename T, typename... Rest>
+	static void encodeArguments(char *p, const T &first, const Rest &... rest)
+	{
+		encodeArguments(XHBinaryLogArg<typename std::decay<T>::type>::encode(p, first), rest...);
+	}
+
+	std::atomic<bool> active;
+	XHBinaryLogPrivate *d_ptr;
+};
+
+/*
+   Logs a message of the given type (an XHServiceBase::MessageType)
+   with a printf style format to log, an XHBinaryLog. The format must
+   be a string literal; it is registered once, and each call only
+   stores the format's id, a time stamp and the arguments.
+*/
+#define XHBINLOG(log, type, format, ...) \
+	do { \
+		static const XHBinaryLogFormat xhBinaryLogFormat_(type, format, __FILE__, __LINE__, \
+			(decltype(xhBinaryLogSignature(__VA_ARGS__)) *)0); \
+		(log).log(xhBinaryLogFormat_, ##__VA_ARGS__); \
+	} while (0)
+
+#endif // XHSERVICE_BINLOG_H
@@ -0,0 +1,54 @@
+/****************************************************************************
+**
+**
+****************************************************************************/
+
+#include "xhservice_drain_p.h"
+#include "xhservice_status_p.h"
+#include <chrono>
+
+bool XHServiceDrain::enter()
+{
+	// Both sides use sequentially consistent operations: either drain()
+	// sees the increment, or the operation sees the flag and backs out.
+	count.fetch_add(1);
+	if (draining.load()) {
+		leave();
+		return false;
+	}
+	return true;
+}
+
+void XHServiceDrain::leave()
+{
+	if (count.fetch_sub(1) == 1 && draining.load()) {
+		std::lock_guard<std::mutex> lock(mutex);
+		idle.notify_all();
+	}
+}
+
+int XHServiceDrain::drain(int timeoutMs, const Progress &progress)
+{
+	typedef std::chrono::steady_clock Clock;
+	draining.store(true);
+	Clock::time_point deadline = Clock::now() + std::chrono::milliseconds(timeoutMs < 0 ? 0 : timeoutMs);
+	std::unique_lock<std::mutex> lock(mutex);
+	for (;;) {
+		int left = count.load();
+		if (left <= 0)
+			return 0;
+		Clock::time_point now = Clock::now();
+		if (timeoutMs >= 0 && now >= deadline)
+			return left;
+		if (progress) {
+			lock.unlock();
+			progress(left);
+			lock.lock();
+		}
+		Clock::time_point wake = now + std::chrono::milliseconds(XHStatusHeartbeatMs);
+		if (timeoutMs >= 0 && deadline < wake)
+			wake = deadline;
+		while (count.load() > 0 && Clock::now() < wake)
+			idle.wait_until(lock, wake);
+	}
+}
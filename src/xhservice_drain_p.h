@@ -0,0 +1,44 @@
+/****************************************************************************
+**
+**
+****************************************************************************/
+
+#ifndef XHSERVICE_DRAIN_P_H
+#define XHSERVICE_DRAIN_P_H
+
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+
+/*
+   Count of in-flight operations. enter() and leave() are one atomic
+   add each (plus a load); the mutex is only taken by the last
+   operation to leave while a drain waits.
+*/
+class XHServiceDrain
+{
+public:
+	// Called about once a heartbeat while drain() waits, with the
+	// number of operations still running.
+	typedef std::function<void(int)> Progress;
+
+	XHServiceDrain() : count(0), draining(false) {}
+
+	bool enter();
+	void leave();
+	int inFlight() const { return count.load(std::memory_order_relaxed); }
+	bool isDraining() const { return draining.load(std::memory_order_relaxed); }
+
+	// Refuses new operations and waits up to timeoutMs (forever if
+	// negative) for the running ones. Returns how many are left.
+	int drain(int timeoutMs, const Progress &progress = Progress());
+
+private:
+	std::atomic<int> count;
+	std::atomic<bool> draining;
+	std::mutex mutex;
+	std::condition_variable idle;
+};
+
+#endif // XHSERVICE_DRAIN_P_H
@@ -0,0 +1,253 @@
+/****************************************************************************
+**
+**
+****************************************************************************/
+
+#include "xhservice_eventloop_p.h"
+#include <algorithm>
+#include <thread>
+#include <vector>
+#if defined(_WIN32)
+#include <windows.h>
+#else
+#include <errno.h>
+#include <poll.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#endif
+
+XHServiceEventLoop::XHServiceEventLoop()
+	: running(false), loopThread(std::thread::id()), posting(0), sleeping(false), quitting(false), returnCode(0), timersPaused(false)
+{
+#if defined(_WIN32)
+	wakeEvent = ::CreateEvent(0, FALSE, FALSE, 0);
+#else
+	wakeFd = ::eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+#endif
+}
+
+XHServiceEventLoop::~XHServiceEventLoop()
+{
+	while (XHServiceEvent *event = queue.pop())
+		delete event;
+#if defined(_WIN32)
+	if (wakeEvent)
+		::CloseHandle(wakeEvent);
+#else
+	if (wakeFd >= 0)
+		::close(wakeFd);
+#endif
+}
+
+void XHServiceEventLoop::setHandler(const Handler &h)
+{
+	handler = h;
+}
+
+void XHServiceEventLoop::post(int type, int code)
+{
+	XHServiceEvent *event = new XHServiceEvent(type, code);
+	event->posted = xhEventTimeUs();
+	post(event);
+}
+
+void XHServiceEventLoop::post(const std::function<void()> &function)
+{
+	XHServiceEvent *event = new XHServiceEvent(XHServiceEvent::Invoke, 0);
+	event->function = function;
+	post(event);
+}
+
+void XHServiceEventLoop::post(XHServiceEvent *event)
+{
+	queue.push(event);
+	// Pairs with the fence in wait(): either the consumer sees the new
+	// node before it goes to sleep, or we see it sleeping and wake it.
+	std::atomic_thread_fence(std::memory_order_seq_cst);
+	if (sleeping.load(std::memory_order_relaxed))
+		wake();
+}
+
+bool XHServiceEventLoop::tryPost(int type, int code)
+{
+	XHServiceEvent *event = new XHServiceEvent(type, code);
+	event->posted = xhEventTimeUs();
+	if (tryPost(event))
+		return true;
+	delete event;
+	return false;
+}
+
+bool XHServiceEventLoop::tryPost(const std::function<void()> &function)
+{
+	XHServiceEvent *event = new XHServiceEvent(XHServiceEvent::Invoke, 0);
+	event->function = function;
+	if (tryPost(event))
+		return true;
+	delete event;
+	return false;
+}
+
+/*
+   Pairs with the end of exec(): either exec() sees this call in
+   'posting' and waits for the event to be queued before it delivers
+   what is left, or this call sees the loop stopped and leaves the
+   event to the caller. An event is never stranded in a loop that
+   stopped.
+*/
+bool XHServiceEventLoop::tryPost(XHServiceEvent *event)
+{
+	event->awaited = true;
+	posting.fetch_add(1, std::memory_order_seq_cst);
+	bool queued = running.load(std::memory_order_seq_cst);
+	if (queued)
+		post(event);
+	posting.fetch_sub(1, std::memory_order_release);
+	return queued;
+}
+
+int XHServiceEventLoop::exec()
+{
+	loopThread.store(std::this_thread::get_id(), std::memory_order_release);
+	running.store(true, std::memory_order_release);
+	quitting = false;
+	returnCode = 0;
+	while (!quitting) {
+		bool any = dispatch();
+		if (!quitting && runTimers())
+			any = true;
+		if (!any && !quitting)
+			wait(timerTimeout());
+	}
+	running.store(false, std::memory_order_seq_cst);
+	// What tryPost() queued is delivered before the loop returns, as it
+	// would have been delivered directly had it come a moment later.
+	// What post() queued stays for processEvents(), or is dropped with
+	// the loop.
+	while (posting.load(std::memory_order_acquire))
+		std::this_thread::yield();
+	std::vector<XHServiceEvent *> kept;
+	while (XHServiceEvent *event = queue.pop()) {
+		if (!event->awaited) {
+			kept.push_back(event);
+			continue;
+		}
+		deliver(event);
+		delete event;
+	}
+	for (size_t i = 0; i < kept.size(); ++i)
+		queue.push(kept[i]);
+	return returnCode;
+}
+
+void XHServiceEventLoop::quit(int code)
+{
+	returnCode = code;
+	quitting = true;
+}
+
+bool XHServiceEventLoop::processEvents(int timeoutMs)
+{
+	// A thread pumping events takes over from direct delivery for good.
+	loopThread.store(std::this_thread::get_id(), std::memory_order_release);
+	running.store(true, std::memory_order_release);
+	quitting = false;
+	bool any = dispatch();
+	if (runTimers())
+		any = true;
+	if (any || timeoutMs == 0)
+		return any;
+	int timeout = timerTimeout();
+	wait(timeout < 0 ? timeoutMs : timeoutMs < 0 ? timeout : std::min(timeout, timeoutMs));
+	any = dispatch();
+	if (runTimers())
+		any = true;
+	return any;
+}
+
+static int64_t timerClockMs()
+{
+	return xhEventTimeUs() / 1000;
+}
+
+uint64_t XHServiceEventLoop::startTimer(int intervalMs, int slackMs, bool repeating,
+	const XHTimerWheel::Callback &callback)
+{
+	return timers.add(timerClockMs(), intervalMs, slackMs, repeating, callback);
+}
+
+bool XHServiceEventLoop::killTimer(uint64_t id)
+{
+	return timers.cancel(id);
+}
+
+bool XHServiceEventLoop::runTimers()
+{
+	if (timersPaused || timers.count() == 0)
+		return false;
+	return timers.advance(timerClockMs()) > 0;
+}
+
+int XHServiceEventLoop::timerTimeout() const
+{
+	return timersPaused ? -1 : timers.timeout(timerClockMs());
+}
+
+bool XHServiceEventLoop::dispatch()
+{
+	bool any = false;
+	while (!quitting) {
+		XHServiceEvent *event = queue.pop();
+		if (!event)
+			break;
+		any = true;
+		if (event->type == XHServiceEvent::Quit)
+			quit(event->code);
+		else
+			deliver(event);
+		delete event;
+	}
+	return any;
+}
+
+void XHServiceEventLoop::deliver(XHServiceEvent *event)
+{
+	if (event->type == XHServiceEvent::Invoke)
+		event->function();
+	else if (handler)
+		handler(*event);
+}
+
+void XHServiceEventLoop::wake()
+{
+#if defined(_WIN32)
+	::SetEvent(wakeEvent);
+#else
+	uint64_t one = 1;
+	while (::write(wakeFd, &one, sizeof(one)) < 0 && errno == EINTR)
+		;
+#endif
+}
+
+void XHServiceEventLoop::wait(int timeoutMs)
+{
+	sleeping.store(true, std::memory_order_relaxed);
+	std::atomic_thread_fence(std::memory_order_seq_cst);
+	if (queue.isEmpty()) {
+#if defined(_WIN32)
+		::WaitForSingleObject(wakeEvent, timeoutMs < 0 ? INFINITE : (DWORD)timeoutMs);
+#else
+		pollfd pfd;
+		pfd.fd = wakeFd;
+		pfd.events = POLLIN;
+		pfd.revents = 0;
+		if (::poll(&pfd, 1, timeoutMs) > 0) {
+			uint64_t count;
+			ssize_t ignored = ::read(wakeFd, &count, sizeof(count));
+			(void)ignored;
+		}
+#endif
+	}
+	sleeping.store(false, std::memory_order_relaxed);
+}
@@ -0,0 +1,181 @@
+/****************************************************************************
+**
+**
+****************************************************************************/
+
+#ifndef XHSERVICE_EVENTLOOP_P_H
+#define XHSERVICE_EVENTLOOP_P_H
+
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <thread>
+#include <stdint.h>
+#include "xhservice_timer_p.h"
+
+/*
+   Intrusive multi-producer/single-consumer queue (Vyukov). push() is
+   wait-free and may be called from any thread, pop() must only be
+   called from the consuming thread. T needs a std::atomic<T *> next
+   member and a default constructor for the stub node.
+*/
+template <typename T>
+class XHMpscQueue
+{
+public:
+	XHMpscQueue() : head(&stub), tail(&stub)
+	{
+		stub.next.store(0, std::memory_order_relaxed);
+	}
+
+	void push(T *node)
+	{
+		node->next.store(0, std::memory_order_relaxed);
+		T *prev = head.exchange(node, std::memory_order_acq_rel);
+		prev->next.store(node, std::memory_order_release);
+	}
+
+	// Returns 0 when the queue is empty, or when a producer is half way
+	// through push(); the node shows up on a later call in that case.
+	T *pop()
+	{
+		T *t = tail;
+		T *next = t->next.load(std::memory_order_acquire);
+		if (t == &stub) {
+			if (!next)
+				return 0;
+			tail = next;
+			t = next;
+			next = next->next.load(std::memory_order_acquire);
+		}
+		if (next) {
+			tail = next;
+			return t;
+		}
+		if (t != head.load(std::memory_order_acquire))
+			return 0;
+		push(&stub);
+		next = t->next.load(std::memory_order_acquire);
+		if (next) {
+			tail = next;
+			return t;
+		}
+		return 0;
+	}
+
+	bool isEmpty() const
+	{
+		return tail == &stub && !stub.next.load(std::memory_order_acquire);
+	}
+
+private:
+	XHMpscQueue(const XHMpscQueue &);
+	XHMpscQueue &operator=(const XHMpscQueue &);
+
+	std::atomic<T *> head;
+	T *tail;
+	T stub;
+};
+
+// Clock of XHServiceEvent::posted, in microseconds.
+inline int64_t xhEventTimeUs()
+{
+	return std::chrono::duration_cast<std::chrono::microseconds>(
+		std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+struct XHServiceEvent
+{
+	enum Type
+	{
+		None = 0,
+		Stop,
+		Shutdown,
+		Pause,
+		Resume,
+		Command,
+		Invoke,
+		Quit,
+		Start
+	};
+
+	XHServiceEvent() : type(None), code(0), posted(0), awaited(false) {}
+	XHServiceEvent(int t, int c) : type(t), code(c), posted(0), awaited(false) {}
+
+	std::atomic<XHServiceEvent *> next;
+	int type;
+	int code;
+	int64_t posted;	// steady clock, microseconds
+	bool awaited;	// queued by tryPost(), never dropped
+	std::function<void()> function;
+};
+
+/*
+   The service thread's event loop. Control handlers running on other
+   threads (the SCM handler thread, the Unix control socket thread)
+   post() events, the thread that runs exec() or processEvents()
+   delivers them to the handler one at a time, and runs the timers in
+   between. The loop sleeps until the next timer is due; while timers
+   are paused it only wakes up for events.
+*/
+class XHServiceEventLoop
+{
+public:
+	typedef std::function<void(const XHServiceEvent &)> Handler;
+
+	XHServiceEventLoop();
+	~XHServiceEventLoop();
+
+	void setHandler(const Handler &handler);
+
+	void post(int type, int code = 0);
+	void post(const std::function<void()> &function);
+	// Queue only while the loop runs; false means the caller delivers.
+	bool tryPost(int type, int code = 0);
+	bool tryPost(const std::function<void()> &function);
+
+	int exec();
+	void quit(int returnCode);
+	bool processEvents(int timeoutMs);
+
+	bool isRunning() const { return running.load(std::memory_order_acquire); }
+	// True on the thread that last ran exec() or processEvents().
+	bool isLoopThread() const { return loopThread.load(std::memory_order_acquire) == std::this_thread::get_id(); }
+
+	// Timers are used on the loop's thread only.
+	uint64_t startTimer(int intervalMs, int slackMs, bool repeating, const XHTimerWheel::Callback &callback);
+	bool killTimer(uint64_t id);
+	int timerCount() const { return timers.count(); }
+	void setTimersPaused(bool paused) { timersPaused = paused; }
+
+private:
+	XHServiceEventLoop(const XHServiceEventLoop &);
+	XHServiceEventLoop &operator=(const XHServiceEventLoop &);
+
+	void post(XHServiceEvent *event);
+	bool tryPost(XHServiceEvent *event);
+	bool dispatch();
+	void deliver(XHServiceEvent *event);
+	bool runTimers();
+	int timerTimeout() const;
+	void wake();
+	void wait(int timeoutMs);
+
+	XHMpscQueue<XHServiceEvent> queue;
+	Handler handler;
+	std::atomic<bool> running;
+	std::atomic<std::thread::id> loopThread;
+	std::atomic<int> posting;	// tryPost() calls that saw the loop running
+	std::atomic<bool> sleeping;
+	bool quitting;
+	int returnCode;
+	XHTimerWheel timers;
+	bool timersPaused;
+#if defined(_WIN32)
+	void *wakeEvent;
+#else
+	int wakeFd;
+#endif
+};
+
+#endif // XHSERVICE_EVENTLOOP_P_H
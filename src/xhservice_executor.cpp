@@ -0,0 +1,499 @@
+/****************************************************************************
+**
+**
+****************************************************************************/
+
+#include "xhservice.h"
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+#if defined(__linux__)
+#  include <sched.h>
+#endif
+
+struct XHExecutorTask
+{
+	explicit XHExecutorTask(const XHServiceExecutor::Task &f) : function(f) {}
+
+	XHServiceExecutor::Task function;
+};
+
+/*
+   Chase-Lev work-stealing deque (in the C11 formulation of Le et al.).
+   The owning worker pushes and pops at the bottom, other workers steal
+   from the top. The ring grows when full; old rings stay allocated
+   until the deque goes, since a thief may still read from one.
+*/
+class XHWorkDeque
+{
+public:
+	XHWorkDeque() : top(0), bottom(0), ring(new Ring(64)) {}
+
+	~XHWorkDeque()
+	{
+		delete ring.load(std::memory_order_relaxed);
+		for (size_t i = 0; i < retired.size(); ++i)
+			delete retired[i];
+	}
+
+	void push(XHExecutorTask *task)
+	{
+		int64_t b = bottom.load(std::memory_order_relaxed);
+		int64_t t = top.load(std::memory_order_acquire);
+		Ring *r = ring.load(std::memory_order_relaxed);
+		if (b - t > r->capacity - 1) {
+			Ring *grown = new Ring(r->capacity * 2);
+			for (int64_t i = t; i < b; ++i)
+				grown->put(i, r->get(i));
+			retired.push_back(r);
+			ring.store(grown, std::memory_order_release);
+			r = grown;
+		}
+		r->put(b, task);
+		std::atomic_thread_fence(std::memory_order_release);
+		bottom.store(b + 1, std::memory_order_relaxed);
+	}
+
+	XHExecutorTask *pop()
+	{
+		int64_t b = bottom.load(std::memory_order_relaxed) - 1;
+		Ring *r = ring.load(std::memory_order_relaxed);
+		bottom.store(b, std::memory_order_relaxed);
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		int64_t t = top.load(std::memory_order_relaxed);
+		if (t > b) {
+			bottom.store(b + 1, std::memory_order_relaxed);
+			return 0;
+		}
+		XHExecutorTask *task = r->get(b);
+		if (t == b) {
+			// The last one: race the thieves for it.
+			if (!top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst,
+				std::memory_order_relaxed))
+				task = 0;
+			bottom.store(b + 1, std::memory_order_relaxed);
+		}
+		return task;
+	}
+
+	XHExecutorTask *steal()
+	{
+		int64_t t = top.load(std::memory_order_acquire);
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		int64_t b = bottom.load(std::memory_order_acquire);
+		if (t >= b)
+			return 0;
+		XHExecutorTask *task = ring.load(std::memory_order_acquire)->get(t);
+		if (!top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed))
+			return 0;
+		return task;
+	}
+
+	int64_t size() const
+	{
+		int64_t n = bottom.load(std::memory_order_relaxed) - top.load(std::memory_order_relaxed);
+		return n > 0 ? n : 0;
+	}
+
+private:
+	struct Ring
+	{
+		explicit Ring(int64_t c) : capacity(c), slots(new std::atomic<XHExecutorTask *>[c]) {}
+		~Ring() { delete [] slots; }
+
+		XHExecutorTask *get(int64_t i) const
+		{
+			return slots[i & (capacity - 1)].load(std::memory_order_relaxed);
+		}
+		void put(int64_t i, XHExecutorTask *task)
+		{
+			slots[i & (capacity - 1)].store(task, std::memory_order_relaxed);
+		}
+
+		int64_t capacity;
+		std::atomic<XHExecutorTask *> *slots;
+	};
+
+	XHWorkDeque(const XHWorkDeque &);
+	XHWorkDeque &operator=(const XHWorkDeque &);
+
+	std::atomic<int64_t> top;
+	std::atomic<int64_t> bottom;
+	std::atomic<Ring *> ring;
+	std::vector<Ring *> retired;	// owner only
+};
+
+// The statistics are written by their worker only and read by anyone.
+struct XHExecutorWorker
+{
+	XHExecutorWorker() : owner(0), index(0), submitted(0), executed(0), stolen(0), parks(0) {}
+
+	XHServiceExecutorPrivate *owner;
+	int index;
+	XHWorkDeque deque;
+	std::thread thread;
+	std::atomic<uint64_t> submitted;
+	std::atomic<uint64_t> executed;
+	std::atomic<uint64_t> stolen;
+	std::atomic<uint64_t> parks;
+};
+
+static thread_local XHExecutorWorker *currentWorker = 0;
+
+static void bump(std::atomic<uint64_t> &counter)
+{
+	counter.store(counter.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+}
+
+class XHServiceExecutorPrivate
+{
+public:
+	XHServiceExecutorPrivate()
+		: outstanding(0), accepting(true), cancelled(false), quitting(false), sleepers(0), epoch(0),
+		sharedSize(0), sharedSubmitted(0) {}
+
+	void work(XHExecutorWorker *worker);
+	XHExecutorTask *find(XHExecutorWorker *worker);
+	bool hasWork() const;
+	void wakeOne();
+	void finished();
+	bool waitIdle(int timeoutMs);
+
+	std::vector<XHExecutorWorker *> workers;
+	XHPauseToken pauseToken;
+	std::atomic<int64_t> outstanding;	// queued or running
+	std::atomic<bool> accepting;
+	std::atomic<bool> cancelled;
+	std::atomic<bool> quitting;
+
+	// Idle workers sleep on 'wake'; 'epoch' changes with every wake-up
+	// so that one can't get lost between the last look at the queues
+	// and the wait.
+	std::mutex mutex;
+	std::condition_variable wake;
+	std::condition_variable idle;
+	std::atomic<int> sleepers;
+	std::atomic<uint64_t> epoch;
+
+	// Tasks posted from outside the workers.
+	mutable std::mutex sharedMutex;
+	std::deque<XHExecutorTask *> shared;
+	std::atomic<int64_t> sharedSize;
+	std::atomic<uint64_t> sharedSubmitted;
+};
+
+void XHServiceExecutorPrivate::work(XHExecutorWorker *worker)
+{
+	currentWorker = worker;
+	for (;;) {
+		pauseToken.wait();
+		if (quitting.load(std::memory_order_acquire))
+			break;
+		if (XHExecutorTask *task = find(worker)) {
+			if (!cancelled.load(std::memory_order_relaxed)) {
+				task->function();
+				bump(worker->executed);
+			}
+			delete task;
+			finished();
+			continue;
+		}
+
+		uint64_t seen = epoch.load();
+		sleepers.fetch_add(1);
+		if (hasWork() || quitting.load()) {
+			sleepers.fetch_sub(1);
+			continue;
+		}
+		bump(worker->parks);
+		{
+			std::unique_lock<std::mutex> lock(mutex);
+			while (epoch.load() == seen && !quitting.load())
+				wake.wait(lock);
+		}
+		sleepers.fetch_sub(1);
+	}
+	currentWorker = 0;
+}
+
+// Own deque first (newest task, still warm), then the shared queue,
+// then the oldest task of the other workers.
+XHExecutorTask *XHServiceExecutorPrivate::find(XHExecutorWorker *worker)
+{
+	if (XHExecutorTask *task = worker->deque.pop())
+		return task;
+	if (sharedSize.load(std::memory_order_relaxed) > 0) {
+		std::lock_guard<std::mutex> lock(sharedMutex);
+		if (!shared.empty()) {
+			XHExecutorTask *task = shared.front();
+			shared.pop_front();
+			sharedSize.store((int64_t)shared.size(), std::memory_order_relaxed);
+			return task;
+		}
+	}
+	size_t n = workers.size();
+	for (size_t i = 1; i < n; ++i) {
+		XHExecutorWorker *victim = workers[(worker->index + i) % n];
+		if (XHExecutorTask *task = victim->deque.steal()) {
+			bump(worker->stolen);
+			return task;
+		}
+	}
+	return 0;
+}
+
+bool XHServiceExecutorPrivate::hasWork() const
+{
+	if (sharedSize.load() > 0)
+		return true;
+	for (size_t i = 0; i < workers.size(); ++i) {
+		if (workers[i]->deque.size() > 0)
+			return true;
+	}
+	return false;
+}
+
+// Pairs with the sleepers increment in work(): either the worker sees
+// the new task, or we see the worker going to sleep.
+void XHServiceExecutorPrivate::wakeOne()
+{
+	std::atomic_thread_fence(std::memory_order_seq_cst);
+	if (sleepers.load() > 0) {
+		std::lock_guard<std::mutex> lock(mutex);
+		epoch.fetch_add(1);
+		wake.notify_one();
+	}
+}
+
+void XHServiceExecutorPrivate::finished()
+{
+	if (outstanding.fetch_sub(1) == 1 && !accepting.load()) {
+		std::lock_guard<std::mutex> lock(mutex);
+		idle.notify_all();
+	}
+}
+
+bool XHServiceExecutorPrivate::waitIdle(int timeoutMs)
+{
+	std::unique_lock<std::mutex> lock(mutex);
+	if (timeoutMs < 0) {
+		idle.wait(lock, [this]() { return outstanding.load() == 0; });
+		return true;
+	}
+	return idle.wait_for(lock, std::chrono::milliseconds(timeoutMs),
+		[this]() { return outstanding.load() == 0; });
+}
+
+/*!
+    \class XHServiceExecutor
+
+    \brief The XHServiceExecutor class is a work-stealing thread pool
+    that follows the service's lifecycle.
+
+    Every worker thread has a deque of its own: tasks posted from a
+    task go to the bottom of the poster's deque and run there, newest
+    first, while tasks posted from other threads go to a shared queue.
+    An idle worker takes from its own deque, then from the shared
+    queue, then steals the oldest task of another worker. Workers with
+    nothing to do sleep until a task is posted.
+
+    The service creates its executor, XHServiceBase::executor(), right
+    before it calls XHServiceBase::start(), with one worker per core
+    the process may run on. Pausing the service parks the workers
+    between two tasks, stopping it drains the executor before
+    XHServiceBase::stop() is called, and a system shutdown cancels the
+    tasks that haven't started yet.
+
+    \sa XHServiceBase::executor(), statistics()
+*/
+
+/*!
+    Creates an executor with \a threads workers, or with one per
+    available core if \a threads is 0 or less.
+
+    \sa availableCores()
+*/
+XHServiceExecutor::XHServiceExecutor(int threads)
+	: d_ptr(new XHServiceExecutorPrivate)
+{
+	int n = threads > 0 ? threads : availableCores();
+	for (int i = 0; i < n; ++i) {
+		XHExecutorWorker *worker = new XHExecutorWorker;
+		worker->owner = d_ptr;
+		worker->index = i;
+		d_ptr->workers.push_back(worker);
+	}
+	for (int i = 0; i < n; ++i)
+		d_ptr->workers[i]->thread = std::thread(&XHServiceExecutorPrivate::work, d_ptr, d_ptr->workers[i]);
+}
+
+/*!
+    Cancels the tasks that haven't started, waits for the running ones
+    and destroys the executor.
+*/
+XHServiceExecutor::~XHServiceExecutor()
+{
+	cancel();
+	d_ptr->quitting.store(true);
+	{
+		std::lock_guard<std::mutex> lock(d_ptr->mutex);
+		d_ptr->epoch.fetch_add(1);
+		d_ptr->wake.notify_all();
+	}
+	for (size_t i = 0; i < d_ptr->workers.size(); ++i) {
+		d_ptr->workers[i]->thread.join();
+		delete d_ptr->workers[i];
+	}
+	delete d_ptr;
+}
+
+/*!
+    Queues \a task to run on one of the workers. Returns false, and
+    drops the task, once the executor is cancelled, or once it is
+    drained and \a task doesn't come from one of its own tasks: the
+    follow-up work of a running task still runs while draining.
+*/
+bool XHServiceExecutor::post(const Task &task)
+{
+	XHExecutorWorker *worker = currentWorker;
+	bool own = worker && worker->owner == d_ptr;
+	if (d_ptr->cancelled.load(std::memory_order_relaxed)
+		|| (!own && !d_ptr->accepting.load(std::memory_order_relaxed)))
+		return false;
+	XHExecutorTask *t = new XHExecutorTask(task);
+	d_ptr->outstanding.fetch_add(1);
+	if (own) {
+		worker->deque.push(t);
+		bump(worker->submitted);
+	} else {
+		std::lock_guard<std::mutex> lock(d_ptr->sharedMutex);
+		d_ptr->shared.push_back(t);
+		d_ptr->sharedSize.store((int64_t)d_ptr->shared.size(), std::memory_order_relaxed);
+		d_ptr->sharedSubmitted.fetch_add(1, std::memory_order_relaxed);
+	}
+	d_ptr->wakeOne();
+	return true;
+}
+
+/*!
+    Returns the number of worker threads.
+*/
+int XHServiceExecutor::threadCount() const
+{
+	return (int)d_ptr->workers.size();
+}
+
+/*!
+    Returns true until the executor is drained or cancelled.
+
+    \sa post()
+*/
+bool XHServiceExecutor::isAccepting() const
+{
+	return d_ptr->accepting.load();
+}
+
+/*!
+    Returns true while the executor is paused.
+*/
+bool XHServiceExecutor::isPaused() const
+{
+	return d_ptr->pauseToken.isPaused();
+}
+
+/*!
+    Returns the number of tasks queued or running.
+*/
+int XHServiceExecutor::pendingTasks() const
+{
+	return (int)d_ptr->outstanding.load();
+}
+
+/*!
+    Parks the workers once they finished the task at hand. Tasks can
+    still be posted; they run after resume().
+*/
+void XHServiceExecutor::pause()
+{
+	d_ptr->pauseToken.pause();
+}
+
+/*!
+    Lets paused workers continue.
+*/
+void XHServiceExecutor::resume()
+{
+	d_ptr->pauseToken.resume();
+}
+
+/*!
+    Stops accepting tasks from other threads and waits up to \a
+    timeoutMs milliseconds, or as long as it takes if \a timeoutMs is
+    -1, for the queued and running tasks to finish. A paused executor
+    is resumed. Returns true if every task finished.
+*/
+bool XHServiceExecutor::drain(int timeoutMs)
+{
+	d_ptr->accepting.store(false);
+	resume();
+	return d_ptr->waitIdle(timeoutMs);
+}
+
+/*!
+    Stops accepting tasks, drops the queued ones and waits up to \a
+    timeoutMs milliseconds, or as long as it takes if \a timeoutMs is
+    -1, for the running ones to finish. Returns true if none is left
+    running.
+*/
+bool XHServiceExecutor::cancel(int timeoutMs)
+{
+	d_ptr->cancelled.store(true);
+	d_ptr->accepting.store(false);
+	resume();
+	return d_ptr->waitIdle(timeoutMs);
+}
+
+/*!
+    Returns the statistics of the shared queue, which comes first, and
+    of every worker's deque. The values are read without stopping the
+    workers, so they may be slightly out of date.
+*/
+std::vector<XHExecutorQueueStats> XHServiceExecutor::statistics() const
+{
+	std::vector<XHExecutorQueueStats> stats;
+	XHExecutorQueueStats shared;
+	shared.depth = d_ptr->sharedSize.load(std::memory_order_relaxed);
+	shared.submitted = d_ptr->sharedSubmitted.load(std::memory_order_relaxed);
+	stats.push_back(shared);
+	for (size_t i = 0; i < d_ptr->workers.size(); ++i) {
+		const XHExecutorWorker *worker = d_ptr->workers[i];
+		XHExecutorQueueStats queue;
+		queue.queue = worker->index;
+		queue.depth = worker->deque.size();
+		queue.submitted = worker->submitted.load(std::memory_order_relaxed);
+		queue.executed = worker->executed.load(std::memory_order_relaxed);
+		queue.stolen = worker->stolen.load(std::memory_order_relaxed);
+		queue.parks = worker->parks.load(std::memory_order_relaxed);
+		stats.push_back(queue);
+	}
+	return stats;
+}
+
+/*!
+    Returns the number of cores the process may run on. On Linux this
+    honours the CPU affinity mask, so a worker process pinned to a core
+    gets a single thread.
+*/
+int XHServiceExecutor::availableCores()
+{
+#if defined(__linux__)
+	cpu_set_t set;
+	if (::sched_getaffinity(0, sizeof(set), &set) == 0 && CPU_COUNT(&set) > 0)
+		return CPU_COUNT(&set);
+#endif
+	unsigned n = std::thread::hardware_concurrency();
+	return n > 0 ? (int)n : 1;
+}
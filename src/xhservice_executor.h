@@ -0,0 +1,59 @@
+/****************************************************************************
+**
+**
+****************************************************************************/
+
+#ifndef XHSERVICE_EXECUTOR_H
+#define XHSERVICE_EXECUTOR_H
+
+#include "xhservice_global.h"
+#include <functional>
+#include <vector>
+#include <stdint.h>
+
+struct XHSERVICE_EXPORT XHExecutorQueueStats
+{
+	XHExecutorQueueStats() : queue(-1), depth(0), submitted(0), executed(0), stolen(0), parks(0) {}
+
+	int queue;	// worker index, -1 for the shared queue of outside submissions
+	int64_t depth;
+	uint64_t submitted;
+	uint64_t executed;
+	uint64_t stolen;	// tasks this worker took from other queues
+	uint64_t parks;
+};
+
+class XHServiceExecutorPrivate;
+
+class XHSERVICE_EXPORT XHServiceExecutor
+{
+public:
+	typedef std::function<void()> Task;
+
+	explicit XHServiceExecutor(int threads = 0);
+	virtual ~XHServiceExecutor();
+
+	bool post(const Task &task);
+
+	int threadCount() const;
+	bool isAccepting() const;
+	bool isPaused() const;
+	int pendingTasks() const;
+
+	void pause();
+	void resume();
+	bool drain(int timeoutMs = -1);
+	bool cancel(int timeoutMs = -1);
+
+	std::vector<XHExecutorQueueStats> statistics() const;
+
+	static int availableCores();
+
+private:
+	XHServiceExecutor(const XHServiceExecutor &);
+	XHServiceExecutor &operator=(const XHServiceExecutor &);
+
+	XHServiceExecutorPrivate *d_ptr;
+};
+
+#endif // XHSERVICE_EXECUTOR_H
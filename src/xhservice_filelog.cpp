@@ -0,0 +1,964 @@
+/****************************************************************************
+**
+**
+****************************************************************************/
+
+#include "xhservice.h"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#if defined(_WIN32)
+#  include <windows.h>
+#else
+#  include <dirent.h>
+#  include <fcntl.h>
+#  include <unistd.h>
+#  include <sys/mman.h>
+#  include <sys/stat.h>
+#endif
+#if defined(XHSERVICE_HAVE_ZLIB)
+#  include <zlib.h>
+#endif
+
+enum
+{
+	DefaultSegmentSize = 64 * 1024 * 1024,
+	MinimumSegmentSize = 64 * 1024,
+	CopyChunkSize = 1024 * 1024,
+	OpenRetryUs = 1000000,
+	StampSize = 27	// 2026-10-17T12:34:56.123456Z
+};
+
+/*
+   A segment is one file mapped whole into memory. The writer thread
+   appends by copying into the mapping; the file has its final size
+   from the start, and is cut down to what was written when the
+   segment is closed.
+*/
+struct XHLogSegment
+{
+	XHLogSegment()
+		:
+#if defined(_WIN32)
+		file(INVALID_HANDLE_VALUE), mapping(0),
+#else
+		file(-1),
+#endif
+		base(0), size(0), used(0), openedUs(0) {}
+
+	std::string path;
+#if defined(_WIN32)
+	HANDLE file;
+	HANDLE mapping;
+#else
+	int file;
+#endif
+	char *base;
+	int64_t size;
+	int64_t used;
+	int64_t openedUs;
+};
+
+static XHLogSegment *createSegment(const std::string &path, int64_t size)
+{
+	XHLogSegment *segment = new XHLogSegment;
+	segment->path = path;
+	segment->size = size;
+#if defined(_WIN32)
+	// FILE_SHARE_DELETE lets the segment be renamed while it is mapped.
+	segment->file = ::CreateFileA(path.c_str(), GENERIC_READ | GENERIC_WRITE,
+		FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, 0, CREATE_ALWAYS,
+		FILE_ATTRIBUTE_NORMAL, 0);
+	if (segment->file != INVALID_HANDLE_VALUE) {
+		segment->mapping = ::CreateFileMappingA(segment->file, 0, PAGE_READWRITE,
+			(DWORD)(size >> 32), (DWORD)size, 0);
+		if (segment->mapping)
+			segment->base = (char *)::MapViewOfFile(segment->mapping, FILE_MAP_WRITE, 0, 0, (SIZE_T)size);
+	}
+#else
+	segment->file = ::open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (segment->file >= 0) {
+		bool sized;
+#  if defined(__linux__)
+		// Allocating the blocks up front, on the background thread,
+		// halves the cost of the page faults of the writer thread.
+		// Prefaulting doesn't help: the first write to a page of a
+		// shared mapping faults again anyway.
+		sized = ::posix_fallocate(segment->file, 0, size) == 0
+			|| ::ftruncate(segment->file, size) == 0;
+#  else
+		sized = ::ftruncate(segment->file, size) == 0;
+#  endif
+		if (sized) {
+			void *base = ::mmap(0, (size_t)size, PROT_READ | PROT_WRITE, MAP_SHARED, segment->file, 0);
+			if (base != MAP_FAILED)
+				segment->base = (char *)base;
+		}
+	}
+#endif
+	if (!segment->base) {
+		// Still empty: closing it truncates the file to nothing.
+		segment->size = 0;
+	}
+	return segment;
+}
+
+// Unmaps the segment and cuts its file down to the bytes written.
+static void closeSegment(XHLogSegment *segment)
+{
+#if defined(_WIN32)
+	if (segment->base)
+		::UnmapViewOfFile(segment->base);
+	if (segment->mapping)
+		::CloseHandle(segment->mapping);
+	if (segment->file != INVALID_HANDLE_VALUE) {
+		LARGE_INTEGER end;
+		end.QuadPart = segment->used;
+		::SetFilePointerEx(segment->file, end, 0, FILE_BEGIN);
+		::SetEndOfFile(segment->file);
+		::CloseHandle(segment->file);
+	}
+#else
+	if (segment->base)
+		::munmap(segment->base, (size_t)segment->size);
+	if (segment->file >= 0) {
+		// A tail left zero filled is cut off by trimFile() next time.
+		int truncated = ::ftruncate(segment->file, segment->used);
+		(void)truncated;
+		::close(segment->file);
+	}
+#endif
+	delete segment;
+}
+
+static bool fileExists(const std::string &path)
+{
+#if defined(_WIN32)
+	return ::GetFileAttributesA(path.c_str()) != INVALID_FILE_ATTRIBUTES;
+#else
+	struct stat st;
+	return ::stat(path.c_str(), &st) == 0;
+#endif
+}
+
+static bool renameFile(const std::string &from, const std::string &to)
+{
+#if defined(_WIN32)
+	return ::MoveFileExA(from.c_str(), to.c_str(), 0) != 0;
+#else
+	return ::rename(from.c_str(), to.c_str()) == 0;
+#endif
+}
+
+static std::vector<std::string> listDirectory(const std::string &directory)
+{
+	std::vector<std::string> names;
+#if defined(_WIN32)
+	WIN32_FIND_DATAA data;
+	HANDLE find = ::FindFirstFileA((directory + "\\*").c_str(), &data);
+	if (find == INVALID_HANDLE_VALUE)
+		return names;
+	do {
+		names.push_back(data.cFileName);
+	} while (::FindNextFileA(find, &data));
+	::FindClose(find);
+#else
+	DIR *dir = ::opendir(directory.c_str());
+	if (!dir)
+		return names;
+	while (dirent *entry = ::readdir(dir))
+		names.push_back(entry->d_name);
+	::closedir(dir);
+#endif
+	return names;
+}
+
+/*
+   Cuts off the zero filled tail a segment keeps when the process dies
+   before closing it. Returns the size left.
+*/
+static int64_t trimFile(const std::string &path)
+{
+	FILE *file = ::fopen(path.c_str(), "rb");
+	if (!file)
+		return -1;
+	::fseek(file, 0, SEEK_END);
+	int64_t end = (int64_t)::ftell(file);
+	std::vector<char> block(64 * 1024);
+	while (end > 0) {
+		int64_t begin = end > (int64_t)block.size() ? end - (int64_t)block.size() : 0;
+		::fseek(file, (long)begin, SEEK_SET);
+		size_t n = ::fread(&block[0], 1, (size_t)(end - begin), file);
+		while (n > 0 && block[n - 1] == 0)
+			--n;
+		if (n > 0) {
+			end = begin + (int64_t)n;
+			break;
+		}
+		end = begin;
+	}
+	::fclose(file);
+#if defined(_WIN32)
+	HANDLE handle = ::CreateFileA(path.c_str(), GENERIC_WRITE, FILE_SHARE_READ, 0, OPEN_EXISTING,
+		FILE_ATTRIBUTE_NORMAL, 0);
+	if (handle != INVALID_HANDLE_VALUE) {
+		LARGE_INTEGER size;
+		size.QuadPart = end;
+		::SetFilePointerEx(handle, size, 0, FILE_BEGIN);
+		::SetEndOfFile(handle);
+		::CloseHandle(handle);
+	}
+#else
+	if (::truncate(path.c_str(), end) != 0)
+		return -1;
+#endif
+	return end;
+}
+
+static int64_t wallClockUs()
+{
+	return std::chrono::duration_cast<std::chrono::microseconds>(
+		std::chrono::system_clock::now().time_since_epoch()).count();
+}
+
+static const char *typeName(int type)
+{
+	switch (type) {
+		case XHServiceBase::Error: return "ERROR";
+		case XHServiceBase::Warning: return "WARNING";
+		case XHServiceBase::Information: return "INFO";
+		default: return "SUCCESS";
+	}
+}
+
+// Copies up to n bytes to p without passing end.
+static char *put(char *p, char *end, const char *text, size_t n)
+{
+	if (n > (size_t)(end - p))
+		n = end - p;
+	::memcpy(p, text, n);
+	return p + n;
+}
+
+static char *putNumber(char *p, char *end, uint64_t value)
+{
+	char digits[24];
+	int n = 0;
+	do {
+		digits[sizeof(digits) - 1 - n++] = (char)('0' + value % 10);
+		value /= 10;
+	} while (value);
+	return put(p, end, digits + sizeof(digits) - n, n);
+}
+
+class XHFileLogSinkPrivate
+{
+public:
+	explicit XHFileLogSinkPrivate(const std::string &fileName);
+
+	void write(const XHLogEntry &entry);
+	void flush();
+	void shutdown();
+
+	bool ensureActive(int64_t nowUs);
+	void openFirst(int64_t nowUs);
+	void rotate(int64_t nowUs);
+	bool rotationDue(int64_t nowUs) const;
+	const char *stamp(int64_t timeUs);
+
+	void backgroundLoop();
+	void runUrgent();
+	void archive(XHLogSegment *segment);
+	void moveLive();
+	std::string archiveName() const;
+	void compressFile(const std::string &path);
+	void enforceRetention();
+	void scanArchives();
+
+	std::string fileName;
+	std::string directory;
+	std::string baseName;
+	std::atomic<int64_t> maxSize;
+	std::atomic<int> interval;
+	std::atomic<int> maxArchived;
+	std::atomic<bool> compress;
+
+	// Writer thread.
+	XHLogSegment *active;
+	bool started;
+	int64_t nextOpenUs;
+	int64_t stampSecond;
+	char stampText[StampSize + 1];
+
+	std::atomic<bool> rotateRequested;
+	std::atomic<uint64_t> bytes;
+	std::atomic<uint64_t> rotated;
+	std::atomic<uint64_t> dropped;
+
+	// Shared with the background thread.
+	std::mutex mutex;
+	std::condition_variable wake;
+	std::condition_variable spareReady;
+	XHLogSegment *spare;
+	bool spareWanted;
+	uint64_t spares;	// numbers the names of the spares
+	XHLogSegment *live;	// the writer's segment
+	std::deque<XHLogSegment *> closed;
+	std::deque<std::string> archives;	// to compress
+	bool stopping;
+	std::thread background;
+};
+
+XHFileLogSinkPrivate::XHFileLogSinkPrivate(const std::string &name)
+	: fileName(name), maxSize(DefaultSegmentSize), interval(0), maxArchived(0),
+#if defined(XHSERVICE_HAVE_ZLIB)
+	compress(true),
+#else
+	compress(false),
+#endif
+	active(0), started(false), nextOpenUs(0), stampSecond(-1), rotateRequested(false),
+	bytes(0), rotated(0), dropped(0), spare(0), spareWanted(false),
+	spares(0), live(0), stopping(false)
+{
+	std::string::size_type slash = fileName.find_last_of(
+#if defined(_WIN32)
+		"/\\"
+#else
+		"/"
+#endif
+	);
+	directory = slash == std::string::npos ? std::string(".") : fileName.substr(0, slash ? slash : 1);
+	baseName = slash == std::string::npos ? fileName : fileName.substr(slash + 1);
+	stampText[StampSize] = 0;
+}
+
+const char *XHFileLogSinkPrivate::stamp(int64_t timeUs)
+{
+	int64_t second = timeUs / 1000000;
+	if (second != stampSecond) {
+		time_t t = (time_t)second;
+		tm parts;
+#if defined(_WIN32)
+		::gmtime_s(&parts, &t);
+#else
+		::gmtime_r(&t, &parts);
+#endif
+		::strftime(stampText, sizeof(stampText), "%Y-%m-%dT%H:%M:%S.", &parts);
+		stampText[StampSize - 1] = 'Z';
+		stampSecond = second;
+	}
+	int micro = (int)(timeUs % 1000000);
+	for (int i = StampSize - 2; i >= StampSize - 7; --i) {
+		stampText[i] = (char)('0' + micro % 10);
+		micro /= 10;
+	}
+	return stampText;
+}
+
+bool XHFileLogSinkPrivate::rotationDue(int64_t nowUs) const
+{
+	if (!active || active->used == 0)
+		return false;
+	int seconds = interval.load(std::memory_order_relaxed);
+	return seconds > 0 && nowUs - active->openedUs >= (int64_t)seconds * 1000000;
+}
+
+void XHFileLogSinkPrivate::write(const XHLogEntry &entry)
+{
+	if (rotateRequested.load(std::memory_order_relaxed) || rotationDue(entry.time)) {
+		rotateRequested.store(false);
+		if (active && active->used > 0)
+			rotate(entry.time);
+	}
+	// Each newline of the message takes a tab after it, each byte of
+	// data two hex digits.
+	size_t needed = StampSize + 40 + entry.message.size() * 2 + entry.data.size() * 2;
+	if (active && active->used > 0 && active->used + (int64_t)needed > active->size)
+		rotate(entry.time);
+	if (!ensureActive(entry.time)) {
+		dropped.fetch_add(1, std::memory_order_relaxed);
+		return;
+	}
+
+	char *begin = active->base + active->used;
+	char *p = begin;
+	char *end = active->base + active->size - 1;	// room for the newline
+	p = put(p, end, stamp(entry.time), StampSize);
+	p = put(p, end, " ", 1);
+	const char *type = typeName(entry.type);
+	p = put(p, end, type, ::strlen(type));
+	if (entry.id || entry.category) {
+		p = put(p, end, " ", 1);
+		p = putNumber(p, end, (uint32_t)entry.id);
+		p = put(p, end, "/", 1);
+		p = putNumber(p, end, entry.category);
+	}
+	p = put(p, end, " ", 1);
+	const char *text = entry.message.data();
+	const char *textEnd = text + entry.message.size();
+	while (text < textEnd) {
+		const char *newline = (const char *)::memchr(text, '\n', textEnd - text);
+		if (!newline) {
+			p = put(p, end, text, textEnd - text);
+			break;
+		}
+		p = put(p, end, text, newline - text + 1);
+		p = put(p, end, "\t", 1);
+		text = newline + 1;
+	}
+	if (!entry.data.empty()) {
+		static const char hex[] = "0123456789abcdef";
+		p = put(p, end, " data=", 6);
+		for (size_t i = 0; i < entry.data.size() && p + 2 <= end; ++i) {
+			unsigned char c = (unsigned char)entry.data[i];
+			*p++ = hex[c >> 4];
+			*p++ = hex[c & 15];
+		}
+	}
+	*p++ = '\n';
+	active->used += p - begin;
+	bytes.fetch_add(p - begin, std::memory_order_relaxed);
+}
+
+void XHFileLogSinkPrivate::flush()
+{
+	int64_t now = wallClockUs();
+	if (rotateRequested.load(std::memory_order_relaxed) || rotationDue(now)) {
+		rotateRequested.store(false);
+		if (active && active->used > 0)
+			rotate(now);
+	}
+	if (!active && started)
+		ensureActive(now);
+}
+
+bool XHFileLogSinkPrivate::ensureActive(int64_t nowUs)
+{
+	if (active)
+		return true;
+	if (nowUs < nextOpenUs)
+		return false;
+	if (!started)
+		openFirst(nowUs);
+	else
+		rotate(nowUs);
+	if (!active)
+		nextOpenUs = nowUs + OpenRetryUs;
+	return active != 0;
+}
+
+/*
+   The first segment is created on the writer thread. Files left
+   behind by an earlier run are archived by the background thread,
+   which from then on keeps the next segment ready.
+*/
+void XHFileLogSinkPrivate::openFirst(int64_t nowUs)
+{
+	started = true;
+	std::vector<std::string> leftover(1, fileName);
+	std::vector<std::string> names = listDirectory(directory);
+	std::string sparePrefix = baseName + ".next-";
+	for (size_t i = 0; i < names.size(); ++i) {
+		if (names[i].compare(0, sparePrefix.size(), sparePrefix) == 0
+			&& names[i].compare(names[i].size() - 4, 4, ".old") != 0)
+			leftover.push_back(directory + "/" + names[i]);
+	}
+	std::vector<std::string> found;
+	for (size_t i = 0; i < leftover.size(); ++i) {
+		if (!fileExists(leftover[i]))
+			continue;
+		std::string parked = leftover[i] + ".old";
+		if (renameFile(leftover[i], parked))
+			found.push_back(parked);
+	}
+	XHLogSegment *segment = createSegment(fileName, maxSize.load());
+	if (segment->base) {
+		segment->openedUs = nowUs;
+		active = segment;
+	} else {
+		closeSegment(segment);
+	}
+	std::lock_guard<std::mutex> lock(mutex);
+	live = active;
+	for (size_t i = 0; i < found.size(); ++i) {
+		XHLogSegment *old = new XHLogSegment;
+		old->path = found[i];
+		closed.push_back(old);
+	}
+	spareWanted = true;
+	background = std::thread(&XHFileLogSinkPrivate::backgroundLoop, this);
+}
+
+/*
+   Swaps in the segment the background thread has prepared and hands
+   the full one over for archiving, so rotating costs the writer a
+   pointer swap. It only waits when segments fill faster than the
+   background thread can prepare them.
+*/
+void XHFileLogSinkPrivate::rotate(int64_t nowUs)
+{
+	XHLogSegment *next;
+	{
+		std::unique_lock<std::mutex> lock(mutex);
+		if (active) {
+			closed.push_back(active);
+			active = 0;
+			live = 0;
+			rotated.fetch_add(1, std::memory_order_relaxed);
+		}
+		while (spareWanted && !spare)
+			spareReady.wait(lock);
+		next = spare;
+		spare = 0;
+		spareWanted = true;
+		live = next;
+		wake.notify_one();
+	}
+	if (next) {
+		next->openedUs = nowUs;
+		active = next;
+	}
+}
+
+void XHFileLogSinkPrivate::shutdown()
+{
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		stopping = true;
+		wake.notify_one();
+	}
+	if (background.joinable())
+		background.join();
+	moveLive();
+	if (spare) {
+		std::string path = spare->path;
+		closeSegment(spare);
+		::remove(path.c_str());
+		spare = 0;
+	}
+	if (active) {
+		closeSegment(active);
+		active = 0;
+	}
+}
+
+std::string XHFileLogSinkPrivate::archiveName() const
+{
+	time_t now = (time_t)(wallClockUs() / 1000000);
+	tm parts;
+#if defined(_WIN32)
+	::gmtime_s(&parts, &now);
+#else
+	::gmtime_r(&now, &parts);
+#endif
+	char stampText[32];
+	::strftime(stampText, sizeof(stampText), "%Y%m%d-%H%M%S", &parts);
+	// The counter keeps names of one second apart and in order.
+	for (int n = 0;; ++n) {
+		char suffix[48];
+		::snprintf(suffix, sizeof(suffix), ".%s-%03d", stampText, n);
+		std::string name = fileName + suffix;
+		if (!fileExists(name) && !fileExists(name + ".gz"))
+			return name;
+	}
+}
+
+/*
+   Closes a full segment and moves it from wherever it is to its
+   archive name. Segments without a mapping are files found at
+   startup.
+*/
+void XHFileLogSinkPrivate::archive(XHLogSegment *segment)
+{
+	std::string path = segment->path;
+	if (segment->base) {
+		closeSegment(segment);
+	} else {
+		delete segment;
+		if (trimFile(path) == 0) {
+			::remove(path.c_str());
+			return;
+		}
+	}
+	std::string name = archiveName();
+	bool renamed = renameFile(path, name);
+	moveLive();
+	if (!renamed)
+		return;
+	std::lock_guard<std::mutex> lock(mutex);
+	archives.push_back(name);
+}
+
+/*
+   Gives the writer's segment the log's own name once the segment
+   that had it is gone, so readers find the current log there. Spares
+   are prepared under names of their own; the writer may go through
+   several of them before the first is archived.
+*/
+void XHFileLogSinkPrivate::moveLive()
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	if (live && live->path != fileName && !fileExists(fileName)
+		&& renameFile(live->path, fileName))
+		live->path = fileName;
+}
+
+// Archives the closed segments and prepares the next one.
+void XHFileLogSinkPrivate::runUrgent()
+{
+	std::unique_lock<std::mutex> lock(mutex);
+	for (;;) {
+		if (!closed.empty()) {
+			XHLogSegment *segment = closed.front();
+			closed.pop_front();
+			lock.unlock();
+			archive(segment);
+			lock.lock();
+			continue;
+		}
+		if (spareWanted && !spare && !stopping) {
+			char suffix[32];
+			::snprintf(suffix, sizeof(suffix), ".next-%llu", (unsigned long long)++spares);
+			lock.unlock();
+			XHLogSegment *segment = createSegment(fileName + suffix, maxSize.load());
+			if (!segment->base) {
+				closeSegment(segment);
+				segment = 0;
+			}
+			lock.lock();
+			spare = segment;
+			// On failure the writer stops waiting and tries again later.
+			spareWanted = segment != 0;
+			spareReady.notify_all();
+			continue;
+		}
+		return;
+	}
+}
+
+void XHFileLogSinkPrivate::backgroundLoop()
+{
+	scanArchives();
+	for (;;) {
+		runUrgent();
+		std::string path;
+		{
+			std::unique_lock<std::mutex> lock(mutex);
+			if (stopping && closed.empty()) {
+				lock.unlock();
+				enforceRetention();
+				break;
+			}
+			if (archives.empty()) {
+				if (!stopping && closed.empty() && !(spareWanted && !spare))
+					wake.wait(lock);
+				continue;
+			}
+			path = archives.front();
+			archives.pop_front();
+		}
+		compressFile(path);
+		enforceRetention();
+	}
+}
+
+// Queues archives an earlier run did not get to compress.
+void XHFileLogSinkPrivate::scanArchives()
+{
+	std::vector<std::string> names = listDirectory(directory);
+	std::sort(names.begin(), names.end());
+	std::string prefix = baseName + ".";
+	std::lock_guard<std::mutex> lock(mutex);
+	for (size_t i = 0; i < names.size(); ++i) {
+		const std::string &name = names[i];
+		if (name.size() > prefix.size() && name.compare(0, prefix.size(), prefix) == 0
+			&& name[prefix.size()] >= '0' && name[prefix.size()] <= '9'
+			&& name.compare(name.size() - 3, 3, ".gz") != 0) {
+			archives.push_back(directory + "/" + name);
+		}
+	}
+}
+
+/*
+   Compresses an archive into a gzip file next to it. Between chunks
+   the rotation work goes first, so a long compression never keeps the
+   writer waiting for its next segment.
+*/
+void XHFileLogSinkPrivate::compressFile(const std::string &path)
+{
+#if defined(XHSERVICE_HAVE_ZLIB)
+	if (!compress.load())
+		return;
+	FILE *in = ::fopen(path.c_str(), "rb");
+	if (!in)
+		return;
+	std::string target = path + ".gz";
+	gzFile out = ::gzopen(target.c_str(), "wb1");
+	bool ok = out != 0;
+	std::vector<char> chunk(CopyChunkSize);
+	while (ok) {
+		size_t n = ::fread(&chunk[0], 1, chunk.size(), in);
+		if (n == 0)
+			break;
+		ok = ::gzwrite(out, &chunk[0], (unsigned)n) == (int)n;
+		runUrgent();
+		std::lock_guard<std::mutex> lock(mutex);
+		if (stopping)
+			ok = false;
+	}
+	ok = !::ferror(in) && ok;
+	::fclose(in);
+	if (out && ::gzclose(out) != Z_OK)
+		ok = false;
+	// An interrupted compression is redone by the next run.
+	::remove(ok ? path.c_str() : target.c_str());
+#else
+	(void)path;
+#endif
+}
+
+void XHFileLogSinkPrivate::enforceRetention()
+{
+	int keep = maxArchived.load();
+	if (keep <= 0)
+		return;
+	std::vector<std::string> names = listDirectory(directory);
+	std::string prefix = baseName + ".";
+	std::vector<std::string> archived;
+	for (size_t i = 0; i < names.size(); ++i) {
+		const std::string &name = names[i];
+		if (name.size() > prefix.size() && name.compare(0, prefix.size(), prefix) == 0
+			&& name[prefix.size()] >= '0' && name[prefix.size()] <= '9')
+			archived.push_back(name);
+	}
+	if ((int)archived.size() <= keep)
+		return;
+	// The names sort by time.
+	std::sort(archived.begin(), archived.end());
+	for (size_t i = 0; i + keep < archived.size(); ++i)
+		::remove((directory + "/" + archived[i]).c_str());
+}
+
+/*!
+    \class XHFileLogSink
+
+    \brief The XHFileLogSink class writes log messages to a set of
+    rotating, memory-mapped files.
+
+    The sink writes each message as one line of text: the UTC time with
+    microseconds, the message type, the id and category if either is
+    set, the message, and the data in hex if there is any. Lines after
+    the first of a message are indented by a tab.
+
+    The current segment is the file named by fileName(). It is created
+    at maxSegmentSize() and mapped whole, so writing a message is a
+    copy into memory; what the writer thread copied is in the page
+    cache, and survives a crash of the process. A segment is rotated
+    when the next message doesn't fit, when it is older than
+    rotationInterval(), or on rotate(). It is then cut to the bytes
+    written and renamed to fileName() followed by the UTC time and a
+    counter, as in \c service.log.20261017-120000-000.
+
+    A background thread of the sink prepares the next segment ahead of
+    time, as \c service.log.next-1 and so on, and archives the full
+    ones, so rotating only swaps two mappings and never blocks
+    logMessage(). The new segment takes the name fileName() as soon as
+    the full one has been moved away. With compression() on, it
+    then gzips the archives and keeps at most maxArchivedSegments() of
+    them. Files an earlier run left behind, after a crash for instance,
+    are archived and compressed the same way.
+
+    \code
+    XHFileLogSink *sink = new XHFileLogSink("/var/log/myservice/service.log");
+    sink->setMaxSegmentSize(256 * 1024 * 1024);
+    sink->setMaxArchivedSegments(20);
+    service.setLogSink(sink);
+    \endcode
+
+    Set it up before passing it to XHServiceBase::setLogSink(); the
+    service owns it from then on.
+*/
+
+/*!
+    Creates a sink writing to \a fileName. The directory must exist.
+    Nothing is opened before the first message.
+*/
+XHFileLogSink::XHFileLogSink(const std::string &fileName)
+	: d_ptr(new XHFileLogSinkPrivate(fileName))
+{
+}
+
+/*!
+    Closes the current segment and stops the background thread.
+    Archives not compressed yet are compressed by the next sink writing
+    to the same file.
+*/
+XHFileLogSink::~XHFileLogSink()
+{
+	d_ptr->shutdown();
+	delete d_ptr;
+}
+
+/*!
+    Returns the name of the current segment.
+*/
+std::string XHFileLogSink::fileName() const
+{
+	return d_ptr->fileName;
+}
+
+/*!
+    Returns the size of a segment in bytes. The default is 64 MB.
+
+    \sa setMaxSegmentSize()
+*/
+int64_t XHFileLogSink::maxSegmentSize() const
+{
+	return d_ptr->maxSize.load();
+}
+
+/*!
+    Sets the size of a segment to \a bytes, at least 64 KB. The file
+    has this size on disk while it is written. A message larger than a
+    segment is cut short.
+
+    \sa maxSegmentSize()
+*/
+void XHFileLogSink::setMaxSegmentSize(int64_t bytes)
+{
+	d_ptr->maxSize.store(std::max<int64_t>(bytes, MinimumSegmentSize));
+}
+
+/*!
+    Returns the number of seconds after which a segment is rotated
+    regardless of its size, or 0 if segments are only rotated when
+    full (the default).
+
+    \sa setRotationInterval()
+*/
+int XHFileLogSink::rotationInterval() const
+{
+	return d_ptr->interval.load();
+}
+
+/*!
+    Rotates segments \a seconds after they were opened; 0 turns it
+    off. An empty segment is not rotated.
+
+    \sa rotationInterval()
+*/
+void XHFileLogSink::setRotationInterval(int seconds)
+{
+	d_ptr->interval.store(seconds > 0 ? seconds : 0);
+}
+
+/*!
+    Returns the number of archived segments kept, or 0 if all of them
+    are kept (the default).
+
+    \sa setMaxArchivedSegments()
+*/
+int XHFileLogSink::maxArchivedSegments() const
+{
+	return d_ptr->maxArchived.load();
+}
+
+/*!
+    Keeps the \a count newest archived segments and deletes older ones;
+    0 keeps all of them.
+
+    \sa maxArchivedSegments()
+*/
+void XHFileLogSink::setMaxArchivedSegments(int count)
+{
+	d_ptr->maxArchived.store(count > 0 ? count : 0);
+}
+
+/*!
+    Returns true if archived segments are compressed. This is the
+    default when xhservice is built with zlib; otherwise it is always
+    false.
+
+    \sa setCompression()
+*/
+bool XHFileLogSink::compression() const
+{
+	return d_ptr->compress.load();
+}
+
+/*!
+    Turns compression of archived segments on or off as \a enabled
+    says. Has no effect when xhservice is built without zlib.
+
+    \sa compression()
+*/
+void XHFileLogSink::setCompression(bool enabled)
+{
+#if defined(XHSERVICE_HAVE_ZLIB)
+	d_ptr->compress.store(enabled);
+#else
+	(void)enabled;
+#endif
+}
+
+/*!
+    Asks the writer thread to rotate the current segment before the
+    next message, or within half a second if no message comes. Can be
+    called from any thread.
+*/
+void XHFileLogSink::rotate()
+{
+	d_ptr->rotateRequested.store(true);
+}
+
+/*!
+    Returns the number of bytes written to all segments.
+*/
+uint64_t XHFileLogSink::bytesWritten() const
+{
+	return d_ptr->bytes.load(std::memory_order_relaxed);
+}
+
+/*!
+    Returns the number of segments rotated.
+*/
+uint64_t XHFileLogSink::segmentsRotated() const
+{
+	return d_ptr->rotated.load(std::memory_order_relaxed);
+}
+
+/*!
+    Returns the number of messages lost because no segment could be
+    created. The sink tries again at most once a second.
+*/
+uint64_t XHFileLogSink::droppedEntries() const
+{
+	return d_ptr->dropped.load(std::memory_order_relaxed);
+}
+
+/*!
+    \reimp
+*/
+void XHFileLogSink::write(const XHLogEntry &entry)
+{
+	d_ptr->write(entry);
+}
+
+/*!
+    \reimp
+
+    Rotates the segment if it is due. The data needs no flushing: it is
+    in the page cache, and the system writes it back.
+*/
+void XHFileLogSink::flush()
+{
+	d_ptr->flush();
+}
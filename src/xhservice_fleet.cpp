@@ -0,0 +1,241 @@
+/****************************************************************************
+**
+**
+****************************************************************************/
+
+#include "xhservice_fleet.h"
+#include "xhservice.h"
+#include "xhservice_graph_p.h"
+#include <chrono>
+#include <map>
+#include <thread>
+
+typedef std::chrono::steady_clock XHFleetClock;
+
+static int64_t elapsedMs(XHFleetClock::time_point since)
+{
+	return std::chrono::duration_cast<std::chrono::milliseconds>(XHFleetClock::now() - since).count();
+}
+
+class XHServiceFleetPrivate
+{
+public:
+	XHServiceFleetPrivate() : maxParallel(0), timeoutMs(30000) {}
+
+	int indexOf(const std::string &name);
+	std::vector<XHServiceFleetResult> run(bool starting);
+	bool startService(const std::string &name);
+	bool stopService(const std::string &name);
+
+	std::vector<std::string> names;
+	std::map<std::string, int> index;
+	XHTaskGraph graph;
+	int maxParallel;
+	int timeoutMs;
+};
+
+int XHServiceFleetPrivate::indexOf(const std::string &name)
+{
+	std::map<std::string, int>::iterator it = index.find(name);
+	if (it != index.end())
+		return it->second;
+	int i = graph.addNode();
+	names.push_back(name);
+	index[name] = i;
+	return i;
+}
+
+bool XHServiceFleetPrivate::startService(const std::string &name)
+{
+	XHServiceController controller(name);
+	// One that is up already may still be starting: it is waited for
+	// like the others, just not launched a second time.
+	if (!controller.isRunning() && !controller.start())
+		return false;
+	// Dependents may only start once this one actually runs.
+	XHFleetClock::time_point begin = XHFleetClock::now();
+	while (elapsedMs(begin) < timeoutMs) {
+		if (controller.status().state == XHServiceController::RunningState)
+			return true;
+		std::this_thread::sleep_for(std::chrono::milliseconds(10));
+	}
+	return false;
+}
+
+bool XHServiceFleetPrivate::stopService(const std::string &name)
+{
+	XHServiceController controller(name);
+	if (!controller.isRunning())
+		return true;
+	if (controller.stop())
+		return true;
+	XHFleetClock::time_point begin = XHFleetClock::now();
+	while (elapsedMs(begin) < timeoutMs) {
+		if (!controller.isRunning())
+			return true;
+		std::this_thread::sleep_for(std::chrono::milliseconds(10));
+	}
+	return false;
+}
+
+std::vector<XHServiceFleetResult> XHServiceFleetPrivate::run(bool starting)
+{
+	// Stopping walks the graph backwards: dependents go first.
+	std::vector<XHTaskGraph::Outcome> outcomes = graph.run([this, starting](int i) {
+		return starting ? startService(names[i]) : stopService(names[i]);
+	}, maxParallel, !starting);
+
+	std::vector<XHServiceFleetResult> results(names.size());
+	for (size_t i = 0; i < names.size(); ++i) {
+		results[i].name = names[i];
+		results[i].success = outcomes[i].success;
+		results[i].skipped = outcomes[i].skipped;
+		results[i].startMs = outcomes[i].startMs;
+		results[i].durationMs = outcomes[i].durationMs;
+	}
+	return results;
+}
+
+/*!
+    \class XHServiceFleet
+
+    \brief The XHServiceFleet class starts and stops a set of services
+    concurrently, respecting the dependencies between them.
+
+    Add the services with addService() and declare which service must
+    be running before another one with addDependency(). start() then
+    starts every service as soon as all of its dependencies run, and
+    stop() stops every service as soon as all services depending on it
+    have stopped, so the whole operation takes about as long as the
+    longest chain of dependencies.
+
+    Both functions block until every service has been handled and
+    return one XHServiceFleetResult per service, in the order the
+    services were added. \c startMs and \c durationMs give the offset
+    from the beginning of the operation at which the service was
+    handled and how long that took. A service whose dependency failed
+    is not touched and reported as \c skipped.
+
+    \code
+    XHServiceFleet fleet;
+    fleet.addDependency("modbus-driver", "tagdb");
+    fleet.addDependency("opc-gateway", "tagdb");
+    fleet.addDependency("historian", "modbus-driver");
+    std::vector<XHServiceFleetResult> results = fleet.start();
+    \endcode
+
+    \sa XHServiceController
+*/
+
+/*!
+    Creates an empty fleet.
+*/
+XHServiceFleet::XHServiceFleet()
+	: d_ptr(new XHServiceFleetPrivate)
+{
+}
+
+/*!
+    Destroys the fleet. The services are neither stopped nor started.
+*/
+XHServiceFleet::~XHServiceFleet()
+{
+	delete d_ptr;
+}
+
+/*!
+    Adds the service called \a name to the fleet. Adding a service
+    twice has no effect.
+*/
+void XHServiceFleet::addService(const std::string &name)
+{
+	d_ptr->indexOf(name);
+}
+
+/*!
+    Declares that \a service needs \a dependsOn to be running. Both are
+    added to the fleet if necessary.
+
+    \sa isValid()
+*/
+void XHServiceFleet::addDependency(const std::string &service, const std::string &dependsOn)
+{
+	int i = d_ptr->indexOf(service);
+	d_ptr->graph.addEdge(i, d_ptr->indexOf(dependsOn));
+}
+
+/*!
+    Returns the names of the services in the fleet, in the order they
+    were added.
+*/
+std::vector<std::string> XHServiceFleet::services() const
+{
+	return d_ptr->names;
+}
+
+/*!
+    Returns false if the dependencies contain a cycle. start() and
+    stop() do nothing and report every service as failed in that case.
+*/
+bool XHServiceFleet::isValid() const
+{
+	return d_ptr->graph.isAcyclic();
+}
+
+/*!
+    Returns the maximum number of services handled at the same time.
+    The default, 0, handles as many at once as the dependencies allow.
+*/
+int XHServiceFleet::maxParallel() const
+{
+	return d_ptr->maxParallel;
+}
+
+/*!
+    Limits the number of services handled at the same time to
+    \a workers.
+*/
+void XHServiceFleet::setMaxParallel(int workers)
+{
+	d_ptr->maxParallel = workers;
+}
+
+/*!
+    Returns how long, in milliseconds, start() waits for a service to
+    reach the running state (and stop() for it to stop) before the
+    service is reported as failed. The default is 30 seconds.
+*/
+int XHServiceFleet::timeout() const
+{
+	return d_ptr->timeoutMs;
+}
+
+/*!
+    Sets the per-service timeout to \a timeoutMs milliseconds.
+*/
+void XHServiceFleet::setTimeout(int timeoutMs)
+{
+	d_ptr->timeoutMs = timeoutMs;
+}
+
+/*!
+    Starts every service of the fleet that isn't running yet. A service
+    is started once all its dependencies are running.
+
+    \sa stop()
+*/
+std::vector<XHServiceFleetResult> XHServiceFleet::start()
+{
+	return d_ptr->run(true);
+}
+
+/*!
+    Stops every running service of the fleet. A service is stopped once
+    all services that depend on it have stopped.
+
+    \sa start()
+*/
+std::vector<XHServiceFleetResult> XHServiceFleet::stop()
+{
+	return d_ptr->run(false);
+}
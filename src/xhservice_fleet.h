@@ -0,0 +1,53 @@
+/****************************************************************************
+**
+**
+****************************************************************************/
+
+#ifndef XHSERVICE_FLEET_H
+#define XHSERVICE_FLEET_H
+
+#include "xhservice_global.h"
+#include <string>
+#include <vector>
+#include <stdint.h>
+
+struct XHSERVICE_EXPORT XHServiceFleetResult
+{
+	XHServiceFleetResult() : success(false), skipped(false), startMs(0), durationMs(0) {}
+
+	std::string name;
+	bool success;
+	bool skipped;
+	int64_t startMs;
+	int64_t durationMs;
+};
+
+class XHServiceFleetPrivate;
+
+class XHSERVICE_EXPORT XHServiceFleet
+{
+public:
+	XHServiceFleet();
+	virtual ~XHServiceFleet();
+
+	void addService(const std::string &name);
+	void addDependency(const std::string &service, const std::string &dependsOn);
+	std::vector<std::string> services() const;
+	bool isValid() const;
+
+	int maxParallel() const;
+	void setMaxParallel(int workers);
+	int timeout() const;
+	void setTimeout(int timeoutMs);
+
+	std::vector<XHServiceFleetResult> start();
+	std::vector<XHServiceFleetResult> stop();
+
+private:
+	XHServiceFleet(const XHServiceFleet &);
+	XHServiceFleet &operator=(const XHServiceFleet &);
+
+	XHServiceFleetPrivate *d_ptr;
+};
+
+#endif // XHSERVICE_FLEET_H
@@ -1,12 +1,23 @@
 #ifndef XHSERVCIE_GLOBAL_H__
 #define XHSERVCIE_GLOBAL_H__
 
+#if defined(_WIN32)
+#  define XHSERVICE_DECL_EXPORT __declspec(dllexport)
+#  define XHSERVICE_DECL_IMPORT __declspec(dllimport)
+#else
+#  define XHSERVICE_DECL_EXPORT __attribute__((visibility("default")))
+#  define XHSERVICE_DECL_IMPORT __attribute__((visibility("default")))
+#  if !defined(Q_OS_UNIX)
+#    define Q_OS_UNIX
+#  endif
+#endif
+
 #if defined(XHSERVICE_LIBRARY)
-#  define XHSERVICE_EXPORT __declspec(dllexport)
+#  define XHSERVICE_EXPORT XHSERVICE_DECL_EXPORT
 #elif  defined(XHSERVICE_STATIC_LIB) // Abuse single files for manual tests
 #  define XHSERVICE_EXPORT
 #else
-#  define XHSERVICE_EXPORT __declspec(dllimport)
+#  define XHSERVICE_EXPORT XHSERVICE_DECL_IMPORT
 #endif
 
 #endif//XHSERVCIE_GLOBAL_H__
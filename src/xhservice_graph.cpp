@@ -0,0 +1,155 @@
+/****************************************************************************
+**
+**
+****************************************************************************/
+
+#include "xhservice_graph_p.h"
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+
+typedef std::chrono::steady_clock XHGraphClock;
+
+static int64_t elapsedMs(XHGraphClock::time_point since)
+{
+	return std::chrono::duration_cast<std::chrono::milliseconds>(XHGraphClock::now() - since).count();
+}
+
+int XHTaskGraph::addNode()
+{
+	dependencies.push_back(std::vector<int>());
+	return (int)dependencies.size() - 1;
+}
+
+void XHTaskGraph::addEdge(int node, int dependsOn)
+{
+	if (node == dependsOn)
+		return;
+	std::vector<int> &deps = dependencies[node];
+	for (size_t k = 0; k < deps.size(); ++k) {
+		if (deps[k] == dependsOn)
+			return;
+	}
+	deps.push_back(dependsOn);
+}
+
+// Kahn's algorithm.
+bool XHTaskGraph::isAcyclic() const
+{
+	size_t n = dependencies.size();
+	std::vector<int> pending(n, 0);
+	std::vector<std::vector<int> > dependents(n);
+	for (size_t i = 0; i < n; ++i) {
+		for (size_t k = 0; k < dependencies[i].size(); ++k) {
+			dependents[dependencies[i][k]].push_back((int)i);
+			++pending[i];
+		}
+	}
+	std::deque<int> ready;
+	for (size_t i = 0; i < n; ++i) {
+		if (!pending[i])
+			ready.push_back((int)i);
+	}
+	size_t visited = 0;
+	while (!ready.empty()) {
+		int i = ready.front();
+		ready.pop_front();
+		++visited;
+		for (size_t k = 0; k < dependents[i].size(); ++k) {
+			if (--pending[dependents[i][k]] == 0)
+				ready.push_back(dependents[i][k]);
+		}
+	}
+	return visited == n;
+}
+
+/*
+   The calling thread is one of the workers. A cyclic graph runs
+   nothing and reports every node as failed.
+*/
+std::vector<XHTaskGraph::Outcome> XHTaskGraph::run(const Task &task, int maxParallel,
+	bool reverse, const Observer &observer) const
+{
+	size_t n = dependencies.size();
+	std::vector<Outcome> outcomes(n);
+	if (!isAcyclic())
+		return outcomes;
+
+	std::vector<int> pending(n, 0);
+	std::vector<std::vector<int> > next(n);
+	for (size_t i = 0; i < n; ++i) {
+		for (size_t k = 0; k < dependencies[i].size(); ++k) {
+			int dep = dependencies[i][k];
+			if (reverse) {
+				next[i].push_back(dep);
+				++pending[dep];
+			} else {
+				next[dep].push_back((int)i);
+				++pending[i];
+			}
+		}
+	}
+
+	std::mutex mutex;
+	std::condition_variable cond;
+	std::deque<int> ready;
+	std::vector<bool> blocked(n, false);
+	size_t remaining = n;
+	for (size_t i = 0; i < n; ++i) {
+		if (!pending[i])
+			ready.push_back((int)i);
+	}
+
+	XHGraphClock::time_point begin = XHGraphClock::now();
+	std::function<void()> worker = [&]() {
+		std::unique_lock<std::mutex> lock(mutex);
+		for (;;) {
+			while (ready.empty() && remaining > 0)
+				cond.wait(lock);
+			if (remaining == 0)
+				return;
+			int i = ready.front();
+			ready.pop_front();
+			bool skip = blocked[i];
+			Outcome &outcome = outcomes[i];
+			lock.unlock();
+
+			if (skip) {
+				outcome.skipped = true;
+			} else {
+				if (observer)
+					observer(i, false);
+				outcome.startMs = elapsedMs(begin);
+				outcome.success = task(i);
+				outcome.durationMs = elapsedMs(begin) - outcome.startMs;
+				if (observer)
+					observer(i, true);
+			}
+
+			lock.lock();
+			for (size_t k = 0; k < next[i].size(); ++k) {
+				int j = next[i][k];
+				if (!outcome.success)
+					blocked[j] = true;
+				if (--pending[j] == 0)
+					ready.push_back(j);
+			}
+			--remaining;
+			cond.notify_all();
+		}
+	};
+
+	size_t workers = maxParallel > 0 ? (size_t)maxParallel : n;
+	if (workers > n)
+		workers = n;
+	std::vector<std::thread> threads;
+	for (size_t i = 1; i < workers; ++i)
+		threads.push_back(std::thread(worker));
+	if (workers > 0)
+		worker();
+	for (size_t i = 0; i < threads.size(); ++i)
+		threads[i].join();
+	return outcomes;
+}
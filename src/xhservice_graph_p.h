@@ -0,0 +1,48 @@
+/****************************************************************************
+**
+**
+****************************************************************************/
+
+#ifndef XHSERVICE_GRAPH_P_H
+#define XHSERVICE_GRAPH_P_H
+
+#include <functional>
+#include <vector>
+#include <stdint.h>
+
+/*
+   Dependency graph of tasks run in parallel, shared by XHServiceFleet
+   and XHStartupPlan. A task runs as soon as every task it waits for
+   has succeeded; when one of them failed it is skipped instead.
+*/
+class XHTaskGraph
+{
+public:
+	struct Outcome
+	{
+		Outcome() : success(false), skipped(false), startMs(0), durationMs(0) {}
+		bool success;
+		bool skipped;
+		int64_t startMs;	// relative to the beginning of run()
+		int64_t durationMs;
+	};
+
+	typedef std::function<bool(int)> Task;
+	// Called from the worker threads right before and after a task.
+	typedef std::function<void(int, bool)> Observer;
+
+	int addNode();
+	void addEdge(int node, int dependsOn);
+	int size() const { return (int)dependencies.size(); }
+	bool isAcyclic() const;
+
+	// 'reverse' runs dependents before the nodes they depend on (used
+	// for stopping). maxParallel <= 0 means one thread per node.
+	std::vector<Outcome> run(const Task &task, int maxParallel, bool reverse = false,
+		const Observer &observer = Observer()) const;
+
+private:
+	std::vector<std::vector<int> > dependencies;
+};
+
+#endif // XHSERVICE_GRAPH_P_H
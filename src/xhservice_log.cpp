@@ -0,0 +1,497 @@
+/****************************************************************************
+**
+**
+****************************************************************************/
+
+#include "xhservice.h"
+#include "xhservice_log_p.h"
+#include <chrono>
+#include <stdio.h>
+
+enum
+{
+	DefaultLogCapacity = 1024,
+	LogBatchSize = 64,
+	PreallocatedMessageSize = 256,
+	RateBuckets = 1024,	// power of two
+	RateProbes = 8,
+	SummaryCheckMs = 1000,
+	SummaryIntervalMs = 5000,
+	IdleSpinUs = 50
+};
+
+static int64_t wallClockUs()
+{
+	return std::chrono::duration_cast<std::chrono::microseconds>(
+		std::chrono::system_clock::now().time_since_epoch()).count();
+}
+
+struct XHLogRateLimiter::Bucket
+{
+	Bucket() : key(0), tat(0), count(0), type(0), lastSummary(0) {}
+
+	std::atomic<uint64_t> key;	// 0 while free
+	std::atomic<int64_t> tat;
+	std::atomic<uint64_t> count;	// suppressed since the last summary
+	std::atomic<int> type;
+	int64_t lastSummary;	// writer thread only
+	std::mutex sampleMutex;
+	std::string sample;	// the first message suppressed since the last summary
+	char padding[64];	// keep hot buckets off each other's cache lines
+};
+
+XHLogRateLimiter::XHLogRateLimiter()
+	: interval(0), perSecond(0), burstSize(0), table(0), pending(false), summarized(0)
+{
+}
+
+XHLogRateLimiter::~XHLogRateLimiter()
+{
+	delete [] table.load();
+}
+
+int64_t XHLogRateLimiter::clockNs()
+{
+	return std::chrono::duration_cast<std::chrono::nanoseconds>(
+		std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+void XHLogRateLimiter::setLimit(int rate, int burst)
+{
+	std::lock_guard<std::mutex> lock(setupMutex);
+	if (rate > 0 && !table.load())
+		table.store(new Bucket[RateBuckets], std::memory_order_release);
+	perSecond.store(rate > 0 ? rate : 0);
+	burstSize.store(burst > 0 ? burst : 1);
+	interval.store(rate > 0 ? 1000000000LL / rate : 0, std::memory_order_release);
+}
+
+bool XHLogRateLimiter::check(int type, const std::string &message, int id, uint16_t category)
+{
+	// Keys of (id, category) pairs have the top bit set, keys of texts
+	// (FNV-1a) the next one, so the two never meet and no key is 0.
+	uint64_t key;
+	if (id || category) {
+		key = (1ull << 63) | ((uint64_t)(uint32_t)id << 16) | category;
+	} else {
+		uint64_t h = 14695981039346656037ull;
+		for (size_t i = 0; i < message.size(); ++i)
+			h = (h ^ (unsigned char)message[i]) * 1099511628211ull;
+		key = (1ull << 62) | (h >> 2);
+	}
+	Bucket *buckets = table.load(std::memory_order_acquire);
+	size_t index = (size_t)((key * 0x9e3779b97f4a7c15ull) >> 32) & (RateBuckets - 1);
+	Bucket *bucket = 0;
+	for (int i = 0; i < RateProbes; ++i) {
+		Bucket &b = buckets[(index + i) & (RateBuckets - 1)];
+		uint64_t k = b.key.load(std::memory_order_acquire);
+		if (k == 0 && b.key.compare_exchange_strong(k, key))
+			k = key;
+		if (k == key) {
+			bucket = &b;
+			break;
+		}
+	}
+	if (!bucket)
+		return true;
+
+	int64_t step = interval.load(std::memory_order_relaxed);
+	int64_t tolerance = step * burstSize.load(std::memory_order_relaxed);
+	int64_t now = clockNs();
+	int64_t tat = bucket->tat.load(std::memory_order_relaxed);
+	for (;;) {
+		int64_t start = tat > now ? tat : now;
+		if (start + step - now > tolerance)
+			break;
+		if (bucket->tat.compare_exchange_weak(tat, start + step, std::memory_order_relaxed))
+			return true;
+	}
+	bucket->type.store(type, std::memory_order_relaxed);
+	if (bucket->count.fetch_add(1, std::memory_order_relaxed) == 0) {
+		std::lock_guard<std::mutex> lock(bucket->sampleMutex);
+		bucket->sample = message;
+	}
+	if (!pending.load(std::memory_order_relaxed))
+		pending.store(true, std::memory_order_relaxed);
+	return false;
+}
+
+int XHLogRateLimiter::summarize(XHLogSink *sink, int64_t nowNs, bool all)
+{
+	Bucket *buckets = table.load(std::memory_order_acquire);
+	if (!buckets)
+		return 0;
+	pending.store(false);
+	int written = 0;
+	bool left = false;
+	for (int i = 0; i < RateBuckets; ++i) {
+		Bucket &b = buckets[i];
+		uint64_t key = b.key.load(std::memory_order_acquire);
+		if (!key || b.count.load(std::memory_order_relaxed) == 0)
+			continue;
+		if (!all && nowNs - b.lastSummary < (int64_t)SummaryIntervalMs * 1000000) {
+			left = true;
+			continue;
+		}
+		XHLogEntry record;
+		record.time = wallClockUs();
+		{
+			// Take the sample first: a count that grows meanwhile
+			// belongs to the next summary, with a new sample.
+			std::lock_guard<std::mutex> lock(b.sampleMutex);
+			record.message.swap(b.sample);
+		}
+		uint64_t n = b.count.exchange(0, std::memory_order_relaxed);
+		b.lastSummary = nowNs;
+		if (!n)
+			continue;
+		char text[64];
+		::snprintf(text, sizeof(text), "%llu similar messages suppressed: ", (unsigned long long)n);
+		record.message.insert(0, text);
+		record.type = b.type.load(std::memory_order_relaxed);
+		record.id = (key >> 63) ? (int)(uint32_t)(key >> 16) : 0;
+		record.category = (key >> 63) ? (uint16_t)key : 0;
+		if (sink)
+			sink->write(record);
+		summarized.fetch_add(n, std::memory_order_relaxed);
+		++written;
+	}
+	if (left)
+		pending.store(true);
+	return written;
+}
+
+uint64_t XHLogRateLimiter::suppressed() const
+{
+	uint64_t n = summarized.load(std::memory_order_relaxed);
+	if (Bucket *buckets = table.load(std::memory_order_acquire)) {
+		for (int i = 0; i < RateBuckets; ++i)
+			n += buckets[i].count.load(std::memory_order_relaxed);
+	}
+	return n;
+}
+
+/*!
+    \class XHLogEntry
+
+    \brief The XHLogEntry struct holds one message passed to
+    XHServiceBase::logMessage().
+
+    \c time is the wall clock time of the logMessage() call in
+    microseconds since the epoch; \c type is an
+    XHServiceBase::MessageType. The other members are the arguments of
+    the call.
+*/
+
+/*!
+    \class XHLogSink
+
+    \brief The XHLogSink class is the destination of the messages
+    passed to XHServiceBase::logMessage().
+
+    logMessage() only queues its message; a writer thread of the
+    service passes the queued messages to the sink. By default that is
+    the system log, the event log on Windows and syslog on Unix. A
+    sink set with XHServiceBase::setLogSink() replaces it.
+
+    write() and flush() are only ever called from the writer thread, one
+    at a time, so a sink needs no locking of its own. write() should
+    not block for long: while it does, messages pile up in the log
+    buffer.
+
+    \sa XHFileLogSink
+*/
+
+/*!
+    Destroys the sink. The writer thread calls flush() first.
+*/
+XHLogSink::~XHLogSink()
+{
+}
+
+/*!
+    \fn void XHLogSink::write(const XHLogEntry &entry)
+
+    Writes \a entry. Implement this to send messages elsewhere.
+*/
+
+/*!
+    Called by the writer thread whenever the log buffer runs empty,
+    every half second while it stays empty, and before the sink is
+    destroyed. The default implementation does nothing.
+*/
+void XHLogSink::flush()
+{
+}
+
+XHServiceLog::XHServiceLog(const std::string &serviceName)
+	: name(serviceName), mask(0), requestedCapacity(DefaultLogCapacity),
+	policy(XHServiceBase::DropOnOverflow), enqueuePos(0), dequeuePos(0), completedPos(0),
+	droppedCount(0), writtenCount(0), started(false), stopping(false),
+	writerSleeping(false), waiters(0), sink(0), replacement(0), sinkChanged(false), nextSummary(0)
+{
+}
+
+XHServiceLog::~XHServiceLog()
+{
+	shutdown();
+	delete replacement;
+}
+
+/*
+   The writer thread owns the sink, so a new one is handed over through
+   'replacement' and adopted between two batches.
+*/
+void XHServiceLog::setSink(XHLogSink *newSink)
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	delete replacement;
+	replacement = newSink;
+	sinkChanged.store(true);
+	writerWake.notify_one();
+}
+
+void XHServiceLog::adoptSink()
+{
+	XHLogSink *next;
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		next = replacement;
+		replacement = 0;
+		sinkChanged.store(false);
+	}
+	if (sink)
+		sink->flush();
+	delete sink;
+	sink = next ? next : xhCreateSystemLogSink(name);
+}
+
+void XHServiceLog::setCapacity(int records)
+{
+	// The ring is allocated once, when the first record arrives.
+	if (!started.load() && records > 0)
+		requestedCapacity = records;
+}
+
+int XHServiceLog::capacity() const
+{
+	return started.load() ? (int)ring.size() : requestedCapacity;
+}
+
+void XHServiceLog::setOverflowPolicy(int p)
+{
+	policy.store(p);
+}
+
+int XHServiceLog::overflowPolicy() const
+{
+	return policy.load();
+}
+
+bool XHServiceLog::ensureStarted()
+{
+	std::call_once(startOnce, [this]() {
+		size_t size = 2;
+		while (size < (size_t)requestedCapacity)
+			size <<= 1;
+		std::vector<XHLogRecord> cells(size);
+		ring.swap(cells);
+		for (size_t i = 0; i < size; ++i) {
+			ring[i].sequence.store(i, std::memory_order_relaxed);
+			ring[i].message.reserve(PreallocatedMessageSize);
+		}
+		mask = size - 1;
+		adoptSink();
+		writer = std::thread(&XHServiceLog::writerLoop, this);
+		started.store(true);
+	});
+	return !stopping.load();
+}
+
+bool XHServiceLog::post(int type, const std::string &message, int id, uint16_t category,
+	const std::string &data)
+{
+	if (!ensureStarted())
+		return false;
+
+	XHLogRecord *cell;
+	size_t pos = enqueuePos.load(std::memory_order_relaxed);
+	for (;;) {
+		cell = &ring[pos & mask];
+		size_t seq = cell->sequence.load(std::memory_order_acquire);
+		intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+		if (diff == 0) {
+			if (enqueuePos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+				break;
+		} else if (diff < 0) {
+			// Full.
+			if (policy.load(std::memory_order_relaxed) == XHServiceBase::DropOnOverflow
+				|| stopping.load()) {
+				droppedCount.fetch_add(1, std::memory_order_relaxed);
+				return false;
+			}
+			wakeWriter();
+			std::unique_lock<std::mutex> lock(mutex);
+			waiters.fetch_add(1);
+			progress.wait_for(lock, std::chrono::milliseconds(10));
+			waiters.fetch_sub(1);
+			pos = enqueuePos.load(std::memory_order_relaxed);
+		} else {
+			pos = enqueuePos.load(std::memory_order_relaxed);
+		}
+	}
+
+	cell->time = wallClockUs();
+	cell->type = type;
+	cell->id = id;
+	cell->category = category;
+	cell->message.assign(message);
+	cell->data.assign(data);
+	cell->sequence.store(pos + 1, std::memory_order_release);
+
+	std::atomic_thread_fence(std::memory_order_seq_cst);
+	if (writerSleeping.load(std::memory_order_relaxed))
+		wakeWriter();
+	return true;
+}
+
+void XHServiceLog::wakeWriter()
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	writerWake.notify_one();
+}
+
+size_t XHServiceLog::drain(size_t max)
+{
+	size_t n = 0;
+	while (n < max) {
+		XHLogRecord &cell = ring[dequeuePos & mask];
+		size_t seq = cell.sequence.load(std::memory_order_acquire);
+		if (seq != dequeuePos + 1)
+			break;
+		if (sink)
+			sink->write(cell);
+		cell.sequence.store(dequeuePos + mask + 1, std::memory_order_release);
+		++dequeuePos;
+		++n;
+	}
+	if (n) {
+		writtenCount.fetch_add(n, std::memory_order_relaxed);
+		completedPos.store(dequeuePos, std::memory_order_release);
+	}
+	return n;
+}
+
+/*
+   Summaries of suppressed messages go straight to the sink, between
+   batches: they are written by this thread anyway.
+*/
+void XHServiceLog::summarize(bool all)
+{
+	if (!all && !limiter.hasPending())
+		return;
+	int64_t now = XHLogRateLimiter::clockNs();
+	if (!all && now < nextSummary)
+		return;
+	nextSummary = now + (int64_t)SummaryCheckMs * 1000000;
+	writtenCount.fetch_add(limiter.summarize(sink, now, all), std::memory_order_relaxed);
+}
+
+/*
+   Waits a little for the next record before the writer goes to sleep.
+   A writer faster than its producers runs dry after every few records,
+   and without this each of them would then pay for waking it up.
+*/
+bool XHServiceLog::spinForRecord()
+{
+	std::chrono::steady_clock::time_point deadline =
+		std::chrono::steady_clock::now() + std::chrono::microseconds(IdleSpinUs);
+	XHLogRecord &next = ring[dequeuePos & mask];
+	do {
+		if (next.sequence.load(std::memory_order_acquire) == dequeuePos + 1)
+			return true;
+		std::this_thread::yield();
+	} while (!stopping.load(std::memory_order_relaxed) && std::chrono::steady_clock::now() < deadline);
+	return false;
+}
+
+void XHServiceLog::writerLoop()
+{
+	for (;;) {
+		if (sinkChanged.load(std::memory_order_relaxed))
+			adoptSink();
+		summarize(false);
+		size_t n = drain(LogBatchSize);
+		if (n) {
+			if (waiters.load() > 0) {
+				std::lock_guard<std::mutex> lock(mutex);
+				progress.notify_all();
+			}
+			continue;
+		}
+		if (spinForRecord())
+			continue;
+		if (sink)
+			sink->flush();
+		{
+			// Nothing left: tell flush() and sleep until a producer
+			// wakes us. Same handshake as XHServiceEventLoop::wait().
+			std::unique_lock<std::mutex> lock(mutex);
+			progress.notify_all();
+			if (stopping.load())
+				break;
+			writerSleeping.store(true, std::memory_order_relaxed);
+			std::atomic_thread_fence(std::memory_order_seq_cst);
+			XHLogRecord &next = ring[dequeuePos & mask];
+			if (next.sequence.load(std::memory_order_acquire) != dequeuePos + 1 && !sinkChanged.load())
+				writerWake.wait_for(lock, std::chrono::milliseconds(500));
+			writerSleeping.store(false, std::memory_order_relaxed);
+		}
+	}
+	// Records posted by a producer racing with shutdown().
+	while (drain(LogBatchSize))
+		;
+	summarize(true);
+	if (sink)
+		sink->flush();
+}
+
+bool XHServiceLog::flush(int timeoutMs)
+{
+	if (!started.load())
+		return true;
+	size_t target = enqueuePos.load();
+	std::unique_lock<std::mutex> lock(mutex);
+	writerWake.notify_one();
+	std::chrono::steady_clock::time_point deadline =
+		std::chrono::steady_clock::now() + std::chrono::milliseconds(timeoutMs < 0 ? 0 : timeoutMs);
+	bool done = true;
+	waiters.fetch_add(1);
+	while (completedPos.load(std::memory_order_acquire) < target) {
+		if (!writer.joinable()) {
+			done = false;
+			break;
+		}
+		if (timeoutMs < 0) {
+			progress.wait(lock);
+		} else if (progress.wait_until(lock, deadline) == std::cv_status::timeout) {
+			done = completedPos.load(std::memory_order_acquire) >= target;
+			break;
+		}
+	}
+	waiters.fetch_sub(1);
+	return done;
+}
+
+void XHServiceLog::shutdown()
+{
+	if (!started.load() || stopping.exchange(true))
+		return;
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		writerWake.notify_one();
+	}
+	writer.join();
+	delete sink;
+	sink = 0;
+}
@@ -0,0 +1,69 @@
+/****************************************************************************
+**
+**
+****************************************************************************/
+
+#ifndef XHSERVICE_LOG_H
+#define XHSERVICE_LOG_H
+
+#include "xhservice_global.h"
+#include <string>
+#include <stdint.h>
+
+struct XHSERVICE_EXPORT XHLogEntry
+{
+	XHLogEntry() : time(0), type(0), id(0), category(0) {}
+
+	int64_t time;	// microseconds since the epoch, taken by logMessage()
+	int type;	// XHServiceBase::MessageType
+	int id;
+	uint16_t category;
+	std::string message;
+	std::string data;
+};
+
+class XHSERVICE_EXPORT XHLogSink
+{
+public:
+	virtual ~XHLogSink();
+
+	virtual void write(const XHLogEntry &entry) = 0;
+	virtual void flush();
+};
+
+class XHFileLogSinkPrivate;
+
+class XHSERVICE_EXPORT XHFileLogSink : public XHLogSink
+{
+public:
+	explicit XHFileLogSink(const std::string &fileName);
+	~XHFileLogSink();
+
+	std::string fileName() const;
+
+	int64_t maxSegmentSize() const;
+	void setMaxSegmentSize(int64_t bytes);
+	int rotationInterval() const;
+	void setRotationInterval(int seconds);
+	int maxArchivedSegments() const;
+	void setMaxArchivedSegments(int count);
+	bool compression() const;
+	void setCompression(bool enabled);
+
+	void rotate();
+
+	uint64_t bytesWritten() const;
+	uint64_t segmentsRotated() const;
+	uint64_t droppedEntries() const;
+
+	void write(const XHLogEntry &entry);
+	void flush();
+
+private:
+	XHFileLogSink(const XHFileLogSink &);
+	XHFileLogSink &operator=(const XHFileLogSink &);
+
+	XHFileLogSinkPrivate *d_ptr;
+};
+
+#endif // XHSERVICE_LOG_H
@@ -0,0 +1,154 @@
+/****************************************************************************
+**
+**
+****************************************************************************/
+
+#ifndef XHSERVICE_LOG_P_H
+#define XHSERVICE_LOG_P_H
+
+#include "xhservice_log.h"
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include <stdint.h>
+
+struct XHLogRecord : XHLogEntry
+{
+	std::atomic<size_t> sequence;
+};
+
+/*
+   The platform sink (the Windows event log, syslog on Unix) keeps its
+   handle open for its lifetime. Like every sink it is only ever called
+   from the writer thread.
+*/
+XHLogSink *xhCreateSystemLogSink(const std::string &serviceName);
+
+/*
+   Per-message-kind token buckets in front of the log. A kind is the
+   (id, category) pair, or the text when both are 0. Each bucket runs
+   the generic cell rate algorithm: one atomic "theoretical arrival
+   time" replaces the token count and the refill, so admit() is a
+   clock read, a probe of an open-addressed table and one
+   compare-and-swap, without locks or allocation. Kinds beyond the
+   table's capacity are never limited.
+
+   Suppressed messages are counted per bucket; the log writer thread
+   turns the counts into summary records with summarize().
+*/
+class XHLogRateLimiter
+{
+public:
+	XHLogRateLimiter();
+	~XHLogRateLimiter();
+
+	void setLimit(int perSecond, int burst);
+	int limit() const { return perSecond.load(std::memory_order_relaxed); }
+	int burst() const { return burstSize.load(std::memory_order_relaxed); }
+
+	bool admit(int type, const std::string &message, int id, uint16_t category)
+	{
+		return interval.load(std::memory_order_acquire) == 0 || check(type, message, id, category);
+	}
+
+	bool hasPending() const { return pending.load(std::memory_order_relaxed); }
+	// Writes the summaries that are due, or all of them, to sink and
+	// returns how many it wrote. Writer thread only.
+	int summarize(XHLogSink *sink, int64_t nowNs, bool all);
+	uint64_t suppressed() const;
+
+	static int64_t clockNs();
+
+private:
+	XHLogRateLimiter(const XHLogRateLimiter &);
+	XHLogRateLimiter &operator=(const XHLogRateLimiter &);
+
+	struct Bucket;
+
+	bool check(int type, const std::string &message, int id, uint16_t category);
+
+	std::atomic<int64_t> interval;	// ns between messages, 0 when off
+	std::atomic<int> perSecond;
+	std::atomic<int> burstSize;
+	std::atomic<Bucket *> table;
+	std::atomic<bool> pending;
+	std::atomic<uint64_t> summarized;
+	std::mutex setupMutex;
+};
+
+/*
+   Asynchronous logMessage() pipeline. Callers copy their record into a
+   preallocated bounded ring (Vyukov's MPMC queue, used here with a
+   single consumer) and return; a writer thread started on first use
+   drains it in batches into the sink.
+*/
+class XHServiceLog
+{
+public:
+	explicit XHServiceLog(const std::string &serviceName);
+	~XHServiceLog();
+
+	void setCapacity(int records);
+	int capacity() const;
+	void setOverflowPolicy(int policy);
+	int overflowPolicy() const;
+
+	bool admit(int type, const std::string &message, int id, uint16_t category)
+	{
+		return limiter.admit(type, message, id, category);
+	}
+	bool post(int type, const std::string &message, int id, uint16_t category,
+		const std::string &data);
+	bool flush(int timeoutMs);
+	void shutdown();
+	void setSink(XHLogSink *sink);
+
+	uint64_t dropped() const { return droppedCount.load(std::memory_order_relaxed); }
+	uint64_t written() const { return writtenCount.load(std::memory_order_relaxed); }
+
+	XHLogRateLimiter limiter;
+
+private:
+	XHServiceLog(const XHServiceLog &);
+	XHServiceLog &operator=(const XHServiceLog &);
+
+	bool ensureStarted();
+	void writerLoop();
+	size_t drain(size_t max);
+	bool spinForRecord();
+	void summarize(bool all);
+	void adoptSink();
+	void wakeWriter();
+
+	std::string name;
+	std::vector<XHLogRecord> ring;
+	size_t mask;
+	int requestedCapacity;
+	std::atomic<int> policy;
+
+	std::atomic<size_t> enqueuePos;
+	size_t dequeuePos;
+	std::atomic<size_t> completedPos;
+
+	std::atomic<uint64_t> droppedCount;
+	std::atomic<uint64_t> writtenCount;
+
+	std::once_flag startOnce;
+	std::atomic<bool> started;
+	std::atomic<bool> stopping;
+	std::atomic<bool> writerSleeping;
+	std::atomic<int> waiters;
+	std::mutex mutex;
+	std::condition_variable writerWake;
+	std::condition_variable progress;
+	std::thread writer;
+	XHLogSink *sink;
+	XHLogSink *replacement;	// under mutex
+	std::atomic<bool> sinkChanged;
+	int64_t nextSummary;	// writer thread only
+};
+
+#endif // XHSERVICE_LOG_P_H
@@ -0,0 +1,645 @@
+/****************************************************************************
+**
+**
+****************************************************************************/
+
+#include "xhservice_metrics.h"
+#include <atomic>
+#include <map>
+#include <mutex>
+#include <stdio.h>
+#include <string.h>
+#if defined(_MSC_VER)
+#  include <intrin.h>
+#endif
+
+enum
+{
+	MaxMetrics = 256,
+	// Slots of a shard: one per counter, buckets + count + sum per histogram.
+	MaxSlots = 4096,
+	HistogramSlots = XHHistogram::BucketCount + 2
+};
+
+/*
+   The counter and histogram slots written by one thread. Only the
+   owning thread writes a shard, so an update is a relaxed load and
+   store on a cache line no other thread writes to; readers add up the
+   shards. A shard outlives its thread and goes to the next thread that
+   needs one, values included, so totals never go backwards.
+*/
+struct XHMetricShard
+{
+	XHMetricShard()
+	{
+		for (int i = 0; i < MaxSlots; ++i)
+			slots[i].store(0, std::memory_order_relaxed);
+	}
+
+	void add(int slot, int64_t delta)
+	{
+		slots[slot].store(slots[slot].load(std::memory_order_relaxed) + delta,
+			std::memory_order_relaxed);
+	}
+
+	std::atomic<int64_t> slots[MaxSlots];
+};
+
+struct XHMetric
+{
+	XHMetric() : type(XHMetricSample::Counter), slot(-1), gauge(0) {}
+
+	std::string name;
+	std::string help;
+	XHMetricSample::Type type;
+	int slot;	// first shard slot, -1 for gauges
+	std::atomic<int64_t> gauge;
+};
+
+class XHMetricsRegistryPrivate
+{
+public:
+	XHMetricsRegistryPrivate();
+	~XHMetricsRegistryPrivate();
+
+	int add(const std::string &name, const std::string &help, XHMetricSample::Type type);
+	XHMetricShard *shard();
+	XHMetricShard *attach();
+	void release(XHMetricShard *shard);
+
+	uint64_t id;
+	XHMetric *metrics;
+	int metricCount;
+	int slotCount;
+	std::map<std::string, int> index;
+	std::vector<XHMetricShard *> shards;
+	std::vector<XHMetricShard *> freeShards;
+	mutable std::mutex mutex;
+};
+
+// Registries by id, for threads returning their shards on exit. Never
+// destroyed: threads may exit after static destructors ran.
+static std::mutex &registriesMutex()
+{
+	static std::mutex *mutex = new std::mutex;
+	return *mutex;
+}
+
+static std::map<uint64_t, XHMetricsRegistryPrivate *> &registries()
+{
+	static std::map<uint64_t, XHMetricsRegistryPrivate *> *map =
+		new std::map<uint64_t, XHMetricsRegistryPrivate *>;
+	return *map;
+}
+
+struct XHMetricsThreadCache
+{
+	struct Entry
+	{
+		uint64_t registry;
+		XHMetricShard *shard;
+	};
+
+	~XHMetricsThreadCache()
+	{
+		std::lock_guard<std::mutex> lock(registriesMutex());
+		for (size_t i = 0; i < entries.size(); ++i) {
+			std::map<uint64_t, XHMetricsRegistryPrivate *>::iterator it =
+				registries().find(entries[i].registry);
+			if (it != registries().end())
+				it->second->release(entries[i].shard);
+		}
+	}
+
+	std::vector<Entry> entries;
+};
+
+static thread_local XHMetricsThreadCache threadCache;
+
+XHMetricsRegistryPrivate::XHMetricsRegistryPrivate()
+	: metrics(new XHMetric[MaxMetrics]), metricCount(0), slotCount(0)
+{
+	// Ids are never reused, so a thread's cache entry for a destroyed
+	// registry can't match a new one.
+	static std::atomic<uint64_t> lastId(0);
+	id = ++lastId;
+	std::lock_guard<std::mutex> lock(registriesMutex());
+	registries()[id] = this;
+}
+
+XHMetricsRegistryPrivate::~XHMetricsRegistryPrivate()
+{
+	{
+		std::lock_guard<std::mutex> lock(registriesMutex());
+		registries().erase(id);
+	}
+	for (size_t i = 0; i < shards.size(); ++i)
+		delete shards[i];
+	delete [] metrics;
+}
+
+int XHMetricsRegistryPrivate::add(const std::string &name, const std::string &help,
+	XHMetricSample::Type type)
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	std::map<std::string, int>::iterator it = index.find(name);
+	if (it != index.end())
+		return metrics[it->second].type == type ? it->second : -1;
+	int slots = type == XHMetricSample::Counter ? 1 : type == XHMetricSample::Histogram ? HistogramSlots : 0;
+	if (metricCount == MaxMetrics || slotCount + slots > MaxSlots)
+		return -1;
+	XHMetric &metric = metrics[metricCount];
+	metric.name = name;
+	metric.help = help;
+	metric.type = type;
+	metric.slot = slots ? slotCount : -1;
+	slotCount += slots;
+	index[name] = metricCount;
+	return metricCount++;
+}
+
+XHMetricShard *XHMetricsRegistryPrivate::shard()
+{
+	std::vector<XHMetricsThreadCache::Entry> &entries = threadCache.entries;
+	for (size_t i = 0; i < entries.size(); ++i) {
+		if (entries[i].registry == id)
+			return entries[i].shard;
+	}
+	return attach();
+}
+
+XHMetricShard *XHMetricsRegistryPrivate::attach()
+{
+	XHMetricShard *shard;
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		if (!freeShards.empty()) {
+			shard = freeShards.back();
+			freeShards.pop_back();
+		} else {
+			shard = new XHMetricShard;
+			shards.push_back(shard);
+		}
+	}
+	XHMetricsThreadCache::Entry entry = { id, shard };
+	threadCache.entries.push_back(entry);
+	return shard;
+}
+
+void XHMetricsRegistryPrivate::release(XHMetricShard *shard)
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	freeShards.push_back(shard);
+}
+
+/*!
+    \class XHCounter
+
+    \brief The XHCounter class is a handle to a monotonic counter of an
+    XHMetricsRegistry.
+
+    Handles are cheap to copy and stay valid as long as the registry.
+    A default-constructed handle, or one the registry couldn't create,
+    ignores updates.
+*/
+
+/*!
+    Adds \a delta to the counter.
+*/
+void XHCounter::add(int64_t delta) const
+{
+	if (registry)
+		registry->shard()->add(slot, delta);
+}
+
+/*!
+    \class XHGauge
+
+    \brief The XHGauge class is a handle to a gauge of an
+    XHMetricsRegistry, a value that goes up and down.
+
+    Unlike counters gauges aren't kept per thread: a gauge is usually
+    set by one thread, and set() has to replace the value seen by all.
+*/
+
+/*!
+    Sets the gauge to \a value.
+*/
+void XHGauge::set(int64_t value) const
+{
+	if (registry)
+		registry->metrics[index].gauge.store(value, std::memory_order_relaxed);
+}
+
+/*!
+    Adds \a delta to the gauge.
+*/
+void XHGauge::add(int64_t delta) const
+{
+	if (registry)
+		registry->metrics[index].gauge.fetch_add(delta, std::memory_order_relaxed);
+}
+
+/*!
+    \class XHHistogram
+
+    \brief The XHHistogram class is a handle to a histogram of an
+    XHMetricsRegistry.
+
+    Values are counted in logarithmic buckets: bucket 0 holds values up
+    to 1, bucket \e n values greater than 2^(n-1) and up to 2^\e n. That
+    keeps recording to three uncontended stores whatever the range of
+    the values, at the price of a precision of a factor of two. Record
+    latencies in the unit that matters, such as microseconds.
+*/
+
+/*!
+    Records \a value.
+*/
+void XHHistogram::record(int64_t value) const
+{
+	if (!registry)
+		return;
+	XHMetricShard *shard = registry->shard();
+	shard->add(slot + bucketOf(value), 1);
+	shard->add(slot + BucketCount, 1);
+	shard->add(slot + BucketCount + 1, value);
+}
+
+/*!
+    Returns the bucket \a value is counted in.
+*/
+int XHHistogram::bucketOf(int64_t value)
+{
+	if (value <= 1)
+		return 0;
+	uint64_t v = (uint64_t)(value - 1);
+#if defined(_MSC_VER)
+	unsigned long bit;
+	_BitScanReverse64(&bit, v);
+	int bucket = (int)bit + 1;
+#else
+	int bucket = 64 - __builtin_clzll(v);
+#endif
+	return bucket < BucketCount ? bucket : BucketCount - 1;
+}
+
+/*!
+    Returns the largest value counted in \a bucket.
+*/
+int64_t XHHistogram::bucketBound(int bucket)
+{
+	if (bucket >= BucketCount - 1)
+		return INT64_MAX;
+	return (int64_t)1 << bucket;
+}
+
+/*!
+    \class XHMetricSample
+
+    \brief The XHMetricSample struct holds the value of one metric, as
+    returned by XHMetricsRegistry::snapshot() and
+    XHServiceController::metrics().
+
+    Counters and gauges have their value in \c value. Histograms have
+    the number of recorded values in \c count, their sum in \c sum and
+    the count of each bucket (see XHHistogram) in \c buckets, up to the
+    last one that isn't empty.
+*/
+
+/*!
+    Returns the upper bound of the bucket holding the \a fraction
+    quantile of a histogram (0.99 for the 99th percentile), or 0 if
+    nothing was recorded.
+*/
+int64_t XHMetricSample::percentile(double fraction) const
+{
+	if (count <= 0)
+		return 0;
+	int64_t rank = (int64_t)(fraction * count + 0.5);
+	if (rank < 1)
+		rank = 1;
+	int64_t seen = 0;
+	for (size_t i = 0; i < buckets.size(); ++i) {
+		seen += buckets[i];
+		if (seen >= rank)
+			return XHHistogram::bucketBound((int)i);
+	}
+	return buckets.empty() ? 0 : XHHistogram::bucketBound((int)buckets.size() - 1);
+}
+
+/*!
+    \class XHMetricsRegistry
+
+    \brief The XHMetricsRegistry class holds the counters, gauges and
+    histograms a service exposes to its controllers.
+
+    Metrics are registered once by name and updated through the
+    returned handles from any thread. Counters and histograms are kept
+    per thread, so an update never contends with another thread:
+    logging a message from eight threads costs the same as from one.
+    snapshot() adds the threads' values up on demand.
+
+    Every service has a registry, XHServiceBase::metrics(), that
+    controllers pull with XHServiceController::metrics() or, as
+    Prometheus text exposition, XHServiceController::metricsReport().
+    It comes with these metrics:
+
+    \table
+    \header \li Name \li Type \li Description
+    \row \li xhservice_commands_total \li counter
+         \li Commands handled by processCommand().
+    \row \li xhservice_control_latency_us \li histogram
+         \li Time from a control request (stop, pause, resume,
+             command) reaching the service to the end of its callback.
+    \row \li xhservice_log_messages_total \li counter
+         \li Messages passed to logMessage().
+    \row \li xhservice_log_bytes_total \li counter
+         \li Bytes of message text passed to logMessage().
+    \row \li xhservice_log_dropped_total \li counter
+         \li Messages dropped because the log buffer was full.
+    \endtable
+
+    \code
+    MyService::MyService(int argc, char **argv)
+        : XHServiceBase(argc, argv, "modbus-gateway")
+    {
+        requests = metrics().counter("modbus_requests_total", "Requests served");
+        latency = metrics().histogram("modbus_latency_us", "Request latency");
+    }
+    \endcode
+
+    Names should follow the Prometheus conventions: letters, digits and
+    underscores, a unit suffix and \c _total for counters. A registry
+    holds up to 256 metrics.
+*/
+
+/*!
+    Creates an empty registry.
+*/
+XHMetricsRegistry::XHMetricsRegistry()
+	: d_ptr(new XHMetricsRegistryPrivate)
+{
+}
+
+/*!
+    Destroys the registry. Handles to its metrics must not be used
+    anymore.
+*/
+XHMetricsRegistry::~XHMetricsRegistry()
+{
+	delete d_ptr;
+}
+
+/*!
+    Returns the counter called \a name, registering it with the
+    description \a help if needed. Returns an invalid handle if \a name
+    is registered as another type or the registry is full.
+*/
+XHCounter XHMetricsRegistry::counter(const std::string &name, const std::string &help)
+{
+	int i = d_ptr->add(name, help, XHMetricSample::Counter);
+	return i < 0 ? XHCounter() : XHCounter(d_ptr, d_ptr->metrics[i].slot);
+}
+
+/*!
+    Returns the gauge called \a name, registering it with the
+    description \a help if needed.
+*/
+XHGauge XHMetricsRegistry::gauge(const std::string &name, const std::string &help)
+{
+	int i = d_ptr->add(name, help, XHMetricSample::Gauge);
+	return i < 0 ? XHGauge() : XHGauge(d_ptr, i);
+}
+
+/*!
+    Returns the histogram called \a name, registering it with the
+    description \a help if needed.
+*/
+XHHistogram XHMetricsRegistry::histogram(const std::string &name, const std::string &help)
+{
+	int i = d_ptr->add(name, help, XHMetricSample::Histogram);
+	return i < 0 ? XHHistogram() : XHHistogram(d_ptr, d_ptr->metrics[i].slot);
+}
+
+/*!
+    Returns the current value of every metric, in the order they were
+    registered. The threads' values are read one after the other, so a
+    histogram's count may be a little ahead of or behind its buckets
+    while it's being updated.
+*/
+std::vector<XHMetricSample> XHMetricsRegistry::snapshot() const
+{
+	std::lock_guard<std::mutex> lock(d_ptr->mutex);
+	std::vector<XHMetricSample> samples(d_ptr->metricCount);
+	std::vector<int64_t> totals(d_ptr->slotCount, 0);
+	for (size_t s = 0; s < d_ptr->shards.size(); ++s) {
+		const XHMetricShard *shard = d_ptr->shards[s];
+		for (int i = 0; i < d_ptr->slotCount; ++i)
+			totals[i] += shard->slots[i].load(std::memory_order_relaxed);
+	}
+	for (int m = 0; m < d_ptr->metricCount; ++m) {
+		const XHMetric &metric = d_ptr->metrics[m];
+		XHMetricSample &sample = samples[m];
+		sample.name = metric.name;
+		sample.help = metric.help;
+		sample.type = metric.type;
+		if (metric.type == XHMetricSample::Gauge) {
+			sample.value = metric.gauge.load(std::memory_order_relaxed);
+		} else if (metric.type == XHMetricSample::Counter) {
+			sample.value = totals[metric.slot];
+		} else {
+			int used = 0;
+			for (int b = 0; b < XHHistogram::BucketCount; ++b) {
+				if (totals[metric.slot + b])
+					used = b + 1;
+			}
+			sample.buckets.assign(totals.begin() + metric.slot, totals.begin() + metric.slot + used);
+			sample.count = totals[metric.slot + XHHistogram::BucketCount];
+			sample.sum = totals[metric.slot + XHHistogram::BucketCount + 1];
+		}
+	}
+	return samples;
+}
+
+/*!
+    Returns snapshot() encoded in \a format.
+*/
+std::string XHMetricsRegistry::report(Format format) const
+{
+	return encode(snapshot(), format);
+}
+
+static void appendVarint(std::string *out, uint64_t value)
+{
+	while (value >= 0x80) {
+		out->push_back((char)(value | 0x80));
+		value >>= 7;
+	}
+	out->push_back((char)value);
+}
+
+static void appendSigned(std::string *out, int64_t value)
+{
+	appendVarint(out, ((uint64_t)value << 1) ^ (uint64_t)(value >> 63));
+}
+
+static void appendString(std::string *out, const std::string &s)
+{
+	appendVarint(out, s.size());
+	out->append(s);
+}
+
+static bool readVarint(const std::string &in, size_t *pos, uint64_t *value)
+{
+	*value = 0;
+	for (int shift = 0; shift < 64; shift += 7) {
+		if (*pos >= in.size())
+			return false;
+		uint8_t byte = (uint8_t)in[(*pos)++];
+		*value |= (uint64_t)(byte & 0x7f) << shift;
+		if (!(byte & 0x80))
+			return true;
+	}
+	return false;
+}
+
+static bool readSigned(const std::string &in, size_t *pos, int64_t *value)
+{
+	uint64_t v;
+	if (!readVarint(in, pos, &v))
+		return false;
+	*value = (int64_t)(v >> 1) ^ -(int64_t)(v & 1);
+	return true;
+}
+
+static bool readString(const std::string &in, size_t *pos, std::string *s)
+{
+	uint64_t size;
+	if (!readVarint(in, pos, &size) || size > in.size() - *pos)
+		return false;
+	s->assign(in, *pos, (size_t)size);
+	*pos += (size_t)size;
+	return true;
+}
+
+static std::string escapeHelp(const std::string &help)
+{
+	std::string escaped;
+	for (size_t i = 0; i < help.size(); ++i) {
+		if (help[i] == '\\')
+			escaped += "\\\\";
+		else if (help[i] == '\n')
+			escaped += "\\n";
+		else
+			escaped += help[i];
+	}
+	return escaped;
+}
+
+static const char binaryMagic[4] = { 'X', 'H', 'M', '1' };
+
+/*!
+    Encodes \a samples in \a format: as Prometheus text exposition
+    (version 0.0.4), or as a compact binary snapshot that decode()
+    reads back.
+*/
+std::string XHMetricsRegistry::encode(const std::vector<XHMetricSample> &samples, Format format)
+{
+	std::string out;
+	if (format == BinarySnapshot) {
+		out.append(binaryMagic, sizeof(binaryMagic));
+		appendVarint(&out, samples.size());
+		for (size_t i = 0; i < samples.size(); ++i) {
+			const XHMetricSample &sample = samples[i];
+			out.push_back((char)sample.type);
+			appendString(&out, sample.name);
+			appendString(&out, sample.help);
+			if (sample.type != XHMetricSample::Histogram) {
+				appendSigned(&out, sample.value);
+				continue;
+			}
+			appendVarint(&out, sample.count);
+			appendSigned(&out, sample.sum);
+			appendVarint(&out, sample.buckets.size());
+			for (size_t b = 0; b < sample.buckets.size(); ++b)
+				appendVarint(&out, sample.buckets[b]);
+		}
+		return out;
+	}
+
+	static const char *const types[] = { "counter", "gauge", "histogram" };
+	char line[256];
+	for (size_t i = 0; i < samples.size(); ++i) {
+		const XHMetricSample &sample = samples[i];
+		const char *name = sample.name.c_str();
+		if (!sample.help.empty())
+			out += "# HELP " + sample.name + " " + escapeHelp(sample.help) + "\n";
+		out += "# TYPE " + sample.name + " " + types[sample.type] + "\n";
+		if (sample.type != XHMetricSample::Histogram) {
+			::snprintf(line, sizeof(line), " %lld\n", (long long)sample.value);
+			out += sample.name + line;
+			continue;
+		}
+		int64_t cumulative = 0;
+		for (size_t b = 0; b < sample.buckets.size(); ++b) {
+			cumulative += sample.buckets[b];
+			::snprintf(line, sizeof(line), "_bucket{le=\"%lld\"} %lld\n",
+				(long long)XHHistogram::bucketBound((int)b), (long long)cumulative);
+			out += name;
+			out += line;
+		}
+		::snprintf(line, sizeof(line), "_bucket{le=\"+Inf\"} %lld\n", (long long)sample.count);
+		out += name;
+		out += line;
+		::snprintf(line, sizeof(line), "_sum %lld\n", (long long)sample.sum);
+		out += name;
+		out += line;
+		::snprintf(line, sizeof(line), "_count %lld\n", (long long)sample.count);
+		out += name;
+		out += line;
+	}
+	return out;
+}
+
+/*!
+    Decodes a binary snapshot made by encode() into \a samples. Returns
+    false if \a data isn't a valid snapshot.
+*/
+bool XHMetricsRegistry::decode(const std::string &data, std::vector<XHMetricSample> *samples)
+{
+	samples->clear();
+	if (data.size() < sizeof(binaryMagic) || ::memcmp(data.data(), binaryMagic, sizeof(binaryMagic)))
+		return false;
+	size_t pos = sizeof(binaryMagic);
+	uint64_t n;
+	if (!readVarint(data, &pos, &n) || n > data.size())
+		return false;
+	for (uint64_t i = 0; i < n; ++i) {
+		XHMetricSample sample;
+		if (pos >= data.size() || (uint8_t)data[pos] > XHMetricSample::Histogram)
+			return false;
+		sample.type = (XHMetricSample::Type)data[pos++];
+		if (!readString(data, &pos, &sample.name) || !readString(data, &pos, &sample.help))
+			return false;
+		if (sample.type != XHMetricSample::Histogram) {
+			if (!readSigned(data, &pos, &sample.value))
+				return false;
+		} else {
+			uint64_t count, buckets;
+			if (!readVarint(data, &pos, &count) || !readSigned(data, &pos, &sample.sum)
+				|| !readVarint(data, &pos, &buckets) || buckets > XHHistogram::BucketCount)
+				return false;
+			sample.count = (int64_t)count;
+			sample.buckets.resize((size_t)buckets);
+			for (size_t b = 0; b < sample.buckets.size(); ++b) {
+				uint64_t value;
+				if (!readVarint(data, &pos, &value))
+					return false;
+				sample.buckets[b] = (int64_t)value;
+			}
+		}
+		samples->push_back(sample);
+	}
+	return pos == data.size();
+}
@@ -0,0 +1,120 @@
+/****************************************************************************
+**
+**
+****************************************************************************/
+
+#ifndef XHSERVICE_METRICS_H
+#define XHSERVICE_METRICS_H
+
+#include "xhservice_global.h"
+#include <string>
+#include <vector>
+#include <stdint.h>
+
+class XHMetricsRegistryPrivate;
+
+class XHSERVICE_EXPORT XHCounter
+{
+public:
+	XHCounter() : registry(0), slot(-1) {}
+
+	void add(int64_t delta = 1) const;
+	bool isValid() const { return registry != 0; }
+
+private:
+	friend class XHMetricsRegistry;
+	XHCounter(XHMetricsRegistryPrivate *r, int s) : registry(r), slot(s) {}
+
+	XHMetricsRegistryPrivate *registry;
+	int slot;
+};
+
+class XHSERVICE_EXPORT XHGauge
+{
+public:
+	XHGauge() : registry(0), index(-1) {}
+
+	void set(int64_t value) const;
+	void add(int64_t delta) const;
+	bool isValid() const { return registry != 0; }
+
+private:
+	friend class XHMetricsRegistry;
+	XHGauge(XHMetricsRegistryPrivate *r, int i) : registry(r), index(i) {}
+
+	XHMetricsRegistryPrivate *registry;
+	int index;
+};
+
+class XHSERVICE_EXPORT XHHistogram
+{
+public:
+	enum
+	{
+		BucketCount = 64
+	};
+
+	XHHistogram() : registry(0), slot(-1) {}
+
+	void record(int64_t value) const;
+	bool isValid() const { return registry != 0; }
+
+	static int bucketOf(int64_t value);
+	static int64_t bucketBound(int bucket);
+
+private:
+	friend class XHMetricsRegistry;
+	XHHistogram(XHMetricsRegistryPrivate *r, int s) : registry(r), slot(s) {}
+
+	XHMetricsRegistryPrivate *registry;
+	int slot;
+};
+
+struct XHSERVICE_EXPORT XHMetricSample
+{
+	enum Type
+	{
+		Counter = 0, Gauge, Histogram
+	};
+	XHMetricSample() : type(Counter), value(0), count(0), sum(0) {}
+
+	int64_t percentile(double fraction) const;
+
+	std::string name;
+	std::string help;
+	Type type;
+	int64_t value;
+	int64_t count;
+	int64_t sum;
+	std::vector<int64_t> buckets;
+};
+
+class XHSERVICE_EXPORT XHMetricsRegistry
+{
+public:
+	enum Format
+	{
+		PrometheusText = 0, BinarySnapshot
+	};
+
+	XHMetricsRegistry();
+	virtual ~XHMetricsRegistry();
+
+	XHCounter counter(const std::string &name, const std::string &help = std::string());
+	XHGauge gauge(const std::string &name, const std::string &help = std::string());
+	XHHistogram histogram(const std::string &name, const std::string &help = std::string());
+
+	std::vector<XHMetricSample> snapshot() const;
+	std::string report(Format format) const;
+
+	static std::string encode(const std::vector<XHMetricSample> &samples, Format format);
+	static bool decode(const std::string &data, std::vector<XHMetricSample> *samples);
+
+private:
+	XHMetricsRegistry(const XHMetricsRegistry &);
+	XHMetricsRegistry &operator=(const XHMetricsRegistry &);
+
+	XHMetricsRegistryPrivate *d_ptr;
+};
+
+#endif // XHSERVICE_METRICS_H
@@ -7,15 +7,59 @@
 #ifndef XHSERVICE_P_H
 #define XHSERVICE_P_H
 
+#include <deque>
+#include <map>
+#include <mutex>
 #include <string>
 #include <vector>
 #include "xhservice.h"
+#include "xhservice_drain_p.h"
+#include "xhservice_eventloop_p.h"
+#include "xhservice_log_p.h"
+#include "xhservice_startup_p.h"
+#include "xhservice_status_p.h"
+
+// Service states as reported to controllers. The values match the
+// Win32 SERVICE_* states so the Windows backend can pass them through.
+enum XHServiceState
+{
+	XHServiceStopped = 1,
+	XHServiceStartPending,
+	XHServiceStopPending,
+	XHServiceRunning,
+	XHServiceContinuePending,
+	XHServicePausePending,
+	XHServicePaused
+};
 
 class XHServiceControllerPrivate
 {
 public:
+    XHServiceControllerPrivate()
+        : callSlab(-1), callSlabData(0), callSlabSize(0), channel(0), subscription(0) {}
+    ~XHServiceControllerPrivate() { sysUnsubscribe(); sysCloseChannel(); sysReleaseSlab(); }
+
 	std::string serviceName;
     XHServiceController *q_ptr;
+    XHStatusReader statusReader;
+    std::mutex cacheMutex;
+    XHServiceStatus cachedStatus;
+    std::mutex callMutex;
+    int callSlab;	// shared memory for call() payloads, Unix only
+    void *callSlabData;
+    size_t callSlabSize;
+    std::once_flag channelOnce;
+    class XHControlChannel *channel;	// Unix: connection of the asynchronous calls
+    class XHStateSubscription *subscription;
+
+    bool readStatus(XHStatusSnapshot *snapshot);
+    int stopTimeout();
+    void queryStatus(XHServiceStatus *status);
+    bool sysReserveSlab(size_t size);
+    void sysReleaseSlab();
+    void sysCloseChannel();
+    bool sysSubscribe(const std::function<void(const XHServiceStateChange &)> &handler);
+    void sysUnsubscribe();
 };
 
 class XHServiceBasePrivate
@@ -29,13 +73,66 @@ public:
 	std::string serviceDescription;
     XHServiceController::StartupType startupType;
 	int serviceFlags;
+	int exitCode;
 	std::vector<std::string> args;
 
     static class XHServiceBase *instance;
 
     XHServiceController controller;
+    XHServiceEventLoop eventLoop;
+    XHServiceLog log;
+    XHStatusPublisher statusPage;
+    XHStartupPlan startupPlan;
+    XHMetricsRegistry metrics;
+    XHPauseToken pauseToken;
+    std::mutex executorMutex;
+    XHServiceExecutor *executor;
+    int executorThreads;
+    bool executorAbandoned;	// a task outran the drain deadline
+    XHCounter commandsProcessed;
+    XHCounter requestsProcessed;
+    XHHistogram controlLatency;
+    XHCounter logMessages;
+    XHCounter logBytes;
+    XHCounter logDropped;
+    XHCounter logSuppressed;
+    XHServiceDrain drain;
+    std::mutex handoffMutex;
+    std::map<std::string, int> handoffDescriptors;
+    std::vector<XHInheritedSocket> inheritedDescriptors;
+    bool runningAsService;
+    int timerSlack;
+    int transition;
+    bool transitionDeferred;
+    std::deque<int> deferredTransitions;
+    std::atomic<uint32_t> progressCheckPoint;
+    std::mutex startupMutex;
+    bool startingUp;	// control events wait in startupEvents
+    std::vector<std::pair<int, int> > startupEvents;
+    int drainTimeout;
+    std::atomic<int64_t> drainDuration;
+    std::atomic<uint64_t> drainAborted;
+    int workerCount;
+    int workerAffinity;
+    int workerIndex;
+    bool supervising;
+    class XHWorkerPool *workers;
+    int restartDelay;
+    int maxRestartDelay;
+    int crashLoopLimit;
+    int crashLoopPeriod;
 
     void startService();
+    void postEvent(int type, int code = 0);
+    void endStartup(bool deliver);
+    void processEvent(int type, int code);
+    void beginTransition(int type);
+    bool endTransition();
+    void finishTransition(int type, bool success);
+    void quitLoop(int code);
+    bool processRequest(int code, const char *data, size_t size, std::string *reply);
+    void drainOperations();
+    XHServiceExecutor *serviceExecutor();
     int run(bool asService, const std::vector<std::string> &argList);
 	bool install(const std::string &account, const std::string &password);
 
@@ -44,6 +141,16 @@ public:
 	std::string filePath() const;
     bool sysInit();
     void sysSetPath();
+    void sysSetState(int state);
+    void sysCollectActivatedSockets();
+    void sysDescribeSocket(XHInheritedSocket *socket);
+    void finishHandoff();
+    void sysSetProgress(const std::string &status, uint32_t checkPoint, uint32_t waitHint);
+    void sysNotifyExit(const XHServiceExitRecord &record);
+    bool sysStartWorkers();
+    void sysStopWorkers();
+    void sysPostToWorkers(int type, int code);
+    int sysRunWorker();
     void sysCleanup();
     class XHServiceSysPrivate *sysd;
 };
@@ -0,0 +1,144 @@
+/****************************************************************************
+**
+**
+****************************************************************************/
+
+#include "xhservice.h"
+#include <chrono>
+#if defined(_WIN32)
+#  include <windows.h>
+#else
+#  include <errno.h>
+#  include <limits.h>
+#  include <time.h>
+#  include <unistd.h>
+#  include <linux/futex.h>
+#  include <sys/syscall.h>
+#endif
+
+/*
+   The token is its own futex word: Running, Paused, or Parked once a
+   thread sleeps on it, so resume() only makes the wake-up system call
+   when somebody waits.
+*/
+enum
+{
+	Running = 0,
+	Paused,
+	Parked
+};
+
+static void parkOn(std::atomic<uint32_t> *word, int timeoutMs)
+{
+#if defined(_WIN32)
+	uint32_t parked = Parked;
+	::WaitOnAddress(word, &parked, sizeof(parked), timeoutMs < 0 ? INFINITE : (DWORD)timeoutMs);
+#else
+	timespec timeout;
+	timeout.tv_sec = timeoutMs / 1000;
+	timeout.tv_nsec = (long)(timeoutMs % 1000) * 1000000;
+	::syscall(SYS_futex, (uint32_t *)word, FUTEX_WAIT_PRIVATE, (uint32_t)Parked,
+		timeoutMs < 0 ? 0 : &timeout, 0, 0);
+#endif
+}
+
+static void wakeAll(std::atomic<uint32_t> *word)
+{
+#if defined(_WIN32)
+	::WakeByAddressAll(word);
+#else
+	::syscall(SYS_futex, (uint32_t *)word, FUTEX_WAKE_PRIVATE, INT_MAX, 0, 0, 0);
+#endif
+}
+
+/*!
+    \class XHPauseToken
+
+    \brief The XHPauseToken class parks worker threads while the
+    service is paused.
+
+    The service flips its token, XHServiceBase::pauseToken(), when it
+    handles a pause or continue request: before it calls
+    XHServiceBase::pause() and after XHServiceBase::resume() returned.
+    Worker threads call wait() between units of work. While the service
+    runs this is a single relaxed atomic load; while it is paused the
+    thread sleeps in the kernel, on a futex on Linux and on
+    WaitOnAddress() on Windows, until resume() wakes all waiting
+    threads at once.
+
+    \code
+    void Poller::run()
+    {
+        XHPauseToken &token = service->pauseToken();
+        while (!stopping) {
+            token.wait();
+            pollDevices();
+        }
+    }
+    \endcode
+
+    A stop request releases the token as well, so that paused workers
+    get to see it and wind down.
+*/
+
+/*!
+    \fn bool XHPauseToken::isPaused() const
+
+    Returns true if the token is paused.
+*/
+
+/*!
+    \fn bool XHPauseToken::wait(int timeoutMs) const
+
+    Blocks the calling thread while the token is paused, for at most \a
+    timeoutMs milliseconds or, if \a timeoutMs is -1, until it is
+    resumed. Returns immediately if the token isn't paused.
+
+    Returns true if the token is not paused on return, false if the
+    wait timed out.
+*/
+
+XHPauseToken::XHPauseToken()
+	: word(Running)
+{
+}
+
+/*!
+    Pauses the token; threads calling wait() from now on block.
+*/
+void XHPauseToken::pause()
+{
+	uint32_t expected = Running;
+	word.compare_exchange_strong(expected, Paused);
+}
+
+/*!
+    Resumes the token and wakes every thread blocked in wait().
+*/
+void XHPauseToken::resume()
+{
+	if (word.exchange(Running) == Parked)
+		wakeAll(&word);
+}
+
+bool XHPauseToken::park(int timeoutMs) const
+{
+	std::chrono::steady_clock::time_point deadline =
+		std::chrono::steady_clock::now() + std::chrono::milliseconds(timeoutMs < 0 ? 0 : timeoutMs);
+	for (;;) {
+		uint32_t state = word.load(std::memory_order_acquire);
+		if (state == Running)
+			return true;
+		if (state == Paused && !word.compare_exchange_weak(state, Parked))
+			continue;
+		int left = -1;
+		if (timeoutMs >= 0) {
+			left = (int)std::chrono::duration_cast<std::chrono::milliseconds>(
+				deadline - std::chrono::steady_clock::now()).count();
+			if (left <= 0)
+				return false;
+		}
+		// Returns at once if resume() got there first.
+		parkOn(&word, left);
+	}
+}
@@ -0,0 +1,100 @@
+/****************************************************************************
+**
+**
+****************************************************************************/
+
+#ifndef XHSERVICE_PREFORK_P_H
+#define XHSERVICE_PREFORK_P_H
+
+#include "xhservice.h"
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include <stdint.h>
+#include <sys/types.h>
+
+/*
+   Worker processes of a service running with
+   XHServiceBase::WorkerProcesses (Unix only). Each worker is the
+   service binary started again with XHSERVICE_WORKER set, optionally
+   pinned to a core or NUMA node, and talks to the master over a
+   socketpair: the master first sends the inherited sockets on it, then
+   XHControlHeader framed requests. A worker notices the master going
+   away as EOF. The master watches a pidfd of each worker instead, as
+   a child the worker forked may keep the socketpair open, and
+   restarts a dead worker with exponential backoff unless it exited
+   cleanly or keeps crashing (crash loop).
+*/
+struct XHRestartPolicy
+{
+	XHRestartPolicy() : delayMs(10), maxDelayMs(30000), loopLimit(5), loopPeriodMs(60000) {}
+
+	int delayMs;		// before the first restart, doubled on each crash in a row
+	int maxDelayMs;
+	int loopLimit;		// crashes within loopPeriodMs that make the pool give up
+	int loopPeriodMs;	// a worker running that long is considered healthy again
+};
+
+class XHWorkerPool
+{
+public:
+	XHWorkerPool();
+	~XHWorkerPool();
+
+	typedef std::function<void(const XHServiceExitRecord &)> ExitHandler;
+	typedef std::function<void(int)> IdleHandler;
+
+	// Called on the supervisor thread with the pool locked.
+	void setExitHandler(const ExitHandler &handler) { exitHandler = handler; }
+	void setIdleHandler(const IdleHandler &handler) { idleHandler = handler; }
+
+	bool start(const std::string &path, const std::vector<std::string> &arguments, int count,
+		int affinity, const std::vector<XHInheritedSocket> &sockets, const XHRestartPolicy &policy);
+	void post(uint16_t op, int32_t code);
+	void stop(int timeoutMs);
+
+private:
+	struct Worker
+	{
+		Worker() : index(0), pid(0), fd(-1), pidFd(-1), startedMs(0), restartMs(0), failures(0),
+			abandoned(false) {}
+		int index;
+		pid_t pid;
+		int fd;
+		int pidFd;		// -1 where the kernel has no pidfd_open()
+		std::vector<int> cpus;
+		int64_t startedMs;
+		int64_t restartMs;	// when to respawn a dead worker, 0 if alive or not restarted
+		int failures;		// crashes in a row
+		std::deque<int64_t> crashes;	// within the crash loop period
+		bool abandoned;
+	};
+
+	bool spawn(Worker &worker);
+	int64_t backoff(Worker &worker, int64_t now);
+	void reap(Worker &worker, int status);
+	void supervise();
+	void wake();
+	int alive() const;
+	bool pending() const;
+
+	std::string path;
+	std::vector<std::string> arguments;
+	std::vector<std::string> socketNames;
+	std::vector<int> socketFds;
+	std::vector<Worker> workers;
+	XHRestartPolicy policy;
+	ExitHandler exitHandler;
+	IdleHandler idleHandler;
+	std::mutex mutex;
+	std::condition_variable exited;
+	std::thread thread;
+	int wakeFd;
+	bool stopping;
+};
+
+#endif // XHSERVICE_PREFORK_P_H
@@ -0,0 +1,632 @@
+/****************************************************************************
+**
+**
+****************************************************************************/
+
+#include "xhservice_p.h"
+#include "xhservice_prefork_p.h"
+#include "xhservice_status_p.h"
+#include "xhservice_unix_p.h"
+#include <atomic>
+#include <chrono>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/prctl.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+
+extern char **environ;
+
+enum
+{
+	// Time the workers get on top of the drain timeout to stop.
+	WorkerStopGraceMs = 5000,
+	// How often workers without a pidfd are checked for having exited.
+	ReapPollMs = 100
+};
+
+static int64_t wallClockMs()
+{
+	return std::chrono::duration_cast<std::chrono::milliseconds>(
+		std::chrono::system_clock::now().time_since_epoch()).count();
+}
+
+static std::vector<int> allowedCpus()
+{
+	std::vector<int> cpus;
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	if (::sched_getaffinity(0, sizeof(set), &set) == 0) {
+		for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+			if (CPU_ISSET(cpu, &set))
+				cpus.push_back(cpu);
+		}
+	}
+	return cpus;
+}
+
+// pidfd_open() has no glibc wrapper before 2.36. The descriptor is
+// close-on-exec and readable once the process has exited.
+static int openPidFd(pid_t pid)
+{
+#if defined(SYS_pidfd_open)
+	return (int)::syscall(SYS_pidfd_open, pid, 0);
+#else
+	(void)pid;
+	errno = ENOSYS;
+	return -1;
+#endif
+}
+
+// "0-3,8,10-11"
+static std::vector<int> parseCpuList(const std::string &list)
+{
+	std::vector<int> cpus;
+	const char *p = list.c_str();
+	while (*p) {
+		char *end;
+		long first = ::strtol(p, &end, 10);
+		if (end == p)
+			break;
+		long last = first;
+		p = end;
+		if (*p == '-') {
+			last = ::strtol(p + 1, &end, 10);
+			p = end;
+		}
+		for (long cpu = first; cpu <= last && cpu < CPU_SETSIZE; ++cpu)
+			cpus.push_back((int)cpu);
+		while (*p == ',' || *p == '\n' || *p == ' ')
+			++p;
+	}
+	return cpus;
+}
+
+// CPUs of each NUMA node that this process may run on.
+static std::vector<std::vector<int> > numaNodes(const std::vector<int> &allowed)
+{
+	std::vector<std::vector<int> > nodes;
+	for (int node = 0; node < 1024; ++node) {
+		char path[64];
+		::snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", node);
+		FILE *f = ::fopen(path, "re");
+		if (!f)
+			break;	// nodes are numbered without gaps
+		char line[4096] = "";
+		if (!::fgets(line, sizeof(line), f))
+			line[0] = 0;
+		::fclose(f);
+		std::vector<int> cpus;
+		std::vector<int> listed = parseCpuList(line);
+		for (size_t i = 0; i < listed.size(); ++i) {
+			for (size_t k = 0; k < allowed.size(); ++k) {
+				if (allowed[k] == listed[i])
+					cpus.push_back(listed[i]);
+			}
+		}
+		if (!cpus.empty())
+			nodes.push_back(cpus);
+	}
+	return nodes;
+}
+
+XHWorkerPool::XHWorkerPool()
+	: wakeFd(-1), stopping(false)
+{
+}
+
+XHWorkerPool::~XHWorkerPool()
+{
+	stop(0);
+	for (size_t i = 0; i < socketFds.size(); ++i)
+		::close(socketFds[i]);
+	if (wakeFd >= 0)
+		::close(wakeFd);
+}
+
+bool XHWorkerPool::start(const std::string &binary, const std::vector<std::string> &args, int count,
+	int affinity, const std::vector<XHInheritedSocket> &sockets, const XHRestartPolicy &restartPolicy)
+{
+	path = binary;
+	arguments = args;
+	policy = restartPolicy;
+	for (size_t i = 0; i < sockets.size() && i < XHHandoffMaxDescriptors; ++i) {
+		socketNames.push_back(sockets[i].name);
+		socketFds.push_back(sockets[i].descriptor);
+	}
+	wakeFd = ::eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (wakeFd < 0)
+		return false;
+
+	std::vector<int> cpus = allowedCpus();
+	if (count <= 0)
+		count = cpus.empty() ? 1 : (int)cpus.size();
+	std::vector<std::vector<int> > nodes;
+	if (affinity == XHServiceBase::NumaNodeAffinity)
+		nodes = numaNodes(cpus);
+
+	std::lock_guard<std::mutex> lock(mutex);
+	workers.resize(count);
+	for (int i = 0; i < count; ++i) {
+		Worker &worker = workers[i];
+		worker.index = i;
+		if (affinity == XHServiceBase::CoreAffinity && !cpus.empty())
+			worker.cpus.push_back(cpus[i % cpus.size()]);
+		else if (affinity == XHServiceBase::NumaNodeAffinity && !nodes.empty())
+			worker.cpus = nodes[i % nodes.size()];
+		if (!spawn(worker))
+			backoff(worker, xhMonotonicMs());
+	}
+	thread = std::thread(&XHWorkerPool::supervise, this);
+	return true;
+}
+
+/*
+   Called with the mutex held, from the thread calling start() or from
+   the supervisor. As in xhLaunchDaemon(), everything the child needs is
+   prepared before fork().
+*/
+bool XHWorkerPool::spawn(Worker &worker)
+{
+	int sv[2];
+	if (::socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sv) != 0)
+		return false;
+	// Queued before the worker runs; it reads them in sysRunWorker().
+	if (!xhSendDescriptors(sv[0], socketNames, socketFds)) {
+		::close(sv[0]);
+		::close(sv[1]);
+		return false;
+	}
+
+	std::vector<char *> argv;
+	argv.push_back(const_cast<char *>(path.c_str()));
+	for (size_t i = 0; i < arguments.size(); ++i)
+		argv.push_back(const_cast<char *>(arguments[i].c_str()));
+	argv.push_back(0);
+	char indexEnv[48];
+	char fdEnv[48];
+	::snprintf(indexEnv, sizeof(indexEnv), "XHSERVICE_WORKER=%d", worker.index);
+	::snprintf(fdEnv, sizeof(fdEnv), "XHSERVICE_WORKER_FD=%d", sv[1]);
+	std::vector<char *> envp;
+	for (char **e = environ; e && *e; ++e) {
+		if (::strncmp(*e, "XHSERVICE_RUN=", 14) != 0 && ::strncmp(*e, "XHSERVICE_WORKER", 16) != 0)
+			envp.push_back(*e);
+	}
+	envp.push_back(indexEnv);
+	envp.push_back(fdEnv);
+	envp.push_back(0);
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	for (size_t i = 0; i < worker.cpus.size(); ++i)
+		CPU_SET(worker.cpus[i], &set);
+	bool pin = !worker.cpus.empty();
+	pid_t parent = ::getpid();
+
+	pid_t pid = ::fork();
+	if (pid < 0) {
+		::close(sv[0]);
+		::close(sv[1]);
+		return false;
+	}
+	if (pid == 0) {
+		// The master blocks SIGTERM and SIGINT for its signalfd.
+		sigset_t none;
+		::sigemptyset(&none);
+		::sigprocmask(SIG_SETMASK, &none, 0);
+		::prctl(PR_SET_PDEATHSIG, SIGTERM);
+		if (::getppid() != parent)
+			::_exit(1);
+		::fcntl(sv[1], F_SETFD, 0);
+		if (pin)
+			::sched_setaffinity(0, sizeof(set), &set);
+		::execve(path.c_str(), argv.data(), envp.data());
+		::_exit(127);
+	}
+	::close(sv[1]);
+	worker.pid = pid;
+	worker.fd = sv[0];
+	worker.pidFd = openPidFd(pid);
+	worker.startedMs = xhMonotonicMs();
+	worker.restartMs = 0;
+	return true;
+}
+
+/*
+   Schedules the restart of a worker that crashed or couldn't be
+   started and returns the delay, or -1 if the worker crashed too often
+   within the crash loop period and is given up.
+*/
+int64_t XHWorkerPool::backoff(Worker &worker, int64_t now)
+{
+	++worker.failures;
+	worker.crashes.push_back(now);
+	while (now - worker.crashes.front() >= policy.loopPeriodMs)
+		worker.crashes.pop_front();
+	if (policy.loopLimit > 0 && (int)worker.crashes.size() >= policy.loopLimit) {
+		worker.abandoned = true;
+		worker.restartMs = 0;
+		return -1;
+	}
+	int64_t delay = policy.delayMs;
+	for (int i = 1; i < worker.failures && delay < policy.maxDelayMs; ++i)
+		delay *= 2;
+	if (delay > policy.maxDelayMs)
+		delay = policy.maxDelayMs;
+	// restartMs 0 means "not scheduled"
+	worker.restartMs = now + delay > 0 ? now + delay : 1;
+	return delay;
+}
+
+// Records the exit of a worker the supervisor has waited for.
+void XHWorkerPool::reap(Worker &worker, int status)
+{
+	if (worker.fd >= 0)
+		::close(worker.fd);
+	if (worker.pidFd >= 0)
+		::close(worker.pidFd);
+	worker.fd = -1;
+	worker.pidFd = -1;
+	if (!stopping) {
+		int64_t now = xhMonotonicMs();
+		XHServiceExitRecord record;
+		record.time = wallClockMs();
+		record.pid = worker.pid;
+		record.workerIndex = worker.index;
+		record.uptime = now - worker.startedMs;
+		if (WIFSIGNALED(status)) {
+			record.signal = WTERMSIG(status);
+			record.coreDumped = WCOREDUMP(status);
+		} else {
+			record.exitCode = WEXITSTATUS(status);
+		}
+		// A worker that ran for a whole crash loop period starts over
+		// with the shortest delay.
+		if (record.uptime >= policy.loopPeriodMs)
+			worker.failures = 0;
+		// A worker that ended by itself, without a crash, is done.
+		if (record.signal == 0 && record.exitCode == 0)
+			worker.restartMs = 0;
+		else
+			record.restartDelay = backoff(worker, now);
+		if (exitHandler)
+			exitHandler(record);
+	}
+	worker.pid = 0;
+}
+
+int XHWorkerPool::alive() const
+{
+	int n = 0;
+	for (size_t i = 0; i < workers.size(); ++i)
+		n += workers[i].pid != 0;
+	return n;
+}
+
+// Whether a worker runs or is about to be restarted.
+bool XHWorkerPool::pending() const
+{
+	for (size_t i = 0; i < workers.size(); ++i) {
+		if (workers[i].pid != 0 || workers[i].restartMs != 0)
+			return true;
+	}
+	return false;
+}
+
+void XHWorkerPool::wake()
+{
+	uint64_t one = 1;
+	ssize_t ignored = ::write(wakeFd, &one, sizeof(one));
+	(void)ignored;
+}
+
+/*
+   Waits for the workers' pidfds, their channels, restart times and
+   wakeups. The exited workers are collected with WNOHANG and without
+   the lock, so post(), stop() and the exit handler never wait for a
+   worker.
+*/
+void XHWorkerPool::supervise()
+{
+	std::vector<pollfd> fds;
+	std::vector<pid_t> candidates;
+	std::vector<std::pair<pid_t, int> > exits;
+	std::unique_lock<std::mutex> lock(mutex);
+	bool idle = false;
+	for (;;) {
+		if (stopping && alive() == 0)
+			return;
+		fds.clear();
+		pollfd wakeup = { wakeFd, POLLIN, 0 };
+		fds.push_back(wakeup);
+		int timeoutMs = -1;
+		int64_t now = xhMonotonicMs();
+		for (size_t i = 0; i < workers.size(); ++i) {
+			// -1 is ignored by poll()
+			pollfd channel = { workers[i].fd, POLLIN, 0 };
+			pollfd process = { workers[i].pidFd, POLLIN, 0 };
+			fds.push_back(channel);
+			fds.push_back(process);
+			if (workers[i].pid != 0 && workers[i].pidFd < 0
+				&& (timeoutMs < 0 || timeoutMs > ReapPollMs))
+				timeoutMs = ReapPollMs;
+			if (!stopping && workers[i].pid == 0 && workers[i].restartMs) {
+				int64_t wait = workers[i].restartMs - now;
+				if (wait < 0)
+					wait = 0;
+				if (timeoutMs < 0 || wait < timeoutMs)
+					timeoutMs = (int)wait;
+			}
+		}
+		lock.unlock();
+		int n = ::poll(fds.data(), fds.size(), timeoutMs);
+		lock.lock();
+		if (n < 0 && errno != EINTR)
+			return;
+		if (n > 0 && fds[0].revents) {
+			uint64_t value;
+			ssize_t ignored = ::read(wakeFd, &value, sizeof(value));
+			(void)ignored;
+		}
+		candidates.clear();
+		for (size_t i = 0; i < workers.size(); ++i) {
+			Worker &worker = workers[i];
+			const pollfd &channel = fds[2 * i + 1];
+			const pollfd &process = fds[2 * i + 2];
+			if (n > 0 && channel.revents && worker.fd == channel.fd) {
+				// The socketpair only carries messages. Closed, it is
+				// of no more use, whether or not the worker still runs.
+				char buffer[256];
+				ssize_t r = ::recv(worker.fd, buffer, sizeof(buffer), MSG_DONTWAIT);
+				if (r == 0 || (r < 0 && errno != EAGAIN && errno != EINTR)) {
+					::close(worker.fd);
+					worker.fd = -1;
+				}
+			}
+			if (worker.pid != 0 && (worker.pidFd < 0 || (n > 0 && process.revents && worker.pidFd == process.fd)))
+				candidates.push_back(worker.pid);
+		}
+		if (!candidates.empty()) {
+			lock.unlock();
+			exits.clear();
+			for (size_t i = 0; i < candidates.size(); ++i) {
+				int status = 0;
+				pid_t r;
+				while ((r = ::waitpid(candidates[i], &status, WNOHANG)) < 0 && errno == EINTR)
+					;
+				if (r == candidates[i])
+					exits.push_back(std::make_pair(r, status));
+			}
+			lock.lock();
+			for (size_t i = 0; i < exits.size(); ++i) {
+				for (size_t k = 0; k < workers.size(); ++k) {
+					if (workers[k].pid == exits[i].first)
+						reap(workers[k], exits[i].second);
+				}
+			}
+			if (!exits.empty())
+				exited.notify_all();
+		}
+		now = xhMonotonicMs();
+		for (size_t i = 0; !stopping && i < workers.size(); ++i) {
+			Worker &worker = workers[i];
+			if (worker.pid == 0 && worker.restartMs && worker.restartMs <= now && !spawn(worker))
+				backoff(worker, now);
+		}
+		// Nothing left to supervise: the service ends with the workers,
+		// failed if one of them was given up.
+		if (!stopping && !idle && !pending()) {
+			idle = true;
+			int exitCode = 0;
+			for (size_t i = 0; i < workers.size(); ++i)
+				exitCode = workers[i].abandoned ? 1 : exitCode;
+			if (idleHandler)
+				idleHandler(exitCode);
+		}
+	}
+}
+
+void XHWorkerPool::post(uint16_t op, int32_t code)
+{
+	XHControlHeader request;
+	request.length = 0;
+	request.requestId = 0;
+	request.op = op;
+	request.flags = 0;
+	request.code = code;
+	std::lock_guard<std::mutex> lock(mutex);
+	for (size_t i = 0; i < workers.size(); ++i) {
+		if (workers[i].fd >= 0)
+			xhControlWrite(workers[i].fd, &request, sizeof(request));
+	}
+}
+
+/*
+   Asks every worker to stop, then waits for them for timeoutMs
+   (forever if negative) before killing those left.
+*/
+void XHWorkerPool::stop(int timeoutMs)
+{
+	if (!thread.joinable())
+		return;
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		stopping = true;
+		for (size_t i = 0; i < workers.size(); ++i)
+			workers[i].restartMs = 0;
+	}
+	post(XHControlTerminate, 0);
+	std::unique_lock<std::mutex> lock(mutex);
+	if (timeoutMs < 0) {
+		while (alive() > 0)
+			exited.wait(lock);
+	} else {
+		std::chrono::steady_clock::time_point deadline =
+			std::chrono::steady_clock::now() + std::chrono::milliseconds(timeoutMs);
+		while (alive() > 0 && exited.wait_until(lock, deadline) != std::cv_status::timeout)
+			;
+	}
+	for (size_t i = 0; i < workers.size(); ++i) {
+		if (workers[i].pid != 0)
+			::kill(workers[i].pid, SIGKILL);
+	}
+	lock.unlock();
+	wake();
+	thread.join();
+}
+
+bool XHServiceBasePrivate::sysStartWorkers()
+{
+	std::vector<XHInheritedSocket> sockets;
+	{
+		// The pool keeps the inherited sockets for workers started later.
+		std::lock_guard<std::mutex> lock(handoffMutex);
+		sockets.swap(inheritedDescriptors);
+	}
+	std::vector<std::string> arguments;
+	for (size_t i = 1; i < args.size(); ++i)
+		arguments.push_back(args[i]);
+	XHRestartPolicy policy;
+	policy.delayMs = restartDelay;
+	policy.maxDelayMs = maxRestartDelay;
+	policy.loopLimit = crashLoopLimit;
+	policy.loopPeriodMs = crashLoopPeriod;
+	// Without WorkerProcesses, RestartOnCrash supervises a single worker.
+	bool pool = serviceFlags & XHServiceBase::WorkerProcesses;
+
+	workers = new XHWorkerPool();
+	workers->setExitHandler([this](const XHServiceExitRecord &record) {
+		statusPage.addExit(record);
+		sysNotifyExit(record);
+		char cause[48];
+		if (record.signal)
+			::snprintf(cause, sizeof(cause), "killed by signal %d%s", record.signal,
+				record.coreDumped ? " (core dumped)" : "");
+		else
+			::snprintf(cause, sizeof(cause), "exited with code %d", record.exitCode);
+		char text[192];
+		int n = ::snprintf(text, sizeof(text), "Worker %d (pid %lld) %s after %lld ms",
+			record.workerIndex, (long long)record.pid, cause, (long long)record.uptime);
+		if (record.restartDelay >= 0)
+			::snprintf(text + n, sizeof(text) - n, ", restarting in %lld ms",
+				(long long)record.restartDelay);
+		else if (record.signal || record.exitCode)
+			::snprintf(text + n, sizeof(text) - n, ", crashing in a loop, not restarted");
+		bool crashed = record.signal || record.exitCode;
+		q_ptr->logMessage(text, !crashed ? XHServiceBase::Information
+			: record.restartDelay >= 0 ? XHServiceBase::Warning : XHServiceBase::Error);
+	});
+	workers->setIdleHandler([this](int code) {
+		eventLoop.post([this, code]() { eventLoop.quit(code); });
+	});
+	if (!workers->start(filePath(), arguments, pool ? workerCount : 1,
+		pool ? workerAffinity : XHServiceBase::NoAffinity, sockets, policy)) {
+		delete workers;
+		workers = 0;
+		return false;
+	}
+	return true;
+}
+
+void XHServiceBasePrivate::sysStopWorkers()
+{
+	if (!workers)
+		return;
+	workers->stop(drainTimeout < 0 ? -1 : drainTimeout + WorkerStopGraceMs);
+	delete workers;
+	workers = 0;
+}
+
+void XHServiceBasePrivate::sysPostToWorkers(int type, int code)
+{
+	if (!workers)
+		return;
+	switch (type) {
+		case XHServiceEvent::Pause:
+			workers->post(XHControlPause, 0);
+			break;
+		case XHServiceEvent::Resume:
+			workers->post(XHControlResume, 0);
+			break;
+		case XHServiceEvent::Command:
+			workers->post(XHControlCommand, code);
+			break;
+		default:
+			break;
+	}
+}
+
+static void workerChannel(int fd, XHServiceBasePrivate *d, std::atomic<bool> *exiting)
+{
+	XHControlHeader request;
+	while (xhControlRead(fd, &request, sizeof(request))) {
+		std::vector<char> payload(request.length <= XHControlMaxPayload ? request.length : 0);
+		if (!payload.empty() && !xhControlRead(fd, payload.data(), payload.size()))
+			break;
+		switch (request.op) {
+			case XHControlTerminate:
+				d->postEvent(XHServiceEvent::Stop);
+				break;
+			case XHControlPause:
+				d->postEvent(XHServiceEvent::Pause);
+				break;
+			case XHControlResume:
+				d->postEvent(XHServiceEvent::Resume);
+				break;
+			case XHControlCommand:
+				d->postEvent(XHServiceEvent::Command, request.code);
+				break;
+			default:
+				break;
+		}
+	}
+	// The master is gone: nobody would stop this worker otherwise.
+	if (!exiting->load())
+		d->postEvent(XHServiceEvent::Stop);
+}
+
+/*
+   Worker side: runs the service like -e does, with the requests of the
+   master instead of a control socket.
+*/
+int XHServiceBasePrivate::sysRunWorker()
+{
+	workerIndex = ::atoi(::getenv("XHSERVICE_WORKER"));
+	const char *fdEnv = ::getenv("XHSERVICE_WORKER_FD");
+	int fd = fdEnv ? ::atoi(fdEnv) : -1;
+	::unsetenv("XHSERVICE_WORKER");
+	::unsetenv("XHSERVICE_WORKER_FD");
+	if (fd < 3)
+		return -1;
+	::fcntl(fd, F_SETFD, FD_CLOEXEC);
+
+	std::vector<std::string> names;
+	std::vector<int> fds;
+	if (xhReceiveDescriptors(fd, &names, &fds, 5000)) {
+		std::lock_guard<std::mutex> lock(handoffMutex);
+		for (size_t i = 0; i < names.size(); ++i) {
+			XHInheritedSocket socket;
+			socket.name = names[i];
+			socket.descriptor = fds[i];
+			sysDescribeSocket(&socket);
+			inheritedDescriptors.push_back(socket);
+		}
+	}
+
+	std::atomic<bool> exiting(false);
+	std::thread channel(workerChannel, fd, this, &exiting);
+	int res = run(false, args);
+	exiting.store(true);
+	::shutdown(fd, SHUT_RDWR);
+	channel.join();
+	::close(fd);
+	return res;
+}
@@ -0,0 +1,210 @@
+/****************************************************************************
+**
+**
+****************************************************************************/
+
+#include "xhservice_startup_p.h"
+#include <mutex>
+#include <set>
+
+int XHStartupPlanPrivate::indexOf(const std::string &name)
+{
+	std::map<std::string, int>::iterator it = index.find(name);
+	if (it != index.end())
+		return it->second;
+	int i = graph.addNode();
+	names.push_back(name);
+	steps.push_back(XHStartupPlan::Step());
+	waitHints.push_back(0);
+	index[name] = i;
+	return i;
+}
+
+/*!
+    \class XHStartupPlan
+
+    \brief The XHStartupPlan class runs the initialization steps of a
+    service in parallel, in dependency order.
+
+    A service that has to do a lot of work before it can serve, such
+    as loading its tag database, opening its field-bus ports and
+    warming its caches, can split that work into named steps and
+    declare which step needs which other one to be done first. run()
+    then executes every step as soon as its dependencies have
+    succeeded, so starting takes about as long as the longest chain of
+    steps instead of the sum of all of them.
+
+    Steps run on worker threads, the calling thread being one of them.
+    A step returns false to report that it failed; the steps depending
+    on it are then skipped and run() returns false.
+
+    XHServiceBase owns a plan, available through
+    XHServiceBase::startupPlan(). Steps added to it in
+    createApplication() are run before start() is called, and every
+    step starting or finishing is reported to the platform as a
+    startup checkpoint: to the Windows service control manager through
+    \c dwCheckPoint and \c dwWaitHint, and on Linux to systemd (or any
+    other manager setting \c NOTIFY_SOCKET) as a status message that
+    also extends the start timeout. A step that may take longer than
+    the default wait hint of 30 seconds should pass its own estimate to
+    addStep(). If the plan fails the service does not start.
+
+    \code
+    void MyService::createApplication(int &argc, char **argv)
+    {
+        XHStartupPlan &plan = startupPlan();
+        plan.addStep("tagdb", [this]() { return tags.load(); }, 60000);
+        plan.addStep("ports", [this]() { return bus.open(); });
+        plan.addStep("cache", [this]() { return cache.warm(tags); });
+        plan.addDependency("cache", "tagdb");
+    }
+    \endcode
+
+    \sa XHServiceFleet
+*/
+
+/*!
+    Creates an empty plan.
+*/
+XHStartupPlan::XHStartupPlan()
+	: d_ptr(new XHStartupPlanPrivate)
+{
+}
+
+/*!
+    Destroys the plan.
+*/
+XHStartupPlan::~XHStartupPlan()
+{
+	delete d_ptr;
+}
+
+/*!
+    Adds the step \a name, executing \a step. \a waitHintMs is an
+    estimate of how long the step takes; 0 uses the default of 30
+    seconds. Adding a step under an existing name replaces it.
+*/
+void XHStartupPlan::addStep(const std::string &name, const Step &step, int waitHintMs)
+{
+	int i = d_ptr->indexOf(name);
+	d_ptr->steps[i] = step;
+	d_ptr->waitHints[i] = waitHintMs;
+}
+
+/*!
+    Declares that \a step may only run once \a dependsOn succeeded. A
+    dependency on a step that is never added fails.
+
+    \sa isValid()
+*/
+void XHStartupPlan::addDependency(const std::string &step, const std::string &dependsOn)
+{
+	int i = d_ptr->indexOf(step);
+	d_ptr->graph.addEdge(i, d_ptr->indexOf(dependsOn));
+}
+
+/*!
+    Returns the names of the steps, in the order they were added.
+*/
+std::vector<std::string> XHStartupPlan::steps() const
+{
+	return d_ptr->names;
+}
+
+/*!
+    Returns true if the plan has no steps.
+*/
+bool XHStartupPlan::isEmpty() const
+{
+	return d_ptr->names.empty();
+}
+
+/*!
+    Returns false if the dependencies contain a cycle, in which case
+    run() fails without running any step.
+*/
+bool XHStartupPlan::isValid() const
+{
+	return d_ptr->graph.isAcyclic();
+}
+
+/*!
+    Removes all steps.
+*/
+void XHStartupPlan::clear()
+{
+	XHStartupPlanPrivate::Progress progress = d_ptr->progress;
+	delete d_ptr;
+	d_ptr = new XHStartupPlanPrivate;
+	d_ptr->progress = progress;
+}
+
+/*!
+    Returns the maximum number of steps run at the same time. The
+    default, 0, runs as many at once as the dependencies allow.
+*/
+int XHStartupPlan::maxParallel() const
+{
+	return d_ptr->maxParallel;
+}
+
+/*!
+    Limits the number of steps run at the same time to \a workers.
+*/
+void XHStartupPlan::setMaxParallel(int workers)
+{
+	d_ptr->maxParallel = workers;
+}
+
+/*!
+    Runs all steps and returns true if every one of them succeeded.
+
+    \sa results()
+*/
+bool XHStartupPlan::run()
+{
+	XHStartupPlanPrivate *d = d_ptr;
+	std::mutex mutex;
+	uint32_t checkPoint = 0;
+	std::multiset<int> running;
+	XHTaskGraph::Observer observer;
+	if (d->progress) {
+		observer = [&](int i, bool finished) {
+			int hint = d->waitHints[i] > 0 ? d->waitHints[i] : (int)XHStartupDefaultWaitHintMs;
+			std::lock_guard<std::mutex> lock(mutex);
+			if (finished)
+				running.erase(running.find(hint));
+			else
+				running.insert(hint);
+			// The slowest step still running bounds the next checkpoint.
+			int waitHint = running.empty() ? (int)XHStartupDefaultWaitHintMs : *running.rbegin();
+			d->progress(d->names[i], finished, ++checkPoint, waitHint);
+		};
+	}
+	std::vector<XHTaskGraph::Outcome> outcomes = d->graph.run([d](int i) {
+		return d->steps[i] ? d->steps[i]() : false;
+	}, d->maxParallel, false, observer);
+
+	bool ok = true;
+	d->results.assign(d->names.size(), XHStartupStepResult());
+	for (size_t i = 0; i < d->names.size(); ++i) {
+		XHStartupStepResult &result = d->results[i];
+		result.name = d->names[i];
+		result.success = outcomes[i].success;
+		result.skipped = outcomes[i].skipped;
+		result.startMs = outcomes[i].startMs;
+		result.durationMs = outcomes[i].durationMs;
+		ok = ok && result.success;
+	}
+	return ok;
+}
+
+/*!
+    Returns the outcome of each step of the last run(), in the order
+    the steps were added. \c startMs is the offset from the beginning
+    of run() at which the step started.
+*/
+std::vector<XHStartupStepResult> XHStartupPlan::results() const
+{
+	return d_ptr->results;
+}
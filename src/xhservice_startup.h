@@ -0,0 +1,57 @@
+/****************************************************************************
+**
+**
+****************************************************************************/
+
+#ifndef XHSERVICE_STARTUP_H
+#define XHSERVICE_STARTUP_H
+
+#include "xhservice_global.h"
+#include <functional>
+#include <string>
+#include <vector>
+#include <stdint.h>
+
+struct XHSERVICE_EXPORT XHStartupStepResult
+{
+	XHStartupStepResult() : success(false), skipped(false), startMs(0), durationMs(0) {}
+
+	std::string name;
+	bool success;
+	bool skipped;
+	int64_t startMs;
+	int64_t durationMs;
+};
+
+class XHStartupPlanPrivate;
+
+class XHSERVICE_EXPORT XHStartupPlan
+{
+public:
+	typedef std::function<bool()> Step;
+
+	XHStartupPlan();
+	virtual ~XHStartupPlan();
+
+	void addStep(const std::string &name, const Step &step, int waitHintMs = 0);
+	void addDependency(const std::string &step, const std::string &dependsOn);
+	std::vector<std::string> steps() const;
+	bool isEmpty() const;
+	bool isValid() const;
+	void clear();
+
+	int maxParallel() const;
+	void setMaxParallel(int workers);
+
+	bool run();
+	std::vector<XHStartupStepResult> results() const;
+
+private:
+	XHStartupPlan(const XHStartupPlan &);
+	XHStartupPlan &operator=(const XHStartupPlan &);
+
+	friend class XHServiceBasePrivate;
+	XHStartupPlanPrivate *d_ptr;
+};
+
+#endif // XHSERVICE_STARTUP_H
@@ -0,0 +1,41 @@
+/****************************************************************************
+**
+**
+****************************************************************************/
+
+#ifndef XHSERVICE_STARTUP_P_H
+#define XHSERVICE_STARTUP_P_H
+
+#include "xhservice_startup.h"
+#include "xhservice_graph_p.h"
+#include <map>
+
+enum
+{
+	// Reported while a step without an estimate of its own runs; the
+	// SCM's default start timeout.
+	XHStartupDefaultWaitHintMs = 30000
+};
+
+class XHStartupPlanPrivate
+{
+public:
+	// Called on every step start and finish with a checkpoint that
+	// grows by one each time and the time the next one may take.
+	typedef std::function<void(const std::string &, bool, uint32_t, uint32_t)> Progress;
+
+	XHStartupPlanPrivate() : maxParallel(0) {}
+
+	int indexOf(const std::string &name);
+
+	std::vector<std::string> names;
+	std::map<std::string, int> index;
+	std::vector<XHStartupPlan::Step> steps;
+	std::vector<int> waitHints;
+	XHTaskGraph graph;
+	int maxParallel;
+	std::vector<XHStartupStepResult> results;
+	Progress progress;
+};
+
+#endif // XHSERVICE_STARTUP_P_H
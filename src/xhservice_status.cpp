@@ -0,0 +1,419 @@
+/****************************************************************************
+**
+**
+****************************************************************************/
+
+#include "xhservice_p.h"
+#include "xhservice_status_p.h"
+#include <chrono>
+#include <string.h>
+
+static void copyText(char *dst, const std::string &src)
+{
+	size_t n = src.size() < XHStatusPage::TextSize - 1 ? src.size() : XHStatusPage::TextSize - 1;
+	::memcpy(dst, src.data(), n);
+	dst[n] = 0;
+}
+
+static int64_t wallClockMs()
+{
+	return std::chrono::duration_cast<std::chrono::milliseconds>(
+		std::chrono::system_clock::now().time_since_epoch()).count();
+}
+
+XHStatusPublisher::XHStatusPublisher()
+	: sampleMs(XHStatusSampleMs), lastSample(0)
+{
+}
+
+XHStatusPublisher::~XHStatusPublisher()
+{
+	close();
+	xhUnmapStatusPage(&detached);
+}
+
+bool XHStatusPublisher::open(const std::string &serviceName)
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	if (mapping.page)
+		return true;
+	if (!xhMapStatusPage(serviceName, true, &mapping))
+		return false;
+
+	// The page outlives the service (controllers keep it mapped across
+	// restarts), so it is reinitialized under the seqlock rather than
+	// recreated.
+	XHStatusPage *p = mapping.page;
+	if (p->magic != XHStatusPage::Magic || p->version != XHStatusPage::Version) {
+		p->sequence.store(0, std::memory_order_relaxed);
+		p->exitCount = 0;
+		p->restarts = 0;
+		p->version = XHStatusPage::Version;
+		p->magic = XHStatusPage::Magic;
+	} else if (p->sequence.load(std::memory_order_relaxed) & 1) {
+		// The previous instance died inside an update.
+		end();
+	}
+	begin();
+	p->state = XHServiceStartPending;
+	p->checkPoint = 0;
+	p->waitHint = 0;
+	p->pid = xhCurrentPid();
+	p->startTime = wallClockMs();
+	p->sampleCount = 0;
+	end();
+	for (int i = 0; i < XHStatusPage::MaxCounters; ++i)
+		p->counters[i].store(0, std::memory_order_relaxed);
+	p->drainDuration.store(0, std::memory_order_relaxed);
+	p->drainAborted.store(0, std::memory_order_relaxed);
+	p->drainTimeout.store(XHStatusDrainTimeoutMs, std::memory_order_relaxed);
+	p->heartbeat.store(xhMonotonicMs(), std::memory_order_release);
+	// Sampling is cheap once the sampler is open, so it stays open even
+	// while sampling is off.
+	sampler.open();
+	lastSample.store(0, std::memory_order_relaxed);
+	return true;
+}
+
+void XHStatusPublisher::close()
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	if (!mapping.page)
+		return;
+	begin();
+	mapping.page->state = XHServiceStopped;
+	end();
+	xhUnmapStatusPage(&mapping);
+	sampler.close();
+}
+
+/*
+   Stops publishing without touching the page, which now belongs to
+   another instance (upgrade). Writers that don't take the mutex may
+   still hold the old pointer, so the mapping stays until destruction.
+*/
+void XHStatusPublisher::detach()
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	if (!mapping.page)
+		return;
+	detached = mapping;
+	mapping = XHStatusMapping();
+}
+
+void XHStatusPublisher::begin()
+{
+	uint32_t seq = mapping.page->sequence.load(std::memory_order_relaxed);
+	mapping.page->sequence.store(seq + 1, std::memory_order_relaxed);
+	std::atomic_thread_fence(std::memory_order_release);
+}
+
+void XHStatusPublisher::end()
+{
+	uint32_t seq = mapping.page->sequence.load(std::memory_order_relaxed);
+	mapping.page->sequence.store(seq + 1, std::memory_order_release);
+}
+
+void XHStatusPublisher::setState(int state)
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	if (!mapping.page)
+		return;
+	begin();
+	mapping.page->state = state;
+	if (state != XHServiceStartPending && state != XHServiceStopPending) {
+		mapping.page->checkPoint = 0;
+		mapping.page->waitHint = 0;
+	}
+	end();
+}
+
+void XHStatusPublisher::setCheckPoint(uint32_t checkPoint, uint32_t waitHint)
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	if (!mapping.page)
+		return;
+	begin();
+	mapping.page->checkPoint = checkPoint;
+	mapping.page->waitHint = waitHint;
+	end();
+}
+
+void XHStatusPublisher::setFlags(int flags)
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	if (!mapping.page)
+		return;
+	begin();
+	mapping.page->flags = flags;
+	end();
+}
+
+void XHStatusPublisher::setInfo(const std::string &filePath, const std::string &description,
+	int startupType)
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	if (!mapping.page)
+		return;
+	begin();
+	copyText(mapping.page->filePath, filePath);
+	copyText(mapping.page->description, description);
+	mapping.page->startupType = startupType;
+	end();
+}
+
+void XHStatusPublisher::beat()
+{
+	XHStatusPage *p = mapping.page;
+	if (!p)
+		return;
+	int64_t now = xhMonotonicMs();
+	p->heartbeat.store(now, std::memory_order_release);
+	// Beats also come between the heartbeat timeouts; a little slack
+	// keeps the samples from slipping by a whole heartbeat.
+	int interval = sampleMs.load(std::memory_order_relaxed);
+	if (interval > 0 && now - lastSample.load(std::memory_order_relaxed) >= interval - XHStatusHeartbeatMs / 10)
+		sample(now);
+}
+
+/*
+   Samples are taken on the heartbeat, so intervals shorter than a
+   heartbeat are rounded up to one. 0 turns sampling off.
+*/
+void XHStatusPublisher::setSampleInterval(int ms)
+{
+	if (ms > 0 && ms < XHStatusHeartbeatMs)
+		ms = XHStatusHeartbeatMs;
+	sampleMs.store(ms < 0 ? 0 : ms, std::memory_order_relaxed);
+}
+
+void XHStatusPublisher::sample(int64_t now)
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	XHStatusSample sample;
+	if (!mapping.page || !sampler.sample(&sample))
+		return;
+	sample.time = wallClockMs();
+	lastSample.store(now, std::memory_order_relaxed);
+	begin();
+	mapping.page->samples[mapping.page->sampleCount % XHStatusPage::MaxSamples] = sample;
+	++mapping.page->sampleCount;
+	end();
+}
+
+void XHStatusPublisher::setCounter(int index, int64_t value)
+{
+	XHStatusPage *p = mapping.page;
+	if (p && index >= 0 && index < XHStatusPage::MaxCounters)
+		p->counters[index].store(value, std::memory_order_relaxed);
+}
+
+void XHStatusPublisher::addCounter(int index, int64_t delta)
+{
+	XHStatusPage *p = mapping.page;
+	if (p && index >= 0 && index < XHStatusPage::MaxCounters)
+		p->counters[index].fetch_add(delta, std::memory_order_relaxed);
+}
+
+void XHStatusPublisher::setDrain(int64_t durationMs, int64_t aborted)
+{
+	if (XHStatusPage *p = mapping.page) {
+		p->drainDuration.store(durationMs, std::memory_order_relaxed);
+		p->drainAborted.store(aborted, std::memory_order_relaxed);
+	}
+}
+
+void XHStatusPublisher::setDrainTimeout(int64_t timeoutMs)
+{
+	if (XHStatusPage *p = mapping.page)
+		p->drainTimeout.store(timeoutMs, std::memory_order_relaxed);
+}
+
+void XHStatusPublisher::addExit(const XHServiceExitRecord &record)
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	if (!mapping.page)
+		return;
+	begin();
+	XHStatusExit &exit = mapping.page->exits[mapping.page->exitCount % XHStatusPage::MaxExits];
+	exit.time = record.time;
+	exit.pid = record.pid;
+	exit.uptime = record.uptime;
+	exit.restartDelay = record.restartDelay;
+	exit.workerIndex = record.workerIndex;
+	exit.exitCode = record.exitCode;
+	exit.signal = record.signal;
+	exit.coreDumped = record.coreDumped;
+	++mapping.page->exitCount;
+	if (record.restartDelay >= 0)
+		++mapping.page->restarts;
+	end();
+}
+
+XHStatusReader::XHStatusReader()
+{
+}
+
+XHStatusReader::~XHStatusReader()
+{
+	xhUnmapStatusPage(&mapping);
+}
+
+bool XHStatusReader::map(const std::string &serviceName)
+{
+	if (mapping.page)
+		return true;
+	// Only this retry costs system calls; once mapped, reads are plain
+	// memory accesses.
+	return xhMapStatusPage(serviceName, false, &mapping);
+}
+
+/*
+   Returns true if the page holds an answer that can be trusted: the
+   service either stopped cleanly or has beaten its heart recently.
+   A stale page (a hung or crashed service) makes the caller fall back
+   to asking the service manager.
+*/
+bool XHStatusReader::read(const std::string &serviceName, XHStatusSnapshot *snapshot)
+{
+	if (!map(serviceName))
+		return false;
+	const XHStatusPage *p = mapping.page;
+	if (p->magic != XHStatusPage::Magic || p->version != XHStatusPage::Version)
+		return false;
+
+	char filePath[XHStatusPage::TextSize];
+	char description[XHStatusPage::TextSize];
+	// A writer that died half way through an update leaves the sequence
+	// odd for good; give up after a while instead of spinning forever.
+	for (int attempt = 0;; ++attempt) {
+		if (attempt == 10000)
+			return false;
+		uint32_t seq = p->sequence.load(std::memory_order_acquire);
+		if (seq & 1)
+			continue;
+		snapshot->state = p->state;
+		snapshot->flags = p->flags;
+		snapshot->startupType = p->startupType;
+		snapshot->checkPoint = p->checkPoint;
+		snapshot->waitHint = p->waitHint;
+		snapshot->pid = p->pid;
+		snapshot->startTime = p->startTime;
+		snapshot->restarts = p->restarts;
+		::memcpy(filePath, p->filePath, sizeof(filePath));
+		::memcpy(description, p->description, sizeof(description));
+		std::atomic_thread_fence(std::memory_order_acquire);
+		if (p->sequence.load(std::memory_order_relaxed) == seq)
+			break;
+	}
+	filePath[sizeof(filePath) - 1] = 0;
+	description[sizeof(description) - 1] = 0;
+	snapshot->filePath = filePath;
+	snapshot->description = description;
+	snapshot->heartbeat = p->heartbeat.load(std::memory_order_acquire);
+	snapshot->drainDuration = p->drainDuration.load(std::memory_order_relaxed);
+	snapshot->drainAborted = p->drainAborted.load(std::memory_order_relaxed);
+	snapshot->drainTimeout = p->drainTimeout.load(std::memory_order_relaxed);
+
+	if (snapshot->state == XHServiceStopped)
+		return true;
+	return xhMonotonicMs() - snapshot->heartbeat < XHStatusStaleMs;
+}
+
+bool XHStatusReader::counter(const std::string &serviceName, int index, int64_t *value)
+{
+	if (index < 0 || index >= XHStatusPage::MaxCounters || !map(serviceName))
+		return false;
+	if (mapping.page->magic != XHStatusPage::Magic)
+		return false;
+	*value = mapping.page->counters[index].load(std::memory_order_relaxed);
+	return true;
+}
+
+/*
+   Unlike read(), this doesn't care whether the service still runs: the
+   history of a service that crashed for good is the interesting one.
+*/
+bool XHStatusReader::exits(const std::string &serviceName, std::vector<XHServiceExitRecord> *records)
+{
+	if (!map(serviceName))
+		return false;
+	const XHStatusPage *p = mapping.page;
+	if (p->magic != XHStatusPage::Magic || p->version != XHStatusPage::Version)
+		return false;
+
+	XHStatusExit exits[XHStatusPage::MaxExits];
+	uint32_t count;
+	for (int attempt = 0;; ++attempt) {
+		if (attempt == 10000)
+			return false;
+		uint32_t seq = p->sequence.load(std::memory_order_acquire);
+		if (seq & 1)
+			continue;
+		count = p->exitCount;
+		::memcpy(exits, p->exits, sizeof(exits));
+		std::atomic_thread_fence(std::memory_order_acquire);
+		if (p->sequence.load(std::memory_order_relaxed) == seq)
+			break;
+	}
+	records->clear();
+	uint32_t first = count > XHStatusPage::MaxExits ? count - XHStatusPage::MaxExits : 0;
+	for (uint32_t i = first; i < count; ++i) {
+		const XHStatusExit &exit = exits[i % XHStatusPage::MaxExits];
+		XHServiceExitRecord record;
+		record.time = exit.time;
+		record.pid = exit.pid;
+		record.uptime = exit.uptime;
+		record.restartDelay = exit.restartDelay;
+		record.workerIndex = exit.workerIndex;
+		record.exitCode = exit.exitCode;
+		record.signal = exit.signal;
+		record.coreDumped = exit.coreDumped != 0;
+		records->push_back(record);
+	}
+	return true;
+}
+
+/*
+   Like exits(), this reads the samples of a service that stopped, too:
+   the last ones tell what it looked like before it went.
+*/
+bool XHStatusReader::samples(const std::string &serviceName, std::vector<XHProcessSample> *samples)
+{
+	if (!map(serviceName))
+		return false;
+	const XHStatusPage *p = mapping.page;
+	if (p->magic != XHStatusPage::Magic || p->version != XHStatusPage::Version)
+		return false;
+
+	XHStatusSample copy[XHStatusPage::MaxSamples];
+	uint32_t count;
+	for (int attempt = 0;; ++attempt) {
+		if (attempt == 10000)
+			return false;
+		uint32_t seq = p->sequence.load(std::memory_order_acquire);
+		if (seq & 1)
+			continue;
+		count = p->sampleCount;
+		::memcpy(copy, p->samples, sizeof(copy));
+		std::atomic_thread_fence(std::memory_order_acquire);
+		if (p->sequence.load(std::memory_order_relaxed) == seq)
+			break;
+	}
+	samples->clear();
+	uint32_t first = count > XHStatusPage::MaxSamples ? count - XHStatusPage::MaxSamples : 0;
+	for (uint32_t i = first; i < count; ++i) {
+		const XHStatusSample &sample = copy[i % XHStatusPage::MaxSamples];
+		XHProcessSample result;
+		result.time = sample.time;
+		result.residentBytes = sample.residentBytes;
+		result.userTime = sample.userTime;
+		result.systemTime = sample.systemTime;
+		result.threads = sample.threads;
+		result.openFiles = sample.openFiles;
+		result.voluntarySwitches = sample.voluntarySwitches;
+		result.involuntarySwitches = sample.involuntarySwitches;
+		samples->push_back(result);
+	}
+	return true;
+}
@@ -0,0 +1,216 @@
+/****************************************************************************
+**
+**
+****************************************************************************/
+
+#ifndef XHSERVICE_STATUS_P_H
+#define XHSERVICE_STATUS_P_H
+
+#include <atomic>
+#include <mutex>
+#include <string>
+#include <vector>
+#include <stdint.h>
+
+struct XHServiceExitRecord;
+struct XHProcessSample;
+
+// An exit of a supervised process, see XHServiceExitRecord.
+struct XHStatusExit
+{
+	int64_t time;
+	int64_t pid;
+	int64_t uptime;
+	int64_t restartDelay;
+	int32_t workerIndex;
+	int32_t exitCode;
+	int32_t signal;
+	int32_t coreDumped;
+};
+
+// A sample of the service's resource usage, see XHProcessSample.
+struct XHStatusSample
+{
+	int64_t time;
+	int64_t residentBytes;
+	int64_t userTime;
+	int64_t systemTime;
+	int64_t voluntarySwitches;
+	int64_t involuntarySwitches;
+	int32_t threads;
+	int32_t openFiles;
+};
+
+/*
+   Status page shared between a running service and its controllers.
+   The service maps it read/write, controllers map it read-only and
+   read it without any system call. The fields between 'sequence' and
+   'heartbeat' are guarded by a seqlock; the heartbeat, the counters
+   and the drain figures are independent atomics updated outside of it.
+   The exit history is kept when the service starts again; the
+   resource samples start over.
+*/
+struct XHStatusPage
+{
+	enum
+	{
+		Magic = 0x50534858,	// "XHSP"
+		Version = 5,
+		MaxCounters = 16,
+		MaxExits = 16,
+		MaxSamples = 60,
+		TextSize = 1024
+	};
+
+	uint32_t magic;
+	uint32_t version;
+	std::atomic<uint32_t> sequence;
+	uint32_t reserved;
+
+	int32_t state;
+	int32_t flags;
+	int32_t startupType;
+	uint32_t checkPoint;
+	uint32_t waitHint;
+	uint32_t reserved2;
+	int64_t pid;
+	int64_t startTime;	// milliseconds since the epoch
+	char filePath[TextSize];
+	char description[TextSize];
+	uint32_t exitCount;	// exits[exitCount % MaxExits] is the next to write
+	uint32_t reserved3;
+	int64_t restarts;
+	XHStatusExit exits[MaxExits];
+	uint32_t sampleCount;	// samples[sampleCount % MaxSamples] is the next to write
+	uint32_t reserved4;
+	XHStatusSample samples[MaxSamples];
+
+	std::atomic<int64_t> heartbeat;	// xhMonotonicMs() of the last beat
+	std::atomic<int64_t> counters[MaxCounters];
+	std::atomic<int64_t> drainDuration;	// milliseconds, of the last stop
+	std::atomic<int64_t> drainAborted;	// operations cut off by the deadline
+	std::atomic<int64_t> drainTimeout;	// milliseconds, negative waits for all
+};
+
+struct XHStatusSnapshot
+{
+	int state;
+	int flags;
+	int startupType;
+	uint32_t checkPoint;
+	uint32_t waitHint;
+	int64_t pid;
+	int64_t startTime;
+	int64_t heartbeat;
+	int64_t drainDuration;
+	int64_t drainAborted;
+	int64_t drainTimeout;
+	int64_t restarts;
+	std::string filePath;
+	std::string description;
+};
+
+// Platform mapping of the page, implemented in xhservice_unix.cpp and
+// xhservice_win.cpp.
+struct XHStatusMapping
+{
+	XHStatusMapping() : page(0), handle(0) {}
+	XHStatusPage *page;
+	intptr_t handle;
+};
+
+bool xhMapStatusPage(const std::string &serviceName, bool writable, XHStatusMapping *mapping);
+void xhUnmapStatusPage(XHStatusMapping *mapping);
+int64_t xhMonotonicMs();
+int64_t xhCurrentPid();
+
+enum
+{
+	XHStatusHeartbeatMs = 1000,
+	XHStatusStaleMs = 3 * XHStatusHeartbeatMs,
+	XHStatusSampleMs = XHStatusHeartbeatMs,
+	XHStatusDrainTimeoutMs = 10000,	// XHServiceBase::drainTimeout() by default
+	XHStatusStopGraceMs = 5000	// for stop() and executeApplication() to unwind
+};
+
+/*
+   Reads the resource usage of the current process. Whatever can be
+   opened ahead is opened by open(), so that sample() only costs a few
+   reads; implemented in xhservice_unix.cpp and xhservice_win.cpp.
+*/
+class XHProcessSampler
+{
+public:
+	XHProcessSampler();
+	~XHProcessSampler();
+
+	bool open();
+	void close();
+	bool sample(XHStatusSample *sample);
+
+private:
+	XHProcessSampler(const XHProcessSampler &);
+	XHProcessSampler &operator=(const XHProcessSampler &);
+
+	intptr_t statFile;	// /proc/self/stat
+	void *fdDirectory;	// /proc/self/fd
+	int64_t pageSize;
+};
+
+class XHStatusPublisher
+{
+public:
+	XHStatusPublisher();
+	~XHStatusPublisher();
+
+	bool open(const std::string &serviceName);
+	void close();
+	void detach();
+	bool isOpen() const { return mapping.page != 0; }
+
+	void setState(int state);
+	void setCheckPoint(uint32_t checkPoint, uint32_t waitHint);
+	void setFlags(int flags);
+	void setInfo(const std::string &filePath, const std::string &description, int startupType);
+	void beat();
+
+	void setCounter(int index, int64_t value);
+	void addCounter(int index, int64_t delta);
+	void setDrain(int64_t durationMs, int64_t aborted);
+	void setDrainTimeout(int64_t timeoutMs);
+	void addExit(const XHServiceExitRecord &record);
+
+	void setSampleInterval(int ms);
+	int sampleInterval() const { return sampleMs.load(std::memory_order_relaxed); }
+
+private:
+	void begin();
+	void end();
+	void sample(int64_t now);
+
+	XHStatusMapping mapping;
+	XHStatusMapping detached;
+	std::mutex mutex;
+	XHProcessSampler sampler;
+	std::atomic<int> sampleMs;
+	std::atomic<int64_t> lastSample;
+};
+
+class XHStatusReader
+{
+public:
+	XHStatusReader();
+	~XHStatusReader();
+
+	bool read(const std::string &serviceName, XHStatusSnapshot *snapshot);
+	bool counter(const std::string &serviceName, int index, int64_t *value);
+	bool exits(const std::string &serviceName, std::vector<XHServiceExitRecord> *records);
+	bool samples(const std::string &serviceName, std::vector<XHProcessSample> *samples);
+
+private:
+	bool map(const std::string &serviceName);
+
+	XHStatusMapping mapping;
+};
+
+#endif // XHSERVICE_STATUS_P_H
@@ -0,0 +1,475 @@
+/****************************************************************************
+**
+**
+****************************************************************************/
+
+#ifndef XHSERVICE_TASK_H
+#define XHSERVICE_TASK_H
+
+#include "xhservice.h"
+
+/*
+   Coroutine support needs C++20; the library itself doesn't, so this
+   header is empty for older compilers.
+*/
+#if defined(__cpp_impl_coroutine) && __cpp_impl_coroutine >= 201902L
+
+#include <coroutine>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <string>
+#include <type_traits>
+#include <utility>
+#include <vector>
+#include <stdio.h>
+
+template <typename T = void> class XHTask;
+
+class XHTaskPromiseBase
+{
+public:
+	struct FinalAwaiter
+	{
+		bool await_ready() const noexcept { return false; }
+		template <typename P>
+		std::coroutine_handle<> await_suspend(std::coroutine_handle<P> handle) noexcept
+		{
+			std::coroutine_handle<> next = handle.promise().continuation;
+			return next ? next : std::noop_coroutine();
+		}
+		void await_resume() const noexcept {}
+	};
+
+	std::suspend_always initial_suspend() const noexcept { return {}; }
+	FinalAwaiter final_suspend() const noexcept { return {}; }
+	void unhandled_exception() { exception = std::current_exception(); }
+
+	std::coroutine_handle<> continuation;
+	std::exception_ptr exception;
+};
+
+template <typename T>
+class XHTaskPromise : public XHTaskPromiseBase
+{
+public:
+	XHTask<T> get_return_object();
+
+	template <typename U>
+	void return_value(U &&v) { value = std::forward<U>(v); }
+
+	T result()
+	{
+		if (exception)
+			std::rethrow_exception(exception);
+		return std::move(value);
+	}
+
+	T value;
+};
+
+template <>
+class XHTaskPromise<void> : public XHTaskPromiseBase
+{
+public:
+	XHTask<void> get_return_object();
+
+	void return_void() {}
+
+	void result()
+	{
+		if (exception)
+			std::rethrow_exception(exception);
+	}
+};
+
+/*
+   A lazily started coroutine: the body runs when the task is awaited,
+   and the awaiter continues, on the same thread, once it finished.
+*/
+template <typename T>
+class XHTask
+{
+public:
+	typedef XHTaskPromise<T> promise_type;
+
+	XHTask() {}
+	XHTask(XHTask &&other) noexcept : handle(std::exchange(other.handle, nullptr)) {}
+	~XHTask()
+	{
+		if (handle)
+			handle.destroy();
+	}
+
+	XHTask &operator=(XHTask &&other) noexcept
+	{
+		if (this != &other) {
+			if (handle)
+				handle.destroy();
+			handle = std::exchange(other.handle, nullptr);
+		}
+		return *this;
+	}
+
+	bool isValid() const { return bool(handle); }
+	bool isDone() const { return !handle || handle.done(); }
+
+	bool await_ready() const noexcept { return !handle || handle.done(); }
+	std::coroutine_handle<> await_suspend(std::coroutine_handle<> awaiter) noexcept
+	{
+		handle.promise().continuation = awaiter;
+		return handle;
+	}
+	T await_resume() { return handle.promise().result(); }
+
+private:
+	XHTask(const XHTask &) = delete;
+	XHTask &operator=(const XHTask &) = delete;
+
+	explicit XHTask(std::coroutine_handle<promise_type> h) : handle(h) {}
+
+	friend class XHTaskPromise<T>;
+	std::coroutine_handle<promise_type> handle;
+};
+
+template <typename T>
+inline XHTask<T> XHTaskPromise<T>::get_return_object()
+{
+	return XHTask<T>(std::coroutine_handle<XHTaskPromise<T> >::from_promise(*this));
+}
+
+inline XHTask<void> XHTaskPromise<void>::get_return_object()
+{
+	return XHTask<void>(std::coroutine_handle<XHTaskPromise<void> >::from_promise(*this));
+}
+
+/*
+   Eagerly started coroutine nobody waits for; it frees itself when it
+   returns. Drives the lifecycle hooks and the tasks of whenAll().
+*/
+struct XHDetachedTask
+{
+	struct promise_type
+	{
+		XHDetachedTask get_return_object() const noexcept { return XHDetachedTask(); }
+		std::suspend_never initial_suspend() const noexcept { return {}; }
+		std::suspend_never final_suspend() const noexcept { return {}; }
+		void return_void() const noexcept {}
+		void unhandled_exception() const noexcept { std::terminate(); }
+	};
+};
+
+/*!
+    \class XHAsyncService
+
+    \brief The XHAsyncService class is a service whose start, stop,
+    pause and resume are coroutines.
+
+    Reimplement startAsync(), and stopAsync(), pauseAsync() and
+    resumeAsync() as needed, instead of the synchronous callbacks. They
+    run on the service thread, driven by the event loop that
+    executeApplication() runs, so slow initialization never holds up
+    the control handler and many I/O-bound steps overlap on one
+    thread:
+
+    \code
+    XHTask<> MyService::startAsync()
+    {
+        std::vector<XHTask<> > steps;
+        for (size_t i = 0; i < plcs.size(); ++i)
+            steps.push_back(connect(plcs[i]));
+        co_await whenAll(std::move(steps), "Connecting");
+    }
+
+    XHTask<> MyService::connect(Plc *plc)
+    {
+        bool ok = co_await completion<bool>([plc](std::function<void(bool)> done) {
+            plc->connectAsync(done);
+        });
+        if (!ok)
+            throw std::runtime_error("Cannot connect to " + plc->name());
+    }
+    \endcode
+
+    The service stays in the pending state until the coroutine returns
+    and keeps the service manager informed through reportProgress().
+    An exception escaping startAsync() is logged and stops the service
+    with exit code 1; one escaping pauseAsync() or resumeAsync()
+    leaves the service in its previous state. Transitions run one
+    after the other: a stop requested while startAsync() runs waits
+    for it, which can check stopRequested() to give up early.
+
+    This class needs a C++20 compiler; the library doesn't.
+
+    \sa XHServiceBase::deferTransition()
+*/
+class XHAsyncService : public XHServiceBase
+{
+public:
+	XHAsyncService(int argc, char **argv, const std::string &name)
+		: XHServiceBase(argc, argv, name), driving(false), stopping(false) {}
+
+	bool stopRequested() const { return stopping; }
+
+	/*
+	   co_await yield() lets the events and coroutines waiting on the
+	   service thread run before the coroutine continues.
+	*/
+	struct YieldAwaiter
+	{
+		bool await_ready() const noexcept { return false; }
+		void await_suspend(std::coroutine_handle<> handle) const
+		{
+			service->post([handle]() { handle.resume(); });
+		}
+		void await_resume() const noexcept {}
+
+		XHServiceBase *service;
+	};
+
+	YieldAwaiter yield() { return YieldAwaiter{ this }; }
+
+	/*
+	   co_await sleep(ms) continues after ms milliseconds, on one of
+	   the service's timers.
+	*/
+	struct SleepAwaiter
+	{
+		bool await_ready() const noexcept { return false; }
+		void await_suspend(std::coroutine_handle<> handle) const
+		{
+			service->singleShot(delayMs, [handle]() { handle.resume(); });
+		}
+		void await_resume() const noexcept {}
+
+		XHServiceBase *service;
+		int delayMs;
+	};
+
+	SleepAwaiter sleep(int delayMs) { return SleepAwaiter{ this, delayMs }; }
+
+	/*
+	   co_await completion<T>(begin) calls begin with a callback and
+	   suspends until the callback is called, from any thread, with
+	   the result. Adapts callback based asynchronous APIs.
+	*/
+	template <typename T>
+	struct CompletionAwaiter
+	{
+		bool await_ready() const noexcept { return false; }
+		void await_suspend(std::coroutine_handle<> handle)
+		{
+			XHServiceBase *s = service;
+			std::shared_ptr<T> r = result;
+			begin([s, r, handle](T value) {
+				*r = std::move(value);
+				s->post([handle]() { handle.resume(); });
+			});
+		}
+		T await_resume() { return std::move(*result); }
+
+		XHServiceBase *service;
+		std::function<void(std::function<void(T)>)> begin;
+		std::shared_ptr<T> result;
+	};
+
+	template <typename T>
+	CompletionAwaiter<T> completion(const std::function<void(std::function<void(T)>)> &begin)
+	{
+		return CompletionAwaiter<T>{ this, begin, std::make_shared<T>() };
+	}
+
+	/*
+	   co_await offload(function) runs a blocking function on the
+	   service's executor and continues on the service thread with its
+	   result, or its exception. Runs it in place when the executor
+	   doesn't take tasks any more.
+	*/
+	template <typename F>
+	struct OffloadAwaiter
+	{
+		typedef typename std::invoke_result<F>::type Result;
+		typedef typename std::conditional<std::is_void<Result>::value, char, Result>::type Value;
+
+		struct State
+		{
+			F function;
+			Value value;
+			std::exception_ptr exception;
+
+			void run()
+			{
+				try {
+					if constexpr (std::is_void<Result>::value)
+						function();
+					else
+						value = function();
+				} catch (...) {
+					exception = std::current_exception();
+				}
+			}
+		};
+
+		bool await_ready() const noexcept { return false; }
+		bool await_suspend(std::coroutine_handle<> handle)
+		{
+			XHServiceBase *s = service;
+			std::shared_ptr<State> st = state;
+			if (s->executor().post([s, st, handle]() {
+					st->run();
+					s->post([handle]() { handle.resume(); });
+				}))
+				return true;
+			st->run();
+			return false;
+		}
+		Result await_resume()
+		{
+			if (state->exception)
+				std::rethrow_exception(state->exception);
+			if constexpr (!std::is_void<Result>::value)
+				return std::move(state->value);
+		}
+
+		XHServiceBase *service;
+		std::shared_ptr<State> state;
+	};
+
+	template <typename F>
+	OffloadAwaiter<F> offload(F function)
+	{
+		typedef typename OffloadAwaiter<F>::State State;
+		return OffloadAwaiter<F>{ this,
+			std::shared_ptr<State>(new State{ std::move(function), {}, nullptr }) };
+	}
+
+	/*
+	   Runs the tasks concurrently on the service thread and returns
+	   once all of them finished, rethrowing the first exception. With
+	   a step name, every finished task is reported as progress.
+	*/
+	XHTask<> whenAll(std::vector<XHTask<> > tasks, const std::string &step = std::string())
+	{
+		struct State
+		{
+			size_t left;	// unfinished tasks, plus one until all are joined
+			size_t done;
+			size_t total;
+			std::coroutine_handle<> waiter;
+			std::exception_ptr exception;
+		};
+		struct Awaiter
+		{
+			bool await_ready() const noexcept { return tasks->empty(); }
+			bool await_suspend(std::coroutine_handle<> handle)
+			{
+				state->waiter = handle;
+				state->left = tasks->size() + 1;
+				state->done = 0;
+				state->total = tasks->size();
+				for (size_t i = 0; i < tasks->size(); ++i)
+					self->join((*tasks)[i], state, *step);
+				// Whatever finished without suspending has counted down
+				// already; the last one to finish resumes us.
+				return --state->left > 0;
+			}
+			void await_resume() const
+			{
+				if (state->exception)
+					std::rethrow_exception(state->exception);
+			}
+
+			XHAsyncService *self;
+			std::vector<XHTask<> > *tasks;
+			std::shared_ptr<State> state;
+			const std::string *step;
+		};
+		co_await Awaiter{ this, &tasks, std::make_shared<State>(), &step };
+	}
+
+	void start() override { enqueue(Starting); }
+	void stop() override
+	{
+		stopping = true;
+		enqueue(Stopping);
+	}
+
+protected:
+	virtual XHTask<> startAsync() = 0;
+	virtual XHTask<> stopAsync() { co_return; }
+	virtual XHTask<> pauseAsync() { co_return; }
+	virtual XHTask<> resumeAsync() { co_return; }
+
+	void pause() override { enqueue(Pausing); }
+	void resume() override { enqueue(Resuming); }
+
+private:
+	enum Transition { Starting, Stopping, Pausing, Resuming };
+
+	template <typename S>
+	XHDetachedTask join(XHTask<> &task, std::shared_ptr<S> state, std::string step)
+	{
+		try {
+			co_await task;
+		} catch (...) {
+			if (!state->exception)
+				state->exception = std::current_exception();
+		}
+		++state->done;
+		if (!step.empty() && state->total > 0) {
+			char text[32];
+			::snprintf(text, sizeof(text), " %zu/%zu", state->done, state->total);
+			reportProgress(step + text);
+		}
+		if (--state->left == 0)
+			state->waiter.resume();
+	}
+
+	// Defers the transition and lets drive() run the hooks one after
+	// the other, each from a fresh event.
+	void enqueue(Transition transition)
+	{
+		deferTransition();
+		queue.push_back(transition);
+		if (!driving) {
+			driving = true;
+			post([this]() { drive(); });
+		}
+	}
+
+	XHDetachedTask drive()
+	{
+		while (!queue.empty()) {
+			Transition transition = queue.front();
+			queue.erase(queue.begin());
+			bool success = true;
+			std::string error;
+			try {
+				XHTask<> task = transition == Starting ? startAsync()
+					: transition == Stopping ? stopAsync()
+					: transition == Pausing ? pauseAsync() : resumeAsync();
+				co_await task;
+			} catch (const std::exception &e) {
+				success = false;
+				error = e.what();
+			} catch (...) {
+				success = false;
+			}
+			if (!success && !error.empty())
+				logMessage(error, Error);
+			completeTransition(success);
+			if (transition == Stopping)
+				break;
+		}
+		queue.clear();
+		driving = false;
+	}
+
+	std::vector<Transition> queue;
+	bool driving;
+	bool stopping;
+};
+
+#endif // __cpp_impl_coroutine
+
+#endif // XHSERVICE_TASK_H
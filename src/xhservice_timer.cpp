@@ -0,0 +1,279 @@
+/****************************************************************************
+**
+**
+****************************************************************************/
+
+#include "xhservice_timer_p.h"
+#include <limits.h>
+#if defined(_MSC_VER)
+#  include <intrin.h>
+#endif
+
+static int lowestBit(uint64_t word)
+{
+#if defined(_MSC_VER)
+	unsigned long index;
+	_BitScanForward64(&index, word);
+	return (int)index;
+#else
+	return __builtin_ctzll(word);
+#endif
+}
+
+// Distance from bit 'from' to the next set bit of 'words', read as a
+// ring of 64 * count bits, or -1 if none is set.
+static int ringDistance(const uint64_t *words, int count, int from)
+{
+	int bits = count * 64;
+	int first = from / 64;
+	for (int k = 0; k <= count; ++k) {
+		int w = (first + k) % count;
+		uint64_t word = words[w];
+		if (k == 0)
+			word &= ~(uint64_t)0 << (from % 64);
+		else if (k == count)
+			word &= ((uint64_t)1 << (from % 64)) - 1;
+		if (word)
+			return (w * 64 + lowestBit(word) - from + bits) % bits;
+	}
+	return -1;
+}
+
+static int levelShift(int level)
+{
+	return 8 + (level - 1) * 6;
+}
+
+XHTimerWheel::XHTimerWheel()
+	: freeList(None), current(0), active(0), running(None)
+{
+	for (int i = 0; i <= Slots; ++i)
+		heads[i] = None;
+	for (int i = 0; i < Slots / 64; ++i)
+		occupied[i] = 0;
+}
+
+uint64_t XHTimerWheel::add(int64_t nowMs, int intervalMs, int slackMs, bool repeating,
+	const Callback &callback)
+{
+	// Nothing is placed relative to the old position: start afresh.
+	if (active == 0)
+		current = nowMs;
+	int32_t index;
+	if (freeList != None) {
+		index = freeList;
+		freeList = nodes[index].next;
+	} else {
+		index = (int32_t)nodes.size();
+		nodes.push_back(Node());
+	}
+	Node &node = nodes[index];
+	node.callback = callback;
+	node.interval = intervalMs > 0 ? intervalMs : 0;
+	node.slack = slackMs;
+	node.due = nowMs + node.interval;
+	node.repeating = repeating;
+	node.used = true;
+	node.cancelled = false;
+	schedule(index);
+	++active;
+	return ((uint64_t)node.generation << 32) | (uint32_t)(index + 1);
+}
+
+bool XHTimerWheel::cancel(uint64_t id)
+{
+	uint32_t index = (uint32_t)id - 1;
+	if (!(uint32_t)id || index >= nodes.size())
+		return false;
+	Node &node = nodes[index];
+	if (!node.used || node.cancelled || node.generation != (uint32_t)(id >> 32))
+		return false;
+	if ((int32_t)index == running) {
+		// Cancelled from its own callback: runTick() releases it. A
+		// single shot timer has fired already.
+		if (!node.repeating)
+			return false;
+		node.cancelled = true;
+		unlink(index);
+		return true;
+	}
+	unlink(index);
+	release(index);
+	return true;
+}
+
+int XHTimerWheel::advance(int64_t nowMs)
+{
+	int fired = 0;
+	while (active > 0 && current <= nowMs) {
+		int64_t tick = nextTick();
+		if (tick > nowMs) {
+			current = nowMs + 1;
+			break;
+		}
+		runTick(tick, nowMs, &fired);
+	}
+	return fired;
+}
+
+int XHTimerWheel::timeout(int64_t nowMs) const
+{
+	if (active == 0)
+		return -1;
+	int64_t tick = nextTick();
+	if (tick <= nowMs)
+		return 0;
+	return tick - nowMs > INT_MAX ? INT_MAX : (int)(tick - nowMs);
+}
+
+int64_t XHTimerWheel::roundUp(int64_t due, int slack)
+{
+	if (slack <= 1)
+		return due;
+	return (due + slack - 1) / slack * slack;
+}
+
+int XHTimerWheel::slotFor(int64_t expiry) const
+{
+	int64_t delta = expiry - current;
+	if (delta < RootSlots)
+		return (int)(expiry & (RootSlots - 1));
+	for (int level = 1; level < Levels; ++level) {
+		int shift = levelShift(level);
+		int64_t span = (int64_t)1 << (shift + LevelBits);
+		if (delta < span || level == Levels - 1) {
+			// Beyond the top level the timer goes round it again.
+			int64_t e = delta < span ? expiry : current + span - 1;
+			return RootSlots + (level - 1) * LevelSlots + (int)((e >> shift) & (LevelSlots - 1));
+		}
+	}
+	return None;
+}
+
+void XHTimerWheel::schedule(int32_t index)
+{
+	Node &node = nodes[index];
+	node.expiry = roundUp(node.due, node.slack);
+	if (node.expiry < current)
+		node.expiry = current;
+	link(index, slotFor(node.expiry));
+}
+
+void XHTimerWheel::link(int32_t index, int slot)
+{
+	Node &node = nodes[index];
+	node.slot = slot;
+	node.prev = None;
+	node.next = heads[slot];
+	if (node.next != None)
+		nodes[node.next].prev = index;
+	heads[slot] = index;
+	if (slot < Slots)
+		occupied[slot / 64] |= (uint64_t)1 << (slot % 64);
+}
+
+void XHTimerWheel::unlink(int32_t index)
+{
+	Node &node = nodes[index];
+	if (node.slot == None)
+		return;
+	if (node.prev != None)
+		nodes[node.prev].next = node.next;
+	else
+		heads[node.slot] = node.next;
+	if (node.next != None)
+		nodes[node.next].prev = node.prev;
+	if (heads[node.slot] == None && node.slot < Slots)
+		occupied[node.slot / 64] &= ~((uint64_t)1 << (node.slot % 64));
+	node.slot = None;
+	node.prev = node.next = None;
+}
+
+void XHTimerWheel::release(int32_t index)
+{
+	Node &node = nodes[index];
+	node.callback = Callback();
+	node.used = false;
+	node.cancelled = false;
+	++node.generation;
+	node.slot = None;
+	node.prev = None;
+	node.next = freeList;
+	freeList = index;
+	--active;
+}
+
+void XHTimerWheel::cascade(int slot)
+{
+	int32_t index = heads[slot];
+	heads[slot] = None;
+	occupied[slot / 64] &= ~((uint64_t)1 << (slot % 64));
+	while (index != None) {
+		int32_t next = nodes[index].next;
+		link(index, slotFor(nodes[index].expiry));
+		index = next;
+	}
+}
+
+void XHTimerWheel::runTick(int64_t tick, int64_t nowMs, int *fired)
+{
+	current = tick;
+	if ((tick & (RootSlots - 1)) == 0) {
+		for (int level = 1; level < Levels; ++level) {
+			int slot = (int)((tick >> levelShift(level)) & (LevelSlots - 1));
+			cascade(RootSlots + (level - 1) * LevelSlots + slot);
+			if (slot != 0)
+				break;
+		}
+	}
+
+	int root = (int)(tick & (RootSlots - 1));
+	heads[Firing] = heads[root];
+	heads[root] = None;
+	occupied[root / 64] &= ~((uint64_t)1 << (root % 64));
+	for (int32_t i = heads[Firing]; i != None; i = nodes[i].next)
+		nodes[i].slot = Firing;
+	// Timers added by the callbacks go to the next tick at the earliest.
+	current = tick + 1;
+
+	int32_t index;
+	while ((index = heads[Firing]) != None) {
+		Node &node = nodes[index];
+		unlink(index);
+		if (node.repeating) {
+			// Skip the periods missed while the loop was busy or paused
+			// instead of firing them all at once.
+			int64_t period = node.interval > 0 ? node.interval : 1;
+			node.due += period;
+			if (node.due <= nowMs)
+				node.due += ((nowMs - node.due) / period + 1) * period;
+			schedule(index);
+		}
+		running = index;
+		++*fired;
+		node.callback();
+		running = None;
+		if (!node.repeating || node.cancelled)
+			release(index);
+	}
+}
+
+int64_t XHTimerWheel::nextTick() const
+{
+	int64_t best = LLONG_MAX;
+	int d = ringDistance(occupied, RootSlots / 64, (int)(current & (RootSlots - 1)));
+	if (d >= 0)
+		best = current + d;
+	for (int level = 1; level < Levels; ++level) {
+		const uint64_t *word = &occupied[RootSlots / 64 + level - 1];
+		if (!*word)
+			continue;
+		// A slot of this level needs work at the start of its span.
+		int shift = levelShift(level);
+		int64_t base = (current + ((int64_t)1 << shift) - 1) >> shift;
+		int64_t tick = (base + ringDistance(word, 1, (int)(base & (LevelSlots - 1)))) << shift;
+		if (tick < best)
+			best = tick;
+	}
+	return best;
+}
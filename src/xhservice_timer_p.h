@@ -0,0 +1,106 @@
+/****************************************************************************
+**
+**
+****************************************************************************/
+
+#ifndef XHSERVICE_TIMER_P_H
+#define XHSERVICE_TIMER_P_H
+
+#include <deque>
+#include <functional>
+#include <stdint.h>
+
+/*
+   Hashed hierarchical timer wheel (Varghese and Lauck, in the layout
+   of the classic Linux timer wheel): a 256 slot root level of 1 ms
+   ticks and four 64 slot levels, each slot of one spanning a whole
+   turn of the level below, about 49 days in all. Timers live in
+   intrusive lists, so adding and cancelling are O(1); a timer due
+   further out is moved down a level whenever its slot comes round,
+   at most four times in its life.
+
+   One bit per slot tells which slots hold timers, so the next tick
+   that needs work is found with a handful of bit scans and the owner
+   sleeps until then instead of ticking every millisecond. Timers are
+   rounded up to their slack, so timers due within the same slack
+   window fire in one go.
+
+   Not thread-safe: everything runs on the thread of the event loop.
+*/
+class XHTimerWheel
+{
+public:
+	typedef std::function<void()> Callback;
+
+	XHTimerWheel();
+
+	// Times are milliseconds of a monotonic clock. Returns the timer's
+	// id, never 0.
+	uint64_t add(int64_t nowMs, int intervalMs, int slackMs, bool repeating, const Callback &callback);
+	bool cancel(uint64_t id);
+
+	// Runs the callbacks of the timers due by nowMs and returns how
+	// many ran.
+	int advance(int64_t nowMs);
+
+	// Milliseconds until advance() has work, -1 without timers.
+	int timeout(int64_t nowMs) const;
+
+	int count() const { return active; }
+
+private:
+	enum
+	{
+		RootBits = 8,
+		LevelBits = 6,
+		Levels = 5,
+		RootSlots = 1 << RootBits,
+		LevelSlots = 1 << LevelBits,
+		Slots = RootSlots + (Levels - 1) * LevelSlots,
+		Firing = Slots,	// list of the timers of the tick being run
+		None = -1
+	};
+
+	struct Node
+	{
+		Node()
+			: due(0), expiry(0), interval(0), slack(0), generation(0), prev(None), next(None),
+			slot(None), repeating(false), used(false), cancelled(false) {}
+
+		Callback callback;
+		int64_t due;	// before rounding to the slack
+		int64_t expiry;
+		int interval;
+		int slack;
+		uint32_t generation;
+		int32_t prev;
+		int32_t next;
+		int32_t slot;
+		bool repeating;
+		bool used;
+		bool cancelled;	// while its callback runs
+	};
+
+	XHTimerWheel(const XHTimerWheel &);
+	XHTimerWheel &operator=(const XHTimerWheel &);
+
+	static int64_t roundUp(int64_t due, int slack);
+	int slotFor(int64_t expiry) const;
+	void schedule(int32_t index);
+	void link(int32_t index, int slot);
+	void unlink(int32_t index);
+	void release(int32_t index);
+	void cascade(int slot);
+	void runTick(int64_t tick, int64_t nowMs, int *fired);
+	int64_t nextTick() const;
+
+	std::deque<Node> nodes;	// stable addresses: callbacks may add timers
+	int32_t freeList;
+	int32_t heads[Slots + 1];
+	uint64_t occupied[Slots / 64];
+	int64_t current;	// the first tick not run yet
+	int active;
+	int32_t running;
+};
+
+#endif // XHSERVICE_TIMER_P_H
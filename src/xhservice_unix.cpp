@@ -0,0 +1,2307 @@
+/****************************************************************************
+**
+**
+****************************************************************************/
+
+#include "xhservice.h"
+#include "xhservice_p.h"
+#include "xhservice_unix_p.h"
+#include <atomic>
+#include <deque>
+#include <map>
+#include <memory>
+#include <set>
+#include <thread>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <unistd.h>
+#include <time.h>
+#include <dirent.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/inotify.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+
+extern char **environ;
+
+/*
+   Service configuration lives in one "key=value" file per service.
+   Root installs go to /etc/xhservice, everybody else gets a per-user
+   directory. XHSERVICE_CONFIG_DIR overrides both.
+*/
+static std::string settingsDir()
+{
+	const char *dir = ::getenv("XHSERVICE_CONFIG_DIR");
+	if (dir && *dir)
+		return dir;
+	if (::geteuid() == 0)
+		return "/etc/xhservice";
+	const char *home = ::getenv("HOME");
+	return std::string(home && *home ? home : "/tmp") + "/.config/xhservice";
+}
+
+static std::string settingsFile(const std::string &name)
+{
+	return settingsDir() + "/" + name + ".conf";
+}
+
+static bool makePath(const std::string &path)
+{
+	std::string::size_type pos = 0;
+	while (pos != std::string::npos) {
+		pos = path.find('/', pos + 1);
+		std::string part = path.substr(0, pos);
+		if (::mkdir(part.c_str(), 0755) != 0 && errno != EEXIST)
+			return false;
+	}
+	return true;
+}
+
+static bool readSettings(const std::string &name, std::map<std::string, std::string> &values)
+{
+	FILE *f = ::fopen(settingsFile(name).c_str(), "r");
+	if (!f)
+		return false;
+	char line[4096];
+	while (::fgets(line, sizeof(line), f)) {
+		std::string s(line);
+		while (!s.empty() && (s[s.size() - 1] == '\n' || s[s.size() - 1] == '\r'))
+			s.erase(s.size() - 1);
+		std::string::size_type eq = s.find('=');
+		if (eq != std::string::npos)
+			values[s.substr(0, eq)] = s.substr(eq + 1);
+	}
+	::fclose(f);
+	return true;
+}
+
+static std::string readSetting(const std::string &name, const std::string &key)
+{
+	std::map<std::string, std::string> values;
+	readSettings(name, values);
+	return values[key];
+}
+
+static bool writeSettings(const std::string &name, const std::map<std::string, std::string> &values)
+{
+	if (!makePath(settingsDir()))
+		return false;
+	std::string file = settingsFile(name);
+	std::string tmp = file + ".tmp";
+	FILE *f = ::fopen(tmp.c_str(), "w");
+	if (!f)
+		return false;
+	for (std::map<std::string, std::string>::const_iterator it = values.begin(); it != values.end(); ++it)
+		::fprintf(f, "%s=%s\n", it->first.c_str(), it->second.c_str());
+	bool ok = ::fflush(f) == 0;
+	::fclose(f);
+	return ok && ::rename(tmp.c_str(), file.c_str()) == 0;
+}
+
+/*
+   Control sockets live in a directory only the service's user can
+   write to, so that nobody else can bind a socket in their place:
+   /run/xhservice for root, $XDG_RUNTIME_DIR/xhservice for everybody
+   else, or /tmp/xhservice-<uid> without a login session.
+   XHSERVICE_RUNTIME_DIR overrides all of them.
+*/
+std::string xhRuntimeDir()
+{
+	const char *dir = ::getenv("XHSERVICE_RUNTIME_DIR");
+	if (dir && *dir)
+		return dir;
+	if (::geteuid() == 0)
+		return "/run/xhservice";
+	const char *runtime = ::getenv("XDG_RUNTIME_DIR");
+	if (runtime && *runtime)
+		return std::string(runtime) + "/xhservice";
+	char fallback[64];
+	::snprintf(fallback, sizeof(fallback), "/tmp/xhservice-%u", (unsigned)::geteuid());
+	return fallback;
+}
+
+/*
+   Checks that the runtime directory is a directory of our own that
+   nobody else can write to, creating it with mode 0700 first if
+   \a create is set. Nothing in the directory is probed, unlinked or
+   trusted before this succeeded; a directory somebody else made in
+   /tmp fails here.
+*/
+bool xhCheckRuntimeDir(bool create)
+{
+	std::string dir = xhRuntimeDir();
+	if (create) {
+		std::string::size_type slash = dir.rfind('/');
+		if (slash != std::string::npos && slash > 0 && !makePath(dir.substr(0, slash)))
+			return false;
+		if (::mkdir(dir.c_str(), 0700) != 0 && errno != EEXIST)
+			return false;
+	}
+	struct stat st;
+	if (::lstat(dir.c_str(), &st) != 0 || !S_ISDIR(st.st_mode))
+		return false;
+	if (st.st_uid != ::geteuid() || (st.st_mode & (S_IWGRP | S_IWOTH))) {
+		if (create)
+			fprintf(stderr, "The runtime directory %s is not private to this user\n", dir.c_str());
+		return false;
+	}
+	return true;
+}
+
+std::string xhControlSocketPath(const std::string &serviceName)
+{
+	return xhRuntimeDir() + "/xhservice-" + serviceName + ".sock";
+}
+
+static bool fillSocketAddress(const std::string &path, sockaddr_un &addr)
+{
+	::memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	if (path.size() >= sizeof(addr.sun_path))
+		return false;
+	::memcpy(addr.sun_path, path.c_str(), path.size());
+	return true;
+}
+
+int xhControlConnect(const std::string &serviceName, int timeoutMs)
+{
+	sockaddr_un addr;
+	if (!xhCheckRuntimeDir(false) || !fillSocketAddress(xhControlSocketPath(serviceName), addr))
+		return -1;
+	int fd = ::socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd < 0)
+		return -1;
+	if (timeoutMs > 0) {
+		timeval tv;
+		tv.tv_sec = timeoutMs / 1000;
+		tv.tv_usec = (timeoutMs % 1000) * 1000;
+		::setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+		::setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+	}
+	if (::connect(fd, (sockaddr *)&addr, sizeof(addr)) != 0) {
+		::close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+bool xhControlWrite(int fd, const void *data, size_t size)
+{
+	const char *p = (const char *)data;
+	while (size > 0) {
+		ssize_t n = ::send(fd, p, size, MSG_NOSIGNAL);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return false;
+		p += n;
+		size -= n;
+	}
+	return true;
+}
+
+bool xhControlRead(int fd, void *data, size_t size)
+{
+	char *p = (char *)data;
+	while (size > 0) {
+		ssize_t n = ::recv(fd, p, size, 0);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return false;
+		p += n;
+		size -= n;
+	}
+	return true;
+}
+
+bool xhControlTransact(const std::string &serviceName, uint16_t op, int32_t code,
+	int32_t *result, int timeoutMs, const std::string &payload, std::string *reply)
+{
+	int fd = xhControlConnect(serviceName, timeoutMs);
+	if (fd < 0)
+		return false;
+	XHControlHeader request;
+	request.length = (uint32_t)payload.size();
+	request.requestId = 1;
+	request.op = op;
+	request.flags = 0;
+	request.code = code;
+	XHControlHeader header;
+	bool ok = xhControlWrite(fd, &request, sizeof(request))
+		&& (payload.empty() || xhControlWrite(fd, payload.data(), payload.size()))
+		&& xhControlRead(fd, &header, sizeof(header))
+		&& header.requestId == request.requestId;
+	// Replies to the basic operations carry no payload, drain it anyway.
+	std::vector<char> replyData(ok ? header.length : 0);
+	if (ok && header.length > 0)
+		ok = header.length <= XHControlMaxPayload && xhControlRead(fd, replyData.data(), replyData.size());
+	::close(fd);
+	if (ok && result)
+		*result = header.code;
+	if (ok && reply)
+		reply->assign(replyData.begin(), replyData.end());
+	return ok;
+}
+
+/*
+   Launches 'path' as a daemon: double fork, new session, stdio on
+   /dev/null and XHSERVICE_RUN set so XHServiceBase::exec() runs the
+   service. A close-on-exec pipe reports an exec() failure back to
+   the caller. Everything the child needs is prepared before fork()
+   since the caller may be multithreaded.
+
+   A 'handoffFd' is kept open across exec() and announced to the new
+   process in XHSERVICE_HANDOFF_FD; the upgrade passes the descriptors
+   of the running instance through it.
+*/
+bool xhLaunchDaemon(const std::string &path, const std::vector<std::string> &arguments,
+	int handoffFd)
+{
+	std::vector<char *> argv;
+	argv.push_back(const_cast<char *>(path.c_str()));
+	for (size_t i = 0; i < arguments.size(); ++i)
+		argv.push_back(const_cast<char *>(arguments[i].c_str()));
+	argv.push_back(0);
+
+	static char runEnv[] = "XHSERVICE_RUN=1";
+	char handoffEnv[48];
+	::snprintf(handoffEnv, sizeof(handoffEnv), "XHSERVICE_HANDOFF_FD=%d", handoffFd);
+	std::vector<char *> envp;
+	for (char **e = environ; e && *e; ++e) {
+		if (::strncmp(*e, "XHSERVICE_RUN=", 14) != 0
+			&& ::strncmp(*e, "XHSERVICE_HANDOFF_FD=", 21) != 0)
+			envp.push_back(*e);
+	}
+	envp.push_back(runEnv);
+	if (handoffFd >= 0)
+		envp.push_back(handoffEnv);
+	envp.push_back(0);
+
+	int pfd[2];
+	if (::pipe2(pfd, O_CLOEXEC) != 0)
+		return false;
+
+	pid_t pid = ::fork();
+	if (pid < 0) {
+		::close(pfd[0]);
+		::close(pfd[1]);
+		return false;
+	}
+	if (pid == 0) {
+		::close(pfd[0]);
+		::setsid();
+		pid_t daemonPid = ::fork();
+		if (daemonPid != 0)
+			::_exit(daemonPid < 0 ? 1 : 0);
+		sigset_t none;
+		::sigemptyset(&none);
+		::sigprocmask(SIG_SETMASK, &none, 0);
+		if (::chdir("/") != 0)
+			::_exit(126);
+		::umask(022);
+		int null = ::open("/dev/null", O_RDWR);
+		if (null >= 0) {
+			::dup2(null, 0);
+			::dup2(null, 1);
+			::dup2(null, 2);
+			if (null > 2)
+				::close(null);
+		}
+		if (handoffFd >= 0)
+			::fcntl(handoffFd, F_SETFD, 0);
+		::execve(path.c_str(), argv.data(), envp.data());
+		int err = errno;
+		ssize_t ignored = ::write(pfd[1], &err, sizeof(err));
+		(void)ignored;
+		::_exit(127);
+	}
+
+	::close(pfd[1]);
+	int status = 0;
+	while (::waitpid(pid, &status, 0) < 0 && errno == EINTR)
+		;
+	int err = 0;
+	ssize_t n;
+	while ((n = ::read(pfd[0], &err, sizeof(err))) < 0 && errno == EINTR)
+		;
+	::close(pfd[0]);
+	return WIFEXITED(status) && WEXITSTATUS(status) == 0 && n == 0;
+}
+
+/*
+   One message: a header with the size of the names that follow, the
+   descriptors riding along as SCM_RIGHTS ancillary data of the header.
+*/
+bool xhSendDescriptors(int socket, const std::vector<std::string> &names, const std::vector<int> &fds)
+{
+	if (names.size() != fds.size() || fds.size() > XHHandoffMaxDescriptors)
+		return false;
+	std::string data;
+	for (size_t i = 0; i < names.size(); ++i)
+		data.append(names[i].c_str(), names[i].size() + 1);
+	uint32_t header[2] = { (uint32_t)data.size(), (uint32_t)fds.size() };
+
+	iovec iov;
+	iov.iov_base = header;
+	iov.iov_len = sizeof(header);
+	msghdr msg;
+	::memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	std::vector<char> control(CMSG_SPACE(sizeof(int) * XHHandoffMaxDescriptors));
+	if (!fds.empty()) {
+		msg.msg_control = control.data();
+		msg.msg_controllen = CMSG_SPACE(sizeof(int) * fds.size());
+		cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+		cmsg->cmsg_level = SOL_SOCKET;
+		cmsg->cmsg_type = SCM_RIGHTS;
+		cmsg->cmsg_len = CMSG_LEN(sizeof(int) * fds.size());
+		::memcpy(CMSG_DATA(cmsg), fds.data(), sizeof(int) * fds.size());
+	}
+	ssize_t n;
+	while ((n = ::sendmsg(socket, &msg, MSG_NOSIGNAL)) < 0 && errno == EINTR)
+		;
+	return n == (ssize_t)sizeof(header) && xhControlWrite(socket, data.data(), data.size());
+}
+
+bool xhReceiveDescriptors(int socket, std::vector<std::string> *names, std::vector<int> *fds,
+	int timeoutMs)
+{
+	pollfd pfd;
+	pfd.fd = socket;
+	pfd.events = POLLIN;
+	int ready;
+	while ((ready = ::poll(&pfd, 1, timeoutMs)) < 0 && errno == EINTR)
+		;
+	if (ready <= 0)
+		return false;
+
+	uint32_t header[2];
+	iovec iov;
+	iov.iov_base = header;
+	iov.iov_len = sizeof(header);
+	msghdr msg;
+	::memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	std::vector<char> control(CMSG_SPACE(sizeof(int) * XHHandoffMaxDescriptors));
+	msg.msg_control = control.data();
+	msg.msg_controllen = control.size();
+	ssize_t n;
+	while ((n = ::recvmsg(socket, &msg, MSG_WAITALL | MSG_CMSG_CLOEXEC)) < 0 && errno == EINTR)
+		;
+	std::vector<int> received;
+	for (cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+		if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+			size_t count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+			const int *p = (const int *)CMSG_DATA(cmsg);
+			received.insert(received.end(), p, p + count);
+		}
+	}
+
+	std::vector<char> data;
+	bool ok = n == (ssize_t)sizeof(header) && !(msg.msg_flags & MSG_CTRUNC)
+		&& header[1] == received.size() && header[0] <= XHControlMaxPayload;
+	if (ok) {
+		data.resize(header[0]);
+		ok = data.empty() || xhControlRead(socket, data.data(), data.size());
+	}
+	if (ok) {
+		size_t pos = 0;
+		for (size_t i = 0; ok && i < received.size(); ++i) {
+			size_t end = pos;
+			while (end < data.size() && data[end])
+				++end;
+			ok = end < data.size();
+			if (ok)
+				names->push_back(std::string(data.data() + pos, end - pos));
+			pos = end + 1;
+		}
+	}
+	if (!ok) {
+		names->clear();
+		for (size_t i = 0; i < received.size(); ++i)
+			::close(received[i]);
+		return false;
+	}
+	fds->insert(fds->end(), received.begin(), received.end());
+	return true;
+}
+
+/*
+   sd_notify() protocol: newline separated assignments sent as one
+   datagram to the socket named by NOTIFY_SOCKET ('@' for the abstract
+   namespace). Under systemd this needs Type=notify and, as the
+   service runs with XHSERVICE_RUN=1 in the unit's environment, no
+   extra library.
+*/
+bool xhNotifyServiceManager(const std::string &state)
+{
+	const char *path = ::getenv("NOTIFY_SOCKET");
+	if (!path || (path[0] != '/' && path[0] != '@') || !path[1])
+		return false;
+	sockaddr_un addr;
+	::memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	size_t len = ::strlen(path);
+	if (len >= sizeof(addr.sun_path))
+		return false;
+	::memcpy(addr.sun_path, path, len);
+	if (addr.sun_path[0] == '@')
+		addr.sun_path[0] = 0;
+	int fd = ::socket(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+	if (fd < 0)
+		return false;
+	ssize_t n = ::sendto(fd, state.data(), state.size(), MSG_NOSIGNAL, (const sockaddr *)&addr,
+		(socklen_t)(offsetof(sockaddr_un, sun_path) + len));
+	::close(fd);
+	return n == (ssize_t)state.size();
+}
+
+int64_t xhMonotonicMs()
+{
+	// CLOCK_MONOTONIC is served by the vDSO, no system call.
+	timespec ts;
+	::clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+int64_t xhCurrentPid()
+{
+	return ::getpid();
+}
+
+/*
+   The status page is a POSIX shared memory object named after the
+   service. It isn't unlinked when the service stops, so controllers
+   that keep it mapped see the next instance too.
+*/
+bool xhMapStatusPage(const std::string &serviceName, bool writable, XHStatusMapping *mapping)
+{
+	std::string name = "/xhservice." + serviceName;
+	int fd = ::shm_open(name.c_str(), writable ? O_RDWR | O_CREAT | O_CLOEXEC : O_RDONLY | O_CLOEXEC, 0644);
+	if (fd < 0)
+		return false;
+	struct stat st;
+	bool ok;
+	if (writable)
+		ok = ::fchmod(fd, 0644) == 0 && ::ftruncate(fd, sizeof(XHStatusPage)) == 0;
+	else
+		ok = ::fstat(fd, &st) == 0 && (size_t)st.st_size >= sizeof(XHStatusPage);
+	void *page = MAP_FAILED;
+	if (ok)
+		page = ::mmap(0, sizeof(XHStatusPage), writable ? PROT_READ | PROT_WRITE : PROT_READ,
+			MAP_SHARED, fd, 0);
+	::close(fd);
+	if (page == MAP_FAILED)
+		return false;
+	mapping->page = (XHStatusPage *)page;
+	return true;
+}
+
+void xhUnmapStatusPage(XHStatusMapping *mapping)
+{
+	if (mapping->page)
+		::munmap(mapping->page, sizeof(XHStatusPage));
+	mapping->page = 0;
+}
+
+XHProcessSampler::XHProcessSampler()
+	: statFile(-1), fdDirectory(0), pageSize(::sysconf(_SC_PAGESIZE))
+{
+}
+
+XHProcessSampler::~XHProcessSampler()
+{
+	close();
+}
+
+bool XHProcessSampler::open()
+{
+	if (statFile < 0)
+		statFile = ::open("/proc/self/stat", O_RDONLY | O_CLOEXEC);
+	if (!fdDirectory)
+		fdDirectory = ::opendir("/proc/self/fd");
+	return statFile >= 0;
+}
+
+void XHProcessSampler::close()
+{
+	if (statFile >= 0)
+		::close((int)statFile);
+	if (fdDirectory)
+		::closedir((DIR *)fdDirectory);
+	statFile = -1;
+	fdDirectory = 0;
+}
+
+/*
+   CPU time and context switches come from getrusage(), which sums them
+   over all threads (the switches in /proc/self/status are the main
+   thread's only). Threads and the resident set come from
+   /proc/self/stat; procfs regenerates it for every read at offset 0,
+   so the file stays open. The open descriptors are counted by reading
+   /proc/self/fd again.
+*/
+bool XHProcessSampler::sample(XHStatusSample *sample)
+{
+	if (statFile < 0)
+		return false;
+	rusage usage;
+	if (::getrusage(RUSAGE_SELF, &usage) != 0)
+		return false;
+	sample->userTime = (int64_t)usage.ru_utime.tv_sec * 1000000 + usage.ru_utime.tv_usec;
+	sample->systemTime = (int64_t)usage.ru_stime.tv_sec * 1000000 + usage.ru_stime.tv_usec;
+	sample->voluntarySwitches = usage.ru_nvcsw;
+	sample->involuntarySwitches = usage.ru_nivcsw;
+
+	sample->threads = -1;
+	sample->residentBytes = -1;
+	char buffer[1024];
+	ssize_t n = ::pread((int)statFile, buffer, sizeof(buffer) - 1, 0);
+	if (n > 0) {
+		buffer[n] = 0;
+		// The command name may contain anything, spaces and parentheses
+		// included; the fields after it start at the last ')'. From
+		// there, num_threads is the 18th field and rss the 22nd.
+		const char *p = ::strrchr(buffer, ')');
+		for (int field = 0; p && *p; ++field) {
+			p = ::strchr(p, ' ');
+			if (!p)
+				break;
+			++p;
+			if (field == 17)
+				sample->threads = (int32_t)::strtol(p, 0, 10);
+			else if (field == 21) {
+				sample->residentBytes = ::strtoll(p, 0, 10) * pageSize;
+				break;
+			}
+		}
+	}
+
+	sample->openFiles = -1;
+	if (DIR *dir = (DIR *)fdDirectory) {
+		::rewinddir(dir);
+		int count = 0;
+		while (dirent *entry = ::readdir(dir)) {
+			if (entry->d_name[0] != '.')
+				++count;
+		}
+		// Without the descriptor of the directory itself.
+		sample->openFiles = count - 1;
+	}
+	return true;
+}
+
+bool XHServiceController::isInstalled() const
+{
+	return ::access(settingsFile(d_ptr->serviceName).c_str(), F_OK) == 0;
+}
+
+bool XHServiceController::isRunning() const
+{
+	XHStatusSnapshot status;
+	if (d_ptr->readStatus(&status))
+		return status.state != XHServiceStopped;
+	int32_t state = 0;
+	if (!xhControlTransact(d_ptr->serviceName, XHControlAlive, 0, &state))
+		return false;
+	return state != XHServiceStopped;
+}
+
+std::string XHServiceController::serviceFilePath() const
+{
+	XHStatusSnapshot status;
+	if (d_ptr->readStatus(&status) && status.state != XHServiceStopped)
+		return status.filePath;
+	return readSetting(d_ptr->serviceName, "path");
+}
+
+std::string XHServiceController::serviceDescription() const
+{
+	XHStatusSnapshot status;
+	if (d_ptr->readStatus(&status) && status.state != XHServiceStopped)
+		return status.description;
+	return readSetting(d_ptr->serviceName, "description");
+}
+
+XHServiceController::StartupType XHServiceController::startupType() const
+{
+	XHStatusSnapshot status;
+	if (d_ptr->readStatus(&status) && status.state != XHServiceStopped)
+		return (StartupType)status.startupType;
+	std::string type = readSetting(d_ptr->serviceName, "startupType");
+	return type == "0" ? AutoStartup : ManualStartup;
+}
+
+void XHServiceControllerPrivate::queryStatus(XHServiceStatus *status)
+{
+	std::map<std::string, std::string> values;
+	status->installed = readSettings(serviceName, values);
+	status->filePath = values["path"];
+	status->description = values["description"];
+	status->startupType = values["startupType"] == "0" ? XHServiceController::AutoStartup
+		: XHServiceController::ManualStartup;
+
+	XHStatusSnapshot snapshot;
+	if (readStatus(&snapshot)) {
+		status->state = (XHServiceController::State)snapshot.state;
+		status->drainDuration = snapshot.drainDuration;
+		status->abortedOperations = snapshot.drainAborted;
+		status->restarts = snapshot.restarts;
+		if (snapshot.state != XHServiceStopped) {
+			status->filePath = snapshot.filePath;
+			status->description = snapshot.description;
+			status->startupType = (XHServiceController::StartupType)snapshot.startupType;
+			status->pid = snapshot.pid;
+			status->startTime = snapshot.startTime;
+			status->checkPoint = snapshot.checkPoint;
+			status->waitHint = snapshot.waitHint;
+		}
+		return;
+	}
+	int32_t state = 0;
+	if (xhControlTransact(serviceName, XHControlAlive, 0, &state) && state > 0)
+		status->state = (XHServiceController::State)state;
+}
+
+bool XHServiceController::uninstall()
+{
+	return ::unlink(settingsFile(d_ptr->serviceName).c_str()) == 0;
+}
+
+bool XHServiceController::start(const std::vector<std::string> &args)
+{
+	std::string path = serviceFilePath();
+	if (path.empty())
+		return false;
+	return xhLaunchDaemon(path, args);
+}
+
+bool XHServiceController::stop()
+{
+	int timeoutMs = d_ptr->stopTimeout();
+	int32_t result = -1;
+	if (!xhControlTransact(d_ptr->serviceName, XHControlTerminate, 0, &result) || result < 0)
+		return false;
+	// The reply only says the stop was queued. The service drains,
+	// calls stop() and unwinds executeApplication() before it reports
+	// itself stopped.
+	int64_t deadline = xhMonotonicMs() + timeoutMs;
+	while (isRunning()) {
+		if (timeoutMs >= 0 && xhMonotonicMs() >= deadline)
+			return false;
+		::usleep(10 * 1000);
+	}
+	return true;
+}
+
+bool XHServiceController::upgrade(const std::string &filePath)
+{
+	int32_t result = -1;
+	return xhControlTransact(d_ptr->serviceName, XHControlUpgrade, 0, &result, 5000, filePath)
+		&& result >= 0;
+}
+
+std::vector<XHMetricSample> XHServiceController::metrics() const
+{
+	std::string report;
+	int32_t result = -1;
+	std::vector<XHMetricSample> samples;
+	if (xhControlTransact(d_ptr->serviceName, XHControlMetrics, XHMetricsRegistry::BinarySnapshot,
+		&result, 5000, std::string(), &report) && result >= 0)
+		XHMetricsRegistry::decode(report, &samples);
+	return samples;
+}
+
+std::string XHServiceController::metricsReport(XHMetricsRegistry::Format format) const
+{
+	std::string report;
+	int32_t result = -1;
+	if (!xhControlTransact(d_ptr->serviceName, XHControlMetrics, format, &result, 5000,
+		std::string(), &report) || result < 0)
+		return std::string();
+	return report;
+}
+
+bool XHServiceController::pause()
+{
+	int32_t result = -1;
+	return xhControlTransact(d_ptr->serviceName, XHControlPause, 0, &result) && result >= 0;
+}
+
+bool XHServiceController::resume()
+{
+	int32_t result = -1;
+	return xhControlTransact(d_ptr->serviceName, XHControlResume, 0, &result) && result >= 0;
+}
+
+bool XHServiceController::sendCommand(int code)
+{
+	if (code < 0 || code > 127)
+		return false;
+	int32_t result = -1;
+	return xhControlTransact(d_ptr->serviceName, XHControlCommand, code, &result) && result >= 0;
+}
+
+/*
+   The call() slab is a memfd owned by the controller and sealed
+   against shrinking, so the service can map it without a controller
+   pulling the pages from under it. Either side grows it as needed.
+*/
+static int createSlab()
+{
+	int slab = ::memfd_create("xhservice-call", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+	if (slab >= 0 && ::fcntl(slab, F_ADD_SEALS, F_SEAL_SHRINK) != 0) {
+		::close(slab);
+		return -1;
+	}
+	return slab;
+}
+
+static bool readSlab(int slab, size_t size, std::string *data)
+{
+	struct stat st;
+	if (::fstat(slab, &st) != 0 || (size_t)st.st_size < size)
+		return false;
+	data->clear();
+	if (size == 0)
+		return true;
+	void *map = ::mmap(0, size, PROT_READ, MAP_SHARED, slab, 0);
+	if (map == MAP_FAILED)
+		return false;
+	data->assign((const char *)map, size);
+	::munmap(map, size);
+	return true;
+}
+
+static bool writeSlab(int slab, const std::string &data)
+{
+	struct stat st;
+	if (::fstat(slab, &st) != 0 || ((size_t)st.st_size < data.size() && ::ftruncate(slab, data.size()) != 0))
+		return false;
+	void *map = ::mmap(0, data.size(), PROT_WRITE, MAP_SHARED, slab, 0);
+	if (map == MAP_FAILED)
+		return false;
+	::memcpy(map, data.data(), data.size());
+	::munmap(map, data.size());
+	return true;
+}
+
+bool XHServiceControllerPrivate::sysReserveSlab(size_t size)
+{
+	if (callSlab < 0) {
+		callSlab = createSlab();
+		if (callSlab < 0)
+			return false;
+	}
+	struct stat st;
+	if (::fstat(callSlab, &st) != 0)
+		return false;
+	size_t fileSize = st.st_size;
+	if (fileSize < size) {
+		if (::ftruncate(callSlab, size) != 0)
+			return false;
+		fileSize = size;
+	}
+	if (fileSize > callSlabSize) {
+		if (callSlabData)
+			::munmap(callSlabData, callSlabSize);
+		callSlabData = ::mmap(0, fileSize, PROT_READ | PROT_WRITE, MAP_SHARED, callSlab, 0);
+		if (callSlabData == MAP_FAILED) {
+			callSlabData = 0;
+			callSlabSize = 0;
+			return false;
+		}
+		callSlabSize = fileSize;
+	}
+	return true;
+}
+
+void XHServiceControllerPrivate::sysReleaseSlab()
+{
+	if (callSlabData)
+		::munmap(callSlabData, callSlabSize);
+	if (callSlab >= 0)
+		::close(callSlab);
+	callSlab = -1;
+	callSlabData = 0;
+	callSlabSize = 0;
+}
+
+static bool sendControlHeader(int socket, const XHControlHeader &header, int fd)
+{
+	iovec iov;
+	iov.iov_base = (void *)&header;
+	iov.iov_len = sizeof(header);
+	msghdr msg;
+	::memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	char control[CMSG_SPACE(sizeof(int))];
+	msg.msg_control = control;
+	msg.msg_controllen = sizeof(control);
+	cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+	::memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+	ssize_t n;
+	while ((n = ::sendmsg(socket, &msg, MSG_NOSIGNAL)) < 0 && errno == EINTR)
+		;
+	return n == (ssize_t)sizeof(header);
+}
+
+bool XHServiceController::call(int code, const std::string &request, std::string *reply, int timeoutMs)
+{
+	if (request.size() > XHControlMaxPayload)
+		return false;
+	std::lock_guard<std::mutex> lock(d_ptr->callMutex);
+	bool slab = request.size() >= XHControlSlabThreshold;
+	if (!d_ptr->sysReserveSlab(slab ? request.size() : 0))
+		return false;
+	if (slab)
+		::memcpy(d_ptr->callSlabData, request.data(), request.size());
+
+	int fd = xhControlConnect(d_ptr->serviceName, timeoutMs);
+	if (fd < 0)
+		return false;
+	XHControlHeader header;
+	header.length = (uint32_t)request.size();
+	header.requestId = 1;
+	header.op = XHControlCall;
+	header.flags = slab ? XHControlSlab : 0;
+	header.code = code;
+	bool ok = sendControlHeader(fd, header, d_ptr->callSlab)
+		&& (slab || request.empty() || xhControlWrite(fd, request.data(), request.size()))
+		&& xhControlRead(fd, &header, sizeof(header))
+		&& header.requestId == 1 && header.op == XHControlCall
+		&& header.length <= XHControlMaxPayload;
+	std::string data;
+	if (ok && (header.flags & XHControlSlab)) {
+		// The service may have grown the slab for the reply.
+		ok = d_ptr->sysReserveSlab(header.length);
+		if (ok)
+			data.assign((const char *)d_ptr->callSlabData, header.length);
+	} else if (ok && header.length > 0) {
+		data.resize(header.length);
+		ok = xhControlRead(fd, &data[0], data.size());
+	}
+	::close(fd);
+	if (ok && reply)
+		reply->swap(data);
+	return ok && header.code >= 0;
+}
+
+/*
+   The persistent connection of the asynchronous controller calls.
+   Requests go out under 'mutex' with increasing ids without waiting
+   for earlier replies; a reader thread matches the replies to their
+   completions by id. When the connection breaks every pending request
+   fails, and the next one connects again.
+*/
+class XHControlChannel
+{
+public:
+	typedef std::function<void(bool ok, int32_t code, std::string &data)> Completion;
+
+	explicit XHControlChannel(const std::string &name)
+		: serviceName(name), fd(-1), nextId(1) {}
+	~XHControlChannel();
+
+	void send(uint16_t op, int32_t code, const std::string &payload, int slab,
+		const Completion &completion);
+
+private:
+	struct Pending
+	{
+		Completion completion;
+		int slab;	// owned, calls only
+	};
+
+	void readReplies(int socket);
+
+	std::string serviceName;
+	std::mutex mutex;
+	int fd;
+	uint32_t nextId;
+	std::map<uint32_t, Pending> pending;
+	std::thread reader;
+};
+
+XHControlChannel::~XHControlChannel()
+{
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		if (fd >= 0)
+			::shutdown(fd, SHUT_RDWR);
+	}
+	if (reader.joinable())
+		reader.join();
+}
+
+/*
+   Takes ownership of 'slab'. A call's payload is in the slab when it
+   is XHControlSlabThreshold bytes or more.
+*/
+void XHControlChannel::send(uint16_t op, int32_t code, const std::string &payload, int slab,
+	const Completion &completion)
+{
+	std::unique_lock<std::mutex> lock(mutex);
+	if (fd < 0) {
+		// The reader of the previous connection is done with the lock.
+		if (reader.joinable()) {
+			lock.unlock();
+			reader.join();
+			lock.lock();
+		}
+		if (fd < 0) {
+			// No receive timeout: the reader waits for as long as
+			// requests are pending.
+			fd = xhControlConnect(serviceName, 0);
+			if (fd >= 0) {
+				timeval tv;
+				tv.tv_sec = 5;
+				tv.tv_usec = 0;
+				::setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+				reader = std::thread(&XHControlChannel::readReplies, this, fd);
+			}
+		}
+	}
+	if (fd < 0) {
+		lock.unlock();
+		if (slab >= 0)
+			::close(slab);
+		std::string none;
+		completion(false, -1, none);
+		return;
+	}
+
+	XHControlHeader header;
+	header.length = (uint32_t)payload.size();
+	header.requestId = nextId++;
+	header.op = op;
+	header.flags = slab >= 0 && payload.size() >= XHControlSlabThreshold ? XHControlSlab : 0;
+	header.code = code;
+	Pending &p = pending[header.requestId];
+	p.completion = completion;
+	p.slab = slab;
+	bool inlinePayload = !(header.flags & XHControlSlab) && !payload.empty();
+	bool ok = slab >= 0 ? sendControlHeader(fd, header, slab) : xhControlWrite(fd, &header, sizeof(header));
+	if (!ok || (inlinePayload && !xhControlWrite(fd, payload.data(), payload.size()))) {
+		// Half a request on the wire: drop the connection, the reader
+		// fails everything pending, this request included.
+		::shutdown(fd, SHUT_RDWR);
+	}
+}
+
+void XHControlChannel::readReplies(int socket)
+{
+	for (;;) {
+		XHControlHeader header;
+		if (!xhControlRead(socket, &header, sizeof(header)) || header.length > XHControlMaxPayload)
+			break;
+		std::string data;
+		bool ok = true;
+		if (!(header.flags & XHControlSlab) && header.length > 0) {
+			data.resize(header.length);
+			ok = xhControlRead(socket, &data[0], data.size());
+		}
+		if (!ok)
+			break;
+
+		Pending p;
+		p.slab = -1;
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			std::map<uint32_t, Pending>::iterator it = pending.find(header.requestId);
+			if (it == pending.end())
+				continue;
+			p = it->second;
+			pending.erase(it);
+		}
+		if (header.flags & XHControlSlab)
+			ok = p.slab >= 0 && readSlab(p.slab, header.length, &data);
+		if (p.slab >= 0)
+			::close(p.slab);
+		p.completion(ok, header.code, data);
+	}
+
+	std::map<uint32_t, Pending> failed;
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		failed.swap(pending);
+		::close(socket);
+		fd = -1;
+	}
+	std::string none;
+	for (std::map<uint32_t, Pending>::iterator it = failed.begin(); it != failed.end(); ++it) {
+		if (it->second.slab >= 0)
+			::close(it->second.slab);
+		it->second.completion(false, -1, none);
+	}
+}
+
+void XHServiceControllerPrivate::sysCloseChannel()
+{
+	delete channel;
+	channel = 0;
+}
+
+static XHControlChannel *controlChannel(XHServiceControllerPrivate *d)
+{
+	std::call_once(d->channelOnce, [d]() {
+		d->channel = new XHControlChannel(d->serviceName);
+	});
+	return d->channel;
+}
+
+static std::future<bool> postAsync(XHServiceControllerPrivate *d, uint16_t op, int32_t code)
+{
+	std::shared_ptr<std::promise<bool> > promise = std::make_shared<std::promise<bool> >();
+	std::future<bool> future = promise->get_future();
+	controlChannel(d)->send(op, code, std::string(), -1,
+		[promise](bool ok, int32_t result, std::string &) {
+			promise->set_value(ok && result >= 0);
+		});
+	return future;
+}
+
+static std::future<bool> readyFuture(bool value)
+{
+	std::promise<bool> promise;
+	promise.set_value(value);
+	return promise.get_future();
+}
+
+std::future<bool> XHServiceController::stopAsync()
+{
+	return postAsync(d_ptr, XHControlTerminate, 0);
+}
+
+std::future<bool> XHServiceController::pauseAsync()
+{
+	return postAsync(d_ptr, XHControlPause, 0);
+}
+
+std::future<bool> XHServiceController::resumeAsync()
+{
+	return postAsync(d_ptr, XHControlResume, 0);
+}
+
+std::future<bool> XHServiceController::sendCommandAsync(int code)
+{
+	if (code < 0 || code > 127)
+		return readyFuture(false);
+	return postAsync(d_ptr, XHControlCommand, code);
+}
+
+/*
+   Calls in flight at the same time can't share the controller's slab,
+   each gets a slab of its own.
+*/
+std::future<XHServiceReply> XHServiceController::callAsync(int code, const std::string &request)
+{
+	std::shared_ptr<std::promise<XHServiceReply> > promise =
+		std::make_shared<std::promise<XHServiceReply> >();
+	std::future<XHServiceReply> future = promise->get_future();
+	int slab = request.size() <= XHControlMaxPayload ? createSlab() : -1;
+	if (slab >= 0 && request.size() >= XHControlSlabThreshold && !writeSlab(slab, request)) {
+		::close(slab);
+		slab = -1;
+	}
+	if (slab < 0) {
+		promise->set_value(XHServiceReply());
+		return future;
+	}
+	controlChannel(d_ptr)->send(XHControlCall, code, request, slab,
+		[promise](bool ok, int32_t result, std::string &data) {
+			XHServiceReply reply;
+			reply.ok = ok && result >= 0;
+			if (reply.ok)
+				reply.data.swap(data);
+			promise->set_value(reply);
+		});
+	return future;
+}
+
+
+static XHControlStateEvent stateEvent(int state, const XHServiceExitRecord *exit)
+{
+	timespec ts;
+	::clock_gettime(CLOCK_REALTIME, &ts);
+	XHControlStateEvent event;
+	::memset(&event, 0, sizeof(event));
+	event.time = (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+	event.pid = exit ? exit->pid : ::getpid();
+	event.state = state;
+	event.workerIndex = exit ? exit->workerIndex : -1;
+	event.exitCode = exit ? exit->exitCode : 0;
+	event.signal = exit ? exit->signal : 0;
+	return event;
+}
+
+/*
+   Follows the service for subscribe(): a connection that receives the
+   state changes, and when the service goes away, a wait for its
+   control socket to be created again. The wait is on inotify, with a
+   slow retry as a fallback for a runtime directory we can't watch.
+*/
+class XHStateSubscription
+{
+public:
+	typedef std::function<void(const XHServiceStateChange &)> Handler;
+
+	XHStateSubscription(const std::string &name, const Handler &h)
+		: serviceName(name), handler(h), stopFd(-1), lastState(0), lastPid(0) {}
+	~XHStateSubscription();
+
+	bool start();
+
+private:
+	void run();
+	bool follow(int socket, bool *received);
+	bool waitForService(int inotifyFd);
+	void deliver(const XHControlStateEvent &event);
+	void deliverCrash();
+
+	std::string serviceName;
+	Handler handler;
+	int stopFd;
+	std::thread thread;
+	int lastState;
+	int64_t lastPid;
+};
+
+XHStateSubscription::~XHStateSubscription()
+{
+	if (thread.joinable()) {
+		uint64_t one = 1;
+		ssize_t ignored = ::write(stopFd, &one, sizeof(one));
+		(void)ignored;
+		thread.join();
+	}
+	if (stopFd >= 0)
+		::close(stopFd);
+}
+
+bool XHStateSubscription::start()
+{
+	stopFd = ::eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (stopFd < 0)
+		return false;
+	thread = std::thread(&XHStateSubscription::run, this);
+	return true;
+}
+
+void XHStateSubscription::run()
+{
+	int inotifyFd = ::inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	for (;;) {
+		bool received = false;
+		int socket = xhControlConnect(serviceName, 0);
+		if (socket >= 0) {
+			bool stopping = follow(socket, &received);
+			::close(socket);
+			if (stopping)
+				break;
+			if (lastState != XHServiceStopped)
+				deliverCrash();
+		} else if (lastState == 0) {
+			// Not running when subscribed: report that first.
+			XHControlStateEvent event = stateEvent(XHServiceStopped, 0);
+			event.pid = 0;
+			deliver(event);
+		}
+		// After an upgrade the next instance answers on the same socket.
+		if (received)
+			continue;
+		if (!waitForService(inotifyFd))
+			break;
+	}
+	if (inotifyFd >= 0)
+		::close(inotifyFd);
+}
+
+// Returns true when asked to stop, false when the connection is lost.
+bool XHStateSubscription::follow(int socket, bool *received)
+{
+	XHControlHeader request;
+	::memset(&request, 0, sizeof(request));
+	request.requestId = 1;
+	request.op = XHControlSubscribe;
+	if (!xhControlWrite(socket, &request, sizeof(request)))
+		return false;
+	for (;;) {
+		pollfd fds[2];
+		fds[0].fd = stopFd;
+		fds[0].events = POLLIN;
+		fds[1].fd = socket;
+		fds[1].events = POLLIN;
+		if (::poll(fds, 2, -1) < 0) {
+			if (errno == EINTR)
+				continue;
+			return false;
+		}
+		if (fds[0].revents)
+			return true;
+		XHControlHeader header;
+		if (!xhControlRead(socket, &header, sizeof(header)) || header.length > XHControlMaxPayload)
+			return false;
+		std::string data(header.length, '\0');
+		if (header.length > 0 && !xhControlRead(socket, &data[0], data.size()))
+			return false;
+		if ((header.op == XHControlSubscribe || header.op == XHControlStateChanged)
+			&& data.size() >= sizeof(XHControlStateEvent)) {
+			XHControlStateEvent event;
+			::memcpy(&event, data.data(), sizeof(event));
+			*received = true;
+			deliver(event);
+		}
+	}
+}
+
+bool XHStateSubscription::waitForService(int inotifyFd)
+{
+	if (inotifyFd >= 0 && xhCheckRuntimeDir(true))
+		::inotify_add_watch(inotifyFd, xhRuntimeDir().c_str(), IN_MOVED_TO);
+	pollfd fds[2];
+	fds[0].fd = stopFd;
+	fds[0].events = POLLIN;
+	fds[1].fd = inotifyFd;
+	fds[1].events = POLLIN;
+	int ready;
+	while ((ready = ::poll(fds, inotifyFd >= 0 ? 2 : 1, 1000)) < 0 && errno == EINTR)
+		;
+	if (ready > 0 && fds[0].revents)
+		return false;
+	if (ready > 0 && fds[1].revents) {
+		char buffer[4096];
+		while (::read(inotifyFd, buffer, sizeof(buffer)) > 0)
+			;
+	}
+	return true;
+}
+
+void XHStateSubscription::deliver(const XHControlStateEvent &event)
+{
+	XHServiceStateChange change;
+	change.time = event.time;
+	change.state = XHServiceController::State(event.state);
+	change.crashed = event.workerIndex >= 0;
+	change.pid = event.pid;
+	change.workerIndex = event.workerIndex;
+	change.exitCode = event.exitCode;
+	change.signal = event.signal;
+	if (event.workerIndex < 0) {
+		lastState = event.state;
+		lastPid = event.pid;
+	}
+	handler(change);
+}
+
+void XHStateSubscription::deliverCrash()
+{
+	XHServiceStateChange change;
+	change.time = stateEvent(XHServiceStopped, 0).time;
+	change.state = XHServiceController::StoppedState;
+	change.crashed = true;
+	change.pid = lastPid;
+	lastState = XHServiceStopped;
+	handler(change);
+}
+
+bool XHServiceControllerPrivate::sysSubscribe(const std::function<void(const XHServiceStateChange &)> &handler)
+{
+	subscription = new XHStateSubscription(serviceName, handler);
+	if (!subscription->start()) {
+		sysUnsubscribe();
+		return false;
+	}
+	return true;
+}
+
+void XHServiceControllerPrivate::sysUnsubscribe()
+{
+	delete subscription;
+	subscription = 0;
+}
+
+class XHSyslogSink : public XHLogSink
+{
+public:
+	explicit XHSyslogSink(const std::string &name)
+		: ident(name)
+	{
+		// openlog() keeps the pointer, so the ident lives in the sink.
+		::openlog(ident.c_str(), LOG_PID, LOG_DAEMON);
+	}
+
+	~XHSyslogSink()
+	{
+		::closelog();
+	}
+
+	void write(const XHLogEntry &record)
+	{
+		int priority;
+		switch (record.type) {
+			case XHServiceBase::Error: priority = LOG_ERR; break;
+			case XHServiceBase::Warning: priority = LOG_WARNING; break;
+			default: priority = LOG_INFO; break;
+		}
+		const std::string &message = record.message;
+		// One record per line; a trailing newline ends the last line
+		// rather than starting an empty one.
+		std::string::size_type begin = 0;
+		do {
+			std::string::size_type end = message.find('\n', begin);
+			if (end == std::string::npos)
+				end = message.size();
+			::syslog(priority, "%.*s", (int)(end - begin), message.data() + begin);
+			begin = end + 1;
+		} while (begin < message.size());
+	}
+
+private:
+	std::string ident;
+};
+
+XHLogSink *xhCreateSystemLogSink(const std::string &serviceName)
+{
+	return new XHSyslogSink(serviceName);
+}
+
+/*
+   A reply waiting for its turn on a connection. Calls are answered by
+   the service thread, which fills in the header and the data and sets
+   'done' last.
+*/
+struct XHControlReply
+{
+	XHControlReply() : slab(-1), done(false) {}
+	~XHControlReply()
+	{
+		if (slab >= 0)
+			::close(slab);
+	}
+
+	XHControlHeader header;
+	std::string data;
+	int slab;
+	std::atomic<bool> done;
+};
+
+/*
+   The daemon side of the control socket. A single thread multiplexes
+   the listening socket, every controller connection, SIGTERM/SIGINT
+   (through a signalfd) and a wake-up eventfd with epoll, and runs the
+   XHServiceBase callbacks for each request it decodes.
+*/
+class XHServiceSysPrivate
+{
+public:
+	XHServiceSysPrivate();
+	~XHServiceSysPrivate();
+
+	bool open(const std::string &name, int inheritedListenFd = -1);
+	void close();
+	void setState(int state);
+	bool transition(int from, int to);
+	int32_t dispatch(uint16_t op, int32_t code, const std::string &payload = std::string(),
+		std::string *reply = 0);
+	bool startUpgrade(const std::string &path);
+	void finishUpgrade();
+	void processCall(const std::shared_ptr<XHControlReply> &call, const std::string &request);
+	void publishState(int state, const XHServiceExitRecord *exit = 0);
+
+	struct Connection
+	{
+		~Connection()
+		{
+			for (size_t i = 0; i < fds.size(); ++i)
+				::close(fds[i]);
+		}
+
+		std::string in;
+		std::string out;
+		std::deque<int> fds;	// received with the requests in 'in'
+		std::deque<std::shared_ptr<XHControlReply> > replies;
+	};
+
+	std::string socketPath;
+	int listenFd;
+	int epollFd;
+	int wakeFd;
+	int signalFd;
+	int notifyFd;	// signalled by processCall() and publishState()
+	std::thread thread;
+	std::map<int, Connection> connections;
+	std::set<int> subscribers;
+	std::mutex stateMutex;
+	std::vector<XHControlStateEvent> stateEvents;	// not yet sent to the subscribers
+	std::atomic<int> state;
+	XHStatusPublisher *statusPage;
+	int successorFd;	// upgrade in progress, to the new instance
+	int predecessorFd;	// started by an upgrade, to the old instance
+	bool handedOver;
+
+	static XHServiceSysPrivate *instance;
+
+private:
+	void controlLoop();
+	void acceptConnections();
+	void readConnection(int fd);
+	void collectReplies(int fd);
+	void sendStates();
+	void flushConnection(int fd);
+	void closeConnection(int fd);
+	void watch(int fd, uint32_t events, int op);
+};
+
+XHServiceSysPrivate *XHServiceSysPrivate::instance = 0;
+
+XHServiceSysPrivate::XHServiceSysPrivate()
+	: listenFd(-1), epollFd(-1), wakeFd(-1), signalFd(-1), notifyFd(-1), state(XHServiceStopped),
+	statusPage(0),
+	successorFd(-1), predecessorFd(-1), handedOver(false)
+{
+	instance = this;
+}
+
+XHServiceSysPrivate::~XHServiceSysPrivate()
+{
+	close();
+	if (instance == this)
+		instance = 0;
+}
+
+void XHServiceSysPrivate::watch(int fd, uint32_t events, int op)
+{
+	epoll_event ev;
+	::memset(&ev, 0, sizeof(ev));
+	ev.events = events;
+	ev.data.fd = fd;
+	::epoll_ctl(epollFd, op, fd, &ev);
+}
+
+/*
+   An upgraded instance gets the listening control socket of its
+   predecessor instead of binding a new one, so controllers never see
+   the socket disappear.
+*/
+bool XHServiceSysPrivate::open(const std::string &name, int inheritedListenFd)
+{
+	sockaddr_un addr;
+	socketPath = xhControlSocketPath(name);
+	if (!xhCheckRuntimeDir(true) || !fillSocketAddress(socketPath, addr))
+		return false;
+
+	if (inheritedListenFd >= 0) {
+		listenFd = inheritedListenFd;
+		::fcntl(listenFd, F_SETFL, ::fcntl(listenFd, F_GETFL) | O_NONBLOCK);
+	} else {
+		// A socket that still answers belongs to a running instance, one
+		// that doesn't is left over from a crash.
+		int probe = xhControlConnect(name, 1000);
+		if (probe >= 0) {
+			::close(probe);
+			fprintf(stderr, "The service [%s] is already running\n", name.c_str());
+			return false;
+		}
+		::unlink(socketPath.c_str());
+
+		// Bound under a temporary name and renamed once it listens, so
+		// the socket never shows up refusing connections; subscribers
+		// wait for the rename.
+		std::string boundPath = socketPath + ".new";
+		sockaddr_un boundAddr;
+		::unlink(boundPath.c_str());
+		listenFd = ::socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+		if (listenFd < 0 || !fillSocketAddress(boundPath, boundAddr)
+			|| ::bind(listenFd, (sockaddr *)&boundAddr, sizeof(boundAddr)) != 0
+			|| ::listen(listenFd, SOMAXCONN) != 0
+			|| ::rename(boundPath.c_str(), socketPath.c_str()) != 0) {
+			::unlink(boundPath.c_str());
+			close();
+			return false;
+		}
+	}
+
+	// Block the termination signals before any other thread exists so
+	// that every thread inherits the mask and they only reach us
+	// through the signalfd.
+	sigset_t mask;
+	::sigemptyset(&mask);
+	::sigaddset(&mask, SIGTERM);
+	::sigaddset(&mask, SIGINT);
+	::pthread_sigmask(SIG_BLOCK, &mask, 0);
+	::signal(SIGPIPE, SIG_IGN);
+
+	epollFd = ::epoll_create1(EPOLL_CLOEXEC);
+	wakeFd = ::eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	signalFd = ::signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+	notifyFd = ::eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (epollFd < 0 || wakeFd < 0 || signalFd < 0 || notifyFd < 0) {
+		close();
+		return false;
+	}
+	watch(listenFd, EPOLLIN, EPOLL_CTL_ADD);
+	watch(wakeFd, EPOLLIN, EPOLL_CTL_ADD);
+	watch(signalFd, EPOLLIN, EPOLL_CTL_ADD);
+	watch(notifyFd, EPOLLIN, EPOLL_CTL_ADD);
+
+	thread = std::thread(&XHServiceSysPrivate::controlLoop, this);
+	return true;
+}
+
+void XHServiceSysPrivate::close()
+{
+	if (thread.joinable()) {
+		uint64_t one = 1;
+		ssize_t ignored = ::write(wakeFd, &one, sizeof(one));
+		(void)ignored;
+		thread.join();
+	}
+	for (std::map<int, Connection>::iterator it = connections.begin(); it != connections.end(); ++it)
+		::close(it->first);
+	connections.clear();
+	subscribers.clear();
+	if (listenFd >= 0) {
+		::close(listenFd);
+		// After an upgrade the path is served by the new instance.
+		if (!handedOver)
+			::unlink(socketPath.c_str());
+	}
+	if (successorFd >= 0)
+		::close(successorFd);
+	if (predecessorFd >= 0)
+		::close(predecessorFd);
+	successorFd = predecessorFd = -1;
+	if (epollFd >= 0)
+		::close(epollFd);
+	if (wakeFd >= 0)
+		::close(wakeFd);
+	if (signalFd >= 0)
+		::close(signalFd);
+	if (notifyFd >= 0)
+		::close(notifyFd);
+	listenFd = epollFd = wakeFd = signalFd = notifyFd = -1;
+}
+
+void XHServiceSysPrivate::setState(int s)
+{
+	if (state.exchange(s) != s)
+		publishState(s);
+	if (statusPage)
+		statusPage->setState(s);
+}
+
+/*
+   Called on any thread; the control thread sends the queued events to
+   the subscribers in sendStates(). Every transition is queued, so a
+   subscriber sees short-lived states too.
+*/
+void XHServiceSysPrivate::publishState(int s, const XHServiceExitRecord *exit)
+{
+	{
+		std::lock_guard<std::mutex> lock(stateMutex);
+		stateEvents.push_back(stateEvent(s, exit));
+	}
+	if (notifyFd >= 0) {
+		uint64_t one = 1;
+		ssize_t ignored = ::write(notifyFd, &one, sizeof(one));
+		(void)ignored;
+	}
+}
+
+void XHServiceSysPrivate::sendStates()
+{
+	std::vector<XHControlStateEvent> events;
+	{
+		std::lock_guard<std::mutex> lock(stateMutex);
+		events.swap(stateEvents);
+	}
+	if (events.empty() || subscribers.empty())
+		return;
+	std::string messages;
+	for (size_t i = 0; i < events.size(); ++i) {
+		XHControlHeader header;
+		header.length = sizeof(XHControlStateEvent);
+		header.requestId = 0;
+		header.op = XHControlStateChanged;
+		header.flags = 0;
+		header.code = events[i].state;
+		messages.append((const char *)&header, sizeof(header));
+		messages.append((const char *)&events[i], sizeof(events[i]));
+	}
+	std::vector<int> fds(subscribers.begin(), subscribers.end());
+	for (size_t i = 0; i < fds.size(); ++i) {
+		connections[fds[i]].out.append(messages);
+		flushConnection(fds[i]);
+	}
+}
+
+void XHServiceSysPrivate::controlLoop()
+{
+	epoll_event events[32];
+	for (;;) {
+		// The wait doubles as the status page's heartbeat timer.
+		int n = ::epoll_wait(epollFd, events, 32, XHStatusHeartbeatMs);
+		if (statusPage)
+			statusPage->beat();
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			return;
+		}
+		for (int i = 0; i < n; ++i) {
+			int fd = events[i].data.fd;
+			if (fd == wakeFd) {
+				// Let the subscribers see the final state.
+				sendStates();
+				return;
+			} else if (fd == listenFd) {
+				acceptConnections();
+			} else if (fd == successorFd) {
+				finishUpgrade();
+			} else if (fd == signalFd) {
+				signalfd_siginfo info;
+				while (::read(signalFd, &info, sizeof(info)) == sizeof(info))
+					dispatch(XHControlTerminate, 0);
+			} else if (fd == notifyFd) {
+				uint64_t count;
+				ssize_t ignored = ::read(notifyFd, &count, sizeof(count));
+				(void)ignored;
+				std::vector<int> fds;
+				for (std::map<int, Connection>::iterator it = connections.begin();
+					it != connections.end(); ++it) {
+					if (!it->second.replies.empty())
+						fds.push_back(it->first);
+				}
+				for (size_t f = 0; f < fds.size(); ++f)
+					collectReplies(fds[f]);
+				sendStates();
+			} else if (connections.count(fd)) {
+				if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR))
+					readConnection(fd);
+				if (connections.count(fd) && (events[i].events & EPOLLOUT))
+					flushConnection(fd);
+			}
+		}
+	}
+}
+
+void XHServiceSysPrivate::acceptConnections()
+{
+	for (;;) {
+		int fd = ::accept4(listenFd, 0, 0, SOCK_NONBLOCK | SOCK_CLOEXEC);
+		if (fd < 0)
+			return;
+		connections[fd];
+		watch(fd, EPOLLIN | EPOLLRDHUP, EPOLL_CTL_ADD);
+	}
+}
+
+void XHServiceSysPrivate::readConnection(int fd)
+{
+	Connection &c = connections[fd];
+	char buffer[4096];
+	char control[CMSG_SPACE(sizeof(int) * 16)];
+	bool eof = false;
+	for (;;) {
+		iovec iov;
+		iov.iov_base = buffer;
+		iov.iov_len = sizeof(buffer);
+		msghdr msg;
+		::memset(&msg, 0, sizeof(msg));
+		msg.msg_iov = &iov;
+		msg.msg_iovlen = 1;
+		msg.msg_control = control;
+		msg.msg_controllen = sizeof(control);
+		ssize_t n = ::recvmsg(fd, &msg, MSG_CMSG_CLOEXEC);
+		if (n > 0) {
+			for (cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+				if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+					const int *p = (const int *)CMSG_DATA(cmsg);
+					c.fds.insert(c.fds.end(), p, p + (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int));
+				}
+			}
+			c.in.append(buffer, n);
+			if (msg.msg_flags & MSG_CTRUNC) {
+				closeConnection(fd);
+				return;
+			}
+			continue;
+		}
+		if (n < 0 && errno == EINTR)
+			continue;
+		eof = n == 0 || (errno != EAGAIN && errno != EWOULDBLOCK);
+		break;
+	}
+
+	// Requests on one connection are answered in order, so a controller
+	// may pipeline several of them without waiting for each reply. A
+	// call answered later on the service thread holds back the replies
+	// queued behind it.
+	std::string::size_type pos = 0;
+	while (c.in.size() - pos >= sizeof(XHControlHeader)) {
+		XHControlHeader request;
+		::memcpy(&request, c.in.data() + pos, sizeof(request));
+		bool slab = request.op == XHControlCall && (request.flags & XHControlSlab);
+		if (request.length > XHControlMaxPayload || (request.op == XHControlCall && c.fds.empty())) {
+			closeConnection(fd);
+			return;
+		}
+		size_t inlineLength = slab ? 0 : request.length;
+		if (c.in.size() - pos < sizeof(request) + inlineLength)
+			break;
+		pos += sizeof(request) + inlineLength;
+
+		std::shared_ptr<XHControlReply> reply = std::make_shared<XHControlReply>();
+		reply->header = request;
+		c.replies.push_back(reply);
+		std::string payload(c.in.data() + pos - inlineLength, inlineLength);
+		if (request.op == XHControlSubscribe) {
+			// The reply carries the current state, the changes follow.
+			// Older changes go to the other subscribers first.
+			if (!subscribers.count(fd)) {
+				sendStates();
+				subscribers.insert(fd);
+			}
+			XHControlStateEvent event = stateEvent(state.load(), 0);
+			reply->header.code = event.state;
+			reply->header.length = sizeof(event);
+			reply->data.assign((const char *)&event, sizeof(event));
+			reply->done.store(true, std::memory_order_relaxed);
+		} else if (request.op == XHControlCall) {
+			reply->slab = c.fds.front();
+			c.fds.pop_front();
+			processCall(reply, payload);
+		} else {
+			reply->header.code = dispatch(request.op, request.code, payload, &reply->data);
+			reply->header.length = (uint32_t)reply->data.size();
+			reply->done.store(true, std::memory_order_relaxed);
+		}
+	}
+	c.in.erase(0, pos);
+
+	collectReplies(fd);
+	if (eof && connections.count(fd))
+		closeConnection(fd);
+}
+
+void XHServiceSysPrivate::collectReplies(int fd)
+{
+	Connection &c = connections[fd];
+	while (!c.replies.empty() && c.replies.front()->done.load(std::memory_order_acquire)) {
+		const XHControlReply &reply = *c.replies.front();
+		c.out.append((const char *)&reply.header, sizeof(reply.header));
+		c.out.append(reply.data);
+		c.replies.pop_front();
+	}
+	if (!c.out.empty())
+		flushConnection(fd);
+}
+
+void XHServiceSysPrivate::flushConnection(int fd)
+{
+	Connection &c = connections[fd];
+	while (!c.out.empty()) {
+		ssize_t n = ::send(fd, c.out.data(), c.out.size(), MSG_NOSIGNAL);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+			break;
+		if (n <= 0) {
+			closeConnection(fd);
+			return;
+		}
+		c.out.erase(0, n);
+	}
+	watch(fd, c.out.empty() ? EPOLLIN | EPOLLRDHUP : EPOLLIN | EPOLLRDHUP | EPOLLOUT, EPOLL_CTL_MOD);
+}
+
+void XHServiceSysPrivate::closeConnection(int fd)
+{
+	::epoll_ctl(epollFd, EPOLL_CTL_DEL, fd, 0);
+	::close(fd);
+	connections.erase(fd);
+	subscribers.erase(fd);
+}
+
+bool XHServiceSysPrivate::transition(int from, int to)
+{
+	if (!state.compare_exchange_strong(from, to))
+		return false;
+	publishState(to);
+	if (statusPage)
+		statusPage->setState(to);
+	return true;
+}
+
+/*
+   Runs on the control thread. Requests are validated and the pending
+   state is claimed here, the XHServiceBase callbacks themselves run on
+   the service thread through XHServiceBasePrivate::postEvent(), which
+   also sets the final state. The reply only says the request was
+   accepted.
+*/
+int32_t XHServiceSysPrivate::dispatch(uint16_t op, int32_t code, const std::string &payload,
+	std::string *reply)
+{
+	XHServiceBase *service = XHServiceBase::instance();
+	if (!service)
+		return -1;
+	XHServiceBasePrivate *d = service->d_ptr;
+	int flags = service->serviceFlags();
+	switch (op) {
+		case XHControlAlive:
+			return state.load();
+		case XHControlTerminate:
+			if (flags & XHServiceBase::CannotBeStopped)
+				return -1;
+			if (transition(XHServiceRunning, XHServiceStopPending)
+				|| transition(XHServicePaused, XHServiceStopPending)
+				|| transition(XHServiceStartPending, XHServiceStopPending))
+				d->postEvent(XHServiceEvent::Stop);
+			return 0;
+		case XHControlPause:
+			if (!(flags & XHServiceBase::CanBeSuspended)
+				|| !transition(XHServiceRunning, XHServicePausePending))
+				return -1;
+			d->postEvent(XHServiceEvent::Pause);
+			return 0;
+		case XHControlResume:
+			if (!(flags & XHServiceBase::CanBeSuspended)
+				|| !transition(XHServicePaused, XHServiceContinuePending))
+				return -1;
+			d->postEvent(XHServiceEvent::Resume);
+			return 0;
+		case XHControlCommand:
+			if (code < 0 || code > 127)
+				return -1;
+			d->postEvent(XHServiceEvent::Command, code);
+			return 0;
+		case XHControlUpgrade:
+			if (state.load() != XHServiceRunning && state.load() != XHServicePaused)
+				return -1;
+			return startUpgrade(payload) ? 0 : -1;
+		case XHControlMetrics:
+			// Read-only and lock-free for the writers: answered right
+			// here, even while the service thread is busy.
+			if (code != XHMetricsRegistry::PrometheusText && code != XHMetricsRegistry::BinarySnapshot)
+				return -1;
+			if (reply)
+				*reply = d->metrics.report(XHMetricsRegistry::Format(code));
+			return 0;
+		default:
+			return -1;
+	}
+}
+
+/*
+   Answers an XHControlCall through XHServiceBase::processRequest() on
+   the service thread, and hands the reply back to the control thread
+   through notifyFd. A request in the slab is passed to the service in
+   place; a large reply is copied into the slab once instead of going
+   through the socket.
+*/
+void XHServiceSysPrivate::processCall(const std::shared_ptr<XHControlReply> &call,
+	const std::string &request)
+{
+	XHServiceBase *service = XHServiceBase::instance();
+	XHServiceBasePrivate *d = service ? service->d_ptr : 0;
+	if (!d || d->supervising || state.load() == XHServiceStopped
+		|| state.load() == XHServiceStopPending) {
+		call->header.code = -1;
+		call->header.length = 0;
+		call->header.flags = 0;
+		call->done.store(true, std::memory_order_relaxed);
+		return;
+	}
+
+	int64_t posted = xhEventTimeUs();
+	std::function<void()> run = [this, d, call, request, posted]() {
+		XHControlHeader &header = call->header;
+		const char *data = request.data();
+		size_t size = request.size();
+		void *map = MAP_FAILED;
+		bool ok = true;
+		if ((header.flags & XHControlSlab) && header.length > 0) {
+			// The shrink seal keeps the pages there while we read them.
+			struct stat st;
+			ok = (::fcntl(call->slab, F_GET_SEALS) & F_SEAL_SHRINK)
+				&& ::fstat(call->slab, &st) == 0 && (size_t)st.st_size >= header.length;
+			if (ok)
+				map = ::mmap(0, header.length, PROT_READ, MAP_SHARED, call->slab, 0);
+			ok = map != MAP_FAILED;
+			data = (const char *)map;
+			size = header.length;
+		}
+		std::string reply;
+		ok = ok && d->processRequest(header.code, data, size, &reply);
+		if (map != MAP_FAILED)
+			::munmap(map, header.length);
+
+		header.flags = 0;
+		if (!ok || reply.size() > XHControlMaxPayload)
+			reply.clear();
+		else if (reply.size() >= XHControlSlabThreshold && writeSlab(call->slab, reply))
+			header.flags = XHControlSlab;
+		header.code = ok ? 0 : -1;
+		header.length = (uint32_t)reply.size();
+		if (!(header.flags & XHControlSlab))
+			call->data.swap(reply);
+		d->controlLatency.record(xhEventTimeUs() - posted);
+		call->done.store(true, std::memory_order_release);
+		if (notifyFd >= 0) {
+			uint64_t one = 1;
+			ssize_t ignored = ::write(notifyFd, &one, sizeof(one));
+			(void)ignored;
+		}
+	};
+	if (!d->eventLoop.tryPost(run))
+		run();
+}
+
+/*
+   Upgrade, old instance side: launches the new binary as a daemon and
+   sends it the listening control socket and the descriptors the
+   service registered with XHServiceBase::setHandoffDescriptor(). Both
+   instances then accept connections until the new one reports that it
+   runs (one byte on the handoff socket, see finishUpgrade()). If it
+   dies before that, the old instance just carries on.
+*/
+bool XHServiceSysPrivate::startUpgrade(const std::string &path)
+{
+	XHServiceBasePrivate *d = XHServiceBase::instance()->d_ptr;
+	if (successorFd >= 0)
+		return false;
+	std::string binary = path;
+	if (binary.empty())
+		binary = readSetting(d->controller.serviceName(), "path");
+	if (binary.empty() || ::access(binary.c_str(), X_OK) != 0)
+		return false;
+
+	std::vector<std::string> names;
+	std::vector<int> fds;
+	names.push_back(XHHANDOFF_CONTROL_SOCKET);
+	fds.push_back(listenFd);
+	{
+		std::lock_guard<std::mutex> lock(d->handoffMutex);
+		for (std::map<std::string, int>::const_iterator it = d->handoffDescriptors.begin();
+			it != d->handoffDescriptors.end() && fds.size() < XHHandoffMaxDescriptors; ++it) {
+			names.push_back(it->first);
+			fds.push_back(it->second);
+		}
+	}
+
+	int sv[2];
+	if (::socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sv) != 0)
+		return false;
+	std::vector<std::string> arguments;
+	for (size_t i = 1; i < d->args.size(); ++i)
+		arguments.push_back(d->args[i]);
+	// The descriptors are queued on the socket before the new process
+	// even runs; it picks them up in sysInit().
+	bool ok = xhSendDescriptors(sv[0], names, fds) && xhLaunchDaemon(binary, arguments, sv[1]);
+	::close(sv[1]);
+	if (!ok) {
+		::close(sv[0]);
+		return false;
+	}
+	successorFd = sv[0];
+	watch(successorFd, EPOLLIN | EPOLLRDHUP, EPOLL_CTL_ADD);
+	XHServiceBase::instance()->logMessage("Upgrading to " + binary, XHServiceBase::Information);
+	return true;
+}
+
+void XHServiceSysPrivate::finishUpgrade()
+{
+	char ready = 0;
+	ssize_t n;
+	while ((n = ::recv(successorFd, &ready, 1, 0)) < 0 && errno == EINTR)
+		;
+	::epoll_ctl(epollFd, EPOLL_CTL_DEL, successorFd, 0);
+	::close(successorFd);
+	successorFd = -1;
+	XHServiceBase *service = XHServiceBase::instance();
+	if (n != 1) {
+		service->logMessage("Upgrade failed: the new instance did not start", XHServiceBase::Error);
+		return;
+	}
+
+	// The new instance owns the control socket and the status page
+	// from now on; this one only drains and exits.
+	::epoll_ctl(epollFd, EPOLL_CTL_DEL, listenFd, 0);
+	handedOver = true;
+	if (statusPage)
+		statusPage->detach();
+	service->logMessage("Handed over to the new instance, stopping", XHServiceBase::Information);
+	if (transition(XHServiceRunning, XHServiceStopPending)
+		|| transition(XHServicePaused, XHServiceStopPending))
+		service->d_ptr->postEvent(XHServiceEvent::Stop);
+}
+
+/*
+   Without -e the process was started from a console or a script: it
+   relaunches itself as a detached daemon (which enters run() through
+   the XHSERVICE_RUN branch of XHServiceBase::exec()) and returns.
+*/
+bool XHServiceBasePrivate::start()
+{
+	std::vector<std::string> arguments;
+	for (size_t i = 1; i < args.size(); ++i)
+		arguments.push_back(args[i]);
+	return xhLaunchDaemon(filePath(), arguments);
+}
+
+bool XHServiceBasePrivate::install(const std::string &/*account*/, const std::string &/*password*/)
+{
+	std::map<std::string, std::string> values;
+	values["path"] = filePath();
+	values["description"] = serviceDescription;
+	values["startupType"] = startupType == XHServiceController::AutoStartup ? "0" : "1";
+	return writeSettings(controller.serviceName(), values);
+}
+
+std::string XHServiceBasePrivate::filePath() const
+{
+	char path[PATH_MAX];
+	ssize_t n = ::readlink("/proc/self/exe", path, sizeof(path) - 1);
+	if (n <= 0)
+		return args.empty() ? std::string() : args[0];
+	path[n] = 0;
+	return path;
+}
+
+bool XHServiceBasePrivate::sysInit()
+{
+	sysd = new XHServiceSysPrivate();
+	sysd->statusPage = &statusPage;
+
+	// Started by an upgrade: the old instance has queued its
+	// descriptors on the handoff socket.
+	int controlFd = -1;
+	if (const char *env = ::getenv("XHSERVICE_HANDOFF_FD")) {
+		int fd = ::atoi(env);
+		::unsetenv("XHSERVICE_HANDOFF_FD");
+		::fcntl(fd, F_SETFD, FD_CLOEXEC);
+		std::vector<std::string> names;
+		std::vector<int> fds;
+		if (fd > 2 && xhReceiveDescriptors(fd, &names, &fds, 5000)) {
+			sysd->predecessorFd = fd;
+			std::lock_guard<std::mutex> lock(handoffMutex);
+			for (size_t i = 0; i < names.size(); ++i) {
+				if (names[i] == XHHANDOFF_CONTROL_SOCKET && controlFd < 0) {
+					controlFd = fds[i];
+					continue;
+				}
+				XHInheritedSocket socket;
+				socket.name = names[i];
+				socket.descriptor = fds[i];
+				sysDescribeSocket(&socket);
+				inheritedDescriptors.push_back(socket);
+			}
+		} else if (fd > 2) {
+			::close(fd);
+		}
+	}
+	if (!sysd->open(controller.serviceName(), controlFd)) {
+		delete sysd;
+		sysd = 0;
+		return false;
+	}
+	sysd->setState(XHServiceStartPending);
+	return true;
+}
+
+void XHServiceBasePrivate::sysSetPath()
+{
+
+}
+
+void XHServiceBasePrivate::sysSetState(int state)
+{
+	if (!sysd)
+		return;
+	// A stop accepted while start() or resume() ran must not be
+	// reported as running again.
+	if (state == XHServiceRunning) {
+		if (sysd->transition(XHServiceStartPending, state)) {
+			{
+				std::lock_guard<std::mutex> lock(handoffMutex);
+				for (size_t i = 0; i < inheritedDescriptors.size(); ++i)
+					::close(inheritedDescriptors[i].descriptor);
+				inheritedDescriptors.clear();
+			}
+			if (sysd->predecessorFd >= 0)
+				finishHandoff();
+			xhNotifyServiceManager("READY=1\nSTATUS=Running");
+		} else if (sysd->transition(XHServiceContinuePending, state)
+			|| sysd->transition(XHServicePausePending, state)) {
+			// Resumed, or a deferred pause that failed.
+			xhNotifyServiceManager("STATUS=Running");
+		}
+		return;
+	}
+	sysd->setState(state);
+	if (sysd->handedOver)
+		return;
+	if (state == XHServiceStopPending || state == XHServiceStopped)
+		xhNotifyServiceManager("STOPPING=1");
+	else if (state == XHServicePaused)
+		xhNotifyServiceManager("STATUS=Paused");
+}
+
+/*
+   Upgrade, new instance side: the service runs, so the old instance
+   may go, and a service manager watching the old process is told to
+   follow this one.
+*/
+void XHServiceBasePrivate::finishHandoff()
+{
+	char ready = 1;
+	ssize_t ignored = ::send(sysd->predecessorFd, &ready, 1, MSG_NOSIGNAL);
+	(void)ignored;
+	::close(sysd->predecessorFd);
+	sysd->predecessorFd = -1;
+	char text[32];
+	::snprintf(text, sizeof(text), "MAINPID=%d", (int)::getpid());
+	xhNotifyServiceManager(text);
+}
+
+/*
+   Socket activation (sd_listen_fds()): the supervisor passes its
+   listening sockets as descriptors 3 to 3 + LISTEN_FDS - 1, meant for
+   the process LISTEN_PID, named by LISTEN_FDNAMES. The variables are
+   removed so that child processes don't take the sockets for theirs.
+*/
+void XHServiceBasePrivate::sysCollectActivatedSockets()
+{
+	const char *pidEnv = ::getenv("LISTEN_PID");
+	const char *countEnv = ::getenv("LISTEN_FDS");
+	const char *namesEnv = ::getenv("LISTEN_FDNAMES");
+	std::string names = namesEnv ? namesEnv : "";
+	bool ours = pidEnv && countEnv && ::atol(pidEnv) == (long)::getpid();
+	int count = ours ? ::atoi(countEnv) : 0;
+	::unsetenv("LISTEN_PID");
+	::unsetenv("LISTEN_FDS");
+	::unsetenv("LISTEN_FDNAMES");
+
+	std::lock_guard<std::mutex> lock(handoffMutex);
+	std::string::size_type pos = 0;
+	for (int i = 0; i < count; ++i) {
+		int fd = 3 + i;
+		if (::fcntl(fd, F_SETFD, FD_CLOEXEC) != 0)
+			continue;
+		XHInheritedSocket socket;
+		std::string::size_type end = names.find(':', pos);
+		socket.name = pos < names.size() ? names.substr(pos, end == std::string::npos ? end : end - pos)
+			: "unknown";
+		pos = end == std::string::npos ? names.size() : end + 1;
+		socket.descriptor = fd;
+		sysDescribeSocket(&socket);
+		inheritedDescriptors.push_back(socket);
+	}
+}
+
+void XHServiceBasePrivate::sysDescribeSocket(XHInheritedSocket *socket)
+{
+	int type = 0;
+	int domain = 0;
+	int listening = 0;
+	socklen_t len = sizeof(type);
+	socket->type = XHInheritedSocket::OtherDescriptor;
+	if (::getsockopt(socket->descriptor, SOL_SOCKET, SO_TYPE, &type, &len) != 0)
+		return;
+	len = sizeof(domain);
+	::getsockopt(socket->descriptor, SOL_SOCKET, SO_DOMAIN, &domain, &len);
+	len = sizeof(listening);
+	::getsockopt(socket->descriptor, SOL_SOCKET, SO_ACCEPTCONN, &listening, &len);
+	socket->listening = listening != 0;
+
+	sockaddr_storage addr;
+	socklen_t addrLen = sizeof(addr);
+	::memset(&addr, 0, sizeof(addr));
+	::getsockname(socket->descriptor, (sockaddr *)&addr, &addrLen);
+	char host[INET6_ADDRSTRLEN] = "";
+	if (domain == AF_INET || domain == AF_INET6) {
+		socket->type = type == SOCK_STREAM ? XHInheritedSocket::TcpSocket
+			: type == SOCK_DGRAM ? XHInheritedSocket::UdpSocket : XHInheritedSocket::OtherDescriptor;
+		if (addr.ss_family == AF_INET) {
+			const sockaddr_in *in = (const sockaddr_in *)&addr;
+			::inet_ntop(AF_INET, &in->sin_addr, host, sizeof(host));
+			socket->address = host;
+			socket->port = ntohs(in->sin_port);
+		} else if (addr.ss_family == AF_INET6) {
+			const sockaddr_in6 *in6 = (const sockaddr_in6 *)&addr;
+			::inet_ntop(AF_INET6, &in6->sin6_addr, host, sizeof(host));
+			socket->address = host;
+			socket->port = ntohs(in6->sin6_port);
+		}
+	} else if (domain == AF_UNIX) {
+		socket->type = type == SOCK_STREAM ? XHInheritedSocket::LocalStreamSocket
+			: type == SOCK_DGRAM ? XHInheritedSocket::LocalDatagramSocket
+			: type == SOCK_SEQPACKET ? XHInheritedSocket::LocalSeqPacketSocket
+			: XHInheritedSocket::OtherDescriptor;
+		const sockaddr_un *un = (const sockaddr_un *)&addr;
+		size_t pathLen = addrLen > offsetof(sockaddr_un, sun_path) ? addrLen - offsetof(sockaddr_un, sun_path) : 0;
+		if (pathLen > 0 && un->sun_path[0] == 0)	// abstract namespace
+			socket->address = "@" + std::string(un->sun_path + 1, pathLen - 1);
+		else if (pathLen > 0)
+			socket->address = std::string(un->sun_path, ::strnlen(un->sun_path, pathLen));
+	}
+}
+
+void XHServiceBasePrivate::sysSetProgress(const std::string &status, uint32_t checkPoint,
+	uint32_t waitHint)
+{
+	if (!sysd)
+		return;
+	statusPage.setCheckPoint(checkPoint, waitHint);
+	char text[64];
+	::snprintf(text, sizeof(text), "\nEXTEND_TIMEOUT_USEC=%llu", (unsigned long long)waitHint * 1000);
+	xhNotifyServiceManager("STATUS=" + status + text);
+}
+
+/*
+   A crashed worker restarted by the supervisor doesn't change the
+   service's state; its subscribers hear about it anyway.
+*/
+void XHServiceBasePrivate::sysNotifyExit(const XHServiceExitRecord &record)
+{
+	if (sysd && (record.signal || record.exitCode))
+		sysd->publishState(sysd->state.load(), &record);
+}
+
+void XHServiceBasePrivate::sysCleanup()
+{
+	if (sysd) {
+		delete sysd;
+		sysd = 0;
+	}
+}
+
+void XHServiceBase::setServiceFlags(int flags)
+{
+	d_ptr->serviceFlags = flags;
+	d_ptr->statusPage.setFlags(flags);
+}
@@ -0,0 +1,90 @@
+/****************************************************************************
+**
+**
+****************************************************************************/
+
+#ifndef XHSERVICE_UNIX_P_H
+#define XHSERVICE_UNIX_P_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+// Wire format of the control socket. Every message is a fixed header
+// followed by 'length' bytes of payload. Replies echo the request id
+// and op of the request they answer and carry the result in 'code'.
+struct XHControlHeader
+{
+	uint32_t length;
+	uint32_t requestId;
+	uint16_t op;
+	uint16_t flags;
+	int32_t code;
+};
+
+enum XHControlOp
+{
+	XHControlAlive = 1,
+	XHControlTerminate,
+	XHControlPause,
+	XHControlResume,
+	XHControlCommand,
+	XHControlUpgrade,	// payload: path of the new binary
+	XHControlMetrics,	// code: XHMetricsRegistry::Format, reply payload: the report
+	XHControlCall,		// code: request code, payload: request, reply payload: reply
+	XHControlSubscribe,	// reply code: the state, reply payload: XHControlStateEvent
+	XHControlStateChanged	// pushed to subscribers with request id 0
+};
+
+// Payload of the subscription messages. A crash of a supervised
+// worker is reported with the worker's index, -1 otherwise.
+struct XHControlStateEvent
+{
+	int64_t time;	// microseconds since the epoch
+	int64_t pid;
+	int32_t state;
+	int32_t workerIndex;
+	int32_t exitCode;
+	int32_t signal;
+};
+
+// A call carries the controller's slab, a sealed memfd, as SCM_RIGHTS
+// data of its header. With XHControlSlab set in 'flags' the 'length'
+// bytes of payload are at the start of the slab instead of following
+// the header, in requests and in replies alike.
+enum XHControlFlag
+{
+	XHControlSlab = 0x01
+};
+
+enum
+{
+	XHControlMaxPayload = 16 * 1024 * 1024,
+	XHControlSlabThreshold = 64 * 1024,
+	XHHandoffMaxDescriptors = 64
+};
+
+// Name under which the control socket is passed to the new instance
+// on an upgrade, next to the descriptors added by the service.
+#define XHHANDOFF_CONTROL_SOCKET "xhservice.control"
+
+std::string xhRuntimeDir();
+bool xhCheckRuntimeDir(bool create);
+std::string xhControlSocketPath(const std::string &serviceName);
+
+int xhControlConnect(const std::string &serviceName, int timeoutMs);
+bool xhControlWrite(int fd, const void *data, size_t size);
+bool xhControlRead(int fd, void *data, size_t size);
+bool xhControlTransact(const std::string &serviceName, uint16_t op, int32_t code,
+	int32_t *result, int timeoutMs = 5000, const std::string &payload = std::string(),
+	std::string *reply = 0);
+
+bool xhLaunchDaemon(const std::string &path, const std::vector<std::string> &arguments,
+	int handoffFd = -1);
+bool xhSendDescriptors(int socket, const std::vector<std::string> &names, const std::vector<int> &fds);
+bool xhReceiveDescriptors(int socket, std::vector<std::string> *names, std::vector<int> *fds,
+	int timeoutMs);
+bool xhNotifyServiceManager(const std::string &state);
+
+#endif // XHSERVICE_UNIX_P_H
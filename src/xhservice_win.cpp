@@ -3,11 +3,15 @@
 **
 ****************************************************************************/
 
-#include "../xhservice.h"
-#include "../xhservice_p.h"
+#include "xhservice.h"
+#include "xhservice_p.h"
 #include <functional>
+#include <thread>
 #include <stdio.h>
 #include <windows.h>
+#include <sddl.h>
+#include <psapi.h>
+#include <tlhelp32.h>
 #include <iostream>
 
 typedef SERVICE_STATUS_HANDLE(WINAPI*PRegisterServiceCtrlHandler)(LPCTSTR, LPHANDLER_FUNCTION);
@@ -46,6 +50,8 @@ typedef BOOL(WINAPI*PQueryServiceConfig)(SC_HANDLE, LPQUERY_SERVICE_CONFIG, DWOR
 static PQueryServiceConfig pQueryServiceConfig = 0;
 typedef BOOL(WINAPI*PQueryServiceConfig2)(SC_HANDLE, DWORD, LPBYTE, DWORD, LPDWORD);
 static PQueryServiceConfig2 pQueryServiceConfig2 = 0;
+typedef DWORD(WINAPI*PNotifyServiceStatusChange)(SC_HANDLE, DWORD, PSERVICE_NOTIFYA);
+static PNotifyServiceStatusChange pNotifyServiceStatusChange = 0;
 
 static bool winServiceInit()
 {
@@ -83,6 +89,7 @@ static bool winServiceInit()
 		pRegisterEventSource = (PRegisterEventSource)GetProcAddress(hdll, "RegisterEventSourceA");
 		pQueryServiceConfig = (PQueryServiceConfig)GetProcAddress(hdll, "QueryServiceConfigA");
 		pQueryServiceConfig2 = (PQueryServiceConfig2)GetProcAddress(hdll, "QueryServiceConfig2A");
+		pNotifyServiceStatusChange = (PNotifyServiceStatusChange)GetProcAddress(hdll, "NotifyServiceStatusChangeA");
 		FreeLibrary(hdll);
 	}
 	if (!pOpenSCManager){
@@ -100,6 +107,131 @@ static bool winServiceInit()
 	return pOpenSCManager != 0;
 }
 
+int64_t xhMonotonicMs()
+{
+	return (int64_t)::GetTickCount64();
+}
+
+int64_t xhCurrentPid()
+{
+	return ::GetCurrentProcessId();
+}
+
+/*
+   The status page is a named file mapping. A service running as
+   LocalSystem lives in session 0, so the page goes to the Global
+   namespace with a DACL that lets authenticated users read it; a
+   service run from a console (-e) falls back to the Local namespace.
+*/
+bool xhMapStatusPage(const std::string &serviceName, bool writable, XHStatusMapping *mapping)
+{
+	std::string globalName = "Global\\XHService." + serviceName;
+	std::string localName = "Local\\XHService." + serviceName;
+	HANDLE h = 0;
+	if (writable) {
+		SECURITY_ATTRIBUTES sa;
+		sa.nLength = sizeof(sa);
+		sa.bInheritHandle = FALSE;
+		sa.lpSecurityDescriptor = 0;
+		::ConvertStringSecurityDescriptorToSecurityDescriptorA(
+			"D:(A;;GA;;;SY)(A;;GA;;;BA)(A;;GR;;;AU)", SDDL_REVISION_1,
+			&sa.lpSecurityDescriptor, 0);
+		h = ::CreateFileMappingA(INVALID_HANDLE_VALUE, &sa, PAGE_READWRITE, 0,
+			sizeof(XHStatusPage), globalName.c_str());
+		if (!h)
+			h = ::CreateFileMappingA(INVALID_HANDLE_VALUE, &sa, PAGE_READWRITE, 0,
+				sizeof(XHStatusPage), localName.c_str());
+		if (sa.lpSecurityDescriptor)
+			::LocalFree(sa.lpSecurityDescriptor);
+	} else {
+		h = ::OpenFileMappingA(FILE_MAP_READ, FALSE, globalName.c_str());
+		if (!h)
+			h = ::OpenFileMappingA(FILE_MAP_READ, FALSE, localName.c_str());
+	}
+	if (!h)
+		return false;
+	void *page = ::MapViewOfFile(h, writable ? FILE_MAP_READ | FILE_MAP_WRITE : FILE_MAP_READ,
+		0, 0, sizeof(XHStatusPage));
+	if (!page) {
+		::CloseHandle(h);
+		return false;
+	}
+	mapping->page = (XHStatusPage *)page;
+	mapping->handle = (intptr_t)h;
+	return true;
+}
+
+void xhUnmapStatusPage(XHStatusMapping *mapping)
+{
+	if (mapping->page)
+		::UnmapViewOfFile(mapping->page);
+	if (mapping->handle)
+		::CloseHandle((HANDLE)mapping->handle);
+	mapping->page = 0;
+	mapping->handle = 0;
+}
+
+XHProcessSampler::XHProcessSampler()
+	: statFile(0), fdDirectory(0), pageSize(0)
+{
+}
+
+XHProcessSampler::~XHProcessSampler()
+{
+}
+
+// The pseudo handle of the current process needs no opening.
+bool XHProcessSampler::open()
+{
+	return true;
+}
+
+void XHProcessSampler::close()
+{
+}
+
+/*
+   The thread count comes from a process snapshot, the only documented
+   source; it's the expensive part of a sample. Windows keeps no
+   per-process count of context switches, so those stay -1.
+*/
+bool XHProcessSampler::sample(XHStatusSample *sample)
+{
+	HANDLE process = ::GetCurrentProcess();
+	FILETIME creation, exit, kernel, user;
+	if (!::GetProcessTimes(process, &creation, &exit, &kernel, &user))
+		return false;
+	// FILETIMEs count 100 nanosecond intervals.
+	sample->userTime = (int64_t)(((uint64_t)user.dwHighDateTime << 32) | user.dwLowDateTime) / 10;
+	sample->systemTime = (int64_t)(((uint64_t)kernel.dwHighDateTime << 32) | kernel.dwLowDateTime) / 10;
+	sample->voluntarySwitches = -1;
+	sample->involuntarySwitches = -1;
+
+	PROCESS_MEMORY_COUNTERS memory;
+	memory.cb = sizeof(memory);
+	sample->residentBytes = ::GetProcessMemoryInfo(process, &memory, sizeof(memory))
+		? (int64_t)memory.WorkingSetSize : -1;
+
+	DWORD handles = 0;
+	sample->openFiles = ::GetProcessHandleCount(process, &handles) ? (int32_t)handles : -1;
+
+	sample->threads = -1;
+	HANDLE snapshot = ::CreateToolhelp32Snapshot(TH32CS_SNAPPROCESS, 0);
+	if (snapshot != INVALID_HANDLE_VALUE) {
+		PROCESSENTRY32 entry;
+		entry.dwSize = sizeof(entry);
+		DWORD pid = ::GetCurrentProcessId();
+		for (BOOL more = ::Process32First(snapshot, &entry); more; more = ::Process32Next(snapshot, &entry)) {
+			if (entry.th32ProcessID == pid) {
+				sample->threads = (int32_t)entry.cntThreads;
+				break;
+			}
+		}
+		::CloseHandle(snapshot);
+	}
+	return true;
+}
+
 bool XHServiceController::isInstalled() const
 {
 	bool result = false;
@@ -124,6 +256,10 @@ bool XHServiceController::isInstalled() const
 
 bool XHServiceController::isRunning() const
 {
+	XHStatusSnapshot snapshot;
+	if (d_ptr->readStatus(&snapshot))
+		return snapshot.state != XHServiceStopped;
+
 	bool result = false;
 	if (!winServiceInit())
 		return result;
@@ -147,6 +283,10 @@ bool XHServiceController::isRunning() const
 }
 std::string XHServiceController::serviceFilePath() const
 {
+	XHStatusSnapshot snapshot;
+	if (d_ptr->readStatus(&snapshot) && snapshot.state != XHServiceStopped)
+		return snapshot.filePath;
+
 	std::string result;
 	if (!winServiceInit())
 		return result;
@@ -172,6 +312,10 @@ std::string XHServiceController::serviceFilePath() const
 }
 std::string XHServiceController::serviceDescription() const
 {
+	XHStatusSnapshot snapshot;
+	if (d_ptr->readStatus(&snapshot) && snapshot.state != XHServiceStopped)
+		return snapshot.description;
+
 	std::string result;
 	if (!winServiceInit())
 		return result;
@@ -192,10 +336,8 @@ std::string XHServiceController::serviceDescription() const
 				8096,
 				&dwBytesNeeded)) {
 				LPSERVICE_DESCRIPTION desc = (LPSERVICE_DESCRIPTION)data;
-				if (desc->lpDescription){
-					//result = (const ushort*)desc->lpDescription;
-					std::cout << "error" << std::endl;
-				}
+				if (desc->lpDescription)
+					result = desc->lpDescription;
 			}
 			pCloseServiceHandle(hService);
 		}
@@ -206,6 +348,10 @@ std::string XHServiceController::serviceDescription() const
 
 XHServiceController::StartupType XHServiceController::startupType() const
 {
+	XHStatusSnapshot snapshot;
+	if (d_ptr->readStatus(&snapshot) && snapshot.state != XHServiceStopped)
+		return (StartupType)snapshot.startupType;
+
 	StartupType result = ManualStartup;
 	if (!winServiceInit())
 		return result;
@@ -230,6 +376,65 @@ XHServiceController::StartupType XHServiceController::startupType() const
 	return result;
 }
 
+void XHServiceControllerPrivate::queryStatus(XHServiceStatus *status)
+{
+	XHStatusSnapshot snapshot;
+	bool paged = readStatus(&snapshot);
+	if (paged) {
+		status->drainDuration = snapshot.drainDuration;
+		status->abortedOperations = snapshot.drainAborted;
+		status->restarts = snapshot.restarts;
+	}
+	if (paged && snapshot.state != XHServiceStopped) {
+		status->installed = true;
+		status->state = (XHServiceController::State)snapshot.state;
+		status->filePath = snapshot.filePath;
+		status->description = snapshot.description;
+		status->startupType = (XHServiceController::StartupType)snapshot.startupType;
+		status->pid = snapshot.pid;
+		status->startTime = snapshot.startTime;
+		status->checkPoint = snapshot.checkPoint;
+		status->waitHint = snapshot.waitHint;
+		return;
+	}
+	if (!winServiceInit())
+		return;
+
+	// One open of the service manager and of the service for everything.
+	SC_HANDLE hSCM = pOpenSCManager(0, 0, 0);
+	if (hSCM) {
+		SC_HANDLE hService = pOpenService(hSCM, serviceName.c_str(),
+			SERVICE_QUERY_CONFIG | SERVICE_QUERY_STATUS);
+		if (hService) {
+			status->installed = true;
+			SERVICE_STATUS_PROCESS info;
+			DWORD sizeNeeded = 0;
+			if (::QueryServiceStatusEx(hService, SC_STATUS_PROCESS_INFO, (LPBYTE)&info,
+				sizeof(info), &sizeNeeded)) {
+				status->state = (XHServiceController::State)info.dwCurrentState;
+				status->pid = info.dwProcessId;
+				status->checkPoint = info.dwCheckPoint;
+				status->waitHint = info.dwWaitHint;
+			}
+			char data[8 * 1024];
+			if (pQueryServiceConfig(hService, (LPQUERY_SERVICE_CONFIG)data, sizeof(data), &sizeNeeded)) {
+				LPQUERY_SERVICE_CONFIG config = (LPQUERY_SERVICE_CONFIG)data;
+				status->filePath = config->lpBinaryPathName;
+				status->startupType = config->dwStartType == SERVICE_DEMAND_START
+					? XHServiceController::ManualStartup : XHServiceController::AutoStartup;
+			}
+			if (pQueryServiceConfig2(hService, SERVICE_CONFIG_DESCRIPTION, (LPBYTE)data,
+				sizeof(data), &sizeNeeded)) {
+				LPSERVICE_DESCRIPTION desc = (LPSERVICE_DESCRIPTION)data;
+				if (desc->lpDescription)
+					status->description = desc->lpDescription;
+			}
+			pCloseServiceHandle(hService);
+		}
+		pCloseServiceHandle(hSCM);
+	}
+}
+
 bool XHServiceController::uninstall()
 {
 	bool result = false;
@@ -281,20 +486,21 @@ bool XHServiceController::stop()
 	if (!winServiceInit())
 		return result;
 
+	int timeoutMs = d_ptr->stopTimeout();
 	SC_HANDLE hSCM = pOpenSCManager(0, 0, SC_MANAGER_CONNECT);
 	if (hSCM) {
 		SC_HANDLE hService = pOpenService(hSCM,d_ptr->serviceName.c_str(), SERVICE_STOP | SERVICE_QUERY_STATUS);
 		if (hService) {
 			SERVICE_STATUS status;
 			if (pControlService(hService, SERVICE_CONTROL_STOP, &status)) {
+				// The service drains its operations before it stops.
 				bool stopped = status.dwCurrentState == SERVICE_STOPPED;
-				int i = 0;
-				while (!stopped && i < 10) {
+				int64_t deadline = xhMonotonicMs() + timeoutMs;
+				while (!stopped && (timeoutMs < 0 || xhMonotonicMs() < deadline)) {
 					Sleep(200);
 					if (!pQueryServiceStatus(hService, &status))
 						break;
 					stopped = status.dwCurrentState == SERVICE_STOPPED;
-					++i;
 				}
 				result = stopped;
 			}
@@ -374,28 +580,246 @@ bool XHServiceController::sendCommand(int code)
 	return result;
 }
 
+/*
+   Handing sockets to another process needs WSADuplicateSocket() and a
+   pipe to the new instance; not supported on Windows yet.
+*/
+bool XHServiceController::upgrade(const std::string &/*filePath*/)
+{
+	return false;
+}
 
-void XHServiceBase::logMessage(const std::string &message, MessageType type,
-	int id, uint16_t category, const std::string &data)
+// The SCM has no way to carry a reply.
+bool XHServiceController::call(int /*code*/, const std::string &/*request*/, std::string * /*reply*/,
+	int /*timeoutMs*/)
 {
-	if (!winServiceInit())
+	return false;
+}
+
+bool XHServiceControllerPrivate::sysReserveSlab(size_t /*size*/)
+{
+	return false;
+}
+
+void XHServiceControllerPrivate::sysReleaseSlab()
+{
+}
+
+/*
+   ControlService() waits for the service's handler anyway, so the
+   asynchronous calls complete before they return.
+*/
+static std::future<bool> readyFuture(bool value)
+{
+	std::promise<bool> promise;
+	promise.set_value(value);
+	return promise.get_future();
+}
+
+std::future<bool> XHServiceController::stopAsync()
+{
+	return readyFuture(stop());
+}
+
+std::future<bool> XHServiceController::pauseAsync()
+{
+	return readyFuture(pause());
+}
+
+std::future<bool> XHServiceController::resumeAsync()
+{
+	return readyFuture(resume());
+}
+
+std::future<bool> XHServiceController::sendCommandAsync(int code)
+{
+	return readyFuture(sendCommand(code));
+}
+
+std::future<XHServiceReply> XHServiceController::callAsync(int /*code*/, const std::string &/*request*/)
+{
+	std::promise<XHServiceReply> promise;
+	promise.set_value(XHServiceReply());
+	return promise.get_future();
+}
+
+void XHServiceControllerPrivate::sysCloseChannel()
+{
+}
+
+/*
+   subscribe() on top of NotifyServiceStatusChange(). The notification
+   is delivered as an APC, so the thread waits alertably on its stop
+   event and registers again after each one. Closing the service
+   handle cancels a pending notification.
+*/
+class XHStateSubscription
+{
+public:
+	typedef std::function<void(const XHServiceStateChange &)> Handler;
+
+	XHStateSubscription(const std::string &name, const Handler &h)
+		: serviceName(name), handler(h), stopEvent(0), lastState(0) {}
+	~XHStateSubscription();
+
+	bool start();
+
+private:
+	void run();
+	static void CALLBACK notified(void *parameter);
+
+	std::string serviceName;
+	Handler handler;
+	HANDLE stopEvent;
+	std::thread thread;
+	DWORD lastState;
+};
+
+XHStateSubscription::~XHStateSubscription()
+{
+	if (thread.joinable()) {
+		::SetEvent(stopEvent);
+		thread.join();
+	}
+	if (stopEvent)
+		::CloseHandle(stopEvent);
+}
+
+bool XHStateSubscription::start()
+{
+	if (!winServiceInit() || !pNotifyServiceStatusChange)
+		return false;
+	stopEvent = ::CreateEvent(0, TRUE, FALSE, 0);
+	if (!stopEvent)
+		return false;
+	thread = std::thread(&XHStateSubscription::run, this);
+	return true;
+}
+
+void CALLBACK XHStateSubscription::notified(void *parameter)
+{
+	SERVICE_NOTIFYA *notify = (SERVICE_NOTIFYA *)parameter;
+	XHStateSubscription *that = (XHStateSubscription *)notify->pContext;
+	if (notify->dwNotificationStatus != ERROR_SUCCESS)
 		return;
-	WORD wType;
-	switch (type) {
-		case Error: wType = EVENTLOG_ERROR_TYPE; break;
-		case Warning: wType = EVENTLOG_WARNING_TYPE; break;
-		case Information: wType = EVENTLOG_INFORMATION_TYPE; break;
-		default: wType = EVENTLOG_SUCCESS; break;
-	}
-	HANDLE h = pRegisterEventSource(0,d_ptr->controller.serviceName().c_str());
-	if (h) {
-		const char *msg = message.c_str();
-		const char *bindata = data.size() > 0 ? data.c_str() : 0;
-		pReportEvent(h, wType, category, id, 0, 1, data.size(), (const char **)&msg,
+	const SERVICE_STATUS_PROCESS &status = notify->ServiceStatus;
+	FILETIME now;
+	::GetSystemTimeAsFileTime(&now);
+	XHServiceStateChange change;
+	// 100 ns intervals since 1601 to microseconds since 1970.
+	change.time = (int64_t)((((uint64_t)now.dwHighDateTime << 32) | now.dwLowDateTime) / 10)
+		- 11644473600000000LL;
+	change.state = XHServiceController::State(status.dwCurrentState);
+	change.pid = status.dwProcessId;
+	change.exitCode = status.dwWin32ExitCode == ERROR_SERVICE_SPECIFIC_ERROR
+		? (int)status.dwServiceSpecificExitCode : (int)status.dwWin32ExitCode;
+	// A service that stops without going through STOP_PENDING, or
+	// with an error, didn't stop on request.
+	change.crashed = status.dwCurrentState == SERVICE_STOPPED
+		&& (change.exitCode != NO_ERROR
+			|| (that->lastState != 0 && that->lastState != SERVICE_STOP_PENDING
+				&& that->lastState != SERVICE_STOPPED));
+	that->lastState = status.dwCurrentState;
+	that->handler(change);
+}
+
+void XHStateSubscription::run()
+{
+	SC_HANDLE hSCM = pOpenSCManager(0, 0, SC_MANAGER_CONNECT);
+	SC_HANDLE hService = hSCM ? pOpenService(hSCM, serviceName.c_str(), SERVICE_QUERY_STATUS) : 0;
+	SERVICE_NOTIFYA notify;
+	DWORD mask = SERVICE_NOTIFY_STOPPED | SERVICE_NOTIFY_START_PENDING | SERVICE_NOTIFY_STOP_PENDING
+		| SERVICE_NOTIFY_RUNNING | SERVICE_NOTIFY_CONTINUE_PENDING | SERVICE_NOTIFY_PAUSE_PENDING
+		| SERVICE_NOTIFY_PAUSED;
+	while (hService) {
+		::memset(&notify, 0, sizeof(notify));
+		notify.dwVersion = SERVICE_NOTIFY_STATUS_CHANGE;
+		notify.pfnNotifyCallback = (PFN_SC_NOTIFY_CALLBACK)&XHStateSubscription::notified;
+		notify.pContext = this;
+		if (pNotifyServiceStatusChange(hService, mask, &notify) != ERROR_SUCCESS)
+			break;
+		if (::WaitForSingleObjectEx(stopEvent, INFINITE, TRUE) != WAIT_IO_COMPLETION)
+			break;
+	}
+	if (hService)
+		pCloseServiceHandle(hService);
+	if (hSCM)
+		pCloseServiceHandle(hSCM);
+}
+
+bool XHServiceControllerPrivate::sysSubscribe(const std::function<void(const XHServiceStateChange &)> &handler)
+{
+	subscription = new XHStateSubscription(serviceName, handler);
+	if (!subscription->start()) {
+		sysUnsubscribe();
+		return false;
+	}
+	return true;
+}
+
+void XHServiceControllerPrivate::sysUnsubscribe()
+{
+	delete subscription;
+	subscription = 0;
+}
+
+std::vector<XHMetricSample> XHServiceController::metrics() const
+{
+	return std::vector<XHMetricSample>();
+}
+
+std::string XHServiceController::metricsReport(XHMetricsRegistry::Format /*format*/) const
+{
+	return std::string();
+}
+
+
+/*
+   Registers the event source once and keeps the handle for as long as
+   the log writer thread runs.
+*/
+class XHEventLogSink : public XHLogSink
+{
+public:
+	explicit XHEventLogSink(const std::string &name)
+		: h(0)
+	{
+		if (winServiceInit())
+			h = pRegisterEventSource(0, name.c_str());
+	}
+
+	~XHEventLogSink()
+	{
+		if (h)
+			pDeregisterEventSource(h);
+	}
+
+	void write(const XHLogEntry &record)
+	{
+		if (!h)
+			return;
+		WORD wType;
+		switch (record.type) {
+			case XHServiceBase::Error: wType = EVENTLOG_ERROR_TYPE; break;
+			case XHServiceBase::Warning: wType = EVENTLOG_WARNING_TYPE; break;
+			case XHServiceBase::Information: wType = EVENTLOG_INFORMATION_TYPE; break;
+			default: wType = EVENTLOG_SUCCESS; break;
+		}
+		const char *msg = record.message.c_str();
+		const char *bindata = record.data.size() > 0 ? record.data.c_str() : 0;
+		pReportEvent(h, wType, record.category, record.id, 0, 1, record.data.size(), (const char **)&msg,
 			const_cast<char *>(bindata));
-		pDeregisterEventSource(h);
 	}
+
+private:
+	HANDLE h;
+};
+
+XHLogSink *xhCreateSystemLogSink(const std::string &serviceName)
+{
+	return new XHEventLogSink(serviceName);
 }
+
 class XHServiceControllerHandler
 {
 public:
@@ -416,6 +840,8 @@ public:
 	XHServiceSysPrivate();
 	~XHServiceSysPrivate();
 	void setStatus(DWORD dwState);
+	void setProgress(DWORD checkPoint, DWORD waitHint);
+	void reportStatus();
 	void setServiceFlags(int flags);
 	DWORD serviceFlags(int flags) const;
 	inline bool available() const;
@@ -428,6 +854,12 @@ public:
 	static XHServiceSysPrivate *instance;
 	
 	XHServiceControllerHandler *controllerHandler;
+	HANDLE startedEvent;
+	bool serviceMainEntered;
+	CRITICAL_SECTION statusLock;
+	XHStatusPublisher *statusPage;
+	HANDLE heartbeatTimer;
+	static void CALLBACK heartbeat(PVOID publisher, BOOLEAN);
 };
 
 XHServiceControllerHandler::XHServiceControllerHandler(XHServiceSysPrivate *sys)
@@ -439,12 +871,20 @@ XHServiceControllerHandler::XHServiceControllerHandler(XHServiceSysPrivate *sys)
 XHServiceSysPrivate *XHServiceSysPrivate::instance = 0;
 
 XHServiceSysPrivate::XHServiceSysPrivate()
+	: controllerHandler(0), startedEvent(0), serviceMainEntered(false), statusPage(0),
+	heartbeatTimer(0)
 {
+	::InitializeCriticalSection(&statusLock);
 	instance = this;
 }
 XHServiceSysPrivate::~XHServiceSysPrivate()
 {
-	
+	if (heartbeatTimer)	// waits for a running callback
+		::DeleteTimerQueueTimer(0, heartbeatTimer, INVALID_HANDLE_VALUE);
+	if (instance == this)
+		instance = 0;
+	delete controllerHandler;
+	::DeleteCriticalSection(&statusLock);
 }
 inline bool XHServiceSysPrivate::available() const
 {
@@ -453,14 +893,13 @@ inline bool XHServiceSysPrivate::available() const
 DWORD dwThreadID = 0;
 void WINAPI XHServiceSysPrivate::serviceMain(DWORD dwArgc, char** lpszArgv)
 {
-	dwThreadID = GetCurrentThreadId();
-
 	if (!instance || !XHServiceBase::instance())
 		return;
 
 	// Windows spins off a random thread to call this function on
-	// startup, so here we just signal to the QApplication event loop
-	// in the main thread to go ahead with start()'ing the service.
+	// startup, so here we just signal the main thread, blocked in
+	// XHServiceBasePrivate::start(), to go ahead with createApplication(),
+	// start() and executeApplication().
 
 	for (DWORD i = 0; i < dwArgc; i++)
 		instance->serviceArgs.push_back(lpszArgv[i]);
@@ -468,75 +907,117 @@ void WINAPI XHServiceSysPrivate::serviceMain(DWORD dwArgc, char** lpszArgv)
 	// Register the control request handler
 	instance->serviceStatus = pRegisterServiceCtrlHandler(XHServiceBase::instance()->serviceName().c_str(), handler);
 
-	if (!instance->serviceStatus) // cannot happen - something is utterly wrong
-		return;
-
-	handler(XHSERVICE_STARTUP); // Signal startup to the application -
-	// causes XHServiceBase::start() to be called in the main thread
+	if (instance->serviceStatus) { // cannot fail - something is utterly wrong otherwise
+		instance->setStatus(SERVICE_START_PENDING);
+		instance->serviceMainEntered = true;
+	}
+	::SetEvent(instance->startedEvent);
 
 	// The MSDN doc says that this thread should just exit - the service is
-	// running in the main thread (here, via callbacks in the handler thread).
+	// running in the main thread (here, via events posted by the handler).
 }
 
+/*
+   Runs on the SCM's handler thread. Claims the pending state and hands
+   the request to the service thread; XHServiceBasePrivate::processEvent()
+   calls XHServiceBase and reports the final state from there.
+*/
 void WINAPI XHServiceSysPrivate::handler(DWORD code)
 {
-	if (!instance)
+	if (!instance || !XHServiceBase::instance())
 		return;
+	XHServiceBasePrivate *d = XHServiceBase::instance()->d_ptr;
 	switch (code) {
-		case XHSERVICE_STARTUP: // QtService startup (called from WinMain when started)			
-			instance->setStatus(SERVICE_START_PENDING);		// ׼ʼ
-			XHServiceBase::instance()->start();
-			instance->setStatus(SERVICE_RUNNING);			// ɹ 
-			break;
 		case SERVICE_CONTROL_STOP: // 1
-			instance->setStatus(SERVICE_STOP_PENDING);		// ֹͣ
-			XHServiceBase::instance()->stop();
-			::PostThreadMessage(dwThreadID, WM_QUIT, 0, 0);
-			instance->setStatus(SERVICE_STOPPED);			// Ѿֹͣ
+			instance->setStatus(SERVICE_STOP_PENDING);
+			d->postEvent(XHServiceEvent::Stop);
+			if (!d->eventLoop.isRunning())
+				::PostThreadMessage(dwThreadID, WM_QUIT, 0, 0);
 			break;
 		case SERVICE_CONTROL_PAUSE: // 2
-			instance->setStatus(SERVICE_PAUSE_PENDING);		//ͣ
-			XHServiceBase::instance()->pause();
-			instance->setStatus(SERVICE_PAUSED);			// ͣɹ
+			instance->setStatus(SERVICE_PAUSE_PENDING);
+			d->postEvent(XHServiceEvent::Pause);
 			break;
 		case SERVICE_CONTROL_CONTINUE: // 3
-			instance->setStatus(SERVICE_CONTINUE_PENDING);	//ڻָ
-			XHServiceBase::instance()->resume();
-			instance->setStatus(SERVICE_RUNNING);			// ָɹ
+			instance->setStatus(SERVICE_CONTINUE_PENDING);
+			d->postEvent(XHServiceEvent::Resume);
 			break;
 		case SERVICE_CONTROL_INTERROGATE: // 4
 			break;
 		case SERVICE_CONTROL_SHUTDOWN: // 5
 			// Don't waste time with reporting stop pending, just do it
-			XHServiceBase::instance()->stop();
-			::PostThreadMessage(dwThreadID, WM_QUIT, 0, 0);
+			d->postEvent(XHServiceEvent::Shutdown);
+			if (!d->eventLoop.isRunning())
+				::PostThreadMessage(dwThreadID, WM_QUIT, 0, 0);
 			break;
 		default:
-			if (code >= 128 && code <= 255) {
-				XHServiceBase::instance()->processCommand(code - 128);
-			}
+			if (code >= 128 && code <= 255)
+				d->postEvent(XHServiceEvent::Command, code - 128);
 			break;
 	}
 
 	// Report current status
-	if (instance->available() && instance->status.dwCurrentState != SERVICE_STOPPED)
-		pSetServiceStatus(instance->serviceStatus, &instance->status);
+	instance->reportStatus();
 }
 
 void XHServiceSysPrivate::setStatus(DWORD state)
 {
 	if (!available())
 		return;
+	::EnterCriticalSection(&statusLock);
 	status.dwCurrentState = state;
+	if (state != SERVICE_START_PENDING && state != SERVICE_STOP_PENDING
+		&& state != SERVICE_PAUSE_PENDING && state != SERVICE_CONTINUE_PENDING) {
+		status.dwCheckPoint = 0;
+		status.dwWaitHint = 0;
+	}
 	pSetServiceStatus(serviceStatus, &status);
+	if (statusPage)
+		statusPage->setState(state);
+	::LeaveCriticalSection(&statusLock);
+}
+
+/*
+   Start and stop progress. The SCM considers the service hung if the
+   checkpoint doesn't move within the wait hint.
+*/
+void XHServiceSysPrivate::setProgress(DWORD checkPoint, DWORD waitHint)
+{
+	if (!available())
+		return;
+	::EnterCriticalSection(&statusLock);
+	if (status.dwCurrentState == SERVICE_START_PENDING
+		|| status.dwCurrentState == SERVICE_STOP_PENDING) {
+		status.dwCheckPoint = checkPoint;
+		status.dwWaitHint = waitHint;
+		pSetServiceStatus(serviceStatus, &status);
+	}
+	::LeaveCriticalSection(&statusLock);
+}
+
+void CALLBACK XHServiceSysPrivate::heartbeat(PVOID publisher, BOOLEAN)
+{
+	((XHStatusPublisher *)publisher)->beat();
+}
+
+void XHServiceSysPrivate::reportStatus()
+{
+	if (!available())
+		return;
+	::EnterCriticalSection(&statusLock);
+	if (status.dwCurrentState != SERVICE_STOPPED)
+		pSetServiceStatus(serviceStatus, &status);
+	::LeaveCriticalSection(&statusLock);
 }
 
 void XHServiceSysPrivate::setServiceFlags(int flags)
 {
 	if (!available())
 		return;
+	::EnterCriticalSection(&statusLock);
 	status.dwControlsAccepted = serviceFlags(flags);
 	pSetServiceStatus(serviceStatus, &status);
+	::LeaveCriticalSection(&statusLock);
 }
 
 DWORD XHServiceSysPrivate::serviceFlags(int flags) const
@@ -576,17 +1057,35 @@ bool XHServiceBasePrivate::start()
 	if (!winServiceInit())
 		return false;
 
+	XHServiceSysPrivate* sys = XHServiceSysPrivate::instance;
+	std::string name = XHServiceBase::instance()->serviceName();
 	SERVICE_TABLE_ENTRY st[2];
-	st[0].lpServiceName = (LPSTR)XHServiceBase::instance()->serviceName().c_str();
+	st[0].lpServiceName = (LPSTR)name.c_str();
 	st[0].lpServiceProc = XHServiceSysPrivate::serviceMain;
 	st[1].lpServiceName = 0;
 	st[1].lpServiceProc = 0;
 
+	// StartServiceCtrlDispatcher() blocks for the lifetime of the service,
+	// so it gets a thread of its own. Once serviceMain() has been called
+	// this (the main) thread becomes the service thread and runs the
+	// event loop that the SCM handler posts to.
+	dwThreadID = GetCurrentThreadId();
+	HANDLE started = ::CreateEvent(0, TRUE, FALSE, 0);
+	sys->startedEvent = started;
 	bool console = true;
-	bool success = (::StartServiceCtrlDispatcher(st) != 0);//  (pStartServiceCtrlDispatcher(st) != 0);// should block
-
+	DWORD dwRet = 0;
+	std::thread dispatcher([&]() {
+		bool success = (::StartServiceCtrlDispatcher(st) != 0);//  (pStartServiceCtrlDispatcher(st) != 0);// should block
+		if (!success)
+			dwRet = GetLastError();
+		::SetEvent(started);
+	});
+	::WaitForSingleObject(started, INFINITE);
+
+	bool success = sys->serviceMainEntered;
 	if (!success) {
-		DWORD dwRet = GetLastError();
+		dispatcher.join();
+		::CloseHandle(started);
 		if (dwRet == ERROR_FAILED_SERVICE_CONTROLLER_CONNECT) {
 			LPTSTR s;
 			::FormatMessage(FORMAT_MESSAGE_ALLOCATE_BUFFER |
@@ -628,15 +1127,14 @@ bool XHServiceBasePrivate::start()
 		else
 			return false;
 	}
-	XHServiceSysPrivate* sys = XHServiceSysPrivate::instance;
-	
 	sys->controllerHandler = new XHServiceControllerHandler(sys);
-	sys->status.dwWin32ExitCode = q_ptr->executeApplication();
-	sys->setStatus(SERVICE_STOPPED);
+	std::vector<std::string> serviceArgs = args;
+	serviceArgs.insert(serviceArgs.end(), sys->serviceArgs.begin() + (sys->serviceArgs.empty() ? 0 : 1), sys->serviceArgs.end());
+	run(true, serviceArgs);	// reports SERVICE_STOPPED and cleans up sys
 
-	delete sys->controllerHandler;
-	sys->controllerHandler = 0;
-	sysCleanup();
+	// SERVICE_STOPPED makes the dispatcher return.
+	dispatcher.join();
+	::CloseHandle(started);
 	return true;
 }
 
@@ -714,6 +1212,9 @@ bool XHServiceBasePrivate::sysInit()
 	sysd->status.dwServiceSpecificExitCode = 0;
 	sysd->status.dwCheckPoint = 0;
 	sysd->status.dwWaitHint = 0;
+	sysd->statusPage = &statusPage;
+	::CreateTimerQueueTimer(&sysd->heartbeatTimer, 0, XHServiceSysPrivate::heartbeat,
+		&statusPage, XHStatusHeartbeatMs, XHStatusHeartbeatMs, WT_EXECUTEDEFAULT);
 
 	return true;
 }
@@ -723,6 +1224,52 @@ void XHServiceBasePrivate::sysSetPath()
 
 }
 
+void XHServiceBasePrivate::sysSetState(int state)
+{
+	if (!sysd)
+		return;
+	if (state == XHServiceStopped)
+		sysd->status.dwWin32ExitCode = exitCode;
+	sysd->setStatus(state);
+}
+
+void XHServiceBasePrivate::sysSetProgress(const std::string &/*status*/, uint32_t checkPoint,
+	uint32_t waitHint)
+{
+	if (!sysd)
+		return;
+	sysd->setProgress(checkPoint, waitHint);
+	statusPage.setCheckPoint(checkPoint, waitHint);
+}
+
+void XHServiceBasePrivate::sysCollectActivatedSockets()
+{
+}
+
+void XHServiceBasePrivate::sysDescribeSocket(XHInheritedSocket */*socket*/)
+{
+}
+
+// Worker processes and crash restarts are Unix only; the service runs in a
+// single process, and the recovery actions of the SCM restart it.
+bool XHServiceBasePrivate::sysStartWorkers()
+{
+	return false;
+}
+
+void XHServiceBasePrivate::sysStopWorkers()
+{
+}
+
+void XHServiceBasePrivate::sysPostToWorkers(int /*type*/, int /*code*/)
+{
+}
+
+int XHServiceBasePrivate::sysRunWorker()
+{
+	return -1;
+}
+
 void XHServiceBasePrivate::sysCleanup()
 {
 	if (sysd) {
@@ -736,6 +1283,7 @@ void XHServiceBase::setServiceFlags(int flags)
 	if (d_ptr->serviceFlags == flags)
 		return;
 	d_ptr->serviceFlags = flags;
+	d_ptr->statusPage.setFlags(flags);
 	if (d_ptr->sysd)
 		d_ptr->sysd->setServiceFlags(flags);
 }
@@ -0,0 +1,160 @@
+/****************************************************************************
+**
+**
+****************************************************************************/
+
+/*
+   Round trip of XHMetricsRegistry::encode() and decode(): a snapshot
+   taken from several threads comes back from the binary format field
+   for field, extreme values survive the varint encoding, and every
+   truncated or corrupted snapshot is rejected. Exits with 1 on the
+   first mismatch.
+*/
+
+#include "xhservice_metrics.h"
+#include <limits>
+#include <thread>
+#include <vector>
+#include <stdio.h>
+#include <stdint.h>
+
+static int failures = 0;
+
+#define CHECK(condition) \
+	do { \
+		if (!(condition)) { \
+			fprintf(stderr, "%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, #condition); \
+			++failures; \
+		} \
+	} while (0)
+
+static bool sameSample(const XHMetricSample &a, const XHMetricSample &b)
+{
+	return a.name == b.name && a.help == b.help && a.type == b.type && a.value == b.value
+		&& a.count == b.count && a.sum == b.sum && a.buckets == b.buckets;
+}
+
+static bool sameSamples(const std::vector<XHMetricSample> &a, const std::vector<XHMetricSample> &b)
+{
+	if (a.size() != b.size())
+		return false;
+	for (size_t i = 0; i < a.size(); ++i) {
+		if (!sameSample(a[i], b[i]))
+			return false;
+	}
+	return true;
+}
+
+static void registryRoundTrip()
+{
+	XHMetricsRegistry registry;
+	XHCounter requests = registry.counter("test_requests_total", "Requests handled");
+	XHGauge depth = registry.gauge("test_queue_depth");
+	XHHistogram latency = registry.histogram("test_latency_us", "Latency\nwith a \\ in the help");
+
+	const int threads = 4;
+	const int perThread = 10000;
+	std::vector<std::thread> workers;
+	for (int t = 0; t < threads; ++t) {
+		workers.push_back(std::thread([&, t]() {
+			for (int i = 0; i < perThread; ++i) {
+				requests.add();
+				latency.record(i * (t + 1));
+			}
+		}));
+	}
+	for (size_t t = 0; t < workers.size(); ++t)
+		workers[t].join();
+	depth.set(-42);
+
+	std::vector<XHMetricSample> samples = registry.snapshot();
+	CHECK(samples.size() == 3);
+	for (size_t i = 0; i < samples.size(); ++i) {
+		const XHMetricSample &sample = samples[i];
+		if (sample.name == "test_requests_total") {
+			CHECK(sample.type == XHMetricSample::Counter);
+			CHECK(sample.value == threads * perThread);
+		} else if (sample.name == "test_queue_depth") {
+			CHECK(sample.type == XHMetricSample::Gauge);
+			CHECK(sample.value == -42);
+		} else {
+			CHECK(sample.type == XHMetricSample::Histogram);
+			CHECK(sample.count == threads * perThread);
+			int64_t inBuckets = 0;
+			for (size_t b = 0; b < sample.buckets.size(); ++b)
+				inBuckets += sample.buckets[b];
+			CHECK(inBuckets == sample.count);
+		}
+	}
+
+	std::vector<XHMetricSample> decoded;
+	CHECK(XHMetricsRegistry::decode(registry.report(XHMetricsRegistry::BinarySnapshot), &decoded));
+	CHECK(sameSamples(samples, decoded));
+}
+
+static void extremeValues()
+{
+	std::vector<XHMetricSample> samples(4);
+	samples[0].name = "min";
+	samples[0].type = XHMetricSample::Gauge;
+	samples[0].value = std::numeric_limits<int64_t>::min();
+	samples[1].name = "max";
+	samples[1].type = XHMetricSample::Counter;
+	samples[1].value = std::numeric_limits<int64_t>::max();
+	samples[2].name = "";
+	samples[2].type = XHMetricSample::Gauge;
+	samples[2].value = 0;
+	samples[3].name = "histogram";
+	samples[3].help = std::string(300, 'h');
+	samples[3].type = XHMetricSample::Histogram;
+	samples[3].count = std::numeric_limits<int64_t>::max();
+	samples[3].sum = std::numeric_limits<int64_t>::min();
+	samples[3].buckets.resize(XHHistogram::BucketCount);
+	for (int b = 0; b < XHHistogram::BucketCount; ++b)
+		samples[3].buckets[b] = (int64_t)1 << (b % 63);
+
+	std::vector<XHMetricSample> decoded;
+	CHECK(XHMetricsRegistry::decode(XHMetricsRegistry::encode(samples,
+		XHMetricsRegistry::BinarySnapshot), &decoded));
+	CHECK(sameSamples(samples, decoded));
+
+	std::vector<XHMetricSample> none;
+	CHECK(XHMetricsRegistry::decode(XHMetricsRegistry::encode(none,
+		XHMetricsRegistry::BinarySnapshot), &decoded));
+	CHECK(decoded.empty());
+}
+
+static void corruptSnapshots()
+{
+	std::vector<XHMetricSample> samples(2);
+	samples[0].name = "counter";
+	samples[0].value = 1234567;
+	samples[1].name = "histogram";
+	samples[1].type = XHMetricSample::Histogram;
+	samples[1].count = 3;
+	samples[1].sum = 300;
+	samples[1].buckets.assign(8, 1);
+	std::string data = XHMetricsRegistry::encode(samples, XHMetricsRegistry::BinarySnapshot);
+
+	std::vector<XHMetricSample> decoded;
+	for (size_t size = 0; size < data.size(); ++size)
+		CHECK(!XHMetricsRegistry::decode(data.substr(0, size), &decoded));
+	CHECK(!XHMetricsRegistry::decode(data + '\0', &decoded));
+	std::string badMagic = data;
+	badMagic[0] = 'Y';
+	CHECK(!XHMetricsRegistry::decode(badMagic, &decoded));
+	CHECK(!XHMetricsRegistry::decode(XHMetricsRegistry::encode(samples,
+		XHMetricsRegistry::PrometheusText), &decoded));
+}
+
+int main()
+{
+	registryRoundTrip();
+	extremeValues();
+	corruptSnapshots();
+	if (failures) {
+		fprintf(stderr, "%d checks failed\n", failures);
+		return 1;
+	}
+	return 0;
+}
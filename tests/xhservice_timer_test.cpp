@@ -0,0 +1,229 @@
+/****************************************************************************
+**
+**
+****************************************************************************/
+
+/*
+   XHTimerWheel against a simulated clock: timers on every level of
+   the wheel fire exactly once, at their due time or at the end of
+   their slack window, in order even when the clock jumps far ahead;
+   repeating timers keep their period; cancelled timers and stale ids
+   stay quiet. Exits with 1 on the first mismatch.
+*/
+
+#include "xhservice_timer_p.h"
+#include <vector>
+#include <stdio.h>
+#include <stdint.h>
+
+static int failures = 0;
+
+#define CHECK(condition) \
+	do { \
+		if (!(condition)) { \
+			fprintf(stderr, "%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, #condition); \
+			++failures; \
+		} \
+	} while (0)
+
+static uint64_t randomState = 0x9e3779b97f4a7c15ull;
+
+static uint64_t nextRandom()
+{
+	randomState ^= randomState << 13;
+	randomState ^= randomState >> 7;
+	randomState ^= randomState << 17;
+	return randomState;
+}
+
+struct Expected
+{
+	int64_t due;
+	int64_t firedAt;
+	int fired;
+	bool cancelled;
+	uint64_t id;
+};
+
+// Sleeps the way the event loop does: straight to the next tick that
+// has work, as long as there are timers.
+static void runUntilIdle(XHTimerWheel &wheel, int64_t &now)
+{
+	while (wheel.count() > 0) {
+		int timeout = wheel.timeout(now);
+		CHECK(timeout >= 0);
+		now += timeout;
+		wheel.advance(now);
+	}
+	CHECK(wheel.timeout(now) == -1);
+}
+
+static void singleShotsOnEveryLevel()
+{
+	XHTimerWheel wheel;
+	int64_t now = 1000;
+	// The root level and each of the four upper levels.
+	static const int64_t ranges[] = { 300, 16000, 1000000, 60000000, 2000000000 };
+	std::vector<Expected> timers;
+	for (int r = 0; r < 5; ++r) {
+		for (int i = 0; i < 200; ++i) {
+			Expected e = { 0, -1, 0, false, 0 };
+			e.due = now + (int64_t)(nextRandom() % ranges[r]);
+			timers.push_back(e);
+		}
+	}
+	for (size_t i = 0; i < timers.size(); ++i) {
+		timers[i].id = wheel.add(now, (int)(timers[i].due - now), 0, false, [&, i]() {
+			++timers[i].fired;
+			timers[i].firedAt = now;
+		});
+		CHECK(timers[i].id != 0);
+	}
+	CHECK(wheel.count() == (int)timers.size());
+
+	// Every third timer is cancelled before it is due.
+	for (size_t i = 0; i < timers.size(); i += 3) {
+		CHECK(wheel.cancel(timers[i].id));
+		CHECK(!wheel.cancel(timers[i].id));
+		timers[i].cancelled = true;
+	}
+
+	runUntilIdle(wheel, now);
+	for (size_t i = 0; i < timers.size(); ++i) {
+		if (timers[i].cancelled) {
+			CHECK(timers[i].fired == 0);
+			continue;
+		}
+		CHECK(timers[i].fired == 1);
+		CHECK(timers[i].firedAt == timers[i].due);
+		// The id of a fired single shot timer is stale.
+		CHECK(!wheel.cancel(timers[i].id));
+	}
+}
+
+static void slackWindows()
+{
+	XHTimerWheel wheel;
+	int64_t now = 5;
+	const int slack = 50;
+	std::vector<Expected> timers;
+	for (int i = 0; i < 500; ++i) {
+		Expected e = { 0, -1, 0, false, 0 };
+		e.due = now + (int64_t)(nextRandom() % 100000);
+		timers.push_back(e);
+	}
+	for (size_t i = 0; i < timers.size(); ++i) {
+		wheel.add(now, (int)(timers[i].due - now), slack, false, [&, i]() {
+			++timers[i].fired;
+			timers[i].firedAt = now;
+		});
+	}
+	runUntilIdle(wheel, now);
+	for (size_t i = 0; i < timers.size(); ++i) {
+		CHECK(timers[i].fired == 1);
+		CHECK(timers[i].firedAt >= timers[i].due);
+		CHECK(timers[i].firedAt < timers[i].due + slack);
+		CHECK(timers[i].firedAt % slack == 0);
+	}
+}
+
+static void jumpAhead()
+{
+	// A loop that was busy for a long time runs everything that fell
+	// due meanwhile in one advance(), earliest first.
+	XHTimerWheel wheel;
+	int64_t now = 0;
+	std::vector<int64_t> order;
+	std::vector<int64_t> dues;
+	for (int i = 0; i < 2000; ++i) {
+		int64_t due = (int64_t)(nextRandom() % 5000000);
+		dues.push_back(due);
+		wheel.add(now, (int)due, 0, false, [&order, due]() { order.push_back(due); });
+	}
+	now = 5000000;
+	CHECK(wheel.timeout(now) == 0);
+	CHECK(wheel.advance(now) == (int)dues.size());
+	CHECK(order.size() == dues.size());
+	for (size_t i = 1; i < order.size(); ++i)
+		CHECK(order[i - 1] <= order[i]);
+	CHECK(wheel.count() == 0);
+}
+
+static void repeatingTimers()
+{
+	XHTimerWheel wheel;
+	int64_t now = 0;
+	std::vector<int64_t> fires;
+	uint64_t id = wheel.add(now, 7, 0, true, [&]() { fires.push_back(now); });
+	for (now = 1; now <= 1000; ++now)
+		wheel.advance(now);
+	now = 1000;
+	CHECK(fires.size() == 1000 / 7);
+	for (size_t i = 0; i < fires.size(); ++i)
+		CHECK(fires[i] == (int64_t)(i + 1) * 7);
+
+	// Periods missed while the loop was busy are skipped, not replayed.
+	fires.clear();
+	now = 1100;
+	CHECK(wheel.advance(now) == 1);
+	CHECK(wheel.timeout(now) == 1106 - 1100);
+	now = 1106;
+	CHECK(wheel.advance(now) == 1);
+	CHECK(fires.size() == 2 && fires[1] == 1106);
+
+	CHECK(wheel.cancel(id));
+	CHECK(wheel.count() == 0);
+	CHECK(wheel.advance(now + 100) == 0);
+}
+
+static void callbacksChangingTheWheel()
+{
+	XHTimerWheel wheel;
+	int64_t now = 0;
+
+	// A repeating timer cancelling itself from its callback.
+	int selfCancelled = 0;
+	uint64_t self = 0;
+	self = wheel.add(now, 10, 0, true, [&]() {
+		if (++selfCancelled == 3)
+			CHECK(wheel.cancel(self));
+	});
+
+	// A timer adding another with no delay: it runs on the next tick,
+	// never in the tick that added it.
+	int64_t addedAt = -1;
+	int64_t childAt = -1;
+	wheel.add(now, 5, 0, false, [&]() {
+		addedAt = now;
+		wheel.add(now, 0, 0, false, [&]() { childAt = now; });
+	});
+
+	// A single shot timer can't cancel itself, it has fired already.
+	uint64_t single = 0;
+	bool singleCancel = true;
+	single = wheel.add(now, 15, 0, false, [&]() { singleCancel = wheel.cancel(single); });
+
+	for (now = 1; now <= 100; ++now)
+		wheel.advance(now);
+	CHECK(selfCancelled == 3);
+	CHECK(addedAt == 5);
+	CHECK(childAt == 6);
+	CHECK(!singleCancel);
+	CHECK(wheel.count() == 0);
+	CHECK(!wheel.cancel(0));
+	CHECK(!wheel.cancel(12345));
+}
+
+int main()
+{
+	singleShotsOnEveryLevel();
+	slackWindows();
+	jumpAhead();
+	repeatingTimers();
+	callbacksChangingTheWheel();
+	if (failures) {
+		fprintf(stderr, "%d checks failed\n", failures);
+		return 1;
+	}
+	return 0;
+}
@@ -0,0 +1,367 @@
+/****************************************************************************
+**
+**
+****************************************************************************/
+
+/*
+   Renders the files written by XHBinaryLog as text, one line per
+   record, in the layout of XHFileLogSink: UTC time with microseconds,
+   message type, thread id and the formatted message. Records of all
+   threads are merged by time unless --unsorted is given.
+*/
+
+#include "xhservice.h"
+#include <algorithm>
+#include <map>
+#include <string>
+#include <vector>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+struct Format
+{
+	int type;
+	int line;
+	std::vector<uint8_t> tags;
+	std::string file;
+	std::string text;
+};
+
+struct Clock
+{
+	uint64_t ticks;
+	int64_t ns;
+
+	bool operator<(const Clock &other) const { return ticks < other.ticks; }
+};
+
+struct Event
+{
+	uint64_t ticks;
+	int64_t ns;
+	uint64_t thread;
+	uint32_t format;
+	size_t arguments;	// offset of the arguments in the file
+	size_t end;
+	size_t order;
+
+	bool operator<(const Event &other) const
+	{
+		return ns != other.ns ? ns < other.ns : order < other.order;
+	}
+};
+
+class Reader
+{
+public:
+	Reader(const std::vector<char> &data, size_t begin, size_t end) : p(begin), limit(end), bytes(data) {}
+
+	bool atEnd() const { return p >= limit; }
+	bool has(size_t n) const { return limit - p >= n; }
+	size_t position() const { return p; }
+	void skipTo(size_t position) { p = position; }
+
+	template <typename T>
+	T get()
+	{
+		T value = T();
+		if (has(sizeof(T))) {
+			memcpy(&value, &bytes[p], sizeof(T));
+			p += sizeof(T);
+		} else {
+			p = limit;
+			failed = true;
+		}
+		return value;
+	}
+
+	std::string string()
+	{
+		uint32_t n = get<uint32_t>();
+		if (!has(n)) {
+			p = limit;
+			failed = true;
+			return std::string();
+		}
+		std::string text(&bytes[p], n);
+		p += n;
+		return text;
+	}
+
+	bool failed = false;
+
+private:
+	size_t p;
+	size_t limit;
+	const std::vector<char> &bytes;
+};
+
+static const char *typeName(int type)
+{
+	switch (type) {
+		case XHServiceBase::Error: return "ERROR";
+		case XHServiceBase::Warning: return "WARNING";
+		case XHServiceBase::Information: return "INFO";
+		default: return "SUCCESS";
+	}
+}
+
+static void appendFormatted(std::string *out, const char *spec, ...)
+{
+	char buffer[512];
+	va_list args;
+	va_start(args, spec);
+	int n = ::vsnprintf(buffer, sizeof(buffer), spec, args);
+	va_end(args);
+	if (n < 0)
+		return;
+	if ((size_t)n < sizeof(buffer)) {
+		out->append(buffer, n);
+		return;
+	}
+	std::vector<char> big(n + 1);
+	va_start(args, spec);
+	::vsnprintf(&big[0], big.size(), spec, args);
+	va_end(args);
+	out->append(&big[0], n);
+}
+
+/*
+   printf over the recorded arguments. The conversion is taken from the
+   format where it suits the recorded type and replaced where it
+   doesn't, so a wrong format garbles a line at worst.
+*/
+static std::string render(const Format &format, Reader *arguments)
+{
+	std::string out;
+	const std::string &text = format.text;
+	size_t next = 0;
+	for (size_t i = 0; i < text.size(); ++i) {
+		if (text[i] != '%') {
+			out += text[i];
+			continue;
+		}
+		size_t start = i++;
+		if (i < text.size() && text[i] == '%') {
+			out += '%';
+			continue;
+		}
+		std::string spec = "%";
+		while (i < text.size() && strchr("-+ #0", text[i]))
+			spec += text[i++];
+		while (i < text.size() && ((text[i] >= '0' && text[i] <= '9') || text[i] == '.'))
+			spec += text[i++];
+		while (i < text.size() && strchr("hlLqjzt", text[i]))
+			++i;
+		if (i >= text.size() || next >= format.tags.size()) {
+			out.append(text, start, i - start + 1);
+			continue;
+		}
+		char conversion = text[i];
+		switch (format.tags[next++]) {
+			case XHBinaryLogInt32:
+			case XHBinaryLogInt64: {
+				long long value = format.tags[next - 1] == XHBinaryLogInt32
+					? arguments->get<int32_t>() : arguments->get<int64_t>();
+				if (conversion == 'c')
+					appendFormatted(&out, (spec + 'c').c_str(), (int)value);
+				else
+					appendFormatted(&out, (spec + "ll" + (strchr("diouxX", conversion) ? conversion : 'd')).c_str(), value);
+				break;
+			}
+			case XHBinaryLogUInt32:
+			case XHBinaryLogUInt64: {
+				unsigned long long value = format.tags[next - 1] == XHBinaryLogUInt32
+					? arguments->get<uint32_t>() : arguments->get<uint64_t>();
+				if (conversion == 'c')
+					appendFormatted(&out, (spec + 'c').c_str(), (int)value);
+				else
+					appendFormatted(&out, (spec + "ll" + (strchr("diouxX", conversion) ? conversion : 'u')).c_str(), value);
+				break;
+			}
+			case XHBinaryLogDouble:
+				appendFormatted(&out, (spec + (strchr("eEfFgGaA", conversion) ? conversion : 'g')).c_str(),
+					arguments->get<double>());
+				break;
+			case XHBinaryLogString:
+				appendFormatted(&out, (spec + 's').c_str(), arguments->string().c_str());
+				break;
+			case XHBinaryLogPointer:
+				appendFormatted(&out, "0x%llx", (unsigned long long)arguments->get<uint64_t>());
+				break;
+			default:
+				out += "<?>";
+				break;
+		}
+	}
+	return out;
+}
+
+// Wall clock time of a time stamp, between the clock readings around it.
+static int64_t toWallClock(const std::vector<Clock> &clocks, uint64_t ticks)
+{
+	if (clocks.empty())
+		return 0;
+	if (clocks.size() == 1)
+		return clocks[0].ns + (int64_t)(ticks - clocks[0].ticks);
+	std::vector<Clock>::const_iterator after = std::upper_bound(clocks.begin(), clocks.end(), Clock{ ticks, 0 });
+	if (after == clocks.begin())
+		++after;
+	if (after == clocks.end())
+		--after;
+	const Clock &a = *(after - 1);
+	const Clock &b = *after;
+	if (b.ticks == a.ticks)
+		return a.ns;
+	double nsPerTick = (double)(b.ns - a.ns) / (double)(b.ticks - a.ticks);
+	return a.ns + (int64_t)(((double)(int64_t)(ticks - a.ticks)) * nsPerTick);
+}
+
+static bool readFile(const char *name, std::vector<char> *data)
+{
+	FILE *file = ::fopen(name, "rb");
+	if (!file)
+		return false;
+	char chunk[65536];
+	size_t n;
+	while ((n = ::fread(chunk, 1, sizeof(chunk), file)) > 0)
+		data->insert(data->end(), chunk, chunk + n);
+	bool ok = !::ferror(file);
+	::fclose(file);
+	return ok;
+}
+
+static int decode(const char *name, bool sorted)
+{
+	std::vector<char> data;
+	if (!readFile(name, &data)) {
+		fprintf(stderr, "xhservice_logdecode: cannot read %s\n", name);
+		return 1;
+	}
+	if (data.size() < sizeof(XHBinaryLogMagic) || memcmp(&data[0], XHBinaryLogMagic, sizeof(XHBinaryLogMagic))) {
+		fprintf(stderr, "xhservice_logdecode: %s is not a binary log\n", name);
+		return 1;
+	}
+
+	std::map<uint32_t, Format> formats;
+	std::vector<Clock> clocks;
+	std::vector<Event> events;
+	uint64_t thread = 0;
+	int status = 0;
+	Reader reader(data, sizeof(XHBinaryLogMagic), data.size());
+	while (!reader.atEnd()) {
+		size_t start = reader.position();
+		uint8_t kind = reader.get<uint8_t>();
+		uint32_t size = reader.get<uint32_t>();
+		if (reader.failed || size < XHBinaryLogHeaderSize || data.size() - start < size) {
+			// A log whose writer died leaves a partial record at the end.
+			fprintf(stderr, "xhservice_logdecode: %s: truncated at byte %zu\n", name, start);
+			status = 1;
+			break;
+		}
+		Reader record(data, reader.position(), start + size);
+		switch (kind) {
+			case XHBinaryLogFormatRecord: {
+				uint32_t id = record.get<uint32_t>();
+				Format &format = formats[id];
+				format.type = record.get<uint8_t>();
+				format.line = (int)record.get<uint32_t>();
+				uint8_t argc = record.get<uint8_t>();
+				for (int i = 0; i < argc; ++i)
+					format.tags.push_back(record.get<uint8_t>());
+				format.file = record.string();
+				format.text = record.string();
+				break;
+			}
+			case XHBinaryLogClockRecord: {
+				Clock clock;
+				clock.ticks = record.get<uint64_t>();
+				clock.ns = record.get<int64_t>();
+				clocks.push_back(clock);
+				break;
+			}
+			case XHBinaryLogThreadRecord:
+				thread = record.get<uint64_t>();
+				break;
+			case XHBinaryLogEventRecord: {
+				Event event;
+				event.format = record.get<uint32_t>();
+				event.ticks = record.get<uint64_t>();
+				event.thread = thread;
+				event.arguments = record.position();
+				event.end = start + size;
+				event.order = events.size();
+				events.push_back(event);
+				break;
+			}
+			default:
+				break;	// from a newer writer: skip it
+		}
+		reader.skipTo(start + size);
+	}
+
+	std::sort(clocks.begin(), clocks.end());
+	for (size_t i = 0; i < events.size(); ++i)
+		events[i].ns = toWallClock(clocks, events[i].ticks);
+	if (sorted)
+		std::sort(events.begin(), events.end());
+
+	time_t second = (time_t)-1;
+	char stamp[32] = "";
+	for (size_t i = 0; i < events.size(); ++i) {
+		const Event &event = events[i];
+		std::map<uint32_t, Format>::const_iterator format = formats.find(event.format);
+		if (format == formats.end())
+			continue;
+		int64_t ns = event.ns;
+		time_t t = (time_t)(ns / 1000000000);
+		if (t != second) {
+			tm parts;
+#if defined(_WIN32)
+			::gmtime_s(&parts, &t);
+#else
+			::gmtime_r(&t, &parts);
+#endif
+			::strftime(stamp, sizeof(stamp), "%Y-%m-%dT%H:%M:%S", &parts);
+			second = t;
+		}
+		Reader arguments(data, event.arguments, event.end);
+		printf("%s.%06dZ %s %llu %s\n", stamp, (int)(ns % 1000000000 / 1000), typeName(format->second.type),
+			(unsigned long long)event.thread, render(format->second, &arguments).c_str());
+	}
+	return status;
+}
+
+static void printHelp(const char *program)
+{
+	printf("\n%s [options] FILE...\n"
+		"\t--unsorted\t: Keep the records in file order instead of merging threads by time.\n",
+		program);
+}
+
+int main(int argc, char **argv)
+{
+	bool sorted = true;
+	std::vector<const char *> files;
+	for (int i = 1; i < argc; ++i) {
+		if (!strcmp(argv[i], "--unsorted")) {
+			sorted = false;
+		} else if (!strcmp(argv[i], "-h") || !strcmp(argv[i], "--help")) {
+			printHelp(argv[0]);
+			return 0;
+		} else {
+			files.push_back(argv[i]);
+		}
+	}
+	if (files.empty()) {
+		printHelp(argv[0]);
+		return 1;
+	}
+	int status = 0;
+	for (size_t i = 0; i < files.size(); ++i)
+		status |= decode(files[i], sorted);
+	return status;
+}